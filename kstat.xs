@@ -15,10 +15,14 @@
 #include <sys/utsname.h>
 #include <sys/sysinfo.h>
 #include <sys/flock.h>
+#include <regex.h>
 
 /* for gethrtime() */
 #include <sys/time.h>
 
+/* for the interval timer behind Solaris::kstat::Ticker */
+#include "libkstatsnap/kstat_common.h"
+
 /* Debug macros */
 #define DEBUG_ID "Solaris::kstat"
 
@@ -58,43 +62,303 @@
  * 
  */
 
-#define SAVE_FNP(H, F, K) \
-    hv_store(H, K, sizeof (K) - 1, newSViv((IVTYPE)(uintptr_t)&F), 0)
+/* As above, but overwrite the value of an existing SV rather than create one */
+#if defined(HAS_QUAD) && defined(USE_64_BIT_INT)
+#  define SET_IV(S, V) \
+          (sv_setiv(S, (IVTYPE) V))
+#  define SET_UV(S, V) \
+          (sv_setuv(S, (UVTYPE) V))
+#else
+#  define SET_IV(S, V) \
+     (V >= IV_MIN && V <= IV_MAX ? sv_setiv(S, (IVTYPE) V) : \
+                                   sv_setnv(S, (NVTYPE) V))
+#  if defined(UVTYPE)
+#    define SET_UV(S, V) \
+       (V <= UV_MAX ? sv_setuv(S, (UVTYPE) V) : sv_setnv(S, (NVTYPE) V))
+#  else
+#  define SET_UV(S, V) \
+       (V <= IV_MAX ? sv_setiv(S, (IVTYPE) V) : sv_setnv(S, (NVTYPE) V))
+#  endif
+#endif
+
+#define SET_HRTIME(S, V) \
+   SET_UV(S, V)
+
+/*
+ * The SAVE_* macros update the value SV already stored under the key, so that
+ * refreshing a kstat doesn't allocate a new SV per statistic.  An SV is only
+ * created the first time a statistic is seen.  Each use of a macro keeps its
+ * key as a shared SV with a precomputed hash, made on first use, so the fixed
+ * keys of the raw readers are neither measured nor hashed again - see
+ * stat_sv_shared()
+ */
+#define SAVE_VALUE(H, K, SET, V) \
+    do { \
+      static SV *stat_key; \
+      SET(stat_sv_shared(H, &stat_key, K, sizeof (K) - 1), V); \
+    } while (0)
 #define SAVE_STRING(H, S, K, SS) \
-    hv_store(H, #K, sizeof (#K) - 1, \
-    newSVpvn(S->K, SS ? strlen(S->K) : sizeof(S->K)), 0)
+    do { \
+      static SV *stat_key; \
+      sv_setpvn(stat_sv_shared(H, &stat_key, #K, sizeof (#K) - 1), S->K, \
+                SS ? strlen(S->K) : sizeof(S->K)); \
+    } while (0)
 #define SAVE_INT32(H, S, K) \
-    hv_store(H, #K, sizeof (#K) - 1, NEW_IV(S->K), 0)
+    SAVE_VALUE(H, #K, SET_IV, S->K)
 #define SAVE_UINT32(H, S, K) \
-    hv_store(H, #K, sizeof (#K) - 1, NEW_UV(S->K), 0)
+    SAVE_VALUE(H, #K, SET_UV, S->K)
 #define SAVE_INT64(H, S, K) \
-    hv_store(H, #K, sizeof (#K) - 1, NEW_IV(S->K), 0)
+    SAVE_VALUE(H, #K, SET_IV, S->K)
 #define SAVE_UINT64(H, S, K) \
-    hv_store(H, #K, sizeof (#K) - 1, NEW_UV(S->K), 0)
+    SAVE_VALUE(H, #K, SET_UV, S->K)
 #define SAVE_HRTIME(H, S, K) \
-    hv_store(H, #K, sizeof (#K) - 1, NEW_HRTIME(S->K), 0)
+    SAVE_VALUE(H, #K, SET_HRTIME, S->K)
+
 
+/* Entry in the table of raw kstat readers - see raw_readers[] */
+typedef struct RawReader RawReader_t;
+
+/* Statistic recorded by a Solaris::kstat::History - see history_append() */
+typedef struct HistorySeries HistorySeries_t;
 
 /* Private structure used for saving kstat info in the tied hashes */
+typedef struct KstatInfo KstatInfo_t;
+struct KstatInfo {
+  char          read;       /* Kstat block has been read before */
+  char          valid;      /* Kstat still exists in kstat chain */
+  char          strip_str;  /* Strip KSTAT_DATA_CHAR fields */
+  SV           *ctl;        /* KstatCtl_t of the owning Solaris::kstat */
+  kstat_t      *kstat;      /* Handle used by kstat_read */
+  const RawReader_t *reader; /* Reader, for KSTAT_TYPE_RAW kstats */
+  HV           *tie;        /* The tied hash this structure belongs to */
+  KstatInfo_t  *read_next;  /* Next entry on the read list */
+  KstatInfo_t **read_prevp; /* Link to this entry, or 0 if not on the list */
+  HistorySeries_t *history; /* Series appended to whenever this is read */
+};
+
+/*
+ * Entry in the index of the kstat chain kept by each Solaris::kstat object -
+ * see build_index().  The names are copied, so that an old index can still be
+ * compared against a new one after kstat_chain_update() has freed the kstats.
+ */
+typedef struct {
+  char          module[KSTAT_STRLEN]; /* Copy of ks_module */
+  char          name[KSTAT_STRLEN];   /* Copy of ks_name */
+  int           instance;             /* Copy of ks_instance */
+  kstat_t      *kstat;                /* The kstat itself */
+  const RawReader_t *reader;          /* Reader, for KSTAT_TYPE_RAW kstats */
+} KstatIndexEnt_t;
+
+/*
+ * Compiled select/exclude patterns passed to new() and copy().  Each selector
+ * has a field for each of module, instance, name and statistic, which matches
+ * anything, a gmatch(3GEN) glob or a regular expression, as in kstat(1M).
+ */
+typedef enum { SEL_ANY, SEL_GLOB, SEL_REGEX } KstatFieldType_t;
+
+typedef struct {
+  KstatFieldType_t  type;       /* How the field is matched */
+  char             *glob;       /* Pattern, for SEL_GLOB */
+  regex_t           regex;      /* Compiled pattern, for SEL_REGEX */
+} KstatField_t;
+
+typedef struct {
+  KstatField_t      field[4];   /* module, instance, name, statistic */
+} KstatSelector_t;
+
+typedef struct {
+  KstatSelector_t  *select;     /* Kstats must match one of these, if any */
+  int               nselect;
+  KstatSelector_t  *exclude;    /* Kstats must not match any of these */
+  int               nexclude;
+} KstatMatcher_t;
+
+/*
+ * Private structure saved in the Solaris::kstat object itself.  Every
+ * KstatInfo_t holds a reference to the SV containing it, so it stays valid
+ * until the last tied hash is gone, even if that outlives the object.
+ */
+typedef struct {
+  kstat_ctl_t      *kstat_ctl;  /* Handle returned by kstat_open */
+  KstatInfo_t      *read_list;  /* Kstats that have been read, for update() */
+  char              strip_str;  /* Strip KSTAT_DATA_CHAR fields */
+  char              lazy;       /* Build the hash tree on demand */
+  KstatMatcher_t   *matcher;    /* select/exclude patterns, or 0 for all */
+  KstatIndexEnt_t  *index;      /* Sorted index of the wanted kstats */
+  size_t            index_len;  /* Number of entries in index */
+} KstatCtl_t;
+
+#define KSTAT_CTL(KIP) \
+    ((KstatCtl_t *)SvPVX((KIP)->ctl))
+
+/*
+ * Private structure saved in the ties of the module, instance and name level
+ * hashes of a lazy Solaris::kstat.  level is the number of keys above the
+ * hash: 0 for the object itself, whose keys are modules, 1 for a module hash,
+ * whose keys are instances, and 2 for an instance hash, whose keys are names.
+ */
 typedef struct {
-  char         read;      /* Kstat block has been read before */
-  char         valid;     /* Kstat still exists in kstat chain */
-  char         strip_str; /* Strip KSTAT_DATA_CHAR fields */
-  kstat_ctl_t *kstat_ctl; /* Handle returned by kstat_open */
-  kstat_t     *kstat;     /* Handle used by kstat_read */
-} KstatInfo_t;
+  SV           *ctl;                  /* KstatCtl_t of the owning object */
+  int           level;                /* Depth of the hash in the tree */
+  char          module[KSTAT_STRLEN]; /* Module, for levels 1 and 2 */
+  int           instance;             /* Instance, for level 2 */
+} KstatTree_t;
+
+#define TREE_CTL(TP) \
+    ((KstatCtl_t *)SvPVX((TP)->ctl))
 
-/* typedef for apply_to_ties callback functions */
-typedef int (*ATTCb_t)(HV *, void *);
+/*
+ * Destination of the statistics of a kstat being read.  If filter is set, only
+ * the statistics matching one of its nfilter fields are stored in hv, and the
+ * values of the others are written to scratch instead.
+ */
+typedef struct {
+  HV            *hv;        /* Hash the statistics are stored in */
+  KstatField_t **filter;    /* Statistic patterns, or 0 for all */
+  int            nfilter;   /* Number of patterns in filter */
+  SV            *scratch;   /* Destination of filtered out values */
+} StatStore_t;
 
 /* typedef for raw kstat reader functions */
-typedef void (*kstat_raw_reader_t)(HV *, kstat_t *, int);
+typedef void (*kstat_raw_reader_t)(StatStore_t *, kstat_t *, int);
+
+struct RawReader {
+  const char         *key;    /* "module:name", without any digits */
+  kstat_raw_reader_t  fnp;    /* Function converting the struct to a hash */
+  size_t              size;   /* Size of the struct the function expects */
+};
+
+/*
+ * The statistics of an I/O kstat that io_delta() works from, and the iostat -x
+ * style columns it returns, with their shared keys
+ */
+enum {
+  IO_READS, IO_WRITES, IO_NREAD, IO_NWRITTEN, IO_WTIME, IO_WLENTIME,
+  IO_RTIME, IO_RLENTIME, IO_SNAPTIME, IO_NFIELDS
+};
+
+static const char *io_field_names[IO_NFIELDS] = {
+  "reads", "writes", "nread", "nwritten", "wtime", "wlentime",
+  "rtime", "rlentime", "snaptime"
+};
+
+static SV *io_field_keys[IO_NFIELDS];
+
+enum {
+  IO_RPS, IO_WPS, IO_KRPS, IO_KWPS, IO_WAIT, IO_ACTV, IO_WSVC_T, IO_ASVC_T,
+  IO_SVC_T, IO_WPCT, IO_BPCT, IO_NRATES
+};
+
+static const char *io_rate_names[IO_NRATES] = {
+  "r/s", "w/s", "kr/s", "kw/s", "wait", "actv", "wsvc_t", "asvc_t",
+  "svc_t", "%w", "%b"
+};
+
+static SV *io_rate_keys[IO_NRATES];
+
+/*
+ * The statistics of a timer kstat that timer_summary() works from, and the
+ * columns of each row it returns after the timer name and elapsed time
+ */
+enum {
+  TIMER_NUM_EVENTS, TIMER_ELAPSED_TIME, TIMER_MIN_TIME, TIMER_MAX_TIME,
+  TIMER_SNAPTIME, TIMER_NFIELDS
+};
+
+static const char *timer_field_names[TIMER_NFIELDS] = {
+  "num_events", "elapsed_time", "min_time", "max_time", "snaptime"
+};
+
+static SV *timer_field_keys[TIMER_NFIELDS];
+
+enum {
+  TIMER_EPS, TIMER_MEAN_TIME, TIMER_NRATES
+};
 
-/* Hash of "module:name" to KSTAT_RAW read functions */
-static HV *raw_kstat_lookup;
+/* Magic attached to the tied hashes, so they leave the read list when freed */
+static int kstat_info_free(pTHX_ SV *sv, MAGIC *mg);
+
+static MGVTBL kstat_info_vtbl = {
+  NULL, NULL, NULL, NULL, kstat_info_free, NULL, NULL, NULL
+};
+
+/* Likewise for the storage of the upper level ties of a lazy tree */
+static int kstat_tree_free(pTHX_ SV *sv, MAGIC *mg);
+
+static MGVTBL kstat_tree_vtbl = {
+  NULL, NULL, NULL, NULL, kstat_tree_free, NULL, NULL, NULL
+};
 
 /* C functions */
 
+static int match_field(KstatField_t *field, const char *str);
+static void history_append(KstatInfo_t *kip);
+
+/*
+ * Return TRUE if the named statistic passes the filter of the StatStore_t.
+ */
+
+static int
+store_wants(StatStore_t *store, const char *stat)
+{
+  int n;
+
+  if (store->filter == 0) {
+    return (1);
+  }
+  for (n = 0; n < store->nfilter; n++) {
+    if (match_field(store->filter[n], stat)) {
+      return (1);
+    }
+  }
+  return (0);
+}
+
+/*
+ * Return the value SV the StatStore_t stores the named statistic in, creating
+ * an empty one in the hash if the key doesn't exist yet, or the scratch SV if
+ * the statistic is filtered out.  The caller then sets the value in place with
+ * one of the SET_* macros.  A negative klen means key is NUL terminated.
+ */
+
+static SV *
+stat_sv(StatStore_t *store, const char *key, I32 klen)
+{
+  SV **svp;
+
+  if (! store_wants(store, key)) {
+    return (store->scratch);
+  }
+  if (klen < 0) {
+    klen = strlen(key);
+  }
+  svp = hv_fetch(store->hv, key, klen, TRUE);
+  PERL_ASSERTMSG(svp != 0, "stat_sv: hv_fetch lvalue failed");
+  return (*svp);
+}
+
+/*
+ * As stat_sv(), for a fixed key of klen characters.  *keyp caches the key as a
+ * shared SV, created on the first call, whose precomputed hash is passed to
+ * hv_fetch_ent(), as io_fields() does with io_field_keys.
+ */
+
+static SV *
+stat_sv_shared(StatStore_t *store, SV **keyp, const char *key, I32 klen)
+{
+  HE *he;
+
+  if (! store_wants(store, key)) {
+    return (store->scratch);
+  }
+  if (*keyp == 0) {
+    *keyp = newSVpvn_share(key, klen, 0);
+  }
+  he = hv_fetch_ent(store->hv, *keyp, TRUE, SvSHARED_HASH(*keyp));
+  PERL_ASSERTMSG(he != 0, "stat_sv_shared: hv_fetch_ent lvalue failed");
+  return (HeVAL(he));
+}
+
 /*
  * Kstats come in two flavours, named and raw.  Raw kstats are just C structs,
  * so we need a function per raw kstat to convert the C struct into the
@@ -107,7 +371,7 @@ static HV *raw_kstat_lookup;
  */
 
   static void
-save_cpu_stat(HV *self, kstat_t *kp, int strip_str)
+save_cpu_stat(StatStore_t *self, kstat_t *kp, int strip_str)
 {
   cpu_stat_t    *statp;
   cpu_sysinfo_t *sysinfop;
@@ -121,13 +385,13 @@ save_cpu_stat(HV *self, kstat_t *kp, int strip_str)
   syswaitp = &statp->cpu_syswait;
   vminfop  = &statp->cpu_vminfo;
 
-  hv_store(self, "idle", 4, NEW_UV(sysinfop->cpu[CPU_IDLE]), 0);
-  hv_store(self, "user", 4, NEW_UV(sysinfop->cpu[CPU_USER]), 0);
-  hv_store(self, "kernel", 6, NEW_UV(sysinfop->cpu[CPU_KERNEL]), 0);
-  hv_store(self, "wait", 4, NEW_UV(sysinfop->cpu[CPU_WAIT]), 0);
-  hv_store(self, "wait_io", 7, NEW_UV(sysinfop->wait[W_IO]), 0);
-  hv_store(self, "wait_swap", 9, NEW_UV(sysinfop->wait[W_SWAP]), 0);
-  hv_store(self, "wait_pio",  8, NEW_UV(sysinfop->wait[W_PIO]), 0);
+  SAVE_VALUE(self, "idle", SET_UV, sysinfop->cpu[CPU_IDLE]);
+  SAVE_VALUE(self, "user", SET_UV, sysinfop->cpu[CPU_USER]);
+  SAVE_VALUE(self, "kernel", SET_UV, sysinfop->cpu[CPU_KERNEL]);
+  SAVE_VALUE(self, "wait", SET_UV, sysinfop->cpu[CPU_WAIT]);
+  SAVE_VALUE(self, "wait_io", SET_UV, sysinfop->wait[W_IO]);
+  SAVE_VALUE(self, "wait_swap", SET_UV, sysinfop->wait[W_SWAP]);
+  SAVE_VALUE(self, "wait_pio", SET_UV, sysinfop->wait[W_PIO]);
   SAVE_UINT32(self, sysinfop, bread);
   SAVE_UINT32(self, sysinfop, bwrite);
   SAVE_UINT32(self, sysinfop, lread);
@@ -225,7 +489,7 @@ save_cpu_stat(HV *self, kstat_t *kp, int strip_str)
  */
 
 static void
-save_var(HV *self, kstat_t *kp, int strip_str)
+save_var(StatStore_t *self, kstat_t *kp, int strip_str)
 {
   struct var *varp;
 
@@ -255,7 +519,7 @@ save_var(HV *self, kstat_t *kp, int strip_str)
  */
 
 static void
-save_sysinfo(HV *self, kstat_t *kp, int strip_str)
+save_sysinfo(StatStore_t *self, kstat_t *kp, int strip_str)
 {
   sysinfo_t *sysinfop;
 
@@ -276,7 +540,7 @@ save_sysinfo(HV *self, kstat_t *kp, int strip_str)
  */
 
 static void
-save_vminfo(HV *self, kstat_t *kp, int strip_str)
+save_vminfo(StatStore_t *self, kstat_t *kp, int strip_str)
 {
   vminfo_t *vminfop;
 
@@ -297,471 +561,2514 @@ save_vminfo(HV *self, kstat_t *kp, int strip_str)
  * We need to be able to find the function corresponding to a particular raw
  * kstat.  To do this we ignore the instance and glue the module and name
  * together to form a composite key.  We can then use the data in the kstat
- * structure to find the appropriate function.  We use a perl hash to manage the
- * lookup, where the key is "module:name" and the value is a pointer to the
- * appropriate C function.
+ * structure to find the appropriate function.  The readers live in a static
+ * table sorted on that "module:name" key, which also records the size of the
+ * C struct each function expects, and is binary searched.  The lookup is done
+ * once per kstat, and the result is kept with it.
  *
  * Note that some kstats include the instance number as part of the module
  * and/or name.  This could be construed as a bug.  However, to work around this
- * we omit any digits from the module and name as we build the table in
- * build_raw_kstat_loopup(), and we remove any digits from the module and name
- * when we look up the functions in lookup_raw_kstat_fn()
- */
-
-/*
- * This function is called when the XS is first dlopen()ed, and builds the
- * lookup table as described above.
+ * the keys in the table contain no digits, and we skip any digits in the module
+ * and name when we compare them against the keys in raw_reader_cmp()
  */
 
-static void
-build_raw_kstat_lookup()
-{
-  /* Create new hash */
-  raw_kstat_lookup = newHV();
-
-  SAVE_FNP(raw_kstat_lookup, save_cpu_stat, "cpu_stat:cpu_stat");
-  SAVE_FNP(raw_kstat_lookup, save_var, "unix:var");
-  SAVE_FNP(raw_kstat_lookup, save_sysinfo, "unix:sysinfo");
-  SAVE_FNP(raw_kstat_lookup, save_vminfo, "unix:vminfo");
+/* Keep this sorted on key, as compared by strcmp() */
+static const RawReader_t raw_readers[] = {
+  { "cpu_stat:cpu_stat",  save_cpu_stat,  sizeof (cpu_stat_t) },
 /*
-  SAVE_FNP(raw_kstat_lookup, save_nfs, "nfs:mntinfo");
+  { "nfs:mntinfo",        save_nfs,       sizeof (struct mntinfo_kstat) },
  */
+  { "unix:sysinfo",       save_sysinfo,   sizeof (sysinfo_t) },
+  { "unix:var",           save_var,       sizeof (struct var) },
+  { "unix:vminfo",        save_vminfo,    sizeof (vminfo_t) },
 #ifdef __sparc
 /*
-  SAVE_FNP(raw_kstat_lookup, save_sfmmu_global_stat,
-      "unix:sfmmu_global_stat");
-  SAVE_FNP(raw_kstat_lookup, save_sfmmu_tsbsize_stat,
-      "unix:sfmmu_tsbsize_stat");
-  SAVE_FNP(raw_kstat_lookup, save_simmstat, "unix:simm-status");
-  SAVE_FNP(raw_kstat_lookup, save_temperature, "unix:temperature");
-  SAVE_FNP(raw_kstat_lookup, save_temp_over, "unix:temperature override");
-  SAVE_FNP(raw_kstat_lookup, save_ps_shadow, "unix:ps_shadow");
-  SAVE_FNP(raw_kstat_lookup, save_fault_list, "unix:fault_list");
-*/
+  { "unix:fault_list",    save_fault_list, ... },
+  { "unix:ps_shadow",     save_ps_shadow, ... },
+  { "unix:sfmmu_global_stat", save_sfmmu_global_stat, ... },
+  { "unix:sfmmu_tsbsize_stat", save_sfmmu_tsbsize_stat, ... },
+  { "unix:simm-status",   save_simmstat, ... },
+  { "unix:temperature",   save_temperature, ... },
+  { "unix:temperature override", save_temp_over, ... },
+ */
 #endif
-}
+};
 
+#define N_RAW_READERS (sizeof (raw_readers) / sizeof (raw_readers[0]))
 
 /*
- * This finds and returns the raw kstat reader function corresponding to the
- * supplied module and name.  If no matching function exists, 0 is returned.
+ * Compare a raw_readers[] key with a kstat module and name, in the same order
+ * strcmp() would compare it with the "module:name" key built from them.
  */
 
-static kstat_raw_reader_t lookup_raw_kstat_fn(char *module, char *name)
+static int
+raw_reader_cmp(const char *key, const char *module, const char *name)
 {
-  char                  key[KSTAT_STRLEN * 2];
-  register char        *f, *t;
-  SV                  **entry;
-  kstat_raw_reader_t    fnp;
-
-  /* Copy across module & name, removing any digits - see comment above */
-  for (f = module, t = key; *f != '\0'; f++, t++) {
-    while (*f != '\0' && isdigit(*f)) { f++; }
-    *t = *f;
-  }
-  *t++ = ':';
-  for (f = name; *f != '\0'; f++, t++) {
-    while (*f != '\0' && isdigit(*f)) {
+  const unsigned char *k, *f;
+  int                  part, end;
+
+  k = (const unsigned char *)key;
+  for (part = 0; part < 2; part++) {
+    f = (const unsigned char *)(part == 0 ? module : name);
+    for (;;) {
+      while (isdigit(*f)) {
+        f++;
+      }
+      if (*f == '\0') {
+        break;
+      }
+      if (*k != *f) {
+        return (*k - *f);
+      }
+      k++;
       f++;
     }
-    *t = *f;
-  }
-  *t = '\0';
-
-  /* look up & return the function, or teturn 0 if not found */
-  if ((entry = hv_fetch(raw_kstat_lookup, key, strlen(key), FALSE)) == 0)
-  {
-    fnp = 0;
-  } else {
-    fnp = (kstat_raw_reader_t)(uintptr_t)SvIV(*entry);
+    end = part == 0 ? ':' : '\0';
+    if (*k != end) {
+      return (*k - end);
+    }
+    k++;
   }
-  return (fnp);
+  return (0);
 }
 
 /*
- * This module converts the flat list returned by kstat_read() into a perl hash
- * tree keyed on module, instance, name and statistic.  The following functions
- * provide code to create the nested hashes, and to iterate over them.
- */
-
-/*
- * Given module, instance and name keys return a pointer to the hash tied to
- * the bottommost hash.  If the hash already exists, we just return a pointer
- * to it, otherwise we create the hash and any others also required above it in
- * the hierarchy.  The returned tiehash is blessed into the
- * Solaris::kstat::_Stat class, so that the appropriate TIEHASH methods are
- * called when the bottommost hash is accessed.  If the is_new parameter is
- * non-null it will be set to TRUE if a new tie has been created, and FALSE if
- * the tie already existed.
+ * This finds and returns the raw kstat reader corresponding to the supplied
+ * module and name.  If no matching reader exists, 0 is returned.
  */
 
-static HV *
-get_tie(SV *self, char *module, int instance, char *name, int *is_new)
+static const RawReader_t *
+lookup_raw_reader(const char *module, const char *name)
 {
-  char str_inst[11];  /* big enough for up to 10^10 instances */
-  char *key[3];       /* 3 part key: module, instance, name */
-  int  k;
-  int  new;
-  HV   *hash;
-  HV   *tie;
-
-  /* Create the keys */
-  (void) snprintf(str_inst, sizeof (str_inst), "%d", instance);
-  key[0] = module;
-  key[1] = str_inst;
-  key[2] = name;
-
-  /* warn("Creating tie for %s:%s:%s\n",key[0],key[1],key[2]); */
-
-  /* Iteratively descend the tree, creating new hashes as required */
-  hash = (HV *)SvRV(self);
-  for (k = 0; k < 3; k++) {
-    SV **entry;
-
-    SvREADONLY_off(hash);
-    entry = hv_fetch(hash, key[k], strlen(key[k]), TRUE);
-
-    /* If the entry doesn't exist, create it */
-    if (! SvOK(*entry)) {
-      HV *newhash;
-      SV *rv;
-
-      newhash = newHV();
-      rv = newRV_noinc((SV *)newhash);
-      sv_setsv(*entry, rv);
-      SvREFCNT_dec(rv);
-      if (k < 2) {
-        SvREADONLY_on(newhash);
-      }
-      SvREADONLY_on(*entry);
-      SvREADONLY_on(hash);
-      hash = newhash;
-      new = 1;
-
-      /* Otherwise it already existed */
+  size_t lo, hi, mid;
+  int    c;
+
+  lo = 0;
+  hi = N_RAW_READERS;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if ((c = raw_reader_cmp(raw_readers[mid].key, module, name)) == 0) {
+      return (&raw_readers[mid]);
+    } else if (c < 0) {
+      lo = mid + 1;
     } else {
-      SvREADONLY_on(hash);
-      hash = (HV *)SvRV(*entry);
-      new = 0;
+      hi = mid;
     }
   }
+  return (0);
+}
 
-  /* Create and bless a hash for the tie, if necessary */
-  if (new) {
-    SV *tieref;
-    HV *stash;
+/*
+ * Build the "module:name" key used by resolve_named() into key, which must be
+ * at least KSTAT_STRLEN * 2 bytes long, removing any digits as above.
+ */
+
+static void
+build_kstat_key(char *key, const char *module, const char *name)
+{
+  register const char  *f;
+  register char        *t;
 
-    tie = newHV();
-    tieref = newRV_noinc((SV *)tie);
-    if (SvREFCNT(tieref) > 1) {
-      warn("just after newRV_noinc(), tieref REFCNT too high\n");
+  for (f = module, t = key; *f != '\0'; f++) {
+    if (! isdigit(*f)) {
+      *t++ = *f;
     }
-    stash = gv_stashpv("Solaris::kstat::_Stat", GV_ADD);
-    sv_bless(tieref, stash);
-    if (SvREFCNT(tieref) > 1) {
-      warn("just after sv_bless(), tieref REFCNT too high\n");
+  }
+  *t++ = ':';
+  for (f = name; *f != '\0'; f++) {
+    if (! isdigit(*f)) {
+      *t++ = *f;
     }
+  }
+  *t = '\0';
+}
 
-    /* Add TIEHASH magic */
-    hv_magic(hash, (GV *)tieref, PERL_MAGIC_tied );
-    /*
-    if (SvREFCNT(tieref) > 1) {
-      warn("just after hv_magic(), tieref REFCNT too high\n");
-    }
-    */
-    /* Why do we have to decrement the reference count here??? */
-    SvREFCNT_dec(tieref);
+/*
+ * update() only needs to reread the kstats that have been read before, so
+ * those are kept on a list hanging off the KstatCtl_t.  A kstat joins the list
+ * the first time it is read, and leaves it when its hash is cleared, when it
+ * is pruned from the tree or when its tied hash is freed.
+ */
 
-    SvREADONLY_on(hash);
+static void
+read_list_insert(KstatInfo_t *kip)
+{
+  KstatCtl_t *ctl;
 
-    /* Otherwise, just find the existing tied hash */
-  } else {
-    MAGIC *mg;
+  if (kip->read_prevp != 0 || kip->tie == 0) {
+    return;
+  }
+  ctl = KSTAT_CTL(kip);
+  if ((kip->read_next = ctl->read_list) != 0) {
+    kip->read_next->read_prevp = &kip->read_next;
+  }
+  kip->read_prevp = &ctl->read_list;
+  ctl->read_list = kip;
+}
 
-    mg = mg_find((SV *)hash, 'P');
-    PERL_ASSERTMSG(mg != 0, "get_tie: lost P magic");
-    tie = (HV *)SvRV(mg->mg_obj);
+static void
+read_list_remove(KstatInfo_t *kip)
+{
+  if (kip->read_prevp == 0) {
+    return;
   }
-  if (is_new) {
-    *is_new = new;
+  if ((*kip->read_prevp = kip->read_next) != 0) {
+    kip->read_next->read_prevp = kip->read_prevp;
   }
-  return (tie);
+  kip->read_next = 0;
+  kip->read_prevp = 0;
 }
 
 /*
- * This is an iterator function used to traverse the hash hierarchy and apply
- * the passed function to the tied hashes at the bottom of the hierarchy.  If
- * any of the callback functions return 0, 0 is returned, otherwise 1
+ * Empty the read list without touching the entries' hashes - used by DESTROY,
+ * after which nothing can be reread anyway.
  */
 
-  static int
-apply_to_ties(SV *self, ATTCb_t cb, void *arg)
+static void
+read_list_detach(KstatCtl_t *ctl)
 {
-  HV   *hash1;
-  HE   *entry1;
-  int   ret;
+  KstatInfo_t *kip, *next;
 
-  hash1 = (HV *)SvRV(self);
-  hv_iterinit(hash1);
-  ret = 1;
+  for (kip = ctl->read_list; kip != 0; kip = next) {
+    next = kip->read_next;
+    kip->read_next = 0;
+    kip->read_prevp = 0;
+  }
+  ctl->read_list = 0;
+}
 
-  /* Iterate over each module */
-  while ((entry1 = hv_iternext(hash1))) {
-    HV *hash2;
-    HE *entry2;
+/*
+ * Called when a tied hash carrying KstatInfo_t magic is freed.  Note that the
+ * KstatInfo_t itself lives in mg_obj, which is released after this returns.
+ */
 
-    hash2 = (HV *)SvRV(hv_iterval(hash1, entry1));
-    hv_iterinit(hash2);
+static int
+kstat_info_free(pTHX_ SV *sv, MAGIC *mg)
+{
+  KstatInfo_t *kip;
 
-    /* Iterate over each module:instance */
-    while ((entry2 = hv_iternext(hash2))) {
-      HV *hash3;
-      HE *entry3;
+  kip = (KstatInfo_t *)SvPVX(mg->mg_obj);
+  if (kip->tie == (HV *)sv) {
+    read_list_remove(kip);
+    kip->tie = 0;
+    SvREFCNT_dec(kip->ctl);
+  }
+  return (0);
+}
 
-      hash3 = (HV *)SvRV(hv_iterval(hash2, entry2));
-      hv_iterinit(hash3);
+/*
+ * Called when the storage hash behind an upper level tie of a lazy tree is
+ * freed, to release its reference to the KstatCtl_t.
+ */
 
-      /* Iterate over each module:instance:name */
-      while ((entry3 = hv_iternext(hash3))) {
-        HV    *hash4;
-        MAGIC *mg;
+static int
+kstat_tree_free(pTHX_ SV *sv, MAGIC *mg)
+{
+  SvREFCNT_dec(((KstatTree_t *)SvPVX(mg->mg_obj))->ctl);
+  return (0);
+}
 
-        /* Get the tie */
-        hash4 = (HV *)SvRV(hv_iterval(hash3, entry3));
-        mg = mg_find((SV *)hash4, 'P');
-        PERL_ASSERTMSG(mg != 0,
-            "apply_to_ties: lost P magic");
+/*
+ * The select and exclude options of new() take kstat(1M) style
+ * module:instance:name patterns.  Missing or empty fields, and "*", match
+ * anything, a field enclosed in slashes is an extended regular expression,
+ * and anything else is a gmatch(3GEN) glob.  The patterns are compiled once
+ * into a KstatMatcher_t, which is then applied to each kstat in the chain.
+ */
 
-        /* Apply the callback */
-        if (! cb((HV *)SvRV(mg->mg_obj), arg)) {
-          ret = 0;
-        }
-      }
+static void
+free_selector(KstatSelector_t *sel)
+{
+  int f;
+
+  for (f = 0; f < 4; f++) {
+    switch (sel->field[f].type) {
+      case SEL_GLOB:
+        Safefree(sel->field[f].glob);
+        break;
+      case SEL_REGEX:
+        regfree(&sel->field[f].regex);
+        break;
+      default:
+        break;
     }
+    sel->field[f].type = SEL_ANY;
   }
-  return (ret);
 }
 
-/*
- * Mark this HV as valid - used by update() when pruning deleted kstat nodes
- */
-
-  static int
-set_valid(HV *self, void *arg)
+static void
+free_matcher(KstatMatcher_t *matcher)
 {
-  MAGIC *mg;
+  int n;
 
-  mg = mg_find((SV *)self, '~');
-  PERL_ASSERTMSG(mg != 0, "set_valid: lost ~ magic");
-  ((KstatInfo_t *)SvPVX(mg->mg_obj))->valid = (int)(intptr_t)arg;
-  return (1);
+  if (matcher == 0) {
+    return;
+  }
+  for (n = 0; n < matcher->nselect; n++) {
+    free_selector(&matcher->select[n]);
+  }
+  for (n = 0; n < matcher->nexclude; n++) {
+    free_selector(&matcher->exclude[n]);
+  }
+  Safefree(matcher->select);
+  Safefree(matcher->exclude);
+  Safefree(matcher);
 }
 
 /*
- * Prune invalid kstat nodes. This is called when kstat_chain_update() detects
- * that the kstat chain has been updated.  This removes any hash tree entries
- * that no longer have a corresponding kstat.  If del is non-null it will be
- * set to the keys of the deleted kstat nodes, if any.  If any entries are
- * deleted 1 will be retured, otherwise 0
+ * Compile a single pattern of up to nfields fields into sel.  Returns 0 on
+ * success, otherwise a description of what is wrong with the pattern.
  */
 
-  static int
-prune_invalid(SV *self, AV *del)
+static const char *
+compile_selector(KstatSelector_t *sel, const char *spec, int nfields)
 {
-  HV      *hash1;
-  HE      *entry1;
-  STRLEN   klen;
-  char    *module, *instance, *name, *key;
-  int      ret;
+  static char   err[256];
+  const char   *p, *end;
+  char         *pat;
+  int           f, rc;
 
-  hash1 = (HV *)SvRV(self);
-  hv_iterinit(hash1);
-  ret = 0;
+  Zero(sel, 1, KstatSelector_t);
+  for (f = 0, p = spec; ; f++) {
+    KstatField_t *field;
+
+    if (f == nfields) {
+      return ("too many fields");
+    }
+    field = &sel->field[f];
 
-  /* Iterate over each module */
-  while ((entry1 = hv_iternext(hash1))) {
-    HV *hash2;
-    HE *entry2;
-
-    module = HePV(entry1, PL_na);
-    hash2 = (HV *)SvRV(hv_iterval(hash1, entry1));
-    hv_iterinit(hash2);
-
-    /* Iterate over each module:instance */
-    while ((entry2 = hv_iternext(hash2))) {
-      HV *hash3;
-      HE *entry3;
-
-      instance = HePV(entry2, PL_na);
-      hash3 = (HV *)SvRV(hv_iterval(hash2, entry2));
-      hv_iterinit(hash3);
-
-      /* Iterate over each module:instance:name */
-      while ((entry3 = hv_iternext(hash3))) {
-        HV    *hash4;
-        MAGIC *mg;
-        HV    *tie;
-
-        name = HePV(entry3, PL_na);
-        hash4 = (HV *)SvRV(hv_iterval(hash3, entry3));
-        mg = mg_find((SV *)hash4, 'P');
-        PERL_ASSERTMSG(mg != 0,
-            "prune_invalid: lost P magic");
-        tie = (HV *)SvRV(mg->mg_obj);
-        mg = mg_find((SV *)tie, '~');
-        PERL_ASSERTMSG(mg != 0,
-            "prune_invalid: lost ~ magic");
-
-        /* If this is marked as invalid, prune it */
-        if (((KstatInfo_t *)SvPVX(
-                (SV *)mg->mg_obj))->valid == FALSE) {
-          SvREADONLY_off(hash3);
-          key = HePV(entry3, klen);
-          hv_delete(hash3, key, klen, G_DISCARD);
-          SvREADONLY_on(hash3);
-          if (del) {
-            av_push(del,
-                newSVpvf("%s:%s:%s",
-                  module, instance, name));
-          }
-          ret = 1;
+    /* A regular expression runs up to a slash ending the field */
+    if (*p == '/') {
+      for (end = p + 1; *end != '\0'; end++) {
+        if (*end == '/' && (end[1] == ':' || end[1] == '\0')) {
+          break;
         }
       }
+      if (*end == '\0') {
+        return ("unterminated regular expression");
+      }
+      pat = savepvn(p + 1, end - p - 1);
+      rc = regcomp(&field->regex, pat, REG_EXTENDED | REG_NOSUB);
+      Safefree(pat);
+      if (rc != 0) {
+        (void) regerror(rc, &field->regex, err, sizeof (err));
+        return (err);
+      }
+      field->type = SEL_REGEX;
+      end++;
 
-      /* If the module:instance:name hash is empty prune it */
-      if (HvKEYS(hash3) == 0) {
-        SvREADONLY_off(hash2);
-        key = HePV(entry2, klen);
-        hv_delete(hash2, key, klen, G_DISCARD);
-        SvREADONLY_on(hash2);
+    /* Otherwise it's a glob, unless it would match anything */
+    } else {
+      if ((end = strchr(p, ':')) == 0) {
+        end = p + strlen(p);
+      }
+      if (end > p && ! (end - p == 1 && *p == '*')) {
+        field->glob = savepvn(p, end - p);
+        field->type = SEL_GLOB;
       }
     }
-    /* If the module:instance hash is empty prune it */
-    if (HvKEYS(hash2) == 0) {
-      SvREADONLY_off(hash1);
-      key = HePV(entry1, klen);
-      hv_delete(hash1, key, klen, G_DISCARD);
-      SvREADONLY_on(hash1);
+
+    if (*end == '\0') {
+      break;
     }
+    p = end + 1;
   }
-  return (ret);
+  return (0);
 }
 
 /*
- * Named kstats are returned as a list of key/values.  This function converts
- * such a list into the equivalent perl datatypes, and stores them in the passed
- * hash.
+ * Compile the patterns passed for one of the options, either a single string
+ * or a reference to an array of them.  Returns 0 on success, otherwise a
+ * mortal SV describing the error.
  */
 
-static void
-save_named(HV *self, kstat_t *kp, int strip_str)
+static SV *
+compile_selectors(SV *patterns, const char *option, int nfields,
+                  KstatSelector_t **selp, int *np)
 {
-  kstat_named_t *knp;
-  int            n;
-  SV*            value;
+  AV         *av;
+  SV        **svp;
+  const char *err;
+  I32         n, len;
+
+  if (SvROK(patterns) && SvTYPE(SvRV(patterns)) == SVt_PVAV) {
+    av = (AV *)SvRV(patterns);
+    len = av_len(av) + 1;
+  } else {
+    av = 0;
+    len = 1;
+  }
+  Newxz(*selp, len > 0 ? len : 1, KstatSelector_t);
+  for (n = 0; n < len; n++) {
+    SV *pattern;
 
-  for (n = kp->ks_ndata, knp = KSTAT_NAMED_PTR(kp); n > 0; n--, knp++) {
-    switch (knp->data_type) {
-    case KSTAT_DATA_CHAR:
-      value = newSVpv(knp->value.c, strip_str ?
-          strlen(knp->value.c) : sizeof (knp->value.c));
-      break;
-    case KSTAT_DATA_INT32:
-      value = newSViv(knp->value.i32);
-      break;
-    case KSTAT_DATA_UINT32:
-      value = NEW_UV(knp->value.ui32);
-      break;
-    case KSTAT_DATA_INT64:
-      value = NEW_UV(knp->value.i64);
-      break;
-    case KSTAT_DATA_UINT64:
-      value = NEW_UV(knp->value.ui64);
-      break;
-    case KSTAT_DATA_STRING:
-      if (KSTAT_NAMED_STR_PTR(knp) == NULL)
-        value = newSVpv("null", sizeof ("null") - 1);
-      else
-        value = newSVpv(KSTAT_NAMED_STR_PTR(knp),
-            KSTAT_NAMED_STR_BUFLEN(knp) -1);
-      break;
+    if (av != 0) {
+      svp = av_fetch(av, n, FALSE);
+      pattern = svp != 0 ? *svp : &PL_sv_undef;
+    } else {
+      pattern = patterns;
+    }
+    if (! SvOK(pattern)) {
+      return (sv_2mortal(newSVpvf("undefined %s pattern", option)));
+    }
+    err = compile_selector(&(*selp)[n], SvPV_nolen(pattern), nfields);
+    (*np)++;
+    if (err != 0) {
+      return (sv_2mortal(newSVpvf("invalid %s pattern '%s': %s",
+                                  option, SvPV_nolen(pattern), err)));
+    }
+  }
+  return (0);
+}
+
+/*
+ * Build a matcher from select and exclude patterns of up to nfields fields,
+ * either of which may be null.  Croaks on behalf of method if any of the
+ * patterns are invalid.
+ */
+
+static KstatMatcher_t *
+compile_matcher(const char *method, SV *select, SV *exclude, int nfields)
+{
+  KstatMatcher_t *matcher;
+  SV             *err;
+
+  Newxz(matcher, 1, KstatMatcher_t);
+  err = 0;
+  if (select != 0) {
+    err = compile_selectors(select, "select", nfields, &matcher->select,
+                            &matcher->nselect);
+  }
+  if (err == 0 && exclude != 0) {
+    err = compile_selectors(exclude, "exclude", nfields, &matcher->exclude,
+                            &matcher->nexclude);
+  }
+  if (err != 0) {
+    free_matcher(matcher);
+    croak(DEBUG_ID ": %s: %s", method, SvPV_nolen(err));
+  }
+  return (matcher);
+}
+
+static int
+match_field(KstatField_t *field, const char *str)
+{
+  switch (field->type) {
+    case SEL_GLOB:
+      return (gmatch(str, field->glob));
+    case SEL_REGEX:
+      return (regexec(&field->regex, str, 0, NULL, 0) == 0);
     default:
-      PERL_ASSERTMSG(0, "kstat_read: invalid data type");
+      return (1);
+  }
+}
+
+/*
+ * Return TRUE if the kstat matches the module, instance and name fields of
+ * the selector.  The statistic field is left to the caller.
+ */
+
+static int
+match_selector(KstatSelector_t *sel, kstat_t *kp, const char *str_inst)
+{
+  return (match_field(&sel->field[0], kp->ks_module) &&
+          match_field(&sel->field[1], str_inst) &&
+          match_field(&sel->field[2], kp->ks_name));
+}
+
+/*
+ * Return TRUE if the kstat matches one of the select patterns, if there are
+ * any, and none of the exclude patterns.
+ */
+
+static int
+match_kstat(KstatMatcher_t *matcher, kstat_t *kp)
+{
+  char str_inst[11];
+  int  n;
+
+  (void) snprintf(str_inst, sizeof (str_inst), "%d", kp->ks_instance);
+  if (matcher->nselect > 0) {
+    for (n = 0; n < matcher->nselect; n++) {
+      if (match_selector(&matcher->select[n], kp, str_inst)) {
+        break;
+      }
+    }
+    if (n == matcher->nselect) {
+      return (0);
+    }
+  }
+  for (n = 0; n < matcher->nexclude; n++) {
+    if (match_selector(&matcher->exclude[n], kp, str_inst)) {
+      return (0);
+    }
+  }
+  return (1);
+}
+
+/*
+ * Decide whether a kstat in the chain gets an entry in the hash tree.  The
+ * reader for a raw kstat is returned in readerp, otherwise it is set to 0.
+ */
+
+static int
+want_kstat(KstatCtl_t *ctl, kstat_t *kp, const RawReader_t **readerp)
+{
+  *readerp = 0;
+
+  /* Don't bother storing the kstat headers */
+  if (strncmp(kp->ks_name, "kstat_", 6) == 0) {
+    return (0);
+  }
+
+  /* Nor the kstats the caller isn't interested in */
+  if (ctl->matcher != 0 && ! match_kstat(ctl->matcher, kp)) {
+    return (0);
+  }
+
+  /* Don't bother storing raw stats we don't understand */
+  if (kp->ks_type == KSTAT_TYPE_RAW &&
+      (*readerp = lookup_raw_reader(kp->ks_module, kp->ks_name)) == 0) {
+#ifdef REPORT_UNKNOWN
+    (void)fprintf(stderr,
+                  "Unknown kstat type %s:%d:%s - %d of size %d\n",
+                  kp->ks_module, kp->ks_instance, kp->ks_name,
+                  kp->ks_ndata, kp->ks_data_size);
+#endif
+    return (0);
+  }
+  return (1);
+}
+
+/*
+ * Every Solaris::kstat keeps an index of the wanted kstats in the chain,
+ * sorted on module, instance and name.  When the chain changes, update()
+ * compares the old index with a new one to find out what has come and gone -
+ * see reindex().  A lazy Solaris::kstat doesn't build the hash tree up front
+ * either, and the tied upper levels of its tree search the index for their
+ * keys instead.  All the kstats under a module, or under a module and
+ * instance, are next to each other in the index.
+ */
+
+/*
+ * Compare an index entry with the given module, instance and name, looking
+ * only at the first depth of them.
+ */
+
+static int
+index_cmp(const KstatIndexEnt_t *ent, int depth, const char *module,
+          int instance, const char *name)
+{
+  int c;
+
+  if (depth < 1) {
+    return (0);
+  }
+  if ((c = strcmp(ent->module, module)) != 0 || depth < 2) {
+    return (c);
+  }
+  if (ent->instance != instance) {
+    return (ent->instance < instance ? -1 : 1);
+  }
+  if (depth < 3) {
+    return (0);
+  }
+  return (strcmp(ent->name, name));
+}
+
+static int
+index_sort_cmp(const void *a, const void *b)
+{
+  const KstatIndexEnt_t *eb = (const KstatIndexEnt_t *)b;
+
+  return (index_cmp((const KstatIndexEnt_t *)a, 3,
+                    eb->module, eb->instance, eb->name));
+}
+
+/*
+ * Build a sorted index of the wanted kstats in the chain.  The number of
+ * entries is returned in lenp, and the index must be freed with Safefree().
+ */
+
+static KstatIndexEnt_t *
+build_index(KstatCtl_t *ctl, size_t *lenp)
+{
+  kstat_ctl_t     *kc;
+  KstatIndexEnt_t *index, *ent;
+  kstat_t         *kp;
+  const RawReader_t *reader;
+  size_t           n;
+
+  kc = ctl->kstat_ctl;
+  for (n = 0, kp = kc->kc_chain; kp != 0; kp = kp->ks_next) {
+    n++;
+  }
+  Newx(index, n > 0 ? n : 1, KstatIndexEnt_t);
+  for (n = 0, kp = kc->kc_chain; kp != 0; kp = kp->ks_next) {
+    if (! want_kstat(ctl, kp, &reader)) {
+      continue;
+    }
+    ent = &index[n++];
+    Copy(kp->ks_module, ent->module, KSTAT_STRLEN, char);
+    Copy(kp->ks_name, ent->name, KSTAT_STRLEN, char);
+    ent->module[KSTAT_STRLEN - 1] = '\0';
+    ent->name[KSTAT_STRLEN - 1] = '\0';
+    ent->instance = kp->ks_instance;
+    ent->kstat = kp;
+    ent->reader = reader;
+  }
+  qsort(index, n, sizeof (KstatIndexEnt_t), index_sort_cmp);
+  *lenp = n;
+  return (index);
+}
+
+/*
+ * Binary search the index, comparing the first depth of module, instance and
+ * name.  Returns the position of the first matching entry, or if upper is true
+ * the position just after the last one.  Either way, if nothing matches, the
+ * position is where a match would have been.
+ */
+
+static size_t
+index_search(KstatCtl_t *ctl, int upper, int depth, const char *module,
+             int instance, const char *name)
+{
+  size_t lo, hi, mid;
+  int    c;
+
+  lo = 0;
+  hi = ctl->index_len;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    c = index_cmp(&ctl->index[mid], depth, module, instance, name);
+    if (c < 0 || (upper && c == 0)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return (lo);
+}
+
+/*
+ * Return TRUE if any entry in the index matches the first depth of module,
+ * instance and name.
+ */
+
+static int
+index_has(KstatCtl_t *ctl, int depth, const char *module, int instance,
+          const char *name)
+{
+  size_t pos;
+
+  pos = index_search(ctl, FALSE, depth, module, instance, name);
+  return (pos < ctl->index_len &&
+          index_cmp(&ctl->index[pos], depth, module, instance, name) == 0);
+}
+
+/*
+ * This module converts the flat list returned by kstat_read() into a perl hash
+ * tree keyed on module, instance, name and statistic.  The following functions
+ * provide code to create the nested hashes, and to iterate over them.
+ */
+
+/*
+ * Tie the given module:instance:name hash to a new hash blessed into the
+ * Solaris::kstat::_Stat class, and return the tie.
+ */
+
+static HV *
+tie_stat_hash(HV *hash)
+{
+  SV *tieref;
+  HV *stash;
+  HV *tie;
+
+  tie = newHV();
+  tieref = newRV_noinc((SV *)tie);
+  if (SvREFCNT(tieref) > 1) {
+    warn("just after newRV_noinc(), tieref REFCNT too high\n");
+  }
+  stash = gv_stashpv("Solaris::kstat::_Stat", GV_ADD);
+  sv_bless(tieref, stash);
+  if (SvREFCNT(tieref) > 1) {
+    warn("just after sv_bless(), tieref REFCNT too high\n");
+  }
+
+  /* Add TIEHASH magic */
+  hv_magic(hash, (GV *)tieref, PERL_MAGIC_tied );
+  /*
+  if (SvREFCNT(tieref) > 1) {
+    warn("just after hv_magic(), tieref REFCNT too high\n");
+  }
+  */
+  /* hv_magic() took its own reference to the tie */
+  SvREFCNT_dec(tieref);
+
+  SvREADONLY_on(hash);
+  return (tie);
+}
+
+/*
+ * Return the hash holding the entries of a level of the hash tree.  That is
+ * the level itself, unless it is an upper level tie of a lazy tree, in which
+ * case it is the storage hash behind the tie, holding only the entries that
+ * have been materialised so far.
+ */
+
+static HV *
+tree_hv(HV *hash)
+{
+  MAGIC *mg;
+  HV    *storage;
+
+  if (SvRMAGICAL(hash) && (mg = mg_find((SV *)hash, 'P')) != 0) {
+    storage = (HV *)SvRV(mg->mg_obj);
+    if (mg_findext((SV *)storage, PERL_MAGIC_ext, &kstat_tree_vtbl) != 0) {
+      return (storage);
+    }
+  }
+  return (hash);
+}
+
+/*
+ * Given module, instance and name keys return a pointer to the hash tied to
+ * the bottommost hash.  If the hash already exists, we just return a pointer
+ * to it, otherwise we create the hash and any others also required above it in
+ * the hierarchy.  The returned tiehash is blessed into the
+ * Solaris::kstat::_Stat class, so that the appropriate TIEHASH methods are
+ * called when the bottommost hash is accessed.  If the is_new parameter is
+ * non-null it will be set to TRUE if a new tie has been created, and FALSE if
+ * the tie already existed.
+ */
+
+static HV *
+get_tie(SV *self, char *module, int instance, char *name, int *is_new)
+{
+  char str_inst[11];  /* big enough for up to 10^10 instances */
+  char *key[3];       /* 3 part key: module, instance, name */
+  int  k;
+  int  new;
+  HV   *hash;
+  HV   *tie;
+
+  /* Create the keys */
+  (void) snprintf(str_inst, sizeof (str_inst), "%d", instance);
+  key[0] = module;
+  key[1] = str_inst;
+  key[2] = name;
+
+  /* warn("Creating tie for %s:%s:%s\n",key[0],key[1],key[2]); */
+
+  /* Iteratively descend the tree, creating new hashes as required */
+  hash = (HV *)SvRV(self);
+  for (k = 0; k < 3; k++) {
+    SV **entry;
+
+    SvREADONLY_off(hash);
+    entry = hv_fetch(hash, key[k], strlen(key[k]), TRUE);
+
+    /* If the entry doesn't exist, create it */
+    if (! SvOK(*entry)) {
+      HV *newhash;
+      SV *rv;
+
+      newhash = newHV();
+      rv = newRV_noinc((SV *)newhash);
+      sv_setsv(*entry, rv);
+      SvREFCNT_dec(rv);
+      if (k < 2) {
+        SvREADONLY_on(newhash);
+      }
+      SvREADONLY_on(*entry);
+      SvREADONLY_on(hash);
+      hash = newhash;
+      new = 1;
+
+      /* Otherwise it already existed */
+    } else {
+      SvREADONLY_on(hash);
+      hash = (HV *)SvRV(*entry);
+      new = 0;
+    }
+  }
+
+  /* Create and bless a hash for the tie, if necessary */
+  if (new) {
+    tie = tie_stat_hash(hash);
+
+    /* Otherwise, just find the existing tied hash */
+  } else {
+    MAGIC *mg;
+
+    mg = mg_find((SV *)hash, 'P');
+    PERL_ASSERTMSG(mg != 0, "get_tie: lost P magic");
+    tie = (HV *)SvRV(mg->mg_obj);
+  }
+  if (is_new) {
+    *is_new = new;
+  }
+  return (tie);
+}
+
+/*
+ * Save the data necessary to read the kstat info on demand in a newly created
+ * tie: the class and crtime values, and the KstatInfo_t magic built from the
+ * template and the kstat.
+ */
+
+static void
+init_tie(HV *tie, kstat_t *kp, const RawReader_t *reader,
+         KstatInfo_t *template)
+{
+  KstatInfo_t kstatinfo;
+  SV *kstatsv;
+
+  if (hv_store(tie, "class", 5, newSVpv(kp->ks_class, 0), 0) == NULL) {
+    warn("hv_store of class returns NULL");
+  }
+  if (hv_store(tie, "crtime", 6, NEW_HRTIME(kp->ks_crtime), 0) == NULL) {
+    warn("hv_store of crtime returns NULL");
+  }
+  kstatinfo = *template;
+  kstatinfo.kstat = kp;
+  kstatinfo.reader = reader;
+  kstatinfo.tie = tie;
+  kstatinfo.read_next = 0;
+  kstatinfo.read_prevp = 0;
+  kstatinfo.history = 0;
+  SvREFCNT_inc(kstatinfo.ctl);
+  kstatsv = newSVpv((char *)&kstatinfo, sizeof (kstatinfo));
+  sv_magicext((SV *)tie, kstatsv, PERL_MAGIC_ext, &kstat_info_vtbl, NULL, 0);
+  SvREFCNT_dec(kstatsv);
+}
+
+/*
+ * Tie an upper level hash of a lazy tree to a new storage hash blessed into
+ * the Solaris::kstat::_Tree class.  The storage hash carries the KstatTree_t
+ * magic describing the level, and holds the entries materialised below it.
+ */
+
+static void
+tie_tree_hash(HV *hash, SV *ctl, int level, const char *module, int instance)
+{
+  KstatTree_t  tree;
+  HV          *storage;
+  SV          *treesv;
+  SV          *tieref;
+
+  Zero(&tree, 1, KstatTree_t);
+  tree.ctl = ctl;
+  tree.level = level;
+  if (module != 0) {
+    (void) strncpy(tree.module, module, KSTAT_STRLEN - 1);
+  }
+  tree.instance = instance;
+  SvREFCNT_inc(ctl);
+
+  storage = newHV();
+  treesv = newSVpvn((char *)&tree, sizeof (tree));
+  sv_magicext((SV *)storage, treesv, PERL_MAGIC_ext, &kstat_tree_vtbl, NULL, 0);
+  SvREFCNT_dec(treesv);
+
+  tieref = newRV_noinc((SV *)storage);
+  sv_bless(tieref, gv_stashpv("Solaris::kstat::_Tree", GV_ADD));
+  hv_magic(hash, (GV *)tieref, PERL_MAGIC_tied);
+  SvREFCNT_dec(tieref);
+}
+
+/*
+ * Return the KstatTree_t of the storage hash behind an upper level tie.
+ */
+
+static KstatTree_t *
+tree_info(HV *storage)
+{
+  MAGIC *mg;
+
+  mg = mg_findext((SV *)storage, PERL_MAGIC_ext, &kstat_tree_vtbl);
+  PERL_ASSERTMSG(mg != 0, "tree_info: lost ~ magic");
+  return ((KstatTree_t *)SvPVX(mg->mg_obj));
+}
+
+/*
+ * Instance keys only match if they are in the canonical form the eager tree
+ * uses, so that a key returned by FIRSTKEY/NEXTKEY can be fed back in.
+ */
+
+static int
+parse_instance(const char *k, STRLEN klen, int *instance)
+{
+  char  str_inst[12];
+  long  v;
+
+  if (klen == 0 || klen >= sizeof (str_inst)) {
+    return (0);
+  }
+  v = strtol(k, NULL, 10);
+  if (v < INT_MIN || v > INT_MAX) {
+    return (0);
+  }
+  (void) snprintf(str_inst, sizeof (str_inst), "%d", (int)v);
+  if (strlen(str_inst) != klen || memNE(str_inst, k, klen)) {
+    return (0);
+  }
+  *instance = (int)v;
+  return (1);
+}
+
+/*
+ * Search the index for the entries below key in a level of a lazy tree.
+ * Returns FALSE if key can't name anything at this level.
+ */
+
+static int
+tree_search(KstatCtl_t *ctl, KstatTree_t *tree, SV *key, int upper,
+            size_t *pos)
+{
+  const char *module, *name;
+  int         instance;
+  char       *k;
+  STRLEN      klen;
+
+  k = SvPV(key, klen);
+  module = tree->module;
+  instance = tree->instance;
+  name = "";
+  switch (tree->level) {
+    case 0:
+      module = k;
+      break;
+    case 1:
+      if (! parse_instance(k, klen, &instance)) {
+        return (0);
+      }
+      break;
+    default:
+      name = k;
+      break;
+  }
+  *pos = index_search(ctl, upper, tree->level + 1, module, instance, name);
+  return (1);
+}
+
+/*
+ * Return the first index entry below key in a level of a lazy tree, or 0 if
+ * there is none.
+ */
+
+static KstatIndexEnt_t *
+tree_lookup(KstatCtl_t *ctl, KstatTree_t *tree, SV *key)
+{
+  size_t lo, hi;
+
+  if (! tree_search(ctl, tree, key, FALSE, &lo) ||
+      ! tree_search(ctl, tree, key, TRUE, &hi) || lo == hi) {
+    return (0);
+  }
+  return (&ctl->index[lo]);
+}
+
+/*
+ * Return the index entry at pos if it lies below a level of a lazy tree, or 0
+ * if it doesn't.  Used to iterate over the keys of the level.
+ */
+
+static KstatIndexEnt_t *
+tree_entry(KstatCtl_t *ctl, KstatTree_t *tree, size_t pos)
+{
+  KstatIndexEnt_t *ent;
+
+  if (pos >= ctl->index_len) {
+    return (0);
+  }
+  ent = &ctl->index[pos];
+  if (index_cmp(ent, tree->level, tree->module, tree->instance, "") != 0) {
+    return (0);
+  }
+  return (ent);
+}
+
+/*
+ * Return the key of an index entry at a level of a lazy tree.
+ */
+
+static SV *
+tree_key(KstatIndexEnt_t *ent, int level)
+{
+  switch (level) {
+    case 0:
+      return (newSVpv(ent->module, 0));
+    case 1:
+      return (newSVpvf("%d", ent->instance));
+    default:
+      return (newSVpv(ent->name, 0));
+  }
+}
+
+/*
+ * Materialise the entry under key in a level of a lazy tree: a new tied hash
+ * for the level below, or for the name level the _Stat tied hash of the kstat
+ * itself.  The new entry is saved in the storage hash and returned.
+ */
+
+static SV *
+tree_fetch(HV *storage, KstatTree_t *tree, SV *key, KstatIndexEnt_t *ent)
+{
+  HV *hash;
+  SV *rv;
+
+  hash = newHV();
+  if (tree->level < 2) {
+    tie_tree_hash(hash, tree->ctl, tree->level + 1, ent->module,
+                  ent->instance);
+  } else {
+    KstatInfo_t kstatinfo;
+
+    kstatinfo.read      = FALSE;
+    kstatinfo.valid     = TRUE;
+    kstatinfo.strip_str = TREE_CTL(tree)->strip_str;
+    kstatinfo.ctl       = tree->ctl;
+    init_tie(tie_stat_hash(hash), ent->kstat, ent->reader, &kstatinfo);
+  }
+  rv = newRV_noinc((SV *)hash);
+  (void) hv_store_ent(storage, key, rv, 0);
+  return (rv);
+}
+
+/*
+ * Find the hashes on the path to a kstat in the tree, which in a lazy tree
+ * may only have been partly materialised so far.
+ * path[0] is the entry storage of the object, path[1] of the module and
+ * path[2] of the instance, and path[3] is the kstat's own hash.  Returns the
+ * number of levels descended, so 3 if the kstat's hash exists.
+ */
+
+static int
+find_path(SV *self, const char *module, int instance, const char *name,
+          HV **path)
+{
+  char        str_inst[11];
+  const char *key[3];
+  HV         *hash;
+  int         k;
+
+  (void) snprintf(str_inst, sizeof (str_inst), "%d", instance);
+  key[0] = module;
+  key[1] = str_inst;
+  key[2] = name;
+
+  hash = (HV *)SvRV(self);
+  for (k = 0; k < 3; k++) {
+    SV **entry;
+
+    path[k] = tree_hv(hash);
+    entry = hv_fetch(path[k], key[k], strlen(key[k]), FALSE);
+    if (entry == 0 || ! SvROK(*entry)) {
+      break;
+    }
+    hash = (HV *)SvRV(*entry);
+  }
+  if (k == 3) {
+    path[3] = hash;
+  }
+  return (k);
+}
+
+/*
+ * Return the SV holding the KstatInfo_t of a kstat hash in the tree.
+ */
+
+static SV *
+stat_info_sv(HV *hash)
+{
+  MAGIC *mg;
+
+  mg = mg_find((SV *)hash, 'P');
+  PERL_ASSERTMSG(mg != 0, "stat_info: lost P magic");
+  mg = mg_find(SvRV(mg->mg_obj), '~');
+  PERL_ASSERTMSG(mg != 0, "stat_info: lost ~ magic");
+  return (mg->mg_obj);
+}
+
+/*
+ * Return the KstatInfo_t of a kstat hash in the tree.
+ */
+
+static KstatInfo_t *
+stat_info(HV *hash)
+{
+  return ((KstatInfo_t *)SvPVX(stat_info_sv(hash)));
+}
+
+/*
+ * Delete an entry from a level of the tree.  The levels of an eager tree are
+ * restricted hashes, so they must be unlocked first.
+ */
+
+static void
+tree_delete(KstatCtl_t *ctl, HV *hash, const char *key)
+{
+  if (! ctl->lazy) {
+    SvREADONLY_off(hash);
+  }
+  hv_delete(hash, key, strlen(key), G_DISCARD);
+  if (! ctl->lazy) {
+    SvREADONLY_on(hash);
+  }
+}
+
+/*
+ * Remove a kstat that has left the chain from the tree, along with any upper
+ * level entries that no longer lead to anything in the new index.
+ */
+
+static void
+prune_kstat(SV *self, KstatCtl_t *ctl, KstatIndexEnt_t *ent)
+{
+  HV   *path[4];
+  char  str_inst[11];
+  int   depth;
+
+  depth = find_path(self, ent->module, ent->instance, ent->name, path);
+  if (depth == 3) {
+    KstatInfo_t *kip;
+
+    kip = stat_info(path[3]);
+    read_list_remove(kip);
+    kip->valid = FALSE;
+    tree_delete(ctl, path[2], ent->name);
+  }
+  if (depth >= 2 && ! index_has(ctl, 2, ent->module, ent->instance, "")) {
+    (void) snprintf(str_inst, sizeof (str_inst), "%d", ent->instance);
+    tree_delete(ctl, path[1], str_inst);
+  }
+  if (depth >= 1 && ! index_has(ctl, 1, ent->module, 0, "")) {
+    tree_delete(ctl, path[0], ent->module);
+  }
+}
+
+/*
+ * Bring the tree into line with a changed kstat chain.  The old and new
+ * indexes are merged, so only the kstats that have come or gone touch the
+ * perl hashes, rather than every kstat in the tree.  Added kstats get a new
+ * tie in an eager tree, while a lazy tree materialises them from the index on
+ * demand.  Deleted kstats are pruned from the tree.  If add and del are
+ * non-null they are set to the keys of the added and deleted kstats.  Returns
+ * 1 if any kstats were deleted, otherwise 0
+ */
+
+static int
+reindex(SV *self, SV *ctlsv, AV *add, AV *del)
+{
+  KstatCtl_t      *ctl;
+  KstatIndexEnt_t *old, *cur;
+  KstatInfo_t      kstatinfo;
+  size_t           old_len, cur_len, i, j;
+  int              c, ret;
+
+  ctl = (KstatCtl_t *)SvPVX(ctlsv);
+  old = ctl->index;
+  old_len = ctl->index_len;
+  cur = build_index(ctl, &cur_len);
+  ctl->index = cur;
+  ctl->index_len = cur_len;
+
+  kstatinfo.read      = FALSE;
+  kstatinfo.valid     = TRUE;
+  kstatinfo.strip_str = ctl->strip_str;
+  kstatinfo.ctl       = ctlsv;
+
+  ret = 0;
+  i = j = 0;
+  while (i < old_len || j < cur_len) {
+    if (i == old_len) {
+      c = 1;
+    } else if (j == cur_len) {
+      c = -1;
+    } else {
+      c = index_cmp(&old[i], 3, cur[j].module, cur[j].instance, cur[j].name);
+    }
+
+    /*
+     * Still there.  If the kstat has been deleted and re-added since the last
+     * update, the address of the kstat structure will have changed, even
+     * though the kstat will still live at the same place in the tree
+     */
+    if (c == 0) {
+      if (old[i].kstat != cur[j].kstat) {
+        HV *path[4];
+
+        if (find_path(self, cur[j].module, cur[j].instance, cur[j].name,
+                      path) == 3) {
+          stat_info(path[3])->kstat = cur[j].kstat;
+        }
+      }
+      i++;
+      j++;
+
+    /* Deleted */
+    } else if (c < 0) {
+      prune_kstat(self, ctl, &old[i]);
+      if (del) {
+        av_push(del, newSVpvf("%s:%d:%s",
+              old[i].module, old[i].instance, old[i].name));
+      }
+      ret = 1;
+      i++;
+
+    /* Added */
+    } else {
+      if (! ctl->lazy) {
+        HV  *tie;
+        int  new;
+
+        tie = get_tie(self, cur[j].module, cur[j].instance, cur[j].name,
+                      &new);
+        if (new) {
+          init_tie(tie, cur[j].kstat, cur[j].reader, &kstatinfo);
+        }
+      }
+      if (add) {
+        av_push(add, newSVpvf("%s:%d:%s",
+              cur[j].module, cur[j].instance, cur[j].name));
+      }
+      j++;
+    }
+  }
+  Safefree(old);
+  return (ret);
+}
+
+/*
+ * Named kstats are returned as a list of key/values.  This function converts
+ * such a list into the equivalent perl datatypes, and stores them in the passed
+ * hash.  Values that are already in the hash are overwritten in place.
+ */
+
+#define NAMED_SV(H, KNP) \
+    stat_sv(H, (KNP)->name, -1)
+
+/*
+ * Set sv to the value of a single named statistic.
+ */
+
+static void
+set_named(SV *sv, kstat_named_t *knp, int strip_str)
+{
+  switch (knp->data_type) {
+  case KSTAT_DATA_CHAR:
+    sv_setpvn(sv, knp->value.c, strip_str ?
+        strlen(knp->value.c) : sizeof (knp->value.c));
+    break;
+  case KSTAT_DATA_INT32:
+    sv_setiv(sv, knp->value.i32);
+    break;
+  case KSTAT_DATA_UINT32:
+    SET_UV(sv, knp->value.ui32);
+    break;
+  case KSTAT_DATA_INT64:
+    SET_IV(sv, knp->value.i64);
+    break;
+  case KSTAT_DATA_UINT64:
+    SET_UV(sv, knp->value.ui64);
+    break;
+  case KSTAT_DATA_STRING:
+    if (KSTAT_NAMED_STR_PTR(knp) == NULL)
+      sv_setpvn(sv, "null", sizeof ("null") - 1);
+    else
+      sv_setpvn(sv, KSTAT_NAMED_STR_PTR(knp),
+          KSTAT_NAMED_STR_BUFLEN(knp) -1);
+    break;
+  default:
+    PERL_ASSERTMSG(0, "kstat_read: invalid data type");
+    sv_setsv(sv, &PL_sv_undef);
+    break;
+  }
+}
+
+static void
+save_named(StatStore_t *self, kstat_t *kp, int strip_str)
+{
+  kstat_named_t *knp;
+  int            n;
+
+  for (n = kp->ks_ndata, knp = KSTAT_NAMED_PTR(kp); n > 0; n--, knp++) {
+    /* warn("save_named: Storing %s\n",knp->name); */
+    set_named(NAMED_SV(self, knp), knp, strip_str);
+  }
+}
+
+/*
+ * I/O kstats hold a single kstat_io_t - definition in /usr/include/kstat.h
+ */
+
+static void
+save_io(StatStore_t *self, kstat_t *kp, int strip_str)
+{
+  kstat_io_t *kiop;
+
+  PERL_ASSERT(kp->ks_data_size >= sizeof (kstat_io_t));
+  kiop = KSTAT_IO_PTR(kp);
+
+  SAVE_UINT64(self, kiop, nread);
+  SAVE_UINT64(self, kiop, nwritten);
+  SAVE_UINT32(self, kiop, reads);
+  SAVE_UINT32(self, kiop, writes);
+  SAVE_HRTIME(self, kiop, wtime);
+  SAVE_HRTIME(self, kiop, wlentime);
+  SAVE_HRTIME(self, kiop, wlastupdate);
+  SAVE_HRTIME(self, kiop, rtime);
+  SAVE_HRTIME(self, kiop, rlentime);
+  SAVE_HRTIME(self, kiop, rlastupdate);
+  SAVE_UINT32(self, kiop, wcnt);
+  SAVE_UINT32(self, kiop, rcnt);
+}
+
+/*
+ * Timer kstats hold an array of kstat_timer_t.  As in Sun::Solaris::Kstat,
+ * only the first timer is decoded, which is all there is in practice
+ */
+
+static void
+save_timer(StatStore_t *self, kstat_t *kp, int strip_str)
+{
+  kstat_timer_t *ktimerp;
+
+  PERL_ASSERT(kp->ks_data_size >= sizeof (kstat_timer_t));
+  ktimerp = KSTAT_TIMER_PTR(kp);
+
+  SAVE_STRING(self, ktimerp, name, strip_str);
+  SAVE_UINT64(self, ktimerp, num_events);
+  SAVE_HRTIME(self, ktimerp, elapsed_time);
+  SAVE_HRTIME(self, ktimerp, min_time);
+  SAVE_HRTIME(self, ktimerp, max_time);
+  SAVE_HRTIME(self, ktimerp, start_time);
+  SAVE_HRTIME(self, ktimerp, stop_time);
+}
+
+/*
+ * Interrupt kstats hold a single kstat_intr_t, whose counters by interrupt
+ * type are stored under the names Sun::Solaris::Kstat gave them, along with
+ * their total
+ */
+
+static void
+save_intr(StatStore_t *self, kstat_t *kp, int strip_str)
+{
+  kstat_intr_t *kintrp;
+  uint64_t      total;
+  int           i;
+
+  PERL_ASSERT(kp->ks_data_size >= sizeof (kstat_intr_t));
+  kintrp = KSTAT_INTR_PTR(kp);
+
+  SAVE_VALUE(self, "hard", SET_UV, kintrp->intrs[KSTAT_INTR_HARD]);
+  SAVE_VALUE(self, "soft", SET_UV, kintrp->intrs[KSTAT_INTR_SOFT]);
+  SAVE_VALUE(self, "watchdog", SET_UV, kintrp->intrs[KSTAT_INTR_WATCHDOG]);
+  SAVE_VALUE(self, "spurious", SET_UV, kintrp->intrs[KSTAT_INTR_SPURIOUS]);
+  SAVE_VALUE(self, "multiple_service", SET_UV,
+             kintrp->intrs[KSTAT_INTR_MULTSVC]);
+  for (total = 0, i = 0; i < KSTAT_NUM_INTRS; i++) {
+    total += kintrp->intrs[i];
+  }
+  SAVE_VALUE(self, "total", SET_UV, total);
+}
+
+/*
+ * Decode the statistics in the buffer of a kstat into the StatStore_t,
+ * according to the kstat's type.  The buffer holds the data from the last
+ * kstat_read().
+ */
+
+static void
+save_kstat(StatStore_t *store, KstatInfo_t *kip)
+{
+  SAVE_VALUE(store, "snaptime", SET_HRTIME, kip->kstat->ks_snaptime);
+  switch (kip->kstat->ks_type) {
+    case KSTAT_TYPE_RAW:
+      /* Don't decode a struct smaller than the reader expects */
+      if (kip->reader != 0 &&
+          kip->kstat->ks_data_size >= kip->reader->size) {
+        kip->reader->fnp(store, kip->kstat, kip->strip_str);
+      }
+      break;
+    case KSTAT_TYPE_NAMED:
+      save_named(store, kip->kstat, kip->strip_str);
+      break;
+    case KSTAT_TYPE_INTR:
+      /* Don't decode a buffer that can't hold a kstat_intr_t */
+      if (kip->kstat->ks_data_size >= sizeof (kstat_intr_t)) {
+        save_intr(store, kip->kstat, kip->strip_str);
+      }
+      break;
+    case KSTAT_TYPE_IO:
+      /* Don't decode a buffer that can't hold a kstat_io_t */
+      if (kip->kstat->ks_data_size >= sizeof (kstat_io_t)) {
+        save_io(store, kip->kstat, kip->strip_str);
+      }
+      break;
+    case KSTAT_TYPE_TIMER:
+      /* Don't decode a buffer that can't hold a kstat_timer_t */
+      if (kip->kstat->ks_data_size >= sizeof (kstat_timer_t)) {
+        save_timer(store, kip->kstat, kip->strip_str);
+      }
+      break;
+    default:
+      PERL_ASSERTMSG(0, "read_kstats: illegal kstat type");
+      break;
+  }
+}
+
+/*
+ * Read kstats and copy into the supplied perl hash structure.  If refresh is
+ * true, this function is being called as part of the update() method.  In this
+ * case it is only necessary to read the kstats if they have previously been
+ * accessed (kip->read == TRUE).  If refresh is false, this function is being
+ * called prior to returning a value to the caller. In this case, it is only
+ * necessary to read the kstats if they have not previously been read.  If the
+ * kstat_read() fails, 0 is returned, otherwise 1
+ */
+
+static int
+read_kstat_info(HV *self, KstatInfo_t *kip, int refresh)
+{
+  kstat_ctl_t        *kc;
+  StatStore_t         store;
+
+  /* Return early if we don't need to actually read the kstats */
+  if ((refresh && ! kip->read) || (! refresh && kip->read)) {
+    /* warn("reading cached kstat\n"); */
+    return (1);
+  } else {
+    /* warn("reading kstat for the first time\n"); */
+  }
+
+  /* Read the kstats and return 0 if this fails, if the kstat has been pruned
+     from the tree, or if the kstat handle has already been closed by DESTROY */
+  if (! kip->valid || (kc = KSTAT_CTL(kip)->kstat_ctl) == 0 ||
+      kstat_read(kc, kip->kstat, NULL) < 0) {
+    return (0);
+  }
+
+  store.hv      = self;
+  store.filter  = 0;
+  store.nfilter = 0;
+  store.scratch = 0;
+
+  /* Save the read data, reusing the existing value SVs when refreshing */
+  save_kstat(&store, kip);
+  kip->read = TRUE;
+  if (kip->history != 0) {
+    history_append(kip);
+  }
+  if (kip->tie == self) {
+    read_list_insert(kip);
+  }
+  return (1);
+}
+
+static int
+read_kstats(HV *self, int refresh)
+{
+  MAGIC              *mg;
+
+  /* Find the MAGIC KstatInfo_t data structure */
+  mg = mg_find((SV *)self, '~');
+  PERL_ASSERTMSG(mg != 0, "read_kstats: lost ~ magic");
+  return (read_kstat_info(self, (KstatInfo_t *)SvPVX(mg->mg_obj), refresh));
+}
+
+/*
+ * Return the hash stored under key in a plain hash, creating it if necessary.
+ */
+
+static HV *
+copy_hv(HV *parent, const char *key)
+{
+  SV **entry;
+
+  entry = hv_fetch(parent, key, strlen(key), TRUE);
+  if (! SvROK(*entry)) {
+    sv_setsv(*entry, sv_2mortal(newRV_noinc((SV *)newHV())));
+  }
+  return ((HV *)SvRV(*entry));
+}
+
+/*
+ * Add a plain copy of a kstat that has been read to the tree of plain hashes
+ * in copy.  The values are copied out of the hash tied to the kstat, so the
+ * copy always agrees with what $k shows, whatever fetch_many() or
+ * intr_sample() have read into the kstat buffer since.  The buckets of the
+ * storage hash are walked directly rather than with its iterator, which an
+ * each() loop over the kstat may be using.  If filter is non-null
+ * only the statistics matching one of its nfilter fields are copied, and
+ * nothing is added if none of them do.
+ */
+
+static void
+copy_kstat_info(HV *copy, KstatInfo_t *kip, KstatField_t **filter,
+                int nfilter, SV *scratch)
+{
+  kstat_t     *kp;
+  StatStore_t  store;
+  HV          *module, *instance;
+  HE          *he;
+  STRLEN       i;
+  char         str_inst[11];
+
+  if (kip->tie == 0) {
+    return;
+  }
+  kp = kip->kstat;
+  (void) snprintf(str_inst, sizeof (str_inst), "%d", kp->ks_instance);
+  module        = copy_hv(copy, kp->ks_module);
+  instance      = copy_hv(module, str_inst);
+  store.hv      = copy_hv(instance, kp->ks_name);
+  store.filter  = filter;
+  store.nfilter = nfilter;
+  store.scratch = scratch;
+
+  if (HvARRAY(kip->tie) != 0) {
+    for (i = 0; i <= HvMAX(kip->tie); i++) {
+      for (he = HvARRAY(kip->tie)[i]; he != 0; he = HeNEXT(he)) {
+        if (store_wants(&store, HeKEY(he))) {
+          (void) hv_store(store.hv, HeKEY(he), HeKLEN(he),
+                          newSVsv(HeVAL(he)), HeHASH(he));
+        }
+      }
+    }
+  }
+
+  /* Don't leave empty branches behind if every statistic was filtered out */
+  if (HvUSEDKEYS(store.hv) == 0) {
+    hv_delete(instance, kp->ks_name, strlen(kp->ks_name), G_DISCARD);
+    if (HvUSEDKEYS(instance) == 0) {
+      hv_delete(module, str_inst, strlen(str_inst), G_DISCARD);
+      if (HvUSEDKEYS(module) == 0) {
+        hv_delete(copy, kp->ks_module, strlen(kp->ks_module), G_DISCARD);
+      }
+    }
+  }
+}
+
+/*
+ * Copy a kstat that has been read if any of the selectors of matcher match it.
+ * Its statistics are filtered on the statistic fields of the matching
+ * selectors, unless one of them doesn't have one.  filter must have room for
+ * a field per selector.
+ */
+
+static void
+copy_selected(HV *copy, KstatInfo_t *kip, KstatMatcher_t *matcher,
+              KstatField_t **filter, SV *scratch)
+{
+  KstatSelector_t *sel;
+  char             str_inst[11];
+  int              n, nfilter;
+
+  (void) snprintf(str_inst, sizeof (str_inst), "%d", kip->kstat->ks_instance);
+  for (n = 0, nfilter = 0; n < matcher->nselect; n++) {
+    sel = &matcher->select[n];
+    if (! match_selector(sel, kip->kstat, str_inst)) {
+      continue;
+    }
+    if (sel->field[3].type == SEL_ANY) {
+      copy_kstat_info(copy, kip, 0, 0, 0);
+      return;
+    }
+    filter[nfilter++] = &sel->field[3];
+  }
+  if (nfilter > 0) {
+    copy_kstat_info(copy, kip, filter, nfilter, scratch);
+  }
+}
+
+/*
+ * If every select pattern of matcher names a single module, store the start
+ * and end of the index range of each of those modules in ranges, which must
+ * have room for two entries per pattern, and return the number of ranges.
+ * Returns 0 if any pattern could match more than one module.
+ */
+
+static int
+select_ranges(KstatCtl_t *ctl, KstatMatcher_t *matcher, size_t *ranges)
+{
+  KstatField_t *field;
+  int           n, m, nranges;
+
+  for (n = 0; n < matcher->nselect; n++) {
+    field = &matcher->select[n].field[0];
+    if (field->type != SEL_GLOB || strpbrk(field->glob, "*?[\\") != 0) {
+      return (0);
+    }
+  }
+
+  nranges = 0;
+  for (n = 0; n < matcher->nselect; n++) {
+    const char *module;
+
+    /* Each module only needs to be visited once */
+    module = matcher->select[n].field[0].glob;
+    for (m = 0; m < n; m++) {
+      if (strEQ(matcher->select[m].field[0].glob, module)) {
+        break;
+      }
+    }
+    if (m < n) {
+      continue;
+    }
+    ranges[nranges * 2] = index_search(ctl, FALSE, 1, module, 0, "");
+    ranges[nranges * 2 + 1] = index_search(ctl, TRUE, 1, module, 0, "");
+    nranges++;
+  }
+  return (nranges);
+}
+
+/*
+ * If every selector of matcher names a single module, copy the kstats they
+ * select by going through just those modules in the index, rather than
+ * through the whole read list.  Returns FALSE if that isn't possible.
+ */
+
+static int
+copy_selected_modules(HV *copy, SV *self, KstatCtl_t *ctl,
+                      KstatMatcher_t *matcher, KstatField_t **filter,
+                      SV *scratch)
+{
+  size_t *ranges, pos;
+  int     nranges, n;
+
+  if (matcher->nselect == 0) {
+    return (0);
+  }
+  Newx(ranges, matcher->nselect * 2, size_t);
+  nranges = select_ranges(ctl, matcher, ranges);
+  for (n = 0; n < nranges; n++) {
+    for (pos = ranges[n * 2]; pos < ranges[n * 2 + 1]; pos++) {
+      KstatIndexEnt_t *ent;
+      KstatInfo_t     *kip;
+      HV              *path[4];
+
+      ent = &ctl->index[pos];
+      if (find_path(self, ent->module, ent->instance, ent->name, path) != 3) {
+        continue;
+      }
+      kip = stat_info(path[3]);
+      if (kip->read_prevp != 0) {
+        copy_selected(copy, kip, matcher, filter, scratch);
+      }
+    }
+  }
+  Safefree(ranges);
+  return (nranges > 0);
+}
+
+/*
+ * Reread every kstat on the read list, as update() does when the kstat chain
+ * hasn't changed.  If any kstat_read() fails, 0 is returned, otherwise 1
+ */
+
+static int
+refresh_read_kstats(KstatCtl_t *ctl)
+{
+  KstatInfo_t *kip, *next;
+  int          ret;
+
+  ret = 1;
+  for (kip = ctl->read_list; kip != 0; kip = next) {
+    next = kip->read_next;
+    if (! read_kstat_info(kip->tie, kip, TRUE)) {
+      ret = 0;
+    }
+  }
+  return (ret);
+}
+
+/*
+ * Return the positions of the named statistics in the KSTAT_TYPE_NAMED kstat
+ * kp, or -1 for any it doesn't have.  The positions are resolved once per
+ * kind of kstat in a fetch_many() call, and kept in the call's poscache keyed
+ * by the "module:name" key of the kstat, so the cache goes with the call.
+ * The cached entry starts with the ks_ndata it was resolved against.  As
+ * positions may shift when a kstat changes shape, or differ between kstats of
+ * the same kind, each cached position is checked against the name before use,
+ * which is a cheap comparison, and only resolved again if it doesn't match.
+ */
+
+static I32 *
+resolve_named(kstat_t *kp, char **names, int nnames, HV *poscache)
+{
+  char           key[KSTAT_STRLEN * 2];
+  kstat_named_t *knp;
+  SV           **entry;
+  STRLEN         len;
+  I32           *pos;
+  int            n, m;
+
+  build_kstat_key(key, kp->ks_module, kp->ks_name);
+  entry = hv_fetch(poscache, key, strlen(key), TRUE);
+  PERL_ASSERTMSG(entry != 0, "resolve_named: hv_fetch lvalue failed");
+
+  len = (nnames + 1) * sizeof (I32);
+  if (! SvPOK(*entry) || SvCUR(*entry) != len) {
+    (void) SvUPGRADE(*entry, SVt_PV);
+    SvGROW(*entry, len + 1);
+    SvCUR_set(*entry, len);
+    SvPOK_only(*entry);
+    pos = (I32 *)SvPVX(*entry);
+    pos[0] = -1;
+  }
+  pos = (I32 *)SvPVX(*entry);
+  knp = KSTAT_NAMED_PTR(kp);
+
+  for (n = 0; n < nnames; n++) {
+    I32 p;
+
+    p = pos[0] == kp->ks_ndata ? pos[n + 1] : -1;
+    if (p >= 0 && p < kp->ks_ndata &&
+        strncmp(knp[p].name, names[n], KSTAT_STRLEN) == 0) {
+      continue;
+    }
+    for (m = 0; m < kp->ks_ndata; m++) {
+      if (strncmp(knp[m].name, names[n], KSTAT_STRLEN) == 0) {
+        break;
+      }
+    }
+    pos[n + 1] = m < kp->ks_ndata ? m : -1;
+  }
+  pos[0] = kp->ks_ndata;
+  return (pos + 1);
+}
+
+/*
+ * Build the fetch_many() row of a kstat that has just been read: module,
+ * instance, name and snaptime, followed by the value of each of the named
+ * statistics, or undef for any the kstat doesn't have.  Named kstats are
+ * indexed directly by resolve_named(), other kinds are decoded into the
+ * scratch hash first.
+ */
+
+static AV *
+fetch_row(KstatCtl_t *ctl, KstatIndexEnt_t *ent, char **names, int nnames,
+          HV *poscache, HV *scratch)
+{
+  kstat_t *kp;
+  AV      *row;
+  int      n;
+
+  kp = ent->kstat;
+  row = newAV();
+  av_extend(row, nnames + 3);
+  av_push(row, newSVpv(kp->ks_module, 0));
+  av_push(row, newSViv(kp->ks_instance));
+  av_push(row, newSVpv(kp->ks_name, 0));
+  av_push(row, NEW_HRTIME(kp->ks_snaptime));
+
+  if (kp->ks_type == KSTAT_TYPE_NAMED) {
+    kstat_named_t *knp;
+    I32           *pos;
+
+    pos = resolve_named(kp, names, nnames, poscache);
+    knp = KSTAT_NAMED_PTR(kp);
+    for (n = 0; n < nnames; n++) {
+      SV *sv;
+
+      sv = newSV(0);
+      if (pos[n] >= 0) {
+        set_named(sv, &knp[pos[n]], ctl->strip_str);
+      }
+      av_push(row, sv);
+    }
+  } else {
+    KstatInfo_t kstatinfo;
+    StatStore_t store;
+
+    Zero(&kstatinfo, 1, KstatInfo_t);
+    kstatinfo.kstat     = kp;
+    kstatinfo.reader    = ent->reader;
+    kstatinfo.strip_str = ctl->strip_str;
+    hv_clear(scratch);
+    store.hv      = scratch;
+    store.filter  = 0;
+    store.nfilter = 0;
+    store.scratch = 0;
+    save_kstat(&store, &kstatinfo);
+    for (n = 0; n < nnames; n++) {
+      SV **svp;
+
+      svp = hv_fetch(scratch, names[n], strlen(names[n]), FALSE);
+      av_push(row, svp != 0 ? newSVsv(*svp) : newSV(0));
+    }
+  }
+  return (row);
+}
+
+/*
+ * Fetch the statistics io_delta() needs from the hash of an I/O kstat, which
+ * may be tied.  A missing hash gives zeros, for rates since boot.
+ */
+
+static void
+io_fields(HV *hv, const char *what, UV *fields)
+{
+  int i;
+
+  for (i = 0; i < IO_NFIELDS; i++) {
+    HE *he;
+
+    if (hv == 0) {
+      fields[i] = 0;
+    } else if ((he = hv_fetch_ent(hv, io_field_keys[i], FALSE,
+                   SvSHARED_HASH(io_field_keys[i]))) != 0) {
+      fields[i] = SvUV(HeVAL(he));
+    } else {
+      croak(DEBUG_ID ": io_delta: %s has no %s statistic", what,
+            io_field_names[i]);
+    }
+  }
+}
+
+/*
+ * Compute the iostat -x columns of an I/O kstat between two reads of it, as
+ * iostat(1M) does.  The reads and writes counters are 32 bits wide, so their
+ * deltas are taken modulo 2^32 to survive wrapping.
+ */
+
+static void
+io_rates(HV *old, HV *new, NV *rates)
+{
+  UV o[IO_NFIELDS], n[IO_NFIELDS];
+  NV etime, secs, tps;
+
+  io_fields(old, "old", o);
+  io_fields(new, "new", n);
+
+  etime = (NV)(n[IO_SNAPTIME] - o[IO_SNAPTIME]);
+  if (etime <= 0) {
+    etime = 1000000000.0;
+  }
+  secs = etime / 1000000000.0;
+
+  rates[IO_RPS]  = (U32)(n[IO_READS] - o[IO_READS]) / secs;
+  rates[IO_WPS]  = (U32)(n[IO_WRITES] - o[IO_WRITES]) / secs;
+  rates[IO_KRPS] = (n[IO_NREAD] - o[IO_NREAD]) / 1024.0 / secs;
+  rates[IO_KWPS] = (n[IO_NWRITTEN] - o[IO_NWRITTEN]) / 1024.0 / secs;
+  rates[IO_WAIT] = (n[IO_WLENTIME] - o[IO_WLENTIME]) / etime;
+  rates[IO_ACTV] = (n[IO_RLENTIME] - o[IO_RLENTIME]) / etime;
+  rates[IO_WPCT] = (n[IO_WTIME] - o[IO_WTIME]) * 100.0 / etime;
+  rates[IO_BPCT] = (n[IO_RTIME] - o[IO_RTIME]) * 100.0 / etime;
+
+  /* Service times are in ms, per transfer */
+  tps = rates[IO_RPS] + rates[IO_WPS];
+  if (tps > 0) {
+    rates[IO_WSVC_T] = rates[IO_WAIT] * 1000.0 / tps;
+    rates[IO_ASVC_T] = rates[IO_ACTV] * 1000.0 / tps;
+    rates[IO_SVC_T]  = (rates[IO_WAIT] + rates[IO_ACTV]) * 1000.0 / tps;
+  } else {
+    rates[IO_WSVC_T] = rates[IO_ASVC_T] = rates[IO_SVC_T] = 0.0;
+  }
+}
+
+/*
+ * Fetch the statistics timer_summary() needs from the hash of a timer kstat.
+ * Returns FALSE if the hash lacks any of them, i.e. isn't that of a timer.
+ */
+
+static bool
+timer_fields(HV *hv, UV *fields)
+{
+  int i;
+
+  for (i = 0; i < TIMER_NFIELDS; i++) {
+    HE *he = hv_fetch_ent(hv, timer_field_keys[i], FALSE,
+                          SvSHARED_HASH(timer_field_keys[i]));
+
+    if (he == 0 || ! SvOK(HeVAL(he))) {
+      return (FALSE);
+    }
+    fields[i] = SvUV(HeVAL(he));
+  }
+  return (TRUE);
+}
+
+/*
+ * Compute the event rate of a timer between two reads of it, and the mean time
+ * of the events in between.  An older read with more events than the newer
+ * one is of a timer since re-created, so the newer one counts from boot.
+ * Returns the ns elapsed between the reads.
+ */
+
+static hrtime_t
+timer_rates(const UV *o, const UV *n, NV *rates)
+{
+  static const UV zero[TIMER_NFIELDS];
+  UV              events;
+  hrtime_t        etime;
+
+  if (o == 0 || o[TIMER_NUM_EVENTS] > n[TIMER_NUM_EVENTS]) {
+    o = zero;
+  }
+
+  etime = n[TIMER_SNAPTIME] - o[TIMER_SNAPTIME];
+  events = n[TIMER_NUM_EVENTS] - o[TIMER_NUM_EVENTS];
+  rates[TIMER_EPS] = events * 1000000000.0 /
+    (etime > 0 ? (NV)etime : 1000000000.0);
+  rates[TIMER_MEAN_TIME] = events > 0 ?
+    (NV)(n[TIMER_ELAPSED_TIME] - o[TIMER_ELAPSED_TIME]) / events : 0.0;
+  return (etime);
+}
+
+/*
+ * Return the hash stored in hv under the key of the entry of another hash, or
+ * 0 if there's no hash there.  The hash value of the key is reused.
+ */
+
+static HV *
+sub_hv(HV *hv, HE *key)
+{
+  SV **svp;
+
+  if (hv == 0 ||
+      (svp = (SV **)hv_common_key_len(hv, HeKEY(key),
+               HeKUTF8(key) ? -HeKLEN(key) : HeKLEN(key),
+               HV_FETCH_JUST_SV, NULL, HeHASH(key))) == 0 ||
+      ! SvROK(*svp) || SvTYPE(SvRV(*svp)) != SVt_PVHV) {
+    return (0);
+  }
+  return ((HV *)SvRV(*svp));
+}
+
+/*
+ * A Solaris::kstat::IntrSample is a reference to a scalar whose buffer holds
+ * the counters of every interrupt kstat in the index at one time, for
+ * intr_delta().  After the header come arrays of cap entries each: the index
+ * entries of the sources, their snaptimes, their crtimes, their counters by
+ * interrupt type plus the total, and their KIDs.  Only the first n entries are used, as
+ * reads can fail.  The kstat pointers of the index entries aren't used once
+ * the sample is taken, as the chain may have changed since.
+ */
+
+#define INTR_NCOUNTS (KSTAT_NUM_INTRS + 1)
+
+typedef struct {
+  size_t cap;               /* Number of entries there is room for */
+  size_t n;                 /* Number of interrupt sources in the sample */
+} IntrSample_t;
+
+#define INTR_SAMPLE_ENTS(S) \
+    ((KstatIndexEnt_t *)((S) + 1))
+#define INTR_SAMPLE_SNAPTIMES(S) \
+    ((hrtime_t *)(INTR_SAMPLE_ENTS(S) + (S)->cap))
+#define INTR_SAMPLE_CRTIMES(S) \
+    (INTR_SAMPLE_SNAPTIMES(S) + (S)->cap)
+#define INTR_SAMPLE_COUNTS(S) \
+    ((uint64_t *)(INTR_SAMPLE_CRTIMES(S) + (S)->cap))
+#define INTR_SAMPLE_KIDS(S) \
+    ((kid_t *)(INTR_SAMPLE_COUNTS(S) + (S)->cap * INTR_NCOUNTS))
+#define INTR_SAMPLE_SIZE(CAP) \
+    (sizeof (IntrSample_t) + (CAP) * (sizeof (KstatIndexEnt_t) + \
+     2 * sizeof (hrtime_t) + INTR_NCOUNTS * sizeof (uint64_t) + sizeof (kid_t)))
+
+static IntrSample_t *
+intr_sample_info(SV *sample, const char *what)
+{
+  SV           *state;
+  IntrSample_t *s;
+
+  if (! sv_isobject(sample) ||
+      ! sv_derived_from(sample, DEBUG_ID "::IntrSample") ||
+      ! SvPOK(state = SvRV(sample)) || SvCUR(state) < sizeof (IntrSample_t) ||
+      SvCUR(state) != INTR_SAMPLE_SIZE(((IntrSample_t *)SvPVX(state))->cap)) {
+    croak(DEBUG_ID ": intr_delta: %s is not an interrupt sample", what);
+  }
+  s = (IntrSample_t *)SvPVX(state);
+  return (s);
+}
+
+/*
+ * Read every interrupt kstat in the index into a new sample
+ */
+
+static SV *
+intr_sample(KstatCtl_t *ctl)
+{
+  SV           *state;
+  IntrSample_t *s;
+  size_t        cap, pos;
+
+  for (cap = 0, pos = 0; pos < ctl->index_len; pos++) {
+    if (ctl->index[pos].kstat->ks_type == KSTAT_TYPE_INTR) {
+      cap++;
+    }
+  }
+
+  state = newSV(INTR_SAMPLE_SIZE(cap));
+  SvPOK_only(state);
+  SvCUR_set(state, INTR_SAMPLE_SIZE(cap));
+  s = (IntrSample_t *)SvPVX(state);
+  s->cap = cap;
+  s->n = 0;
+
+  for (pos = 0; pos < ctl->index_len && s->n < cap; pos++) {
+    KstatIndexEnt_t *ent = &ctl->index[pos];
+    kstat_intr_t    *kintrp;
+    uint64_t        *counts;
+    int              i;
+
+    if (ent->kstat->ks_type != KSTAT_TYPE_INTR ||
+        kstat_read(ctl->kstat_ctl, ent->kstat, NULL) < 0 ||
+        ent->kstat->ks_data_size < sizeof (kstat_intr_t)) {
+      continue;
+    }
+    kintrp = KSTAT_INTR_PTR(ent->kstat);
+    counts = &INTR_SAMPLE_COUNTS(s)[s->n * INTR_NCOUNTS];
+    counts[KSTAT_NUM_INTRS] = 0;
+    for (i = 0; i < KSTAT_NUM_INTRS; i++) {
+      counts[i] = kintrp->intrs[i];
+      counts[KSTAT_NUM_INTRS] += counts[i];
+    }
+    INTR_SAMPLE_ENTS(s)[s->n] = *ent;
+    INTR_SAMPLE_SNAPTIMES(s)[s->n] = ent->kstat->ks_snaptime;
+    INTR_SAMPLE_CRTIMES(s)[s->n] = ent->kstat->ks_crtime;
+    INTR_SAMPLE_KIDS(s)[s->n] = ent->kstat->ks_kid;
+    s->n++;
+  }
+
+  return (sv_bless(newRV_noinc(state),
+                   gv_stashpv(DEBUG_ID "::IntrSample", GV_ADD)));
+}
+
+/*
+ * Subtract the counters of the old sample from those of the new one, into
+ * delta, which has room for the counters of every source of new.  When the
+ * two samples hold the same kstats, which is the usual case, that is one
+ * counts_delta() over flat arrays of counters.  dist.ini links it in from
+ * libkstatsnap/delta.c, and its intrinsics give vector instructions even at
+ * -xO0, wherever the compiler targets SSE2 or NEON.  Otherwise the sources
+ * are matched up by name, as both samples are in index order, and a source
+ * new to the new sample, or re-created since the old one, counts from zero.
+ * The elapsed time of each source goes in etime.  For a source counting from
+ * zero, that is the time since its creation, as its counters only run from
+ * then.
+ */
+
+static void
+intr_delta(IntrSample_t *old, IntrSample_t *new, uint64_t *delta,
+           hrtime_t *etime)
+{
+  const uint64_t *oc = INTR_SAMPLE_COUNTS(old);
+  const uint64_t *nc = INTR_SAMPLE_COUNTS(new);
+  size_t          i, j, k;
+
+  if (old->n == new->n &&
+      memcmp(INTR_SAMPLE_KIDS(old), INTR_SAMPLE_KIDS(new),
+             new->n * sizeof (kid_t)) == 0) {
+    counts_delta(delta, nc, oc, new->n * INTR_NCOUNTS);
+    for (i = 0; i < new->n; i++) {
+      etime[i] = INTR_SAMPLE_SNAPTIMES(new)[i] - INTR_SAMPLE_SNAPTIMES(old)[i];
+    }
+    return;
+  }
+
+  for (i = 0, j = 0; i < new->n; i++) {
+    const KstatIndexEnt_t *ent = &INTR_SAMPLE_ENTS(new)[i];
+    int                    c = 1;
+
+    while (j < old->n && (c = index_cmp(&INTR_SAMPLE_ENTS(old)[j], 3,
+           ent->module, ent->instance, ent->name)) < 0) {
+      j++;
+    }
+    if (j < old->n && c == 0 &&
+        INTR_SAMPLE_KIDS(old)[j] == INTR_SAMPLE_KIDS(new)[i]) {
+      counts_delta(&delta[i * INTR_NCOUNTS], &nc[i * INTR_NCOUNTS],
+                   &oc[j * INTR_NCOUNTS], INTR_NCOUNTS);
+      etime[i] = INTR_SAMPLE_SNAPTIMES(new)[i] - INTR_SAMPLE_SNAPTIMES(old)[j];
+    } else {
+      for (k = 0; k < INTR_NCOUNTS; k++) {
+        delta[i * INTR_NCOUNTS + k] = nc[i * INTR_NCOUNTS + k];
+      }
+      etime[i] = INTR_SAMPLE_SNAPTIMES(new)[i] - INTR_SAMPLE_CRTIMES(new)[i];
+    }
+  }
+}
+
+/*
+ * A Solaris::kstat::Ticker is a reference to a scalar whose buffer holds the
+ * struct ticker, so it goes away with the object.
+ */
+static struct ticker *
+ticker_info(SV *self)
+{
+  SV *state;
+
+  if (!sv_isobject(self) ||
+      !SvPOK(state = SvRV(self)) || SvCUR(state) != sizeof (struct ticker)) {
+    croak(DEBUG_ID "::Ticker: not a ticker");
+  }
+  return ((struct ticker *)SvPVX(state));
+}
+
+/*
+ * A Solaris::kstat::History is a reference to a scalar whose buffer holds the
+ * History_t, followed by a HistorySeries_t per numeric statistic it records,
+ * then a column of depth values per series and a column of their snaptimes.
+ * Each series is resolved once, to a kstat and the position of the statistic
+ * in it, and hangs off the KstatInfo_t of the kstat, so read_kstat_info()
+ * appends to it whenever the kstat is read.  A series holds a reference to
+ * the SV containing the KstatInfo_t, so that stays valid until the history is
+ * destroyed, even if the kstat leaves the chain first.  As the series are
+ * linked into the KstatInfo_t, the buffer must never move: h_self catches a
+ * copy of the buffer made behind the object's back.
+ */
+
+typedef struct {
+  const void   *h_self;     /* The History_t itself, unless this is a copy */
+  size_t        depth;      /* Number of samples kept per series */
+  size_t        nseries;    /* Number of series */
+} History_t;
+
+/*
+ * The statistics of the I/O, interrupt and timer kstat types, at fixed offsets
+ * in the kstat buffer.  The interrupt total has a size of 0, as it is the sum
+ * of the counters.
+ */
+typedef struct {
+  uchar_t       type;       /* ks_type of the kstats that have it */
+  const char   *name;       /* Its name, as decoded into the hash */
+  size_t        offset;     /* Offset in the kstat buffer */
+  size_t        size;       /* Size of the value, 4 or 8, or 0 */
+  size_t        min_size;   /* ks_data_size the kstat buffer needs */
+} FixedStat_t;
+
+#define FIXED_STAT(T, S, F) \
+    { T, #F, offsetof(S, F), sizeof (((S *)0)->F), sizeof (S) }
+#define INTR_STAT(N, I) \
+    { KSTAT_TYPE_INTR, N, offsetof(kstat_intr_t, intrs) + \
+      (I) * sizeof (uint_t), sizeof (uint_t), sizeof (kstat_intr_t) }
+
+static const FixedStat_t fixed_stats[] = {
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, nread),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, nwritten),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, reads),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, writes),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, wtime),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, wlentime),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, wlastupdate),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, rtime),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, rlentime),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, rlastupdate),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, wcnt),
+  FIXED_STAT(KSTAT_TYPE_IO, kstat_io_t, rcnt),
+  INTR_STAT("hard", KSTAT_INTR_HARD),
+  INTR_STAT("soft", KSTAT_INTR_SOFT),
+  INTR_STAT("watchdog", KSTAT_INTR_WATCHDOG),
+  INTR_STAT("spurious", KSTAT_INTR_SPURIOUS),
+  INTR_STAT("multiple_service", KSTAT_INTR_MULTSVC),
+  { KSTAT_TYPE_INTR, "total", 0, 0, sizeof (kstat_intr_t) },
+  FIXED_STAT(KSTAT_TYPE_TIMER, kstat_timer_t, num_events),
+  FIXED_STAT(KSTAT_TYPE_TIMER, kstat_timer_t, elapsed_time),
+  FIXED_STAT(KSTAT_TYPE_TIMER, kstat_timer_t, min_time),
+  FIXED_STAT(KSTAT_TYPE_TIMER, kstat_timer_t, max_time),
+  FIXED_STAT(KSTAT_TYPE_TIMER, kstat_timer_t, start_time),
+  FIXED_STAT(KSTAT_TYPE_TIMER, kstat_timer_t, stop_time),
+};
+
+#define NUM_FIXED_STATS (sizeof (fixed_stats) / sizeof (fixed_stats[0]))
+
+struct HistorySeries {
+  HistorySeries_t  *next;       /* Next series of the same kstat */
+  HistorySeries_t **prevp;      /* Link to this series, or 0 if detached */
+  SV               *kipsv;      /* SV holding the KstatInfo_t of the kstat */
+  const FixedStat_t *fixed;     /* The statistic, unless the kstat is named */
+  I32               pos;        /* Last position of a named statistic */
+  int               is_signed;  /* Values are INT32 or INT64, as resolved */
+  int               is_32bit;   /* Values are 32 bits wide, as resolved */
+  size_t            depth;      /* Number of slots in the columns */
+  size_t            head;       /* Slot the next sample goes in */
+  size_t            count;      /* Number of samples held */
+  uint64_t         *values;     /* Column of values */
+  hrtime_t         *snaptimes;  /* Column of the snaptimes of the values */
+  char              module[KSTAT_STRLEN];
+  int               instance;
+  char              name[KSTAT_STRLEN];
+  char              stat[KSTAT_STRLEN];
+};
+
+#define HISTORY_SERIES(H) \
+    ((HistorySeries_t *)((H) + 1))
+#define HISTORY_VALUES(H) \
+    ((uint64_t *)(HISTORY_SERIES(H) + (H)->nseries))
+#define HISTORY_SNAPTIMES(H) \
+    ((hrtime_t *)(HISTORY_VALUES(H) + (H)->nseries * (H)->depth))
+#define HISTORY_SIZE(N, D) \
+    (sizeof (History_t) + (N) * (sizeof (HistorySeries_t) + \
+     (D) * (sizeof (uint64_t) + sizeof (hrtime_t))))
+
+/* Whether values of a named statistic of the data type are signed */
+#define HISTORY_SIGNED(T) \
+    ((T) == KSTAT_DATA_INT32 || (T) == KSTAT_DATA_INT64)
+
+/* Whether values of a named statistic of the data type are 32 bits wide */
+#define HISTORY_32BIT(T) \
+    ((T) == KSTAT_DATA_INT32 || (T) == KSTAT_DATA_UINT32)
+
+/* Slot of the k-th newest sample of a series, from 0 for the newest */
+#define HISTORY_SLOT(HS, K) \
+    (((HS)->head + (HS)->depth - 1 - (K)) % (HS)->depth)
+
+/*
+ * Fetch the value of the statistic of a series from the buffer of its kstat.
+ * The position of a named statistic is checked against its name, and looked
+ * up again if the kstat has changed shape.  Returns FALSE if the kstat no
+ * longer has a numeric value for the statistic, or has one of the other
+ * signedness or width, which can't go in the same column.
+ */
+
+static int
+history_value(HistorySeries_t *hs, kstat_t *kp, uint64_t *vp)
+{
+  const FixedStat_t *fs;
+
+  if ((fs = hs->fixed) == 0) {
+    kstat_named_t *knp;
+    I32            p;
+
+    knp = KSTAT_NAMED_PTR(kp);
+    p = hs->pos;
+    if (p < 0 || p >= kp->ks_ndata ||
+        strncmp(knp[p].name, hs->stat, KSTAT_STRLEN) != 0) {
+      for (p = 0; p < kp->ks_ndata; p++) {
+        if (strncmp(knp[p].name, hs->stat, KSTAT_STRLEN) == 0) {
+          break;
+        }
+      }
+      if (p == kp->ks_ndata) {
+        return (FALSE);
+      }
+      hs->pos = p;
+    }
+    if (HISTORY_SIGNED(knp[p].data_type) != hs->is_signed ||
+        HISTORY_32BIT(knp[p].data_type) != hs->is_32bit) {
+      return (FALSE);
+    }
+    switch (knp[p].data_type) {
+      case KSTAT_DATA_INT32:
+        *vp = (uint64_t)(int64_t)knp[p].value.i32;
+        break;
+      case KSTAT_DATA_UINT32:
+        *vp = knp[p].value.ui32;
+        break;
+      case KSTAT_DATA_INT64:
+        *vp = (uint64_t)knp[p].value.i64;
+        break;
+      case KSTAT_DATA_UINT64:
+        *vp = knp[p].value.ui64;
+        break;
+      default:
+        return (FALSE);
+    }
+  } else {
+    const char *data = (const char *)kp->ks_data;
+
+    if (kp->ks_data_size < fs->min_size) {
+      return (FALSE);
+    }
+    if (fs->size == 0) {
+      const kstat_intr_t *kintrp = (const kstat_intr_t *)data;
+      int                 i;
+
+      for (*vp = 0, i = 0; i < KSTAT_NUM_INTRS; i++) {
+        *vp += kintrp->intrs[i];
+      }
+    } else if (fs->size == sizeof (uint32_t)) {
+      uint32_t v;
+
+      (void) memcpy(&v, data + fs->offset, sizeof (v));
+      *vp = v;
+    } else {
+      (void) memcpy(vp, data + fs->offset, sizeof (*vp));
+    }
+  }
+  return (TRUE);
+}
+
+/*
+ * Append a sample to a series, overwriting the oldest one once the columns
+ * are full
+ */
+
+static void
+history_store(HistorySeries_t *hs, uint64_t v, hrtime_t snaptime)
+{
+  hs->values[hs->head] = v;
+  hs->snaptimes[hs->head] = snaptime;
+  hs->head = (hs->head + 1) % hs->depth;
+  if (hs->count < hs->depth) {
+    hs->count++;
+  }
+}
+
+/*
+ * Append the value of the statistic of a series in the buffer of its kstat
+ */
+
+static void
+history_push(HistorySeries_t *hs, kstat_t *kp)
+{
+  uint64_t v;
+
+  if (history_value(hs, kp, &v)) {
+    history_store(hs, v, kp->ks_snaptime);
+  }
+}
+
+/*
+ * Called by read_kstat_info() after every read of a kstat with history
+ */
+
+static void
+history_append(KstatInfo_t *kip)
+{
+  HistorySeries_t *hs;
+
+  for (hs = kip->history; hs != 0; hs = hs->next) {
+    history_push(hs, kip->kstat);
+  }
+}
+
+/*
+ * Go through the numeric statistics of a kstat that has been read, counting
+ * those that pass the filter, which may be null for all of them, and if hs
+ * is non-null, filling in a series for each.  Statistics of raw kstats can't
+ * be recorded, as they have no fixed layout.
+ */
+
+static size_t
+history_resolve(KstatInfo_t *kip, KstatField_t **filter, int nfilter,
+                HistorySeries_t *hs)
+{
+  StatStore_t  store;
+  kstat_t     *kp;
+  size_t       n, m;
+
+  Zero(&store, 1, StatStore_t);
+  store.filter = filter;
+  store.nfilter = nfilter;
+  kp = kip->kstat;
+  n = 0;
+
+  if (kp->ks_type == KSTAT_TYPE_NAMED) {
+    kstat_named_t *knp;
+    char           stat[KSTAT_STRLEN];
+
+    knp = KSTAT_NAMED_PTR(kp);
+    for (m = 0; m < kp->ks_ndata; m++) {
+      switch (knp[m].data_type) {
+        case KSTAT_DATA_INT32:
+        case KSTAT_DATA_UINT32:
+        case KSTAT_DATA_INT64:
+        case KSTAT_DATA_UINT64:
+          break;
+        default:
+          continue;
+      }
+      (void) strncpy(stat, knp[m].name, KSTAT_STRLEN - 1);
+      stat[KSTAT_STRLEN - 1] = '\0';
+      if (! store_wants(&store, stat)) {
+        continue;
+      }
+      if (hs != 0) {
+        hs[n].fixed = 0;
+        hs[n].pos = (I32)m;
+        hs[n].is_signed = HISTORY_SIGNED(knp[m].data_type);
+        hs[n].is_32bit = HISTORY_32BIT(knp[m].data_type);
+        (void) strcpy(hs[n].stat, stat);
+      }
+      n++;
+    }
+  } else if (kp->ks_type != KSTAT_TYPE_RAW) {
+    for (m = 0; m < NUM_FIXED_STATS; m++) {
+      const FixedStat_t *fs = &fixed_stats[m];
+
+      if (fs->type != kp->ks_type || kp->ks_data_size < fs->min_size ||
+          ! store_wants(&store, fs->name)) {
+        continue;
+      }
+      if (hs != 0) {
+        hs[n].fixed = fs;
+        hs[n].pos = -1;
+        hs[n].is_signed = FALSE;
+        hs[n].is_32bit = fs->size == sizeof (uint32_t);
+        (void) strcpy(hs[n].stat, fs->name);
+      }
+      n++;
+    }
+  }
+
+  if (hs != 0) {
+    for (m = 0; m < n; m++) {
+      (void) strcpy(hs[m].module, kp->ks_module);
+      hs[m].instance = kp->ks_instance;
+      (void) strcpy(hs[m].name, kp->ks_name);
+    }
+  }
+  return (n);
+}
+
+/*
+ * Go through the kstats of the index that have been read, in index order, and
+ * resolve the statistics the selectors of matcher select into series, as
+ * for copy().  If h is null the series are only counted, otherwise they are
+ * filled in, attached to their kstats and seeded with their current values.
+ * filter must have room for a field per selector.  Returns the number of
+ * series.
+ */
+
+static size_t
+history_build(SV *self, KstatCtl_t *ctl, KstatMatcher_t *matcher,
+              KstatField_t **filter, History_t *h)
+{
+  size_t pos, nseries;
+
+  for (nseries = 0, pos = 0; pos < ctl->index_len; pos++) {
+    KstatIndexEnt_t *ent;
+    KstatInfo_t     *kip;
+    HistorySeries_t *hs;
+    HV              *path[4];
+    char             str_inst[11];
+    size_t           n, m;
+    int              s, nfilter, all;
+
+    ent = &ctl->index[pos];
+    if (find_path(self, ent->module, ent->instance, ent->name, path) != 3) {
       continue;
     }
-    /* warn("save_named: Storing %s\n",knp->name); */
-    if (hv_store(self, knp->name, strlen(knp->name), value, 0) == NULL) {
-      warn("hv_store returns NULL at %d of %s (function %s)\n",
-           __FILE__, __LINE__, __func__);
+    kip = stat_info(path[3]);
+    if (kip->read_prevp == 0 || kip->kstat->ks_data == 0) {
+      continue;
+    }
+
+    (void) snprintf(str_inst, sizeof (str_inst), "%d", ent->instance);
+    for (all = FALSE, nfilter = 0, s = 0; s < matcher->nselect; s++) {
+      KstatSelector_t *sel = &matcher->select[s];
+
+      if (! match_selector(sel, kip->kstat, str_inst)) {
+        continue;
+      }
+      if (sel->field[3].type == SEL_ANY) {
+        all = TRUE;
+      }
+      filter[nfilter++] = &sel->field[3];
     }
+    if (nfilter == 0) {
+      continue;
+    }
+
+    hs = h != 0 ? &HISTORY_SERIES(h)[nseries] : 0;
+    n = history_resolve(kip, all ? 0 : filter, nfilter, hs);
+    for (m = 0; hs != 0 && m < n; m++, hs++) {
+      size_t col = (nseries + m) * h->depth;
+
+      hs->kipsv = SvREFCNT_inc(stat_info_sv(path[3]));
+      hs->depth = h->depth;
+      hs->head = 0;
+      hs->count = 0;
+      hs->values = &HISTORY_VALUES(h)[col];
+      hs->snaptimes = &HISTORY_SNAPTIMES(h)[col];
+      if ((hs->next = kip->history) != 0) {
+        hs->next->prevp = &hs->next;
+      }
+      hs->prevp = &kip->history;
+      kip->history = hs;
+      history_push(hs, kip->kstat);
+    }
+    nseries += n;
   }
+  return (nseries);
 }
 
 /*
- * Read kstats and copy into the supplied perl hash structure.  If refresh is
- * true, this function is being called as part of the update() method.  In this
- * case it is only necessary to read the kstats if they have previously been
- * accessed (kip->read == TRUE).  If refresh is false, this function is being
- * called prior to returning a value to the caller. In this case, it is only
- * necessary to read the kstats if they have not previously been read.  If the
- * kstat_read() fails, 0 is returned, otherwise 1
+ * Detach the series of a history from their kstats, before it goes away
  */
 
-static int
-read_kstats(HV *self, int refresh)
+static void
+history_detach(History_t *h)
 {
-  MAGIC              *mg;
-  KstatInfo_t        *kip;
-  kstat_raw_reader_t  fnp;
+  HistorySeries_t *hs;
+  size_t           n;
 
-  /* Find the MAGIC KstatInfo_t data structure */
-  mg = mg_find((SV *)self, '~');
-  PERL_ASSERTMSG(mg != 0, "read_kstats: lost ~ magic");
-  kip = (KstatInfo_t *)SvPVX(mg->mg_obj);
+  for (n = 0, hs = HISTORY_SERIES(h); n < h->nseries; n++, hs++) {
+    if (hs->prevp != 0) {
+      if ((*hs->prevp = hs->next) != 0) {
+        hs->next->prevp = hs->prevp;
+      }
+      hs->next = 0;
+      hs->prevp = 0;
+    }
+    SvREFCNT_dec(hs->kipsv);
+    hs->kipsv = 0;
+  }
+  h->nseries = 0;
+}
 
-  /* Return early if we don't need to actually read the kstats */
-  if ((refresh && ! kip->read) || (! refresh && kip->read)) {
-    /* warn("reading cached kstat\n"); */
-    return (1);
-  } else {
-    /* warn("reading kstat for the first time\n"); */
+static History_t *
+history_info(SV *self)
+{
+  SV *state;
+
+  if (! sv_isobject(self) || ! SvPOK(state = SvRV(self)) ||
+      SvCUR(state) < sizeof (History_t) ||
+      ((History_t *)SvPVX(state))->h_self != SvPVX(state)) {
+    croak(DEBUG_ID "::History: not a history");
   }
+  return ((History_t *)SvPVX(state));
+}
 
-  /* Read the kstats and return 0 if this fails */
-  if (kstat_read(kip->kstat_ctl, kip->kstat, NULL) < 0) {
-    return (0);
+/*
+ * Find a series of a history by its position, or by its
+ * "module:instance:name:statistic" label
+ */
+
+static HistorySeries_t *
+history_series(History_t *h, SV *which)
+{
+  HistorySeries_t *hs;
+  size_t           n;
+
+  if (looks_like_number(which)) {
+    IV i = SvIV(which);
+
+    if (i < 0 || (UV)i >= h->nseries) {
+      croak(DEBUG_ID "::History: no series %" IVdf, i);
+    }
+    return (&HISTORY_SERIES(h)[i]);
   }
+  for (n = 0, hs = HISTORY_SERIES(h); n < h->nseries; n++, hs++) {
+    char label[KSTAT_STRLEN * 3 + 16];
 
-  /* Save the read data */
-  if (hv_store(self, "snaptime", 8, NEW_HRTIME(kip->kstat->ks_snaptime), 0) == NULL) {
-    warn("hv_store returns NULL at %d of %s (function %s)\n",
-         __FILE__, __LINE__, __func__);
+    (void) snprintf(label, sizeof (label), "%s:%d:%s:%s", hs->module,
+                    hs->instance, hs->name, hs->stat);
+    if (strEQ(label, SvPV_nolen(which))) {
+      return (hs);
+    }
   }
-  switch (kip->kstat->ks_type) {
-    case KSTAT_TYPE_RAW:
-      if ((fnp = lookup_raw_kstat_fn(kip->kstat->ks_module,
-                                     kip->kstat->ks_name)) != 0) {
-        fnp(self, kip->kstat, kip->strip_str);
-      }
-      break;
-    case KSTAT_TYPE_NAMED:
-      save_named(self, kip->kstat, kip->strip_str);
-      break;
-    case KSTAT_TYPE_INTR:
-      /* save_intr(self, kip->kstat, kip->strip_str); */
-      break;
-    case KSTAT_TYPE_IO:
-      /* save_io(self, kip->kstat, kip->strip_str); */
-      break;
-    case KSTAT_TYPE_TIMER:
-      /* save_timer(self, kip->kstat, kip->strip_str); */
-      break;
-    default:
-      PERL_ASSERTMSG(0, "read_kstats: illegal kstat type");
-      break;
+  croak(DEBUG_ID "::History: no series %s", SvPV_nolen(which));
+  return (0);
+}
+
+/*
+ * Return how many of the newest samples of a series a query covers: n, if
+ * it's defined and no more than the series holds, otherwise all of them
+ */
+
+static size_t
+history_span(HistorySeries_t *hs, SV *n)
+{
+  if (n != 0 && SvOK(n) && SvIV(n) >= 0 && (UV)SvIV(n) < hs->count) {
+    return ((size_t)SvIV(n));
   }
-  kip->read = TRUE;
-  return (1);
+  return (hs->count);
 }
 
 /*
@@ -775,9 +3082,24 @@ read_kstats(HV *self, int refresh)
 MODULE = Solaris::kstat       PACKAGE = Solaris::kstat
 PROTOTYPES: ENABLE
 
-# Create the raw kstat to store function lookup table on load
+# Create the caches on load
 BOOT:
-  build_raw_kstat_lookup();
+  {
+    int i;
+
+    for (i = 0; i < IO_NFIELDS; i++) {
+      io_field_keys[i] = newSVpvn_share(io_field_names[i],
+                                        strlen(io_field_names[i]), 0);
+    }
+    for (i = 0; i < IO_NRATES; i++) {
+      io_rate_keys[i] = newSVpvn_share(io_rate_names[i],
+                                       strlen(io_rate_names[i]), 0);
+    }
+    for (i = 0; i < TIMER_NFIELDS; i++) {
+      timer_field_keys[i] = newSVpvn_share(timer_field_names[i],
+                                           strlen(timer_field_names[i]), 0);
+    }
+  }
 
 #
 # The Solaris::kstat constructor.  This builds the nested
@@ -792,10 +3114,12 @@ new(class, ...)
 PREINIT:
   HV          *stash;
   kstat_ctl_t *kc;
-  SV          *kcsv;
-  kstat_t     *kp;
+  KstatCtl_t   ctl, *ctlp;
+  SV          *ctlsv;
+  SV          *select, *exclude;
   KstatInfo_t kstatinfo;
-  int         sp, strip_str;
+  size_t      n;
+  int         sp, strip_str, lazy;
 CODE:
   /* Check we have an even number of arguments, excluding the class */
   sp = 1;
@@ -805,6 +3129,9 @@ CODE:
 
   /* Process any (name => value) arguments */
   strip_str = 0;
+  lazy = 0;
+  select = 0;
+  exclude = 0;
   while (sp < items) {
     SV *name, *value;
 
@@ -814,14 +3141,27 @@ CODE:
     sp++;
     if (strcmp(SvPVX(name), "strip_strings") == 0) {
       strip_str = SvTRUE(value);
+    } else if (strcmp(SvPVX(name), "lazy") == 0) {
+      lazy = SvTRUE(value);
+    } else if (strcmp(SvPVX(name), "select") == 0) {
+      select = value;
+    } else if (strcmp(SvPVX(name), "exclude") == 0) {
+      exclude = value;
     } else {
       croak(DEBUG_ID ": new: invalid parameter name '%s'",
           SvPVX(name));
     }
   }
 
+  /* Compile any select/exclude patterns, croaking if they are invalid */
+  ctl.matcher = 0;
+  if (select != 0 || exclude != 0) {
+    ctl.matcher = compile_matcher("new", select, exclude, 3);
+  }
+
   /* Open the kstats handle */
   if ((kc = kstat_open()) == 0) {
+    free_matcher(ctl.matcher);
     XSRETURN_UNDEF;
   }
 
@@ -830,58 +3170,50 @@ CODE:
   stash = gv_stashpv(class, TRUE);
   sv_bless(RETVAL, stash);
 
-  /* Create a place to save the KstatInfo_t structure */
-  kcsv = newSVpv((char *)&kc, sizeof (kc));
-  sv_magic(SvRV(RETVAL), kcsv, '~', 0, 0);
-  SvREFCNT_dec(kcsv);
-
-  /* Initialise the KstatsInfo_t structure */
-  kstatinfo.read = FALSE;
-  kstatinfo.valid = TRUE;
-  kstatinfo.strip_str = strip_str;
-  kstatinfo.kstat_ctl = kc;
-
-  /* Scan the kstat chain, building hash entries for the kstats */
-  for (kp = kc->kc_chain; kp != 0; kp = kp->ks_next) {
-    HV *tie;
-    SV *kstatsv;
-
-    /* Don't bother storing the kstat headers */
-    if (strncmp(kp->ks_name, "kstat_", 6) == 0) {
-      continue;
-    }
-
-    /* Don't bother storing raw stats we don't understand */
-    if (kp->ks_type == KSTAT_TYPE_RAW &&
-        lookup_raw_kstat_fn(kp->ks_module, kp->ks_name) == 0) {
-#ifdef REPORT_UNKNOWN
-      (void)fprintf(stderr,
-                    "Unknown kstat type %s:%d:%s - %d of size %d\n",
-                    kp->ks_module, kp->ks_instance, kp->ks_name,
-                    kp->ks_ndata, kp->ks_data_size);
-#endif
-      continue;
-    }
+  /* Create a place to save the KstatCtl_t structure */
+  ctl.kstat_ctl = kc;
+  ctl.read_list = 0;
+  ctl.strip_str = strip_str;
+  ctl.lazy = lazy;
+  ctl.index = 0;
+  ctl.index_len = 0;
+  ctlsv = newSVpv((char *)&ctl, sizeof (ctl));
+  sv_magic(SvRV(RETVAL), ctlsv, '~', 0, 0);
+  SvREFCNT_dec(ctlsv);
+  ctlp = (KstatCtl_t *)SvPVX(ctlsv);
+
+  /* Index the wanted kstats in the chain */
+  ctlp->index = build_index(ctlp, &ctlp->index_len);
 
-    /* Create a 3-layer hash hierarchy - module.instance.name */
-    tie = get_tie(RETVAL, kp->ks_module, kp->ks_instance,
-                          kp->ks_name, 0);
+  /*
+   * In lazy mode tie the object, so that the tree is materialised from the
+   * index as it is dereferenced
+   */
+  if (lazy) {
+    tie_tree_hash((HV *)SvRV(RETVAL), ctlsv, 0, 0, 0);
 
-    /* Save the data necessary to read the kstat info on demand */
-    if (hv_store(tie, "class", 5, newSVpv(kp->ks_class, 0), 0) == NULL) {
-      warn("hv_store returns NULL at %d of %s (function %s)\n",
-           __FILE__, __LINE__, __func__);
-    }
-    if (hv_store(tie, "crtime", 6, NEW_HRTIME(kp->ks_crtime), 0) == NULL) {
-      warn("hv_store returns NULL at %d of %s (function %s)\n",
-           __FILE__, __LINE__, __func__);
+  /* Otherwise build the whole tree now */
+  } else {
+    /* Initialise the KstatsInfo_t structure */
+    kstatinfo.read = FALSE;
+    kstatinfo.valid = TRUE;
+    kstatinfo.strip_str = strip_str;
+    kstatinfo.ctl = ctlsv;
+
+    /* Build hash entries for the indexed kstats */
+    for (n = 0; n < ctlp->index_len; n++) {
+      KstatIndexEnt_t *ent;
+      HV              *tie;
+
+      /* Create a 3-layer hash hierarchy - module.instance.name */
+      ent = &ctlp->index[n];
+      tie = get_tie(RETVAL, ent->module, ent->instance, ent->name, 0);
+
+      /* Save the data necessary to read the kstat info on demand */
+      init_tie(tie, ent->kstat, ent->reader, &kstatinfo);
     }
-    kstatinfo.kstat = kp;
-    kstatsv = newSVpv((char *)&kstatinfo, sizeof (kstatinfo));
-    sv_magic((SV *)tie, kstatsv, '~', 0, 0);
-    SvREFCNT_dec(kstatsv);
+    SvREADONLY_on(SvRV(RETVAL));
   }
-  SvREADONLY_on(SvRV(RETVAL));
 OUTPUT:
   RETVAL
 
@@ -897,15 +3229,16 @@ update(self)
   SV* self;
 PREINIT:
   MAGIC       *mg;
+  KstatCtl_t  *ctl;
   kstat_ctl_t *kc;
-  kstat_t     *kp;
   int          ret;
   AV          *add, *del;
 PPCODE:
-  /* Find the hidden KstatInfo_t structure */
+  /* Find the hidden KstatCtl_t structure */
   mg = mg_find(SvRV(self), '~');
   PERL_ASSERTMSG(mg != 0, "update: lost ~ magic");
-  kc = *(kstat_ctl_t **)SvPVX(mg->mg_obj);
+  ctl = (KstatCtl_t *)SvPVX(mg->mg_obj);
+  kc = ctl->kstat_ctl;
   
   /* Update the kstat chain, and return immediately on error. */
   if ((ret = kstat_chain_update(kc)) == -1) {
@@ -913,9 +3246,11 @@ PPCODE:
       EXTEND(SP, 2);
       PUSHs(sv_newmortal());
       PUSHs(sv_newmortal());
+      XSRETURN(2);
     } else {
       EXTEND(SP, 1);
       PUSHs(sv_2mortal(newSViv(ret)));
+      XSRETURN(1);
     }
   }
   
@@ -929,135 +3264,23 @@ PPCODE:
   }
   
   /*
-   * If the kstat chain hasn't changed we can just reread any stats
-   * that have already been read
+   * If the kstat chain has changed we have to update the Perl structure so
+   * that it is in agreement with the new kstat chain.  We do this in such a
+   * way as to retain all the existing structures, just adding or deleting
+   * the bare minimum.
    */
-  if (ret == 0) {
-    if (! apply_to_ties(self, (ATTCb_t)read_kstats, (void *)TRUE)) {
-      if (GIMME_V == G_ARRAY) {
-        EXTEND(SP, 2);
-        PUSHs(sv_2mortal(newRV_noinc((SV *)add)));
-        PUSHs(sv_2mortal(newRV_noinc((SV *)del)));
-      } else {
-        EXTEND(SP, 1);
-        PUSHs(sv_2mortal(newSViv(-1)));
-      }
-    }
-  
-    /*
-     * Otherwise we have to update the Perl structure so that it is in
-     * agreement with the new kstat chain.  We do this in such a way as to
-     * retain all the existing structures, just adding or deleting the
-     * bare minimum.
-     */
-  } else {
-    KstatInfo_t kstatinfo;
-  
-    /*
-     * Step 1: set the 'invalid' flag on each entry
-     */
-    apply_to_ties(self, &set_valid, (void *)FALSE);
-  
-    /*
-     * Step 2: Set the 'valid' flag on all entries still in the
-     * kernel kstat chain
-     */
-    kstatinfo.read      = FALSE;
-    kstatinfo.valid     = TRUE;
-    kstatinfo.kstat_ctl = kc;
-    for (kp = kc->kc_chain; kp != 0; kp = kp->ks_next) {
-      int  new;
-      HV  *tie;
-  
-      /* Don't bother storing the kstat headers or types */
-      if (strncmp(kp->ks_name, "kstat_", 6) == 0) {
-        continue;
-      }
-  
-      /* Don't bother storing raw stats we don't understand */
-      if (kp->ks_type == KSTAT_TYPE_RAW &&
-          lookup_raw_kstat_fn(kp->ks_module, kp->ks_name)
-            == 0) {
-#ifdef REPORT_UNKNOWN
-        (void) printf("Unknown kstat type %s:%d:%s "
-            "- %d of size %d\n", kp->ks_module,
-            kp->ks_instance, kp->ks_name,
-            kp->ks_ndata, kp->ks_data_size);
-#endif
-        continue;
-      }
-  
-      /* Find the tied hash associated with the kstat entry */
-      tie = get_tie(self, kp->ks_module, kp->ks_instance,
-          kp->ks_name, &new);
-  
-      /* If newly created store the associated kstat info */
-      if (new) {
-        SV *kstatsv;
-  
-        /*
-         * Save the data necessary to read the kstat
-         * info on demand
-         */
-        if (hv_store(tie, "class", 5,
-                     newSVpv(kp->ks_class, 0), 0) == NULL) {
-          warn("hv_store of class returns NULL");
-        }
-        if (hv_store(tie, "crtime", 6,
-                     NEW_HRTIME(kp->ks_crtime), 0) == NULL) {
-          /* This seems to cause a core dump */
-          /*
-          warn("hv_store returns NULL at %d of %s (function %s)\n",
-               __FILE__, __LINE__, __func__);
-          */
-          warn("hv_store of crtime returns NULL");
-        }
-        kstatinfo.kstat = kp;
-        kstatsv = newSVpv((char *)&kstatinfo,
-            sizeof (kstatinfo));
-        sv_magic((SV *)tie, kstatsv, '~', 0, 0);
-        SvREFCNT_dec(kstatsv);
-  
-        /* Save the key on the add list, if required */
-        if (GIMME_V == G_ARRAY) {
-          av_push(add, newSVpvf("%s:%d:%s",
-                kp->ks_module, kp->ks_instance,
-                kp->ks_name));
-        }
-  
-        /* If the stats already exist, just update them */
-      } else {
-        MAGIC *mg;
-        KstatInfo_t *kip;
-  
-        /* Find the hidden KstatInfo_t */
-        mg = mg_find((SV *)tie, '~');
-        PERL_ASSERTMSG(mg != 0, "update: lost ~ magic");
-        kip = (KstatInfo_t *)SvPVX(mg->mg_obj);
-  
-        /* Mark the tie as valid */
-        kip->valid = TRUE;
-  
-        /* Re-save the kstat_t pointer.  If the kstat
-         * has been deleted and re-added since the last
-         * update, the address of the kstat structure
-         * will have changed, even though the kstat will
-         * still live at the same place in the perl
-         * hash tree structure.
-         */
-        kip->kstat = kp;
-  
-        /* Reread the stats, if read previously */
-        read_kstats(tie, TRUE);
-      }
-    }
-  
-    /*
-     *Step 3: Delete any entries still marked as 'invalid'
-     */
-    ret = prune_invalid(self, del);
-  
+  if (ret != 0) {
+    ret = reindex(self, mg->mg_obj, add, del);
+  }
+
+  /*
+   * Then reread any stats that have already been read, which are all on the
+   * read list
+   */
+  if (! refresh_read_kstats(ctl) && ret == 0) {
+    ret = -1;
   }
+
   if (GIMME_V == G_ARRAY) {
     EXTEND(SP, 2);
     PUSHs(sv_2mortal(newRV_noinc((SV *)add)));
@@ -1067,6 +3290,187 @@ PPCODE:
     PUSHs(sv_2mortal(newSViv(ret)));
   }
 
+#
+# Return a hashref of the iostat -x style rates of an I/O kstat between two
+# reads of it, given as hashrefs of its statistics, e.g. from copy().  old may
+# be undef, for rates since boot
+#
+
+SV*
+io_delta(self, old, new)
+  SV* self;
+  SV* old;
+  SV* new;
+PREINIT:
+  HV *ohv = 0;
+  HV *hv;
+  NV  rates[IO_NRATES];
+  int i;
+CODE:
+  if (SvOK(old)) {
+    if (! SvROK(old) || SvTYPE(SvRV(old)) != SVt_PVHV) {
+      croak(DEBUG_ID ": io_delta: old must be a hash ref or undef");
+    }
+    ohv = (HV *)SvRV(old);
+  }
+  if (! SvROK(new) || SvTYPE(SvRV(new)) != SVt_PVHV) {
+    croak(DEBUG_ID ": io_delta: new must be a hash ref");
+  }
+  io_rates(ohv, (HV *)SvRV(new), rates);
+  hv = newHV();
+  for (i = 0; i < IO_NRATES; i++) {
+    (void) hv_store_ent(hv, io_rate_keys[i], newSVnv(rates[i]),
+                        SvSHARED_HASH(io_rate_keys[i]));
+  }
+  RETVAL = newRV_noinc((SV *)hv);
+OUTPUT:
+  RETVAL
+
+#
+# Summarise every timer kstat between two copies of the kstats, returning a row
+# per timer in new of its module, instance, name, timer name and the ns
+# elapsed between the copies, then the events per second and the mean event
+# time in ns, and its shortest and longest event times.  old may be undef,
+# for rates since boot
+#
+
+void
+timer_summary(self, old, new)
+  SV* self;
+  SV* old;
+  SV* new;
+PREINIT:
+  HV *ohv = 0;
+  HV *mhv, *ihv;
+  HE *mhe, *ihe, *nhe;
+PPCODE:
+  if (SvOK(old)) {
+    if (! SvROK(old) || SvTYPE(SvRV(old)) != SVt_PVHV) {
+      croak(DEBUG_ID ": timer_summary: old must be a hash ref or undef");
+    }
+    ohv = (HV *)SvRV(old);
+  }
+  if (! SvROK(new) || SvTYPE(SvRV(new)) != SVt_PVHV) {
+    croak(DEBUG_ID ": timer_summary: new must be a hash ref");
+  }
+
+  mhv = (HV *)SvRV(new);
+  hv_iterinit(mhv);
+  while ((mhe = hv_iternext(mhv)) != 0) {
+    HV *oihv;
+
+    if (! SvROK(HeVAL(mhe)) || SvTYPE(SvRV(HeVAL(mhe))) != SVt_PVHV) {
+      continue;
+    }
+    ihv = (HV *)SvRV(HeVAL(mhe));
+    oihv = sub_hv(ohv, mhe);
+    hv_iterinit(ihv);
+    while ((ihe = hv_iternext(ihv)) != 0) {
+      HV *nhv, *onhv;
+
+      if (! SvROK(HeVAL(ihe)) || SvTYPE(SvRV(HeVAL(ihe))) != SVt_PVHV) {
+        continue;
+      }
+      nhv = (HV *)SvRV(HeVAL(ihe));
+      onhv = sub_hv(oihv, ihe);
+      hv_iterinit(nhv);
+      while ((nhe = hv_iternext(nhv)) != 0) {
+        HV       *thv, *othv;
+        UV        o[TIMER_NFIELDS], n[TIMER_NFIELDS];
+        NV        rates[TIMER_NRATES];
+        hrtime_t  etime;
+        SV      **namep;
+        AV       *row;
+
+        if (! SvROK(HeVAL(nhe)) || SvTYPE(SvRV(HeVAL(nhe))) != SVt_PVHV ||
+            ! timer_fields(thv = (HV *)SvRV(HeVAL(nhe)), n)) {
+          continue;
+        }
+        othv = sub_hv(onhv, nhe);
+        etime = timer_rates(othv != 0 && timer_fields(othv, o) ? o : 0, n,
+                            rates);
+
+        namep = hv_fetchs(thv, "name", FALSE);
+        row = newAV();
+        av_extend(row, 9);
+        av_push(row, newSVhek(HeKEY_hek(mhe)));
+        av_push(row, newSVhek(HeKEY_hek(ihe)));
+        av_push(row, newSVhek(HeKEY_hek(nhe)));
+        av_push(row, namep != 0 ? newSVsv(*namep) : newSV(0));
+        av_push(row, NEW_HRTIME(etime));
+        av_push(row, newSVnv(rates[TIMER_EPS]));
+        av_push(row, newSVnv(rates[TIMER_MEAN_TIME]));
+        av_push(row, NEW_HRTIME(n[TIMER_MIN_TIME]));
+        av_push(row, NEW_HRTIME(n[TIMER_MAX_TIME]));
+        XPUSHs(sv_2mortal(newRV_noinc((SV *)row)));
+      }
+    }
+  }
+
+#
+# Read the counters of every interrupt kstat, into a sample for intr_delta()
+#
+
+SV*
+intr_sample(self)
+  SV* self;
+PREINIT:
+  MAGIC      *mg;
+  KstatCtl_t *ctl;
+CODE:
+  mg = mg_find(SvRV(self), '~');
+  PERL_ASSERTMSG(mg != 0, "intr_sample: lost ~ magic");
+  ctl = (KstatCtl_t *)SvPVX(mg->mg_obj);
+  if (ctl->kstat_ctl == 0) {
+    croak(DEBUG_ID ": intr_sample: the kstat chain has been closed");
+  }
+  RETVAL = intr_sample(ctl);
+OUTPUT:
+  RETVAL
+
+#
+# Return a row per interrupt source of the new sample, of its module,
+# instance, name and the ns elapsed since the old sample, then the number of
+# hard, soft, watchdog, spurious and multiple service interrupts since, and
+# their total.  old may be undef, for counts since each source was created
+#
+
+void
+intr_delta(self, old, new)
+  SV* self;
+  SV* old;
+  SV* new;
+PREINIT:
+  IntrSample_t  empty = { 0, 0 };
+  IntrSample_t *os, *ns;
+  uint64_t     *delta;
+  hrtime_t     *etime;
+  size_t        i;
+  int           k;
+PPCODE:
+  os = SvOK(old) ? intr_sample_info(old, "old") : &empty;
+  ns = intr_sample_info(new, "new");
+  Newx(delta, ns->n * INTR_NCOUNTS + 1, uint64_t);
+  Newx(etime, ns->n + 1, hrtime_t);
+  intr_delta(os, ns, delta, etime);
+  EXTEND(SP, ns->n);
+  for (i = 0; i < ns->n; i++) {
+    const KstatIndexEnt_t *ent = &INTR_SAMPLE_ENTS(ns)[i];
+    AV                    *row = newAV();
+
+    av_extend(row, 3 + INTR_NCOUNTS);
+    av_push(row, newSVpv(ent->module, 0));
+    av_push(row, newSViv(ent->instance));
+    av_push(row, newSVpv(ent->name, 0));
+    av_push(row, NEW_HRTIME(etime[i]));
+    for (k = 0; k < INTR_NCOUNTS; k++) {
+      av_push(row, NEW_UV(delta[i * INTR_NCOUNTS + k]));
+    }
+    PUSHs(sv_2mortal(newRV_noinc((SV *)row)));
+  }
+  Safefree(delta);
+  Safefree(etime);
+
 #
 # gethrtime() Utility Function
 #
@@ -1077,192 +3481,157 @@ CODE:
 OUTPUT:
   RETVAL
 
+#
+# The number of live SVs in the interpreter, so the tests can check that
+# update() doesn't allocate
+#
+
+IV
+_sv_count()
+CODE:
+  RETVAL = PL_sv_count;
+OUTPUT:
+  RETVAL
+
+#
+# Return a plain hashref copy, without any magic, of the kstats read so far.
+# Kstats that have never been read don't appear in the copy at all.  Any
+# arguments are module:instance:name[:statistic] selectors, limiting the copy
+# to the matching kstats and statistics
+#
+
+SV *
+copy(self, ...)
+  SV *self;
+PREINIT:
+  MAGIC          *mg;
+  KstatCtl_t     *ctl;
+  KstatInfo_t    *kip;
+  KstatMatcher_t *matcher;
+  KstatField_t  **filter;
+  SV             *selectors, *scratch;
+  HV             *copy;
+  int             n;
+CODE:
+  mg = mg_find(SvRV(self), '~');
+  PERL_ASSERTMSG(mg != 0, "copy: lost ~ magic");
+  ctl = (KstatCtl_t *)SvPVX(mg->mg_obj);
+
+  /*
+   * Compile any selectors first, as this croaks if they are invalid.  They
+   * may be passed as a list, or as a single array ref
+   */
+  matcher = 0;
+  filter = 0;
+  scratch = 0;
+  if (items > 1) {
+    if (items == 2) {
+      selectors = ST(1);
+    } else {
+      AV *av;
+
+      av = (AV *)sv_2mortal((SV *)newAV());
+      for (n = 1; n < items; n++) {
+        av_push(av, SvREFCNT_inc(ST(n)));
+      }
+      selectors = sv_2mortal(newRV_inc((SV *)av));
+    }
+    matcher = compile_matcher("copy", selectors, 0, 4);
+    Newx(filter, matcher->nselect > 0 ? matcher->nselect : 1,
+         KstatField_t *);
+    scratch = sv_newmortal();
+  }
+
+  /* Create an unblessed hashref to build, copy into, and return */
+  copy = newHV();
+  RETVAL = newRV_noinc((SV *)copy);
+
+  /* Only the kstats on the read list have anything to copy */
+  if (matcher == 0) {
+    for (kip = ctl->read_list; kip != 0; kip = kip->read_next) {
+      copy_kstat_info(copy, kip, 0, 0, 0);
+    }
+  } else if (! copy_selected_modules(copy, self, ctl, matcher, filter,
+                                     scratch)) {
+    for (kip = ctl->read_list; kip != 0; kip = kip->read_next) {
+      copy_selected(copy, kip, matcher, filter, scratch);
+    }
+  }
+  Safefree(filter);
+  free_matcher(matcher);
+OUTPUT:
+  RETVAL
+
+#
+# Read the kstats matching module:instance:name selectors, given as a string
+# or an array ref of strings, and return a list of array refs, one per kstat,
+# each holding module, instance, name and snaptime followed by the values of
+# the named statistics.  This bypasses the hash altogether, with one
+# kstat_read() per matching kstat
+#
 
-SV *
-copy(self)
+void
+fetch_many(self, selectors, stat_names)
   SV *self;
+  SV *selectors;
+  SV *stat_names;
 PREINIT:
-  MAGIC       *mg;
-  HV          *omodule_hash, *oinstance_hash, *oname_hash;
-  /* Copy hashes (no magic or ties) */
-  SV          *cmodule_hash_rv;
-  HV          *cmodule_hash, *cinstance_hash, *cname_hash, *chash4;
-  HE          *omodule_entry;
-  char        *module, *instance, *name, *stat;
-CODE:
-  /* Create an unblessed hashref to build, copy into, and return */
-  cmodule_hash_rv = (SV *)newRV_noinc((SV *)newHV());
-  RETVAL = cmodule_hash_rv;
-  cmodule_hash = (HV *)SvRV(cmodule_hash_rv);
-
-  /* Iterate each level of our existing hash */
-  omodule_hash = (HV *)SvRV(self);
-  hv_iterinit(omodule_hash);
-
-  /* Iterate over each module */
-  while ((omodule_entry = hv_iternext(omodule_hash))) {
-    /* Where we're copying to */
-    SV **cmodule_entry;
-    SV  *cinstance_hash_rv;
-    /* What we're descending into next */
-    HV *oinstance_hash;
-    HE *oinstance_entry;
-
-    /* Look for the module key in our level 1 hash copy (it won't be there),
-       creating the key pointing to an empty entry that we'll fill in
-       immediately with the new level 2 hashref */
-    module = HePV(omodule_entry, PL_na);
-    cmodule_entry = hv_fetch(cmodule_hash, module, strlen(module), TRUE);
-
-    cinstance_hash = newHV();
-    cinstance_hash_rv = newRV_noinc((SV *)cinstance_hash);
-    sv_setsv(*cmodule_entry, cinstance_hash_rv);
-    SvREFCNT_dec(cinstance_hash_rv);
-
-    oinstance_hash = (HV *)SvRV(hv_iterval(omodule_hash, omodule_entry));
-    hv_iterinit(oinstance_hash);
-
-    /* Iterate over each module:instance */
-    while ((oinstance_entry = hv_iternext(oinstance_hash))) {
-      /* Where we're copying to */
-      SV **cinstance_entry;
-      SV  *cname_hash_rv;
-      /* What we're descending into next */
-      HV *oname_hash;
-      HE *oname_entry;
-
-      /* Look for the module key in our level 2 hash copy (it won't be there),
-         creating the key pointing to an empty entry that we'll fill in
-         immediately with the new level 3 hashref */
-      instance = HePV(oinstance_entry, PL_na);
-      cinstance_entry = hv_fetch(cinstance_hash, instance, strlen(instance),
-                                 TRUE);
-
-      cname_hash = newHV();
-      cname_hash_rv = newRV_noinc((SV *)cname_hash);
-      sv_setsv(*cinstance_entry, cname_hash_rv);
-      SvREFCNT_dec(cname_hash_rv);
-
-      oname_hash = (HV *)SvRV(hv_iterval(oinstance_hash, oinstance_entry));
-      hv_iterinit(oname_hash);
-
-      /* Iterate over each module:instance:name */
-      while ((oname_entry = hv_iternext(oname_hash))) {
-        /* Where we're copying to */
-        SV    **cname_entry;
-        HV     *cstat_hash;
-        SV     *cstat_hash_rv;
-        HV     *ostat_hash;
-        HE     *ostat_entry;
-        MAGIC  *mg;
-        HV     *tie;
-        I32     retlen;
-        KstatInfo_t        *kip;
-
-      /* Look for the module key in our level 3 hash copy (it won't be there),
-         creating the key pointing to an empty entry that we'll fill in
-         immediately with the new level 4 hashref (or hash?) */
-        name = HePV(oname_entry, PL_na);
-        cname_entry = hv_fetch(cname_hash, name, strlen(name), TRUE);
-
-        cstat_hash = newHV();
-        cstat_hash_rv = newRV_noinc((SV *)cstat_hash);
-        sv_setsv(*cname_entry, cstat_hash_rv);
-        SvREFCNT_dec(cstat_hash_rv);
-
-        ostat_hash = (HV *)SvRV(hv_iterval(oname_hash, oname_entry));
-        hv_iterinit(ostat_hash);
-        /* warn("module:instance:name %s:%s:%s\n", module, instance, name); */
-
-        /* If the module:instance:name hash exists, copy it */
-        /* Get P magic off of the hash, and get the tie */
-        mg = mg_find((SV *)ostat_hash, 'P');
-        PERL_ASSERTMSG(mg != 0,
-            "copy: lost P magic");
-        tie = (HV *)SvRV(mg->mg_obj);
-
-        /* Find the MAGIC KstatInfo_t data structure */
-        /* For some reason, the '~' magic has been lost */
-        /* Get ~ magic off of the tie */
-        mg = mg_find((SV *)tie, '~');
-        PERL_ASSERTMSG(mg != 0, "copy: lost ~ magic");
-
-        kip = (KstatInfo_t *)SvPVX(mg->mg_obj);
-        if (!kip->read) {
-          /* warn("copy: %s:%s:%s has never been read",module,instance,name); */
-          continue;
-        } else {
-          /* warn("copy: %s:%s:%s has been read - COPYING it",
-                  module,instance,name); */
-        }
+  MAGIC          *mg;
+  KstatCtl_t     *ctl;
+  KstatMatcher_t *matcher;
+  AV             *names_av;
+  char          **names;
+  HV             *poscache, *scratch;
+  size_t         *ranges, pos;
+  int             nnames, nranges, n;
+PPCODE:
+  mg = mg_find(SvRV(self), '~');
+  PERL_ASSERTMSG(mg != 0, "fetch_many: lost ~ magic");
+  ctl = (KstatCtl_t *)SvPVX(mg->mg_obj);
+
+  if (! SvROK(stat_names) || SvTYPE(SvRV(stat_names)) != SVt_PVAV) {
+    croak(DEBUG_ID ": fetch_many: statistic names must be an array ref");
+  }
+  names_av = (AV *)SvRV(stat_names);
+  nnames = av_len(names_av) + 1;
 
+  /* Compiling the selectors croaks if they are invalid, so do it first */
+  matcher = compile_matcher("fetch_many", selectors, 0, 3);
 
-        /* while (ostat_entry = hv_iternext(ostat_hash)) { */
-        while (ostat_entry = hv_iternext(ostat_hash)) {
-          SV    **cstat_entry;
-          SV     *valcopy = newSV(0);
-          SV    **valptr;
-
-          SV     *statkey;
-          SV     *val;
-          HE     *valent;
-          /*
-          char   *val_pv;
-          long long     val_iv;
-          unsigned long long     val_uv;
-          unsigned long     val_length;
-          */
-
-          statkey     = HeSVKEY(ostat_entry);
-          stat        = HePV(ostat_entry, PL_na);
-          /* val         = HeVAL(ostat_entry); */
-          valent      = hv_fetch_ent(ostat_hash, statkey, 0, 0);
-          val         = HeVAL(valent);
-          /* stat        = HePV(ostat_entry, PL_na); */
-          cstat_entry = hv_fetch(cstat_hash, stat, strlen(stat), TRUE);
-          /*
-          warn("Working on %s:%s:%s:%s\n",
-               module, instance, name, stat);
-          */
-          if (val == NULL) {
-            warn("%s:%s:%s:%s is NULL\n",
-                  module, instance, name, stat);
-            continue;
-          }
-          /*
-          val_pv = SvPV_force(val, val_length);
-          warn("string value of %s:%s:%s:%s is  %s\n",
-                 module, instance, name, stat, val_pv);
-          */
-          /*
-          if (SvIOK(val)) {
-            val_iv = SvIV(val);
-            warn("Signed integer value of %s:%s:%s:%s is  %lld\n",
-                   module, instance, name, stat, val_iv);
-          }
-          if (SvIOK_UV(val)) {
-            val_uv = SvUV(val);
-            warn("Unigned integer value of %s:%s:%s:%s is  %ull\n",
-                   module, instance, name, stat, val_uv);
-          }
-          */
-
-          /* Copy the data out of the ostat_entry SV into our own SV in the
-             cstat_entry */
-          SvSetSV(valcopy, val);
-          sv_setsv(*cstat_entry, valcopy);
-
-          /*
-          warn("$k->{%s}->{%s}->{%s}->{%s}\n",
-               module, instance, name, hv_iterkey(ostat_entry, &retlen));
-           */
-        }
+  Newx(names, nnames > 0 ? nnames : 1, char *);
+  for (n = 0; n < nnames; n++) {
+    SV **svp;
+
+    svp = av_fetch(names_av, n, FALSE);
+    names[n] = svp != 0 ? SvPV_nolen(*svp) : "";
+  }
+  poscache = (HV *)sv_2mortal((SV *)newHV());
+  scratch = (HV *)sv_2mortal((SV *)newHV());
+
+  /* Only the modules named by the selectors need visiting, if they all do */
+  Newx(ranges, matcher->nselect > 0 ? matcher->nselect * 2 : 2, size_t);
+  if ((nranges = select_ranges(ctl, matcher, ranges)) == 0) {
+    ranges[0] = 0;
+    ranges[1] = ctl->index_len;
+    nranges = 1;
+  }
+
+  for (n = 0; n < nranges && ctl->kstat_ctl != 0; n++) {
+    for (pos = ranges[n * 2]; pos < ranges[n * 2 + 1]; pos++) {
+      KstatIndexEnt_t *ent;
 
+      ent = &ctl->index[pos];
+      if (! match_kstat(matcher, ent->kstat) ||
+          kstat_read(ctl->kstat_ctl, ent->kstat, NULL) < 0) {
+        continue;
       }
+      XPUSHs(sv_2mortal(newRV_noinc((SV *)fetch_row(ctl, ent, names,
+          nnames, poscache, scratch))));
     }
   }
-OUTPUT:
-  RETVAL
+  Safefree(ranges);
+  Safefree(names);
+  free_matcher(matcher);
 
 #
 # Destructor.  Closes the kstat connection
@@ -1273,11 +3642,22 @@ DESTROY(self)
   SV *self;
 PREINIT:
   MAGIC       *mg;
+  KstatCtl_t  *ctl;
   kstat_ctl_t *kc;
 CODE:
   mg = mg_find(SvRV(self), '~');
   PERL_ASSERTMSG(mg != 0, "DESTROY: lost ~ magic");
-  kc = *(kstat_ctl_t **)SvPVX(mg->mg_obj);
+  ctl = (KstatCtl_t *)SvPVX(mg->mg_obj);
+  kc = ctl->kstat_ctl;
+
+  /* Any tied hashes that outlive us can no longer be read */
+  read_list_detach(ctl);
+  ctl->kstat_ctl = 0;
+  Safefree(ctl->index);
+  ctl->index = 0;
+  ctl->index_len = 0;
+  free_matcher(ctl->matcher);
+  ctl->matcher = 0;
   if (kstat_close(kc) != 0) {
     croak(DEBUG_ID ": kstat_close: failed with errno %d", errno);
   }
@@ -1437,7 +3817,16 @@ CODE:
   PERL_ASSERTMSG(mg != 0, "CLEAR: lost ~ magic");
   kip = (KstatInfo_t *)SvPVX(mg->mg_obj);
   kip->read  = FALSE;
-  kip->valid = TRUE;
+  read_list_remove(kip);
+
+  /*
+   * The kstat_t is gone once the kstat has been pruned from the tree, as
+   * kstat_chain_update() freed it, or once the Solaris::kstat object has been
+   * destroyed
+   */
+  if (! kip->valid || KSTAT_CTL(kip)->kstat_ctl == 0) {
+    XSRETURN_EMPTY;
+  }
   if (hv_store((HV *)self, "class", 5, newSVpv(kip->kstat->ks_class, 0), 0) == NULL) {
     warn("hv_store returns NULL at %d of %s (function %s)\n",
          __FILE__, __LINE__, __func__);
@@ -1446,3 +3835,489 @@ CODE:
     warn("hv_store returns NULL at %d of %s (function %s)\n",
          __FILE__, __LINE__, __func__);
   }
+
+#
+# The following XS methods implement the TIEHASH mechanism used for the
+# module, instance and name levels of a Solaris::kstat created with the lazy
+# option.  The entries of each level are only created when first dereferenced,
+# by looking them up in the index of the kstat chain, and the levels are
+# read-only.  These are blessed into a package that isn't visible to callers
+# of the Solaris::kstat module
+#
+
+MODULE = Solaris::kstat PACKAGE = Solaris::kstat::_Tree
+PROTOTYPES: ENABLE
+
+#
+# Return the entry under the key, materialising it if necessary
+#
+
+SV*
+FETCH(self, key)
+  SV* self;
+  SV* key;
+PREINIT:
+  HV              *storage;
+  KstatTree_t     *tree;
+  KstatIndexEnt_t *ent;
+  HE              *he;
+CODE:
+  storage = (HV *)SvRV(self);
+  tree = tree_info(storage);
+  if ((he = hv_fetch_ent(storage, key, FALSE, 0)) != 0) {
+    RETVAL = HeVAL(he);
+  } else if ((ent = tree_lookup(TREE_CTL(tree), tree, key)) != 0) {
+    RETVAL = tree_fetch(storage, tree, key, ent);
+  } else {
+    RETVAL = &PL_sv_undef;
+  }
+  SvREFCNT_inc(RETVAL);
+OUTPUT:
+  RETVAL
+
+#
+# Check for the existence of the passed key, without materialising it
+#
+
+bool
+EXISTS(self, key)
+  SV* self;
+  SV* key;
+PREINIT:
+  KstatTree_t *tree;
+CODE:
+  tree = tree_info((HV *)SvRV(self));
+  RETVAL = tree_lookup(TREE_CTL(tree), tree, key) != 0;
+OUTPUT:
+  RETVAL
+
+#
+# Hash iterator initialisation.  The keys come from the index, so iterating
+# over a level doesn't materialise anything below it.
+#
+
+SV*
+FIRSTKEY(self)
+  SV* self;
+PREINIT:
+  KstatTree_t     *tree;
+  KstatCtl_t      *ctl;
+  KstatIndexEnt_t *ent;
+  size_t           pos;
+PPCODE:
+  tree = tree_info((HV *)SvRV(self));
+  ctl = TREE_CTL(tree);
+  pos = index_search(ctl, FALSE, tree->level, tree->module, tree->instance,
+                     "");
+  if ((ent = tree_entry(ctl, tree, pos)) != 0) {
+    EXTEND(SP, 1);
+    PUSHs(sv_2mortal(tree_key(ent, tree->level)));
+  }
+
+#
+# Return hash iterator next value, which is the key following lastkey in the
+# index
+#
+
+SV*
+NEXTKEY(self, lastkey)
+  SV* self;
+  SV* lastkey;
+PREINIT:
+  KstatTree_t     *tree;
+  KstatCtl_t      *ctl;
+  KstatIndexEnt_t *ent;
+  size_t           pos;
+PPCODE:
+  tree = tree_info((HV *)SvRV(self));
+  ctl = TREE_CTL(tree);
+  if (tree_search(ctl, tree, lastkey, TRUE, &pos) &&
+      (ent = tree_entry(ctl, tree, pos)) != 0) {
+    EXTEND(SP, 1);
+    PUSHs(sv_2mortal(tree_key(ent, tree->level)));
+  }
+
+#
+# The tree mirrors the kstat chain, so it can't be modified
+#
+
+void
+STORE(self, key, value)
+  SV* self;
+  SV* key;
+  SV* value;
+CODE:
+  croak_no_modify();
+
+void
+DELETE(self, key)
+  SV* self;
+  SV* key;
+CODE:
+  croak_no_modify();
+
+void
+CLEAR(self)
+  SV* self;
+CODE:
+  croak_no_modify();
+
+
+#
+# A drift-free interval timer, over the ticker of libkstatsnap.  Each wait()
+# sleeps until the next deadline of a fixed cadence, as an absolute time on
+# the gethrtime() clock, and returns how many deadlines had to be skipped
+#
+
+MODULE = Solaris::kstat PACKAGE = Solaris::kstat::Ticker
+PROTOTYPES: ENABLE
+
+#
+# Create a ticker whose first deadline is interval nanoseconds from now
+#
+
+SV*
+new(class, interval)
+  char* class;
+  IV    interval;
+PREINIT:
+  SV *state;
+CODE:
+  if (interval <= 0) {
+    croak(DEBUG_ID "::Ticker: interval must be a positive number of ns");
+  }
+  state = newSV(sizeof (struct ticker));
+  SvPOK_only(state);
+  SvCUR_set(state, sizeof (struct ticker));
+  ticker_start((struct ticker *)SvPVX(state), (hrtime_t)interval);
+  RETVAL = newRV_noinc(state);
+  sv_bless(RETVAL, gv_stashpv(class, GV_ADD));
+OUTPUT:
+  RETVAL
+
+#
+# Sleep until the next deadline, and return the number of deadlines that
+# had already passed and were skipped.  Perl signal handlers are run if a
+# signal interrupts the sleep, which then goes on until the same deadline
+#
+
+IV
+wait(self)
+  SV* self;
+PREINIT:
+  struct ticker *tk;
+  int64_t        missed;
+CODE:
+  tk = ticker_info(self);
+  while ((missed = ticker_wait(tk)) == -1) {
+    if (errno != EINTR) {
+      croak(DEBUG_ID "::Ticker: sleeping failed: %s", strerror(errno));
+    }
+    PERL_ASYNC_CHECK();
+  }
+  RETVAL = (IV)missed;
+OUTPUT:
+  RETVAL
+
+hrtime_t
+interval(self)
+  SV* self;
+CODE:
+  RETVAL = ticker_info(self)->tk_interval;
+OUTPUT:
+  RETVAL
+
+#
+# The gethrtime() value of the next deadline
+#
+
+hrtime_t
+deadline(self)
+  SV* self;
+CODE:
+  RETVAL = ticker_info(self)->tk_deadline;
+OUTPUT:
+  RETVAL
+
+#
+# The number of wait() calls that returned, and of deadlines skipped by them
+#
+
+UV
+ticks(self)
+  SV* self;
+CODE:
+  RETVAL = (UV)ticker_info(self)->tk_ticks;
+OUTPUT:
+  RETVAL
+
+UV
+missed(self)
+  SV* self;
+CODE:
+  RETVAL = (UV)ticker_info(self)->tk_missed;
+OUTPUT:
+  RETVAL
+
+#
+# Solaris::kstat::History records the last samples of numeric statistics of
+# a Solaris::kstat, in C, as the kstats are read
+#
+
+MODULE = Solaris::kstat PACKAGE = Solaris::kstat::History
+PROTOTYPES: ENABLE
+
+#
+# Create a history of the last depth samples of the statistics selected by
+# module:instance:name:statistic selectors, given as a list or as an array
+# ref, from the kstats of the Solaris::kstat that have been read so far
+#
+
+SV*
+new(class, kstat, depth, ...)
+  char* class;
+  SV*   kstat;
+  IV    depth;
+PREINIT:
+  MAGIC          *mg;
+  KstatCtl_t     *ctl;
+  KstatMatcher_t *matcher;
+  KstatField_t  **filter;
+  SV             *selectors, *state;
+  History_t      *h;
+  size_t          nseries;
+  int             n;
+CODE:
+  if (! sv_isobject(kstat) || ! sv_derived_from(kstat, DEBUG_ID) ||
+      (mg = mg_find(SvRV(kstat), '~')) == 0) {
+    croak(DEBUG_ID "::History: not a Solaris::kstat object");
+  }
+  ctl = (KstatCtl_t *)SvPVX(mg->mg_obj);
+  if (depth <= 0 || (UV)depth > (UV)(SSize_t_MAX / 2) /
+      (sizeof (uint64_t) + sizeof (hrtime_t) + sizeof (HistorySeries_t))) {
+    croak(DEBUG_ID "::History: depth must be a positive number of samples");
+  }
+  if (items < 4) {
+    croak(DEBUG_ID "::History: no statistics selected");
+  }
+  if (items == 4) {
+    selectors = ST(3);
+  } else {
+    AV *av;
+
+    av = (AV *)sv_2mortal((SV *)newAV());
+    for (n = 3; n < items; n++) {
+      av_push(av, SvREFCNT_inc(ST(n)));
+    }
+    selectors = sv_2mortal(newRV_inc((SV *)av));
+  }
+  matcher = compile_matcher("History", selectors, 0, 4);
+  Newx(filter, matcher->nselect > 0 ? matcher->nselect : 1, KstatField_t *);
+
+  /* Count the series first, so the buffer is made once and never moves */
+  nseries = history_build(kstat, ctl, matcher, filter, 0);
+  if (nseries > (SSize_t_MAX / 2) / HISTORY_SIZE(1, depth)) {
+    Safefree(filter);
+    free_matcher(matcher);
+    croak(DEBUG_ID "::History: too many samples");
+  }
+  state = newSV(HISTORY_SIZE(nseries, depth));
+  SvPOK_only(state);
+  SvCUR_set(state, HISTORY_SIZE(nseries, depth));
+  h = (History_t *)SvPVX(state);
+  h->h_self = h;
+  h->depth = depth;
+  h->nseries = nseries;
+  (void) history_build(kstat, ctl, matcher, filter, h);
+  Safefree(filter);
+  free_matcher(matcher);
+
+  RETVAL = newRV_noinc(state);
+  sv_bless(RETVAL, gv_stashpv(class, GV_ADD));
+OUTPUT:
+  RETVAL
+
+void
+DESTROY(self)
+  SV* self;
+PREINIT:
+  SV *state;
+CODE:
+  /* A copy of the buffer doesn't own the series it points to */
+  if (SvROK(self) && SvPOK(state = SvRV(self)) &&
+      SvCUR(state) >= sizeof (History_t) &&
+      ((History_t *)SvPVX(state))->h_self == SvPVX(state)) {
+    history_detach((History_t *)SvPVX(state));
+  }
+
+#
+# The "module:instance:name:statistic" labels of the series, in order
+#
+
+void
+series(self)
+  SV* self;
+PREINIT:
+  History_t       *h;
+  HistorySeries_t *hs;
+  size_t           n;
+PPCODE:
+  h = history_info(self);
+  EXTEND(SP, h->nseries);
+  for (n = 0, hs = HISTORY_SERIES(h); n < h->nseries; n++, hs++) {
+    PUSHs(sv_2mortal(newSVpvf("%s:%d:%s:%s", hs->module, hs->instance,
+                              hs->name, hs->stat)));
+  }
+
+UV
+depth(self)
+  SV* self;
+CODE:
+  RETVAL = (UV)history_info(self)->depth;
+OUTPUT:
+  RETVAL
+
+#
+# The number of samples a series holds
+#
+
+UV
+count(self, which)
+  SV* self;
+  SV* which;
+CODE:
+  RETVAL = (UV)history_series(history_info(self), which)->count;
+OUTPUT:
+  RETVAL
+
+#
+# The last n samples of a series, or all of them, oldest first, as array refs
+# of snaptime and value
+#
+
+void
+last(self, which, n = 0)
+  SV* self;
+  SV* which;
+  SV* n;
+PREINIT:
+  HistorySeries_t *hs;
+  size_t           span, k;
+PPCODE:
+  hs = history_series(history_info(self), which);
+  span = history_span(hs, n);
+  EXTEND(SP, span);
+  for (k = span; k > 0; k--) {
+    size_t  slot = HISTORY_SLOT(hs, k - 1);
+    AV     *row = newAV();
+
+    av_extend(row, 1);
+    av_push(row, NEW_HRTIME(hs->snaptimes[slot]));
+    av_push(row, hs->is_signed ? NEW_IV((int64_t)hs->values[slot]) :
+                                 NEW_UV(hs->values[slot]));
+    PUSHs(sv_2mortal(newRV_noinc((SV *)row)));
+  }
+
+#
+# The rate of change per second of a series, from the oldest sample within
+# window ns of the newest to the newest, or over all the samples without a
+# window.  Unsigned 32-bit counters are subtracted modulo 2^32, so that one
+# wrapping once within the window still gives its rate, as in io_rates().
+# Returns undef unless there are two samples to go on
+#
+
+SV*
+rate(self, which, window = 0)
+  SV* self;
+  SV* which;
+  SV* window;
+PREINIT:
+  HistorySeries_t *hs;
+  size_t           newest, slot, k;
+  hrtime_t         limit;
+CODE:
+  hs = history_series(history_info(self), which);
+  limit = window != 0 && SvOK(window) ? (hrtime_t)SvIV(window) : -1;
+  RETVAL = &PL_sv_undef;
+  if (hs->count > 1) {
+    newest = HISTORY_SLOT(hs, 0);
+    for (slot = newest, k = 1; k < hs->count; k++) {
+      size_t s = HISTORY_SLOT(hs, k);
+
+      if (limit >= 0 &&
+          hs->snaptimes[newest] - hs->snaptimes[s] > limit) {
+        break;
+      }
+      slot = s;
+    }
+    if (slot != newest && hs->snaptimes[newest] > hs->snaptimes[slot]) {
+      int64_t delta;
+
+      if (hs->is_32bit && ! hs->is_signed) {
+        delta = (uint32_t)(hs->values[newest] - hs->values[slot]);
+      } else {
+        delta = (int64_t)(hs->values[newest] - hs->values[slot]);
+      }
+      RETVAL = newSVnv((NV)delta * 1000000000.0 /
+        (NV)(hs->snaptimes[newest] - hs->snaptimes[slot]));
+    }
+  }
+  if (RETVAL == &PL_sv_undef) {
+    SvREFCNT_inc(RETVAL);
+  }
+OUTPUT:
+  RETVAL
+
+#
+# The smallest and largest values among the last n samples of a series, or all
+# of them.  Returns undef if it has none
+#
+
+SV*
+min(self, which, n = 0)
+  SV* self;
+  SV* which;
+  SV* n;
+ALIAS:
+  max = 1
+PREINIT:
+  HistorySeries_t *hs;
+  size_t           span, k;
+  uint64_t         v;
+CODE:
+  hs = history_series(history_info(self), which);
+  span = history_span(hs, n);
+  if (span == 0) {
+    RETVAL = newSV(0);
+  } else {
+    v = hs->values[HISTORY_SLOT(hs, 0)];
+    for (k = 1; k < span; k++) {
+      uint64_t x = hs->values[HISTORY_SLOT(hs, k)];
+
+      if (hs->is_signed ? (ix == 0 ? (int64_t)x < (int64_t)v :
+                                     (int64_t)x > (int64_t)v) :
+                          (ix == 0 ? x < v : x > v)) {
+        v = x;
+      }
+    }
+    RETVAL = hs->is_signed ? NEW_IV((int64_t)v) : NEW_UV(v);
+  }
+OUTPUT:
+  RETVAL
+
+#
+# Append a sample to a series by hand, for the tests, which can't make a live
+# counter take the values they need
+#
+
+void
+_push(self, which, snaptime, value)
+  SV* self;
+  SV* which;
+  SV* snaptime;
+  SV* value;
+CODE:
+  history_store(history_series(history_info(self), which),
+                SvIOK_notUV(value) ? (uint64_t)SvIV(value) :
+                                     (uint64_t)SvUV(value),
+                (hrtime_t)SvIV(snaptime));
@@ -115,6 +115,32 @@ only populated if it's read.  Otherwise, it's just a blank placeholder.
 Create a new Solaris::kstat object.  This returns a tied hashref, which can be
 dereferenced by successive kstat keys.
 
+Options are passed as name => value pairs:
+
+* strip_strings - strip the trailing NULs from KSTAT_DATA_CHAR statistics.
+
+* lazy - don't build the module:instance:name levels of the hash up front.
+Instead, those levels are tied as well, and new() only builds a sorted index
+of the kstat chain.  A module, instance or name entry is created the first
+time it is dereferenced, by looking it up in that index; listing the keys of a
+level, or checking whether one exists, is answered from the index without
+creating anything.  On hosts with large kstat chains this makes new() much
+cheaper in both time and memory.  The levels of a lazy object are read-only.
+
+* select - a kstat(1M) style module:instance:name pattern, or a reference to
+an array of them.  Only the kstats matching at least one of the patterns get
+an entry in the hash, in new() and in any later update().  A missing or empty
+field, or "*", matches anything, a field enclosed in slashes is an extended
+regular expression, and anything else is a shell style glob.  Unlike kstat(1M),
+there is no statistic field.
+
+* exclude - patterns as for select.  Kstats matching any of them never get an
+entry in the hash, even if they are selected.
+
+  my $k = Solaris::kstat->new( lazy => 1 );
+  my $k = Solaris::kstat->new( select  => [ 'cpu:*:sys', 'zfs:0:arcstats' ],
+                               exclude => '/^cpu$/:/^(8|9)$/' );
+
 =cut
 
 =head2 update()
@@ -123,6 +149,16 @@ By default, once a kstat has been referenced, it will never update again of it's
 own volition.  That's what the update() method is for.  It simply resnapshots the
 portion of the kstat chain the tied hashref refers to.
 
+Statistics that have already been read are refreshed in place: the value
+scalars already stored in the hash are overwritten, and new scalars are only
+allocated for statistics that appear for the first time.
+
+If kstats have been added to or removed from the kernel's kstat chain since
+the last call, only the entries for those kstats are added to or removed from
+the hash.  In list context update() returns references to arrays of the
+"module:instance:name" keys that were added and deleted.  In scalar context it
+returns 1 if any kstats were deleted, 0 if not, and -1 on failure.
+
 NOTE: It's very common to want to save and compare the previous kstat snapshot;
 don't make the mistake of trying to just assign the hashref to a variable; it'll
 change out from under you on the next update(), and you'll just have 2 copies of
@@ -141,11 +177,130 @@ the copy efficient (rather than traversing the entire kstat chain every time),
 as well as not having to worry about the tie or extended magic attached to
 the object.
 
+Only kstats that have been read appear in the copy, so there are no empty
+module, instance or name branches.  The values are those the hash holds, as of
+the last time each kstat was read through it or refreshed by update().
+
+copy() optionally takes one or more kstat(1M) style
+module:instance:name:statistic selectors, as a list or as an array ref, with
+fields matched as for the select option of new().  Only the read kstats
+matching one of the selectors are copied, and if the matching selectors have a
+statistic field, only the statistics it matches.  If every selector names a
+single module, only those modules are visited.
+
+  my $c = $k->copy('cpu:*:sys', 'cpu:*:vm', 'unix:0:*');
+  my $t = $k->copy('cpu:*:sys:/^cpu_nsec_/', 'cpu:*:sys:snaptime');
+
 These copies can then easily be used for kstat comparisons, which is the most
 common use case.
 
 =cut
 
+=head2 fetch_many()
+
+Reads a handful of statistics from many kstats in one call, without going
+through the hash.  The first argument is a module:instance:name selector, or an
+array ref of them, matched as for the select option of new(); the second is a
+reference to an array of statistic names.  Every matching kstat is read once,
+and a list of array refs is returned, one per kstat, each holding the module,
+instance, name and snaptime followed by the value of each named statistic, in
+the order given.  Statistics a kstat doesn't have are undef.
+
+  foreach my $row ($k->fetch_many('cpu:*:sys',
+                                  [ 'cpu_nsec_idle', 'cpu_nsec_user' ])) {
+    my ($module, $instance, $name, $snaptime, $idle, $user) = @{$row};
+    ...
+  }
+
+For named kstats, the position of each statistic is looked up the first time
+and remembered, so later calls go straight to the values.  The hash is left
+alone: no kstat is added to the set refreshed by update(), and neither the hash
+nor copy() sees the data fetch_many() read.
+
+=cut
+
+=head2 io_delta()
+
+I/O kstats, such as those of disks and NFS mounts, hold every field of a
+kstat_io_t: nread, nwritten, reads, writes, wtime, wlentime, wlastupdate,
+rtime, rlentime, rlastupdate, wcnt and rcnt.  io_delta() takes two reads of
+one such kstat, as hashrefs of its statistics, e.g. from copy(), and returns a
+hashref of the iostat(1M) -x columns between them, computed in C:
+
+* r/s, w/s, kr/s, kw/s - transfers and kilobytes per second
+
+* wait, actv - the average number of transactions waiting and active
+
+* wsvc_t, asvc_t, svc_t - the average wait, active and total service time, in
+milliseconds
+
+* %w, %b - the percentage of time transactions were waiting, and the disk was
+busy
+
+  my $old = $k->copy('sd:*:*');
+  ...
+  my $new = $k->copy('sd:*:*');
+  my $rates = $k->io_delta($old->{sd}{0}{sd0}, $new->{sd}{0}{sd0});
+  printf "%.1f r/s %.1f %%b\n", $rates->{'r/s'}, $rates->{'%b'};
+
+The older read may be undef, for rates since boot.
+
+=cut
+
+=head2 timer_summary()
+
+Timer kstats hold the name of the timer, num_events, elapsed_time, min_time,
+max_time, start_time and stop_time.  Like Sun::Solaris::Kstat, only the first
+timer of a kstat is decoded.  timer_summary() takes two copies of the kstats,
+e.g. from copy(), and returns a list of array refs, one per timer kstat in the
+newer copy, each holding the module, instance, name, timer name and the
+nanoseconds elapsed between the copies, followed by the events per second,
+the mean event time in nanoseconds, and the shortest and longest event times.
+The copies are walked and the rates computed in C.
+
+  my $old = $k->copy();
+  ...
+  my $new = $k->copy();
+  foreach my $row ($k->timer_summary($old, $new)) {
+    my ($module, $instance, $name, $timer, $etime, $eps, $mean) = @{$row};
+    ...
+  }
+
+The older copy may be undef, for rates since boot, and a timer that is
+missing from it, or has more events in it than in the newer one, also counts
+from boot.
+
+=cut
+
+=head2 intr_sample(), intr_delta()
+
+Interrupt kstats hold the hard, soft, watchdog, spurious and multiple_service
+interrupt counts of a source, to which the hash adds their total.  For
+intrstat(1M) style collection across every source at once, intr_sample() reads
+all the interrupt kstats into an opaque Solaris::kstat::IntrSample, and
+intr_delta() takes two such samples and returns a list of array refs, one per
+source in the newer sample, each holding the module, instance, name and the
+nanoseconds elapsed between the samples, followed by the number of hard, soft,
+watchdog, spurious, multiple service and all interrupts in between.
+
+  my $old = $k->intr_sample();
+  ...
+  my $new = $k->intr_sample();
+  foreach my $row ($k->intr_delta($old, $new)) {
+    my ($module, $instance, $name, $etime, @counts) = @{$row};
+    ...
+  }
+
+The differences are worked out in C, in a single pass over all the sources
+when the kstat chain hasn't changed between the samples.  A source that is new
+in the newer sample, or was re-created since the older one, counts from its
+creation, as every source does when the older sample is undef.  Its elapsed
+time is then that since its creation, i.e. its snaptime less its crtime, so
+that rates worked out from its row aren't understated.  Neither method
+touches the hash.
+
+=cut
+
 =head1 UTILITY FUNCTIONS
 
 =head2 gethrtime()
@@ -159,3 +314,102 @@ Returns a 64-bit integer, which is what an hrtime_t resolves to anyway.
 This implies that this module can only operate with a 64-bit Perl.
 
 =cut
+
+=head1 Solaris::kstat::Ticker
+
+A drift-free interval timer for sampling loops, implemented in C.  Its ticks
+fall on a fixed cadence of deadlines on the gethrtime() clock, which are slept
+until as absolute times, so neither the time spent sampling nor the latency of
+waking up pushes later samples back.
+
+  my $ticker = Solaris::kstat::Ticker->new(1_000_000_000);   # 1 second
+  while (1) {
+    my $missed = $ticker->wait();
+    $k->update();
+    ...
+  }
+
+=head2 new($interval)
+
+Create a ticker with the given interval in nanoseconds.  Its first deadline is
+one interval from now.
+
+=head2 wait()
+
+Sleep until the next deadline, and return the number of deadlines that were
+skipped.  If the next deadline has already passed, because sampling took
+longer than an interval or the process was stopped and continued, wait()
+returns at once, and any earlier deadlines that passed are skipped and
+counted rather than made up in a burst, keeping the cadence.  Perl signal
+handlers run if a signal interrupts the sleep, which then goes on until the
+same deadline.
+
+=head2 interval(), deadline(), ticks(), missed()
+
+The interval, the gethrtime() value of the next deadline, the number of
+wait() calls so far, and the number of deadlines they skipped in all.
+
+=cut
+
+=head1 Solaris::kstat::History
+
+An in-process history of the last samples of numeric statistics, kept in C
+rather than as an array of copy() hashrefs.  Each statistic recorded is
+resolved once, to its kstat and its position within it, and its samples are
+held as unsigned 64-bit values alongside their snaptimes, in fixed size
+columns that the oldest samples are overwritten in.  A sample is appended to
+every series of a kstat each time update() reads it, without going through
+Perl.
+
+  () = each %{$k->{cpu}{$_}{sys}} foreach (keys %{$k->{cpu}});
+  my $history = Solaris::kstat::History->new($k, 60, 'cpu:*:sys:cpu_nsec_*');
+  my $ticker = Solaris::kstat::Ticker->new(1_000_000_000);
+  while (1) {
+    $ticker->wait();
+    $k->update();
+    foreach my $series ($history->series) {
+      printf "%s %.0f/s\n", $series, $history->rate($series, 10_000_000_000);
+    }
+  }
+
+=head2 new($kstat, $depth, @selectors)
+
+Create a history of the last $depth samples of the statistics of a
+Solaris::kstat object selected by kstat(1M) style module:instance:name:statistic
+selectors, given as a list or as an array ref, and matched as for copy().  As
+with copy(), only the kstats that have been read so far are considered, and
+the history starts with their last read.  Statistics of named, I/O,
+interrupt and timer kstats can be recorded, but not those of raw kstats, nor
+string statistics.  Kstats that join the chain later aren't added, and the
+series of a kstat that leaves it keep the samples they have.  A history
+outlives the object it was made from.
+
+=head2 series()
+
+The list of the series of the history, as "module:instance:name:statistic"
+labels, in kstat order.  The other methods take a series either by its
+position in this list, or by its label.
+
+=head2 depth(), count($series)
+
+The number of samples a series can hold, and the number it holds.
+
+=head2 last($series, $n)
+
+The last $n samples of a series, or all of them if $n is omitted, oldest
+first, as array refs of snaptime and value.
+
+=head2 rate($series, $window)
+
+The rate of change per second of a series, from the oldest sample within
+$window nanoseconds of the newest sample to the newest, or over all the
+samples if $window is omitted.  Unsigned 32-bit statistics are subtracted
+modulo 2^32, so a counter that wraps once within the window still gives its
+rate.  Returns undef unless there are two samples to go on.
+
+=head2 min($series, $n), max($series, $n)
+
+The smallest and largest value among the last $n samples of a series, or all
+of them if $n is omitted, or undef if it holds none.
+
+=cut
@@ -6,6 +6,14 @@
 #include <errno.h>
 #include <limits.h>
 #include <time.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define ARRAY_SIZE(a) (sizeof (a) / sizeof (*a))
 
@@ -24,12 +32,236 @@ static char *cpu_states[] = {
   "cpu_ticks_wait"
 };
 
+/* cpu:*:sys kstats all have the same shape, so this is resolved once */
+static int cpu_states_index[ARRAY_SIZE(cpu_states)];
+
+static struct kstat_schema cpu_states_schema =
+  KSTAT_SCHEMA_INIT(cpu_states, cpu_states_index);
+
+
+
+/*
+ * A hash index of the kstat chain, so the acquire_* helpers can find each
+ * kstat they read without kstat_lookup() walking kc_chain every time.  There
+ * is one per kstat_ctl_t, built on first use and rebuilt whenever the chain
+ * ID of the kstat_ctl_t changes.  Every kstat gets an entry under its
+ * module:instance:name, and the first kstat of each module:instance gets a
+ * second one with ks_any set, for lookups without a name.  The table is open
+ * addressed, with at least twice as many slots as entries.  The index also
+ * keeps the interrupt kstats of the chain, sorted by name, for
+ * acquire_intrs(), along with where the clock interrupt sorts among them,
+ * and the CPU topology, as cpu_topo_get() last queried it.
+ */
+struct kstat_slot {
+  uint32_t  ks_hash;
+  int       ks_any;
+  kstat_t  *ks_ksp;
+};
+
+/* The topology of one CPU ID, as the topology provider gave it */
+struct cpu_topo {
+  /* As p_online(id, P_STATUS), so -1 if there is no such CPU */
+  int                 ct_state;
+  psetid_t            ct_pset_id;
+  /* The state statistic of the cpu_info kstat of the CPU at the time */
+  kstat_named_t       ct_info_state;
+};
+
+struct kstat_index {
+  kstat_ctl_t        *ki_kc;
+  kid_t               ki_chain_id;
+  size_t              ki_mask;
+  struct kstat_slot  *ki_slots;
+  size_t              ki_nr_intrs;
+  kstat_t           **ki_intrs;
+  size_t              ki_clock_pos;
+  /* The topology generation ki_cpus was queried in, or 0 if it is stale */
+  unsigned            ki_topo_gen;
+  size_t              ki_nr_cpus;
+  struct cpu_topo    *ki_cpus;
+  struct kstat_index *ki_next;
+};
+
+static struct kstat_index *kstat_indexes;
+
+/* Guards the list of indexes, as CPU workers each look up their own */
+static pthread_mutex_t kstat_indexes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t
+kstat_hash(const char *module, int instance, const char *name)
+{
+  uint32_t h = 2166136261U;
+
+  while (*module != '\0')
+    h = (h ^ (unsigned char)*module++) * 16777619U;
+  h = (h ^ (uint32_t)instance) * 16777619U;
+  if (name != NULL) {
+    while (*name != '\0')
+      h = (h ^ (unsigned char)*name++) * 16777619U;
+  }
+  return (h);
+}
+
+static struct kstat_slot *
+kstat_index_probe(struct kstat_index *ki, uint32_t hash, const char *module,
+    int instance, const char *name)
+{
+  size_t i;
+
+  for (i = hash & ki->ki_mask; ki->ki_slots[i].ks_ksp != NULL;
+      i = (i + 1) & ki->ki_mask) {
+    struct kstat_slot *slot = &ki->ki_slots[i];
+
+    if (slot->ks_hash == hash && slot->ks_any == (name == NULL) &&
+        slot->ks_ksp->ks_instance == instance &&
+        strcmp(slot->ks_ksp->ks_module, module) == 0 &&
+        (name == NULL || strcmp(slot->ks_ksp->ks_name, name) == 0))
+      return (slot);
+  }
+  return (&ki->ki_slots[i]);
+}
+
+static void
+kstat_index_insert(struct kstat_index *ki, kstat_t *ksp, int any)
+{
+  const char        *name = any ? NULL : ksp->ks_name;
+  uint32_t           hash;
+  struct kstat_slot *slot;
+
+  hash = kstat_hash(ksp->ks_module, ksp->ks_instance, name);
+  slot = kstat_index_probe(ki, hash, ksp->ks_module, ksp->ks_instance, name);
+  /* As kstat_lookup() would, the first kstat in the chain wins */
+  if (slot->ks_ksp == NULL) {
+    slot->ks_hash = hash;
+    slot->ks_any  = any;
+    slot->ks_ksp  = ksp;
+  }
+}
+
+static int
+intr_ksp_cmp(const void *a, const void *b)
+{
+  return (strcmp((*(kstat_t * const *)a)->ks_name,
+                 (*(kstat_t * const *)b)->ks_name));
+}
+
+static int
+kstat_index_build(struct kstat_index *ki)
+{
+  kstat_t *ksp;
+  size_t   nr = 0, nr_intrs = 0, size = 16;
+
+  for (ksp = ki->ki_kc->kc_chain; ksp; ksp = ksp->ks_next) {
+    nr++;
+    if (ksp->ks_type == KSTAT_TYPE_INTR)
+      nr_intrs++;
+  }
+  while (size < nr * 4)
+    size <<= 1;
+
+  free(ki->ki_slots);
+  free(ki->ki_intrs);
+  free(ki->ki_cpus);
+  ki->ki_intrs = NULL;
+  ki->ki_cpus = NULL;
+  ki->ki_nr_cpus = 0;
+  ki->ki_nr_intrs = 0;
+  if ((ki->ki_slots = calloc(size, sizeof (struct kstat_slot))) == NULL)
+    return (errno);
+  ki->ki_mask = size - 1;
+  if ((ki->ki_intrs = calloc(nr_intrs + 1, sizeof (kstat_t *))) == NULL) {
+    free(ki->ki_slots);
+    ki->ki_slots = NULL;
+    return (errno);
+  }
+
+  for (ksp = ki->ki_kc->kc_chain; ksp; ksp = ksp->ks_next) {
+    kstat_index_insert(ki, ksp, 0);
+    kstat_index_insert(ki, ksp, 1);
+    if (ksp->ks_type == KSTAT_TYPE_INTR)
+      ki->ki_intrs[ki->ki_nr_intrs++] = ksp;
+  }
+
+  /* Keep the interrupt sources sorted by name, for intr_walk() */
+  qsort(ki->ki_intrs, ki->ki_nr_intrs, sizeof (kstat_t *), intr_ksp_cmp);
+  for (ki->ki_clock_pos = 0; ki->ki_clock_pos < ki->ki_nr_intrs;
+      ki->ki_clock_pos++) {
+    if (strcmp(ki->ki_intrs[ki->ki_clock_pos]->ks_name, "clock") > 0)
+      break;
+  }
+
+  ki->ki_chain_id = ki->ki_kc->kc_chain_id;
+  return (0);
+}
+
+/* Find the index of kc, building or rebuilding it as necessary */
+static struct kstat_index *
+kstat_index_get(kstat_ctl_t *kc)
+{
+  struct kstat_index *ki;
+
+  (void) pthread_mutex_lock(&kstat_indexes_lock);
+  for (ki = kstat_indexes; ki != NULL; ki = ki->ki_next) {
+    if (ki->ki_kc == kc)
+      break;
+  }
+  if (ki == NULL && (ki = calloc(1, sizeof (struct kstat_index))) != NULL) {
+    ki->ki_kc = kc;
+    ki->ki_next = kstat_indexes;
+    kstat_indexes = ki;
+  }
+  (void) pthread_mutex_unlock(&kstat_indexes_lock);
+  if (ki == NULL)
+    return (NULL);
+  if (ki->ki_slots == NULL || ki->ki_chain_id != kc->kc_chain_id) {
+    if (kstat_index_build(ki) != 0)
+      return (NULL);
+  }
+  return (ki);
+}
+
+/*
+ * A drop-in for kstat_lookup(), which must not be given a NULL module or a
+ * negative instance.  Sets errno to ENOENT if there is no such kstat.
+ */
+static kstat_t *
+kstat_index_lookup(kstat_ctl_t *kc, char *module, int instance, char *name)
+{
+  struct kstat_index *ki;
+  struct kstat_slot  *slot;
+
+  if ((ki = kstat_index_get(kc)) == NULL)
+    return (NULL);
+  slot = kstat_index_probe(ki, kstat_hash(module, instance, name), module,
+      instance, name);
+  if (slot->ks_ksp == NULL)
+    errno = ENOENT;
+  return (slot->ks_ksp);
+}
 
+static void
+kstat_index_free(kstat_ctl_t *kc)
+{
+  struct kstat_index **kip, *ki;
+
+  (void) pthread_mutex_lock(&kstat_indexes_lock);
+  for (kip = &kstat_indexes; (ki = *kip) != NULL; kip = &ki->ki_next) {
+    if (ki->ki_kc == kc) {
+      *kip = ki->ki_next;
+      free(ki->ki_slots);
+      free(ki->ki_intrs);
+      free(ki->ki_cpus);
+      free(ki);
+      break;
+    }
+  }
+  (void) pthread_mutex_unlock(&kstat_indexes_lock);
+}
 
 static kstat_t *
 kstat_lookup_read(kstat_ctl_t *kc, char *module, int instance, char *name)
 {
-  kstat_t *ksp = kstat_lookup(kc, module, instance, name);
+  kstat_t *ksp = kstat_index_lookup(kc, module, instance, name);
   if (ksp == NULL)
     return (NULL);
   if (kstat_read(kc, ksp, NULL) == -1)
@@ -37,27 +269,534 @@ kstat_lookup_read(kstat_ctl_t *kc, char *module, int instance, char *name)
   return (ksp);
 }
 
+/*
+ * Everything a snapshot points to is carved from its arena, which is a list
+ * of chunks, the newest first.  Resetting the arena keeps its memory.  If the
+ * last snapshot needed more than one chunk, they are replaced by one chunk
+ * big enough for all it used, so a snapshot refilled in the same shape makes
+ * no heap allocations at all.  Memory handed out is zeroed, as by calloc().
+ * The CPU workers each carve from an arena of their own within the arena of
+ * the snapshot, one of sa_parts, which are reset along with it.
+ */
+#define ARENA_ALIGN 16
+#define ARENA_MIN   (64 * 1024)
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+  struct arena_chunk *ac_next;
+  size_t              ac_size;
+  size_t              ac_used;
+};
+
+struct snapshot_arena {
+  struct arena_chunk    *sa_chunks;
+  size_t                 sa_nr_parts;
+  struct snapshot_arena *sa_parts;
+};
+
+#define CHUNK_DATA(c) ((char *)(c) + ARENA_ROUND(sizeof (struct arena_chunk)))
+
+static struct arena_chunk *
+arena_chunk_new(struct snapshot_arena *sa, size_t size)
+{
+  struct arena_chunk *c;
+
+  c = malloc(ARENA_ROUND(sizeof (struct arena_chunk)) + size);
+  if (c == NULL)
+    return (NULL);
+  c->ac_next = sa->sa_chunks;
+  c->ac_size = size;
+  c->ac_used = 0;
+  sa->sa_chunks = c;
+  return (c);
+}
+
+static void *
+arena_alloc(struct snapshot *ss, size_t size)
+{
+  struct arena_chunk *c;
+  void               *ptr;
+
+  if (ss->s_arena == NULL &&
+      (ss->s_arena = calloc(1, sizeof (struct snapshot_arena))) == NULL)
+    return (NULL);
+
+  size = ARENA_ROUND(size);
+  c = ss->s_arena->sa_chunks;
+  if (c == NULL || c->ac_size - c->ac_used < size) {
+    size_t csize = c != NULL ? c->ac_size * 2 : ARENA_MIN;
+
+    while (csize < size)
+      csize <<= 1;
+    if ((c = arena_chunk_new(ss->s_arena, csize)) == NULL)
+      return (NULL);
+  }
+
+  ptr = CHUNK_DATA(c) + c->ac_used;
+  c->ac_used += size;
+  (void) memset(ptr, 0, size);
+  return (ptr);
+}
+
+static void
+arena_free_chunks(struct snapshot_arena *sa)
+{
+  struct arena_chunk *c, *next;
+  size_t              i;
+
+  for (c = sa->sa_chunks; c != NULL; c = next) {
+    next = c->ac_next;
+    free(c);
+  }
+  for (i = 0; i < sa->sa_nr_parts; i++)
+    arena_free_chunks(&sa->sa_parts[i]);
+  free(sa->sa_parts);
+}
+
+static void
+arena_free(struct snapshot_arena *sa)
+{
+  if (sa == NULL)
+    return;
+  arena_free_chunks(sa);
+  free(sa);
+}
+
+static void
+arena_reset(struct snapshot_arena *sa)
+{
+  struct arena_chunk *c, *next;
+  size_t              used = 0, i;
+
+  if (sa == NULL)
+    return;
+  for (i = 0; i < sa->sa_nr_parts; i++)
+    arena_reset(&sa->sa_parts[i]);
+  if (sa->sa_chunks == NULL)
+    return;
+
+  if (sa->sa_chunks->ac_next == NULL) {
+    sa->sa_chunks->ac_used = 0;
+    return;
+  }
+
+  /* Coalesce the chunks into one, with an eighth to spare for growth */
+  for (c = sa->sa_chunks; c != NULL; c = next) {
+    next = c->ac_next;
+    used += c->ac_used;
+    free(c);
+  }
+  sa->sa_chunks = NULL;
+  /* If this fails, arena_alloc() will try again */
+  (void) arena_chunk_new(sa, ARENA_ROUND(used + used / 8));
+}
+
+/*
+ * Make sure the arena of ss has at least nr parts, for as many CPU workers.
+ * The parts only ever grow, so once a snapshot has been filled by a set of
+ * workers, refilling it allocates nothing here.
+ */
+static int
+arena_parts(struct snapshot *ss, size_t nr)
+{
+  struct snapshot_arena *parts;
+
+  if (ss->s_arena == NULL &&
+      (ss->s_arena = calloc(1, sizeof (struct snapshot_arena))) == NULL)
+    return (-1);
+  if (ss->s_arena->sa_nr_parts >= nr)
+    return (0);
+
+  if ((parts = calloc(nr, sizeof (struct snapshot_arena))) == NULL)
+    return (-1);
+  if (ss->s_arena->sa_nr_parts > 0)
+    bcopy(ss->s_arena->sa_parts, parts,
+        ss->s_arena->sa_nr_parts * sizeof (struct snapshot_arena));
+  free(ss->s_arena->sa_parts);
+  ss->s_arena->sa_parts = parts;
+  ss->s_arena->sa_nr_parts = nr;
+  return (0);
+}
+
+/* kstat_copy(), with the data carved from the arena of the snapshot */
+static int
+arena_kstat_copy(struct snapshot *ss, const kstat_t *src, kstat_t *dst)
+{
+  *dst = *src;
+
+  if (src->ks_data != NULL) {
+    if ((dst->ks_data = arena_alloc(ss, src->ks_data_size)) == NULL)
+      return (-1);
+    bcopy(src->ks_data, dst->ks_data, src->ks_data_size);
+  } else {
+    dst->ks_data = NULL;
+    dst->ks_data_size = 0;
+  }
+  return (0);
+}
+
+/*
+ * Aggregation of named kstats of one shape, such as cpu:*:sys, into one.
+ * This does what a kstat_add() per kstat would, but the positions of the
+ * numeric statistics are worked out once, from the first kstat, and their
+ * values are summed into a dense array of counters, which is only written
+ * back to the aggregate kstat at the end.  The inner loop is then a strided
+ * gather of 64-bit values, which agg_sum() vectorises where it can.
+ */
+struct kstat_agg {
+  kstat_t   *ka_dst;
+  uint_t     ka_ndata;
+  size_t     ka_nr;
+  /* Byte offsets of the numeric values in ks_data, and their sums */
+  uint32_t  *ka_off;
+  uint64_t  *ka_acc;
+};
+
+/* The 64-bit value at byte offset off of base, without aliasing it */
+static uint64_t
+agg_value(const void *base, uint32_t off)
+{
+  uint64_t v;
+
+  (void) memcpy(&v, (const char *)base + off, sizeof (v));
+  return (v);
+}
+
+static void
+agg_sum(uint64_t *acc, const void *base, const uint32_t *off, size_t nr)
+{
+  size_t k = 0;
+
+#if defined(__AVX2__)
+  for (; k + 4 <= nr; k += 4) {
+    __m128i vo = _mm_loadu_si128((const __m128i *)&off[k]);
+    __m256i v  = _mm256_i32gather_epi64((const long long *)base, vo, 1);
+    __m256i a  = _mm256_loadu_si256((const __m256i *)&acc[k]);
+
+    _mm256_storeu_si256((__m256i *)&acc[k], _mm256_add_epi64(a, v));
+  }
+#elif defined(__SSE2__)
+  for (; k + 2 <= nr; k += 2) {
+    __m128i v = _mm_set_epi64x((long long)agg_value(base, off[k + 1]),
+                               (long long)agg_value(base, off[k]));
+    __m128i a = _mm_loadu_si128((const __m128i *)&acc[k]);
+
+    _mm_storeu_si128((__m128i *)&acc[k], _mm_add_epi64(a, v));
+  }
+#elif defined(__ARM_NEON)
+  for (; k + 2 <= nr; k += 2) {
+    uint64x2_t v = vcombine_u64(vcreate_u64(agg_value(base, off[k])),
+                                vcreate_u64(agg_value(base, off[k + 1])));
+
+    vst1q_u64(&acc[k], vaddq_u64(vld1q_u64(&acc[k]), v));
+  }
+#endif
+  for (; k < nr; k++)
+    acc[k] += agg_value(base, off[k]);
+}
+
+/* Add src to the aggregate, copying it into dst if it is the first */
+static int
+agg_add(struct snapshot *ss, struct kstat_agg *ka, const kstat_t *src,
+    kstat_t *dst)
+{
+  kstat_named_t *knp;
+  size_t         k;
+  uint_t         i;
+
+  if (ka->ka_dst == NULL || (dst->ks_data == NULL && src->ks_data != NULL)) {
+    if (arena_kstat_copy(ss, src, dst))
+      return (-1);
+    ka->ka_dst   = dst;
+    ka->ka_ndata = dst->ks_data != NULL ? dst->ks_ndata : 0;
+    ka->ka_nr    = 0;
+    knp = dst->ks_data;
+    for (i = 0; i < ka->ka_ndata; i++) {
+      if (knp[i].data_type != KSTAT_DATA_CHAR &&
+          knp[i].data_type != KSTAT_DATA_STRING)
+        ka->ka_nr++;
+    }
+    ka->ka_off = arena_alloc(ss, ka->ka_nr * sizeof (uint32_t));
+    ka->ka_acc = arena_alloc(ss, ka->ka_nr * sizeof (uint64_t));
+    if (ka->ka_off == NULL || ka->ka_acc == NULL)
+      return (-1);
+    for (i = 0, k = 0; i < ka->ka_ndata; i++) {
+      if (knp[i].data_type != KSTAT_DATA_CHAR &&
+          knp[i].data_type != KSTAT_DATA_STRING)
+        ka->ka_off[k++] = i * sizeof (kstat_named_t) +
+          offsetof(kstat_named_t, value);
+    }
+  }
+
+  if (src->ks_data == NULL)
+    return (0);
+
+  if (src->ks_ndata == ka->ka_ndata) {
+    agg_sum(ka->ka_acc, src->ks_data, ka->ka_off, ka->ka_nr);
+    return (0);
+  }
+
+  /* A kstat of another shape only adds what it has in common by position */
+  knp = src->ks_data;
+  for (k = 0; k < ka->ka_nr; k++) {
+    i = ka->ka_off[k] / sizeof (kstat_named_t);
+    if (i < src->ks_ndata && knp[i].data_type != KSTAT_DATA_CHAR &&
+        knp[i].data_type != KSTAT_DATA_STRING)
+      ka->ka_acc[k] += knp[i].value.ui64;
+  }
+  return (0);
+}
+
+/* Write the sums back to the aggregate kstat */
+static void
+agg_finish(struct kstat_agg *ka)
+{
+  size_t k;
+
+  for (k = 0; k < ka->ka_nr; k++)
+    (void) memcpy((char *)ka->ka_dst->ks_data + ka->ka_off[k],
+        &ka->ka_acc[k], sizeof (uint64_t));
+}
+
+static int
+pset_id_cmp(const void *a, const void *b)
+{
+  psetid_t pa = *(const psetid_t *)a;
+  psetid_t pb = *(const psetid_t *)b;
+
+  return (pa < pb ? -1 : pa > pb);
+}
+
 /*
  * NOTE: The following helper routines do not clean up in the case of failure.
  *       That is left to the free_snapshot() routine in the acquire_snapshot()
  *       failure path.
  */
 
+/*
+ * The CPU topology comes from the system calls below, unless another
+ * provider has been plugged in with snapshot_set_topology().  Plugging one in
+ * starts a new generation, which makes every cached topology stale.
+ */
+static long
+sys_cpuid_max(void *arg)
+{
+  return (sysconf(_SC_CPUID_MAX));
+}
+
 static int
-acquire_cpus(struct snapshot *ss, kstat_ctl_t *kc)
+sys_cpu_state(processorid_t id, void *arg)
 {
-  size_t i;
+  return (p_online(id, P_STATUS));
+}
 
-  ss->s_nr_cpus = sysconf(_SC_CPUID_MAX) + 1;
-  ss->s_cpus = calloc(ss->s_nr_cpus, sizeof (struct cpu_snapshot));
-  if (ss->s_cpus == NULL)
-    goto out;
+static int
+sys_cpu_pset(processorid_t id, psetid_t *pset, void *arg)
+{
+  return (pset_assign(PS_QUERY, id, pset));
+}
 
-  for (i = 0; i < ss->s_nr_cpus; i++) {
-    kstat_t *ksp;
+static const struct snapshot_topology sys_topology = {
+  sys_cpuid_max, sys_cpu_state, sys_cpu_pset, NULL
+};
+
+static struct snapshot_topology topology = {
+  sys_cpuid_max, sys_cpu_state, sys_cpu_pset, NULL
+};
+
+static unsigned topology_gen = 1;
+
+static pthread_mutex_t topology_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+snapshot_set_topology(const struct snapshot_topology *st)
+{
+  (void) pthread_mutex_lock(&topology_lock);
+  topology = st != NULL ? *st : sys_topology;
+  if (++topology_gen == 0)
+    topology_gen = 1;
+  (void) pthread_mutex_unlock(&topology_lock);
+}
+
+/*
+ * Return the topology of every CPU ID of kc, of which there are *nrp, asking
+ * the provider only if the cached one is stale: the index was rebuilt for a
+ * new chain, another provider was plugged in, or cpu_topo_invalidate() was
+ * called.  Returns NULL with errno set on failure.
+ */
+static struct cpu_topo *
+cpu_topo_get(kstat_ctl_t *kc, size_t *nrp)
+{
+  struct kstat_index      *ki;
+  struct snapshot_topology st;
+  struct cpu_topo         *ct;
+  unsigned                 gen;
+  size_t                   i, nr;
+
+  if ((ki = kstat_index_get(kc)) == NULL)
+    return (NULL);
+
+  (void) pthread_mutex_lock(&topology_lock);
+  st  = topology;
+  gen = topology_gen;
+  (void) pthread_mutex_unlock(&topology_lock);
+
+  if (ki->ki_cpus != NULL && ki->ki_topo_gen == gen) {
+    *nrp = ki->ki_nr_cpus;
+    return (ki->ki_cpus);
+  }
+
+  nr = st.st_cpuid_max(st.st_arg) + 1;
+  if ((ct = calloc(nr, sizeof (struct cpu_topo))) == NULL)
+    return (NULL);
+
+  for (i = 0; i < nr; i++) {
+    kstat_t       *ksp;
+    kstat_named_t *knp;
+
+    /* Only the CPUs that are present have a cpu_info kstat */
+    if ((ct[i].ct_state = st.st_cpu_state(i, st.st_arg)) == -1)
+      continue;
+
+    if ((ksp = kstat_lookup_read(kc, "cpu_info", i, NULL)) == NULL) {
+      int err = errno;
+
+      free(ct);
+      errno = err;
+      return (NULL);
+    }
+    if ((knp = kstat_data_lookup(ksp, "state")) != NULL)
+      ct[i].ct_info_state = *knp;
+
+    (void) st.st_cpu_pset(i, &ct[i].ct_pset_id, st.st_arg);
+    if (ct[i].ct_pset_id == PS_NONE)
+      ct[i].ct_pset_id = ID_NO_PSET;
+  }
+
+  free(ki->ki_cpus);
+  ki->ki_cpus     = ct;
+  ki->ki_nr_cpus  = nr;
+  ki->ki_topo_gen = gen;
+  *nrp = nr;
+  return (ct);
+}
+
+/* Have the next cpu_topo_get() of kc ask the provider again */
+static void
+cpu_topo_invalidate(kstat_ctl_t *kc)
+{
+  struct kstat_index *ki;
+
+  if ((ki = kstat_index_get(kc)) != NULL)
+    ki->ki_topo_gen = 0;
+}
+
+/*
+ * Optionally, the CPU kstats can be read by a pool of worker threads, each
+ * with its own kstat_ctl_t and a share of the CPUs, so a snapshot of a very
+ * large system is taken over a shorter span of time.  The threads are started
+ * by snapshot_set_workers() and wait on cws_start between snapshots; each
+ * snapshot bumps cws_gen to set them going and waits on cws_done for the
+ * last of them.  A worker carves its kstats from its part of the arena of the
+ * snapshot, so the memory stays with the snapshot and is reused when it is
+ * refilled.  The workers of a kstat_ctl_t are kept on a list like its index.
+ */
+struct cpu_workers;
+
+struct cpu_worker {
+  struct cpu_workers   *cw_pool;
+  kstat_ctl_t          *cw_kc;
+  /* Only the arena of this is used, pointing at the worker's part of ss's */
+  struct snapshot       cw_mem;
+  struct snapshot      *cw_ss;
+  const struct cpu_topo *cw_topo;
+  size_t                cw_lo, cw_hi;
+  int                   cw_do_agg;
+  struct kstat_agg      cw_agg[2];
+  kstat_t               cw_agg_dst[2];
+  int                   cw_err;
+  pthread_t             cw_thread;
+};
+
+struct cpu_workers {
+  kstat_ctl_t          *cws_kc;
+  int                   cws_nr;
+  struct cpu_worker    *cws_workers;
+  struct cpu_workers   *cws_next;
+  /* Guards the fields below, which the threads wait on */
+  pthread_mutex_t       cws_lock;
+  pthread_cond_t        cws_start;
+  pthread_cond_t        cws_done;
+  unsigned              cws_gen;
+  int                   cws_pending;
+  int                   cws_quit;
+  int                   cws_nr_started;
+};
+
+static struct cpu_workers *cpu_workers_list;
+
+static pthread_mutex_t cpu_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct cpu_workers *
+cpu_workers_find(kstat_ctl_t *kc, struct cpu_workers ***prevp)
+{
+  struct cpu_workers **cwsp, *cws;
+
+  for (cwsp = &cpu_workers_list; (cws = *cwsp) != NULL;
+      cwsp = &cws->cws_next) {
+    if (cws->cws_kc == kc)
+      break;
+  }
+  if (prevp != NULL)
+    *prevp = cwsp;
+  return (cws);
+}
+
+/* Stop and join the threads of the pool, then free it */
+static void
+cpu_workers_free(struct cpu_workers *cws)
+{
+  int i;
+
+  if (cws == NULL)
+    return;
+  (void) pthread_mutex_lock(&cws->cws_lock);
+  cws->cws_quit = 1;
+  (void) pthread_cond_broadcast(&cws->cws_start);
+  (void) pthread_mutex_unlock(&cws->cws_lock);
+  for (i = 0; i < cws->cws_nr_started; i++)
+    (void) pthread_join(cws->cws_workers[i].cw_thread, NULL);
+  for (i = 0; i < cws->cws_nr; i++) {
+    if (cws->cws_workers[i].cw_kc != NULL)
+      close_kstat(cws->cws_workers[i].cw_kc);
+  }
+  (void) pthread_cond_destroy(&cws->cws_done);
+  (void) pthread_cond_destroy(&cws->cws_start);
+  (void) pthread_mutex_destroy(&cws->cws_lock);
+  free(cws->cws_workers);
+  free(cws);
+}
+
+/*
+ * Fill in the CPUs [lo, hi) of ss, as laid out in topo, carving the copied
+ * kstats from the arena of mem.  When agg isn't NULL, each CPU's vm and sys
+ * kstats are also added to the aggregates agg[0] and agg[1], kept in
+ * *agg_dst[0] and *agg_dst[1], while they are still in the cache.  Fails
+ * with ESTALE if a CPU has changed state since topo was queried.
+ */
+static int
+acquire_cpu_range(struct snapshot *ss, struct snapshot *mem, kstat_ctl_t *kc,
+    const struct cpu_topo *topo, size_t lo, size_t hi, struct kstat_agg *agg,
+    kstat_t **agg_dst)
+{
+  size_t i;
+
+  for (i = lo; i < hi; i++) {
+    kstat_t       *ksp;
+    kstat_named_t *knp;
 
     ss->s_cpus[i].cs_id    = ID_NO_CPU;
-    ss->s_cpus[i].cs_state = p_online(i, P_STATUS);
+    ss->s_cpus[i].cs_state = topo[i].ct_state;
 
     /* If no valid CPU is present, move on to the next CPU */
     if (ss->s_cpus[i].cs_state == -1)
@@ -67,9 +806,14 @@ acquire_cpus(struct snapshot *ss, kstat_ctl_t *kc)
     if ((ksp = kstat_lookup_read(kc, "cpu_info", i, NULL)) == NULL)
       goto out;
 
-    (void)pset_assign(PS_QUERY, i, &ss->s_cpus[i].cs_pset_id);
-    if (ss->s_cpus[i].cs_pset_id == PS_NONE)
-      ss->s_cpus[i].cs_pset_id = ID_NO_PSET;
+    knp = (kstat_named_t *)kstat_data_lookup(ksp, "state");
+    if (knp != NULL && memcmp(&knp->value, &topo[i].ct_info_state.value,
+        sizeof (knp->value)) != 0) {
+      errno = ESTALE;
+      goto out;
+    }
+
+    ss->s_cpus[i].cs_pset_id = topo[i].ct_pset_id;
 
     if (!CPU_ACTIVE(&ss->s_cpus[i]))
       continue;
@@ -77,20 +821,259 @@ acquire_cpus(struct snapshot *ss, kstat_ctl_t *kc)
     if ((ksp = kstat_lookup_read(kc, "cpu", i, "vm")) == NULL)
       goto out;
 
-    if (kstat_copy(ksp, &ss->s_cpus[i].cs_vm))
+    if (arena_kstat_copy(mem, ksp, &ss->s_cpus[i].cs_vm))
+      goto out;
+
+    if (agg != NULL &&
+        agg_add(mem, &agg[0], &ss->s_cpus[i].cs_vm, agg_dst[0]))
+      goto out;
+
+    if ((ksp = kstat_lookup_read(kc, "cpu", i, "sys")) == NULL)
+      goto out;
+
+    if (arena_kstat_copy(mem, ksp, &ss->s_cpus[i].cs_sys))
+      goto out;
+
+    if (agg != NULL &&
+        agg_add(mem, &agg[1], &ss->s_cpus[i].cs_sys, agg_dst[1]))
       goto out;
+  }
+
+  errno = 0;
+
+out:
+  return (errno);
+}
+
+/* Read the worker's share of the CPUs of the current snapshot */
+static void
+cpu_worker_run(struct cpu_worker *cw)
+{
+  kstat_t *dst[2];
+  int      i;
+
+  cw->cw_err = 0;
+  if (kstat_chain_update(cw->cw_kc) == -1) {
+    cw->cw_err = errno;
+    return;
+  }
+  (void) memset(cw->cw_agg, 0, sizeof (cw->cw_agg));
+  (void) memset(cw->cw_agg_dst, 0, sizeof (cw->cw_agg_dst));
+  dst[0] = &cw->cw_agg_dst[0];
+  dst[1] = &cw->cw_agg_dst[1];
+  cw->cw_err = acquire_cpu_range(cw->cw_ss, &cw->cw_mem, cw->cw_kc,
+      cw->cw_topo, cw->cw_lo, cw->cw_hi, cw->cw_do_agg ? cw->cw_agg : NULL,
+      dst);
+  for (i = 0; i < 2 && cw->cw_err == 0; i++) {
+    if (cw->cw_agg[i].ka_dst != NULL)
+      agg_finish(&cw->cw_agg[i]);
+  }
+}
+
+/* The thread of a worker: one run per generation, until the pool quits */
+static void *
+cpu_worker_main(void *arg)
+{
+  struct cpu_worker  *cw = arg;
+  struct cpu_workers *cws = cw->cw_pool;
+  unsigned            gen;
+
+  /* The pool starts at generation 0, which may be gone by the time we run */
+  gen = 0;
+  (void) pthread_mutex_lock(&cws->cws_lock);
+  for (;;) {
+    while (cws->cws_gen == gen && !cws->cws_quit)
+      (void) pthread_cond_wait(&cws->cws_start, &cws->cws_lock);
+    if (cws->cws_quit)
+      break;
+    gen = cws->cws_gen;
+    (void) pthread_mutex_unlock(&cws->cws_lock);
+
+    cpu_worker_run(cw);
+
+    (void) pthread_mutex_lock(&cws->cws_lock);
+    if (--cws->cws_pending == 0)
+      (void) pthread_cond_signal(&cws->cws_done);
+  }
+  (void) pthread_mutex_unlock(&cws->cws_lock);
+  return (NULL);
+}
+
+/*
+ * Share the CPUs out among the workers, give each its part of the arena of
+ * ss, set them going and wait for them all, then merge their aggregates into
+ * agg, in CPU order, as a serial acquire_cpu_range() would have.
+ */
+static int
+acquire_cpus_parallel(struct snapshot *ss, struct cpu_workers *cws,
+    const struct cpu_topo *topo, struct kstat_agg *agg)
+{
+  kstat_t *dst[2];
+  size_t   per;
+  int      i, k, err = 0;
+
+  if (arena_parts(ss, cws->cws_nr))
+    return (errno);
+
+  dst[0] = &ss->s_sys.ss_agg_vm;
+  dst[1] = &ss->s_sys.ss_agg_sys;
+  per = (ss->s_nr_cpus + cws->cws_nr - 1) / cws->cws_nr;
+
+  for (i = 0; i < cws->cws_nr; i++) {
+    struct cpu_worker *cw = &cws->cws_workers[i];
+
+    cw->cw_ss     = ss;
+    cw->cw_topo   = topo;
+    cw->cw_lo     = i * per;
+    cw->cw_hi     = cw->cw_lo + per;
+    if (cw->cw_lo > ss->s_nr_cpus)
+      cw->cw_lo = ss->s_nr_cpus;
+    if (cw->cw_hi > ss->s_nr_cpus)
+      cw->cw_hi = ss->s_nr_cpus;
+    cw->cw_do_agg = agg != NULL;
+    cw->cw_mem.s_arena = &ss->s_arena->sa_parts[i];
+  }
+
+  (void) pthread_mutex_lock(&cws->cws_lock);
+  cws->cws_pending = cws->cws_nr;
+  cws->cws_gen++;
+  (void) pthread_cond_broadcast(&cws->cws_start);
+  while (cws->cws_pending > 0)
+    (void) pthread_cond_wait(&cws->cws_done, &cws->cws_lock);
+  (void) pthread_mutex_unlock(&cws->cws_lock);
+
+  for (i = 0; i < cws->cws_nr; i++) {
+    struct cpu_worker *cw = &cws->cws_workers[i];
+
+    if (err == 0)
+      err = cw->cw_err;
+    for (k = 0; k < 2 && err == 0 && agg != NULL; k++) {
+      if (cw->cw_agg[k].ka_dst != NULL &&
+          agg_add(ss, &agg[k], &cw->cw_agg_dst[k], dst[k]))
+        err = errno;
+    }
+  }
+
+  return (err);
+}
+
+/*
+ * When agg isn't NULL, the vm and sys kstats of the CPUs are also summed into
+ * the aggregates agg[0] and agg[1], which acquire_sys() finishes.  If a CPU
+ * has changed state since the topology was cached, the cache is dropped and
+ * this fails with ENXIO, like a CPU going away, so the CPUs are acquired again
+ * at once.
+ */
+static int
+acquire_cpus(struct snapshot *ss, kstat_ctl_t *kc, struct kstat_agg *agg)
+{
+  struct cpu_workers *cws;
+  struct cpu_topo    *topo;
+  kstat_t            *dst[2];
+  hrtime_t            min = 0, max = 0;
+  size_t              i;
+  int                 err;
+
+  if ((topo = cpu_topo_get(kc, &ss->s_nr_cpus)) == NULL)
+    return (errno);
+  ss->s_cpus = arena_alloc(ss, ss->s_nr_cpus * sizeof (struct cpu_snapshot));
+  if (ss->s_cpus == NULL)
+    return (errno);
+
+  (void) pthread_mutex_lock(&cpu_workers_lock);
+  cws = cpu_workers_find(kc, NULL);
+  if (cws != NULL && cws->cws_nr > 1) {
+    err = acquire_cpus_parallel(ss, cws, topo, agg);
+  } else {
+    dst[0] = &ss->s_sys.ss_agg_vm;
+    dst[1] = &ss->s_sys.ss_agg_sys;
+    err = acquire_cpu_range(ss, ss, kc, topo, 0, ss->s_nr_cpus, agg, dst);
+  }
+  (void) pthread_mutex_unlock(&cpu_workers_lock);
+  if (err == ESTALE) {
+    cpu_topo_invalidate(kc);
+    err = ENXIO;
+  }
+  if (err != 0)
+    return (err);
+
+  /* How far apart in time the CPU kstats were read */
+  for (i = 0; i < ss->s_nr_cpus; i++) {
+    struct cpu_snapshot *cs = &ss->s_cpus[i];
+    hrtime_t             lo, hi;
+
+    if (!CPU_ACTIVE(cs))
+      continue;
+    lo = cs->cs_vm.ks_snaptime < cs->cs_sys.ks_snaptime ?
+      cs->cs_vm.ks_snaptime : cs->cs_sys.ks_snaptime;
+    hi = cs->cs_vm.ks_snaptime > cs->cs_sys.ks_snaptime ?
+      cs->cs_vm.ks_snaptime : cs->cs_sys.ks_snaptime;
+    if (min == 0 || lo < min)
+      min = lo;
+    if (hi > max)
+      max = hi;
+  }
+  ss->s_snaptime_spread = max - min;
+
+  return (0);
+}
 
-    if ((ksp = kstat_lookup_read(kc, "cpu", i, "sys")) == NULL)
-      goto out;
+int
+snapshot_set_workers(kstat_ctl_t *kc, int nworkers)
+{
+  struct cpu_workers **prevp, *cws, *old;
+  int                  i;
 
-    if (kstat_copy(ksp, &ss->s_cpus[i].cs_sys))
-      goto out;
+  cws = NULL;
+  if (nworkers > 1) {
+    if ((cws = calloc(1, sizeof (struct cpu_workers))) == NULL)
+      return (errno);
+    cws->cws_kc = kc;
+    cws->cws_workers = calloc(nworkers, sizeof (struct cpu_worker));
+    if (cws->cws_workers == NULL) {
+      free(cws);
+      return (ENOMEM);
+    }
+    cws->cws_nr = nworkers;
+    (void) pthread_mutex_init(&cws->cws_lock, NULL);
+    (void) pthread_cond_init(&cws->cws_start, NULL);
+    (void) pthread_cond_init(&cws->cws_done, NULL);
+    for (i = 0; i < nworkers; i++) {
+      struct cpu_worker *cw = &cws->cws_workers[i];
+
+      cw->cw_pool = cws;
+      if ((cw->cw_kc = kstat_open()) == NULL) {
+        int err = errno;
+
+        cpu_workers_free(cws);
+        return (err);
+      }
+    }
+    for (i = 0; i < nworkers; i++) {
+      int err;
+
+      err = pthread_create(&cws->cws_workers[i].cw_thread, NULL,
+          cpu_worker_main, &cws->cws_workers[i]);
+      if (err != 0) {
+        cpu_workers_free(cws);
+        return (err);
+      }
+      cws->cws_nr_started++;
+    }
   }
 
-  errno = 0;
+  (void) pthread_mutex_lock(&cpu_workers_lock);
+  old = cpu_workers_find(kc, &prevp);
+  if (old != NULL)
+    *prevp = old->cws_next;
+  if (cws != NULL) {
+    cws->cws_next = cpu_workers_list;
+    cpu_workers_list = cws;
+  }
+  (void) pthread_mutex_unlock(&cpu_workers_lock);
 
-out:
-  return (errno);
+  cpu_workers_free(old);
+  return (0);
 }
 
 static int
@@ -98,7 +1081,7 @@ acquire_psets(struct snapshot *ss)
 {
   psetid_t             *pids = NULL;
   struct pset_snapshot *ps;
-  size_t                pids_nr;
+  uint_t                pids_nr, nr_alloc;
   size_t                i, j;
 
   /*
@@ -108,16 +1091,27 @@ acquire_psets(struct snapshot *ss)
    *          of pids_nr
    */
 
-  if (pset_list(NULL, (uint_t *)&pids_nr) < 0)
+  if (pset_list(NULL, &pids_nr) < 0)
     return (errno);
 
-  if ((pids = calloc(pids_nr, sizeof (psetid_t))) == NULL)
+  nr_alloc = pids_nr;
+  if ((pids = arena_alloc(ss, nr_alloc * sizeof (psetid_t))) == NULL)
+    goto out;
+
+  if (pset_list(pids, &pids_nr) < 0)
     goto out;
 
-  if (pset_list(pids,(uint_t *)&pids_nr) < 0)
+  /* A pset was created in between, so pids only holds some of them */
+  if (pids_nr > nr_alloc) {
+    errno = EAGAIN;
     goto out;
+  }
+
+  /* Keep the psets sorted by ID, for pset_walk() */
+  qsort(pids, pids_nr, sizeof (psetid_t), pset_id_cmp);
 
-  ss->s_psets = calloc(pids_nr + 1, sizeof (struct pset_snapshot));
+  ss->s_psets =
+    arena_alloc(ss, (pids_nr + 1) * sizeof (struct pset_snapshot));
   if (ss->s_psets == NULL)
     goto out;
   ss->s_nr_psets = pids_nr + 1;
@@ -125,7 +1119,8 @@ acquire_psets(struct snapshot *ss)
   /* CPUs that are not in any pset */
   ps = &ss->s_psets[0];
   ps->ps_id = 0;
-  ps->ps_cpus = calloc(ss->s_nr_cpus, sizeof (struct cpu_snapshot *));
+  ps->ps_cpus =
+    arena_alloc(ss, ss->s_nr_cpus * sizeof (struct cpu_snapshot *));
   if (ps->ps_cpus == NULL)
     goto out;
 
@@ -135,7 +1130,7 @@ acquire_psets(struct snapshot *ss)
 
     ps->ps_id = pids[i - 1];
     ps->ps_cpus =
-      calloc(ss->s_nr_cpus, sizeof (struct cpu_snapshot *));
+      arena_alloc(ss, ss->s_nr_cpus * sizeof (struct cpu_snapshot *));
     if (ps->ps_cpus == NULL)
       goto out;
   }
@@ -156,61 +1151,75 @@ acquire_psets(struct snapshot *ss)
   errno = 0;
 
 out:
-  free(pids);
   return (errno);
 }
 
+/*
+ * Read unix:0:system_misc for the snapshot, unless that has been done
+ * already, as both acquire_intrs() and acquire_sys() need it.
+ */
 static int
-acquire_intrs(struct snapshot *ss, kstat_ctl_t *kc)
+read_sys_misc(kstat_ctl_t *kc, kstat_t **sys_misc)
 {
-  kstat_t       *ksp;
-  size_t         i = 0;
-  kstat_t       *sys_misc;
-  kstat_named_t *clock;
+  if (*sys_misc == NULL &&
+      (*sys_misc = kstat_lookup_read(kc, "unix", 0, "system_misc")) == NULL)
+    return (errno);
+  return (0);
+}
 
-  /* clock interrupt */
-  ss->s_nr_intrs = 1;
+/*
+ * The interrupt kstats come from the index, which only gathers them when the
+ * chain changes, already sorted by name, so all that is left is to read
+ * them.  The clock interrupt is slotted in where it sorts.
+ */
+static int
+acquire_intrs(struct snapshot *ss, kstat_ctl_t *kc, kstat_t **sys_misc)
+{
+  struct kstat_index *kidx;
+  kstat_named_t      *clock;
+  size_t              i, n = 0;
 
-  for (ksp = kc->kc_chain; ksp; ksp = ksp->ks_next){
-    if (ksp->ks_type == KSTAT_TYPE_INTR)
-      ss->s_nr_intrs++;
-  }
+  if ((kidx = kstat_index_get(kc)) == NULL)
+    return (errno);
 
-  ss->s_intrs = calloc(ss->s_nr_intrs, sizeof (struct intr_snapshot));
+  /* clock interrupt */
+  ss->s_nr_intrs = kidx->ki_nr_intrs + 1;
+
+  ss->s_intrs =
+    arena_alloc(ss, ss->s_nr_intrs * sizeof (struct intr_snapshot));
   if (ss->s_intrs == NULL)
     return (errno);
 
-  sys_misc = kstat_lookup_read(kc, "unix", 0, "system_misc");
-  if (sys_misc == NULL)
+  if (read_sys_misc(kc, sys_misc) != 0)
     goto out;
 
-  clock = (kstat_named_t *)kstat_data_lookup(sys_misc, "clk_intr");
+  clock = (kstat_named_t *)kstat_data_lookup(*sys_misc, "clk_intr");
   if (clock == NULL)
     goto out;
 
-  (void) strlcpy(ss->s_intrs[0].is_name, "clock", KSTAT_STRLEN);
-  ss->s_intrs[0].is_total = clock->value.ui32;
-
-  i = 1;
-
-  for (ksp = kc->kc_chain; ksp; ksp = ksp->ks_next) {
-    kstat_intr_t *ki;
-    int           j;
+  for (i = 0; i < ss->s_nr_intrs; i++) {
+    struct intr_snapshot *is = &ss->s_intrs[i];
+    kstat_t              *ksp;
+    kstat_intr_t         *ki;
+    int                   j;
 
-    if (ksp->ks_type != KSTAT_TYPE_INTR)
+    if (i == kidx->ki_clock_pos) {
+      (void) strlcpy(is->is_name, "clock", KSTAT_STRLEN);
+      is->is_total = clock->value.ui32;
       continue;
+    }
+
+    ksp = kidx->ki_intrs[n++];
     if (kstat_read(kc, ksp, NULL) == -1)
       goto out;
 
     ki = KSTAT_INTR_PTR(ksp);
 
-    (void) strlcpy(ss->s_intrs[i].is_name, ksp->ks_name, KSTAT_STRLEN);
-    ss->s_intrs[i].is_total = 0;
+    (void) strlcpy(is->is_name, ksp->ks_name, KSTAT_STRLEN);
+    is->is_total = 0;
 
     for (j = 0; j < KSTAT_NUM_INTRS; j++)
-      ss->s_intrs[i].is_total += ki->intrs[j];
-
-    i++;
+      is->is_total += ki->intrs[j];
   }
 
   errno = 0;
@@ -219,37 +1228,37 @@ out:
 }
 
 
-int
-acquire_sys(struct snapshot *ss, kstat_ctl_t *kc)
+/* agg holds the vm and sys aggregates acquire_cpus() has summed */
+static int
+acquire_sys(struct snapshot *ss, kstat_ctl_t *kc, kstat_t **sys_misc,
+            struct kstat_agg *agg)
 {
   size_t         i;
   kstat_named_t *knp;
   kstat_t       *ksp;
 
-  if ((ksp = kstat_lookup(kc, "unix", 0, "sysinfo")) == NULL)
+  if ((ksp = kstat_index_lookup(kc, "unix", 0, "sysinfo")) == NULL)
     return (errno);
 
   if (kstat_read(kc, ksp, &ss->s_sys.ss_sysinfo) == -1)
     return (errno);
 
-  if ((ksp = kstat_lookup(kc, "unix", 0, "vminfo")) == NULL)
+  if ((ksp = kstat_index_lookup(kc, "unix", 0, "vminfo")) == NULL)
     return (errno);
 
   if (kstat_read(kc, ksp, &ss->s_sys.ss_vminfo) == -1)
     return (errno);
 
-  if ((ksp = kstat_lookup(kc, "unix", 0, "dnlcstats")) == NULL)
+  if ((ksp = kstat_index_lookup(kc, "unix", 0, "dnlcstats")) == NULL)
     return (errno);
 
   if (kstat_read(kc, ksp, &ss->s_sys.ss_nc) == -1)
     return (errno);
 
-  if ((ksp = kstat_lookup(kc, "unix", 0, "system_misc")) == NULL)
-    return (errno);
-
-  if (kstat_read(kc, ksp, NULL) == -1)
+  if (read_sys_misc(kc, sys_misc) != 0)
     return (errno);
 
+  ksp = *sys_misc;
   knp = (kstat_named_t *)kstat_data_lookup(ksp, "clk_intr");
   if (knp == NULL)
     return (errno);
@@ -263,98 +1272,518 @@ acquire_sys(struct snapshot *ss, kstat_ctl_t *kc)
   ss->s_sys.ss_deficit = knp->value.l;
 
   for (i = 0; i < ss->s_nr_cpus; i++) {
-    if (!CPU_ACTIVE(&ss->s_cpus[i]))
-      continue;
+    if (CPU_ACTIVE(&ss->s_cpus[i]))
+      ss->s_nr_active_cpus++;
+  }
 
-    if (kstat_add(&ss->s_cpus[i].cs_sys, &ss->s_sys.ss_agg_sys))
-      return (errno);
-    if (kstat_add(&ss->s_cpus[i].cs_vm,  &ss->s_sys.ss_agg_vm))
-      return (errno);
-    ss->s_nr_active_cpus++;
+  for (i = 0; i < 2; i++) {
+    if (agg[i].ka_dst != NULL)
+      agg_finish(&agg[i]);
   }
 
   return (0);
 }
 
-struct snapshot *
-acquire_snapshot(kstat_ctl_t *kc, int types)
+/* How acquire_snapshot() has always retried: forever, every 200 ms */
+static const struct snapshot_retry retry_forever = {
+  -1, RETRY_DELAY, RETRY_DELAY
+};
+
+static const struct snapshot_retry retry_default = SNAPSHOT_RETRY_DEFAULT;
+
+/*
+ * Decide whether to retry after err, the retries'th retry so far, sleeping
+ * for *delay first and doubling it for next time.  A kstat that went away is
+ * retried at once the first time a step fails, as updating the chain usually
+ * deals with that.  Returns non-zero to retry.
+ */
+static int
+retry_wait(const struct snapshot_retry *retry, int err, int retries,
+    int step_retries, hrtime_t *delay)
+{
+  struct timespec ts;
+
+  if (err != EAGAIN && err != ENXIO && err != ENOENT)
+    return (0);
+  if (retry->sr_max_retries >= 0 && retries >= retry->sr_max_retries)
+    return (0);
+  if (err == EAGAIN || step_retries > 0) {
+    ts.tv_sec  = *delay / 1000000000;
+    ts.tv_nsec = *delay % 1000000000;
+    (void) nanosleep(&ts, NULL);
+    *delay = *delay * 2 < retry->sr_max_delay ?
+      *delay * 2 : retry->sr_max_delay;
+  }
+  return (1);
+}
+
+/*
+ * The subsystems of a snapshot, in the order they are acquired.  Later ones
+ * depend on the CPUs, but not the other way around, so each can be acquired
+ * again on its own after a failure.
+ */
+enum snapshot_step {
+  STEP_INTRS,
+  STEP_CPUS,
+  STEP_PSETS,
+  STEP_SYS,
+  STEP_DONE
+};
+
+/*
+ * Acquire one subsystem of ss, discarding anything a failed try left.
+ * *sys_misc caches unix:0:system_misc once read, and must be reset whenever
+ * the chain is updated.
+ */
+static int
+acquire_step(kstat_ctl_t *kc, struct snapshot *ss, enum snapshot_step step,
+    kstat_t **sys_misc, struct kstat_agg *agg)
 {
-  struct snapshot *ss = NULL;
-  int              err;
+  int types = ss->s_types;
+
+  switch (step) {
+    case STEP_INTRS:
+      if (!(types & SNAP_INTERRUPTS))
+        return (0);
+      ss->s_nr_intrs = 0;
+      ss->s_intrs = NULL;
+      return (acquire_intrs(ss, kc, sys_misc));
+    case STEP_CPUS:
+      if (!(types & (SNAP_CPUS | SNAP_SYSTEM | SNAP_PSETS)))
+        return (0);
+      ss->s_nr_cpus = 0;
+      ss->s_cpus = NULL;
+      ss->s_snaptime_spread = 0;
+      (void) memset(&ss->s_sys.ss_agg_vm, 0, sizeof (kstat_t));
+      (void) memset(&ss->s_sys.ss_agg_sys, 0, sizeof (kstat_t));
+      (void) memset(agg, 0, 2 * sizeof (struct kstat_agg));
+      return (acquire_cpus(ss, kc, (types & SNAP_SYSTEM) ? agg : NULL));
+    case STEP_PSETS:
+      if (!(types & SNAP_PSETS))
+        return (0);
+      ss->s_nr_psets = 0;
+      ss->s_psets = NULL;
+      return (acquire_psets(ss));
+    case STEP_SYS:
+      if (!(types & SNAP_SYSTEM))
+        return (0);
+      ss->s_nr_active_cpus = 0;
+      return (acquire_sys(ss, kc, sys_misc, agg));
+    default:
+      return (0);
+  }
+}
 
-retry:
-  err = 0;
-  /* Make sure any partial resources are freed on a retry */
-  free_snapshot(ss);
+/*
+ * Fill in ss, whose arena is reset first, so any memory it holds is reused.
+ * A subsystem that fails with a transient error is acquired again, after
+ * updating the chain, within the budget of retry.  What a failed try
+ * allocated stays in the arena until it is next reset.  Returns 0 or an
+ * errno.
+ */
+static int
+try_fill_snapshot(kstat_ctl_t *kc, struct snapshot *ss, int types,
+    const struct snapshot_retry *retry)
+{
+  struct snapshot_arena *arena = ss->s_arena;
+  struct kstat_agg       agg[2];
+  kstat_t               *sys_misc = NULL;
+  enum snapshot_step     step;
+  hrtime_t               delay = retry->sr_delay;
+  int                    retries = 0, step_retries = 0;
+  int                    err;
 
-  ss = safe_alloc(sizeof (struct snapshot));
+  arena_reset(arena);
 
   (void) memset(ss, 0, sizeof (struct snapshot));
 
   ss->s_types = types;
+  ss->s_arena = arena;
 
   /* Wait for a possibly up to date chain */
   while (kstat_chain_update(kc) == -1) {
-    if (errno == EAGAIN)
-      nanosleep( &retry_delay, NULL );
-    else
-      fail(1, "kstat_chain_update failed");
+    if (!retry_wait(retry, errno, retries++, 1, &delay))
+      return (errno);
+  }
+
+  step = STEP_INTRS;
+  while (step != STEP_DONE) {
+    err = acquire_step(kc, ss, step, &sys_misc, agg);
+    if (err == 0) {
+      step++;
+      step_retries = 0;
+      continue;
+    }
+    /* A kstat may have gone, so look at the chain afresh */
+    do {
+      if (!retry_wait(retry, err, retries++, step_retries++, &delay))
+        return (err);
+    } while (kstat_chain_update(kc) == -1 && (err = errno) != 0);
+    sys_misc = NULL;
   }
 
-  if (!err && (types & SNAP_INTERRUPTS))
-    err = acquire_intrs(ss, kc);
+  return (0);
+}
 
-  if (!err && (types & (SNAP_CPUS | SNAP_SYSTEM | SNAP_PSETS)))
-    err = acquire_cpus(ss, kc);
+/* Fill in ss as acquire_snapshot() does, retrying forever */
+static void
+fill_snapshot(kstat_ctl_t *kc, struct snapshot *ss, int types)
+{
+  if (try_fill_snapshot(kc, ss, types, &retry_forever) != 0)
+    fail(1, "acquiring snapshot failed");
+}
 
-  if (!err && (types & SNAP_PSETS))
-    err = acquire_psets(ss);
+int
+try_acquire_snapshot(kstat_ctl_t *kc, int types,
+    const struct snapshot_retry *retry, struct snapshot **ssp)
+{
+  if (*ssp == NULL) {
+    if ((*ssp = calloc(1, sizeof (struct snapshot))) == NULL)
+      return (errno);
+  }
+  return (try_fill_snapshot(kc, *ssp, types,
+      retry != NULL ? retry : &retry_default));
+}
 
-  if (!err && (types & SNAP_SYSTEM))
-    err = acquire_sys(ss, kc);
+kstat_ctl_t *
+try_open_kstat(const struct snapshot_retry *retry)
+{
+  kstat_ctl_t *kc;
+  hrtime_t     delay;
+  int          retries = 0;
 
-  switch (err) {
-    case 0:
-      break;
-    case EAGAIN:
-      nanosleep( &retry_delay, NULL );
-    /* A kstat disappeared out from under us */
-    /* FALLTHROUGH */
-    case ENXIO:
-    case ENOENT:
-      goto retry;
-    default:
-      fail(1, "acquiring snapshot failed");
+  if (retry == NULL)
+    retry = &retry_default;
+  delay = retry->sr_delay;
+  while ((kc = kstat_open()) == NULL) {
+    if (errno != EAGAIN || !retry_wait(retry, errno, retries++, 1, &delay))
+      return (NULL);
   }
+  return (kc);
+}
+
+struct snapshot *
+acquire_snapshot(kstat_ctl_t *kc, int types)
+{
+  struct snapshot *ss;
+
+  ss = safe_alloc(sizeof (struct snapshot));
+  (void) memset(ss, 0, sizeof (struct snapshot));
+  fill_snapshot(kc, ss, types);
+  return (ss);
+}
 
+struct snapshot *
+recycle_snapshot(kstat_ctl_t *kc, struct snapshot *ss, int types)
+{
+  if (ss == NULL)
+    return (acquire_snapshot(kc, types));
+  fill_snapshot(kc, ss, types);
   return (ss);
 }
 
+struct snapshot_ring *
+snapshot_ring_create(kstat_ctl_t *kc, size_t n, int types)
+{
+  struct snapshot_ring *ring;
+  size_t                i;
+
+  ring = safe_alloc(sizeof (struct snapshot_ring));
+  ring->sr_kc    = kc;
+  ring->sr_types = types;
+  ring->sr_size  = n > 0 ? n : 1;
+  ring->sr_count = 0;
+  ring->sr_head  = ring->sr_size - 1;
+  ring->sr_slots = safe_alloc(ring->sr_size * sizeof (struct snapshot *));
+  for (i = 0; i < ring->sr_size; i++) {
+    ring->sr_slots[i] = safe_alloc(sizeof (struct snapshot));
+    (void) memset(ring->sr_slots[i], 0, sizeof (struct snapshot));
+  }
+  return (ring);
+}
+
+struct snapshot *
+acquire_into(struct snapshot_ring *ring)
+{
+  /* The slot after the newest holds the oldest generation */
+  ring->sr_head = (ring->sr_head + 1) % ring->sr_size;
+  fill_snapshot(ring->sr_kc, ring->sr_slots[ring->sr_head], ring->sr_types);
+  if (ring->sr_count < ring->sr_size)
+    ring->sr_count++;
+  return (ring->sr_slots[ring->sr_head]);
+}
+
+struct snapshot *
+snapshot_ring_get(struct snapshot_ring *ring, size_t age)
+{
+  if (age >= ring->sr_count)
+    return (NULL);
+  return (ring->sr_slots[(ring->sr_head + ring->sr_size - age) %
+      ring->sr_size]);
+}
+
 void
-free_snapshot(struct snapshot *ss)
+snapshot_ring_free(struct snapshot_ring *ring)
 {
   size_t i;
 
+  if (ring == NULL)
+    return;
+
+  for (i = 0; i < ring->sr_size; i++)
+    free_snapshot(ring->sr_slots[i]);
+  free(ring->sr_slots);
+  free(ring);
+}
+
+void
+free_snapshot(struct snapshot *ss)
+{
   if (ss == NULL)
     return;
 
-  while (ss->s_cpus) {
-    for (i = 0; i < ss->s_nr_cpus; i++) {
-      free(ss->s_cpus[i].cs_vm.ks_data);
-      free(ss->s_cpus[i].cs_sys.ks_data);
+  arena_free(ss->s_arena);
+  free(ss);
+}
+
+/*
+ * The walkers below pair up the items of two snapshots with a single merge
+ * over their arrays, which are kept sorted: CPUs are indexed by ID, psets are
+ * sorted by ID (with the no-pset set, ID 0, first) and interrupt sources by
+ * name.  Each returns non-zero if anything was added, removed or changed its
+ * configuration.  A NULL old snapshot walks everything in new as added.
+ */
+
+static int
+cpu_walk(struct snapshot *old, struct snapshot *new, snapshot_cb cb,
+    void *data)
+{
+  size_t nr_old = old != NULL ? old->s_nr_cpus : 0;
+  size_t nr = nr_old > new->s_nr_cpus ? nr_old : new->s_nr_cpus;
+  size_t i;
+  int    changed = 0;
+
+  for (i = 0; i < nr; i++) {
+    struct cpu_snapshot *oc = NULL;
+    struct cpu_snapshot *nc = NULL;
+
+    if (i < nr_old && old->s_cpus[i].cs_id != ID_NO_CPU)
+      oc = &old->s_cpus[i];
+    if (i < new->s_nr_cpus && new->s_cpus[i].cs_id != ID_NO_CPU)
+      nc = &new->s_cpus[i];
+
+    if (oc == NULL && nc == NULL)
+      continue;
+    if (oc == NULL || nc == NULL || oc->cs_state != nc->cs_state ||
+        oc->cs_pset_id != nc->cs_pset_id)
+      changed = 1;
+    cb(oc, nc, data);
+  }
+
+  return (changed);
+}
+
+/* Whether the two psets hold the same CPUs, which are in ID order */
+static int
+pset_cpus_equal(struct pset_snapshot *op, struct pset_snapshot *np)
+{
+  size_t i;
+
+  if (op->ps_nr_cpus != np->ps_nr_cpus)
+    return (0);
+  for (i = 0; i < op->ps_nr_cpus; i++) {
+    if (op->ps_cpus[i]->cs_id != np->ps_cpus[i]->cs_id)
+      return (0);
+  }
+  return (1);
+}
+
+static int
+pset_walk(struct snapshot *old, struct snapshot *new, snapshot_cb cb,
+    void *data)
+{
+  size_t i = 0, j = 0;
+  size_t nr_old = old != NULL ? old->s_nr_psets : 0;
+  int    changed = 0;
+
+  while (i < nr_old || j < new->s_nr_psets) {
+    struct pset_snapshot *op = i < nr_old ? &old->s_psets[i] : NULL;
+    struct pset_snapshot *np = j < new->s_nr_psets ? &new->s_psets[j] : NULL;
+
+    if (np == NULL || (op != NULL && op->ps_id < np->ps_id)) {
+      cb(op, NULL, data);
+      changed = 1;
+      i++;
+    } else if (op == NULL || op->ps_id > np->ps_id) {
+      cb(NULL, np, data);
+      changed = 1;
+      j++;
+    } else {
+      if (!pset_cpus_equal(op, np))
+        changed = 1;
+      cb(op, np, data);
+      i++;
+      j++;
     }
-    free(ss->s_cpus);
   }
 
-  if (ss->s_psets) {
-    for (i = 0; i < ss->s_nr_psets; i++)
-      free(ss->s_psets[i].ps_cpus);
-    free(ss->s_psets);
+  return (changed);
+}
+
+static int
+intr_walk(struct snapshot *old, struct snapshot *new, snapshot_cb cb,
+    void *data)
+{
+  size_t i = 0, j = 0;
+  size_t nr_old = old != NULL ? old->s_nr_intrs : 0;
+  int    changed = 0;
+
+  while (i < nr_old || j < new->s_nr_intrs) {
+    struct intr_snapshot *oi = i < nr_old ? &old->s_intrs[i] : NULL;
+    struct intr_snapshot *ni = j < new->s_nr_intrs ? &new->s_intrs[j] : NULL;
+    int                   cmp;
+
+    if (ni == NULL)
+      cmp = -1;
+    else if (oi == NULL)
+      cmp = 1;
+    else
+      cmp = strcmp(oi->is_name, ni->is_name);
+
+    if (cmp < 0) {
+      cb(oi, NULL, data);
+      changed = 1;
+      i++;
+    } else if (cmp > 0) {
+      cb(NULL, ni, data);
+      changed = 1;
+      j++;
+    } else {
+      cb(oi, ni, data);
+      i++;
+      j++;
+    }
   }
 
-  free(ss->s_sys.ss_agg_sys.ks_data);
-  free(ss->s_sys.ss_agg_vm.ks_data);
-  free(ss);
+  return (changed);
+}
+
+int
+snapshot_walk(enum snapshot_types type, struct snapshot *old,
+    struct snapshot *new, snapshot_cb cb, void *data)
+{
+  switch (type) {
+    case SNAP_CPUS:
+      return (cpu_walk(old, new, cb, data));
+    case SNAP_PSETS:
+      return (pset_walk(old, new, cb, data));
+    case SNAP_INTERRUPTS:
+      return (intr_walk(old, new, cb, data));
+    case SNAP_SYSTEM:
+      cb(old != NULL ? &old->s_sys : NULL, &new->s_sys, data);
+      return (old == NULL);
+    default:
+      return (0);
+  }
+}
+
+static void
+dummy_cb(void *v1, void *v2, void *data)
+{
+}
+
+int
+snapshot_has_changed(struct snapshot *old, struct snapshot *new)
+{
+  int ret = 0;
+
+  if (old == NULL || old->s_types != new->s_types)
+    return (1);
+
+  if (new->s_types & (SNAP_CPUS | SNAP_PSETS | SNAP_SYSTEM))
+    ret |= cpu_walk(old, new, dummy_cb, NULL);
+
+  if (!ret && (new->s_types & SNAP_PSETS))
+    ret |= pset_walk(old, new, dummy_cb, NULL);
+
+  if (!ret && (new->s_types & SNAP_INTERRUPTS))
+    ret |= intr_walk(old, new, dummy_cb, NULL);
+
+  return (ret);
+}
+
+static void
+cpu_report(void *v1, void *v2, void *data)
+{
+  int                 *pset = (int *)data;
+  struct cpu_snapshot *c1 = (struct cpu_snapshot *)v1;
+  struct cpu_snapshot *c2 = (struct cpu_snapshot *)v2;
+
+  if (c1 == NULL) {
+    (void) printf("<<processor %d added>>\n", c2->cs_id);
+    return;
+  }
+  if (c2 == NULL) {
+    (void) printf("<<processor %d removed>>\n", c1->cs_id);
+    return;
+  }
+
+  if (*pset && c1->cs_pset_id != c2->cs_pset_id) {
+    (void) printf("<<processor %d moved from pset: %d to: %d>>\n",
+        c1->cs_id, c1->cs_pset_id, c2->cs_pset_id);
+  }
+
+  if (c1->cs_state == c2->cs_state)
+    return;
+
+  if (CPU_ONLINE(c1->cs_state) && !CPU_ONLINE(c2->cs_state))
+    (void) printf("<<processor %d went offline>>\n", c1->cs_id);
+  else if (!CPU_ONLINE(c1->cs_state) && CPU_ONLINE(c2->cs_state))
+    (void) printf("<<processor %d went online>>\n", c1->cs_id);
+}
+
+static void
+pset_report(void *v1, void *v2, void *data)
+{
+  struct pset_snapshot *p1 = (struct pset_snapshot *)v1;
+  struct pset_snapshot *p2 = (struct pset_snapshot *)v2;
+
+  if (p1 == NULL)
+    (void) printf("<<pset %d created>>\n", p2->ps_id);
+  else if (p2 == NULL)
+    (void) printf("<<pset %d destroyed>>\n", p1->ps_id);
+}
+
+static void
+intr_report(void *v1, void *v2, void *data)
+{
+  struct intr_snapshot *i1 = (struct intr_snapshot *)v1;
+  struct intr_snapshot *i2 = (struct intr_snapshot *)v2;
+
+  if (i1 == NULL)
+    (void) printf("<<interrupt source %s added>>\n", i2->is_name);
+  else if (i2 == NULL)
+    (void) printf("<<interrupt source %s removed>>\n", i1->is_name);
+}
+
+void
+snapshot_report_changes(struct snapshot *old, struct snapshot *new)
+{
+  int pset;
+
+  if (old == NULL || new == NULL || old->s_types != new->s_types)
+    return;
+
+  pset = (new->s_types & SNAP_PSETS) != 0;
+
+  if (new->s_types & (SNAP_CPUS | SNAP_PSETS | SNAP_SYSTEM))
+    (void) cpu_walk(old, new, cpu_report, &pset);
+
+  if (pset)
+    (void) pset_walk(old, new, pset_report, NULL);
+
+  if (new->s_types & SNAP_INTERRUPTS)
+    (void) intr_walk(old, new, intr_report, NULL);
 }
 
 kstat_ctl_t *
@@ -372,6 +1801,14 @@ open_kstat(void)
   return (kc);
 }
 
+void
+close_kstat(kstat_ctl_t *kc)
+{
+  (void) snapshot_set_workers(kc, 0);
+  kstat_index_free(kc);
+  (void) kstat_close(kc);
+}
+
 void *
 safe_alloc(size_t size)
 {
@@ -409,7 +1846,7 @@ kstat_delta(kstat_t *old, kstat_t *new, char *name)
   kstat_named_t *knew = kstat_data_lookup(new, name);
   if (old && old->ks_data) {
     kstat_named_t *kold = kstat_data_lookup(old, name);
-    return (knew->value.ui64 = kold->value.ui64);
+    return (knew->value.ui64 - kold->value.ui64);
   }
   return (knew->value.ui64);
 }
@@ -455,15 +1892,93 @@ kstat_add(const kstat_t *src, kstat_t *dst)
   return (0);
 }
 
+struct kstat_schema *
+kstat_schema_create(char **names, size_t nr)
+{
+  struct kstat_schema *sc;
+
+  sc = safe_alloc(sizeof (struct kstat_schema));
+  (void) memset(sc, 0, sizeof (struct kstat_schema));
+  sc->ksc_nr    = nr;
+  sc->ksc_names = names;
+  sc->ksc_index = safe_alloc(nr * sizeof (int));
+  return (sc);
+}
+
+void
+kstat_schema_free(struct kstat_schema *sc)
+{
+  if (sc == NULL)
+    return;
+  free(sc->ksc_index);
+  free(sc);
+}
+
+int
+kstat_schema_resolve(struct kstat_schema *sc, const kstat_t *ksp)
+{
+  kstat_named_t *knp = ksp->ks_data;
+  size_t         i;
+  uint_t         j;
+
+  if (sc->ksc_ndata == ksp->ks_ndata &&
+      strcmp(sc->ksc_name, ksp->ks_name) == 0 &&
+      strcmp(sc->ksc_module, ksp->ks_module) == 0)
+    return (0);
+
+  for (i = 0; i < sc->ksc_nr; i++) {
+    sc->ksc_index[i] = -1;
+    for (j = 0; j < ksp->ks_ndata; j++) {
+      if (strcmp(knp[j].name, sc->ksc_names[i]) == 0) {
+        sc->ksc_index[i] = j;
+        break;
+      }
+    }
+  }
+  (void) strlcpy(sc->ksc_module, ksp->ks_module, KSTAT_STRLEN);
+  (void) strlcpy(sc->ksc_name, ksp->ks_name, KSTAT_STRLEN);
+  sc->ksc_ndata = ksp->ks_ndata;
+  return (1);
+}
+
 uint64_t
-cpu_ticks_delta(kstat_t *old, kstat_t *new)
+kstat_schema_delta(struct kstat_schema *sc, kstat_t *old, kstat_t *new,
+    size_t i)
+{
+  kstat_named_t *knew = new->ks_data;
+  kstat_named_t *kold;
+  int            idx;
+
+  (void) kstat_schema_resolve(sc, new);
+  if ((idx = sc->ksc_index[i]) < 0)
+    return (0);
+  if (old == NULL || old->ks_data == NULL)
+    return (knew[idx].value.ui64);
+  if (old->ks_ndata == new->ks_ndata) {
+    kold = old->ks_data;
+    return (knew[idx].value.ui64 - kold[idx].value.ui64);
+  }
+  /* The positions don't hold in a kstat of another shape */
+  if ((kold = kstat_data_lookup(old, sc->ksc_names[i])) == NULL)
+    return (knew[idx].value.ui64);
+  return (knew[idx].value.ui64 - kold->value.ui64);
+}
+
+uint64_t
+kstat_schema_delta_sum(struct kstat_schema *sc, kstat_t *old, kstat_t *new)
 {
-  uint64_t ticks = 0;
+  uint64_t sum = 0;
   size_t   i;
 
-  for (i = 0; i < ARRAY_SIZE(cpu_states); i++)
-    ticks += kstat_delta(old, new, cpu_states[i]);
-  return (ticks);
+  for (i = 0; i < sc->ksc_nr; i++)
+    sum += kstat_schema_delta(sc, old, new, i);
+  return (sum);
+}
+
+uint64_t
+cpu_ticks_delta(kstat_t *old, kstat_t *new)
+{
+  return (kstat_schema_delta_sum(&cpu_states_schema, old, new));
 }
 
 int
@@ -0,0 +1,40 @@
+#include "kstat_common.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * counts_delta() is kept apart from the rest of libkstatsnap, so that the
+ * Perl extension can link it in on its own, as it does ticker.c.
+ */
+
+void
+counts_delta(uint64_t *delta, const uint64_t *new, const uint64_t *old,
+    size_t nr)
+{
+  size_t k = 0;
+
+#if defined(__AVX2__)
+  for (; k + 4 <= nr; k += 4) {
+    __m256i n = _mm256_loadu_si256((const __m256i *)&new[k]);
+    __m256i o = _mm256_loadu_si256((const __m256i *)&old[k]);
+
+    _mm256_storeu_si256((__m256i *)&delta[k], _mm256_sub_epi64(n, o));
+  }
+#elif defined(__SSE2__)
+  for (; k + 2 <= nr; k += 2) {
+    __m128i n = _mm_loadu_si128((const __m128i *)&new[k]);
+    __m128i o = _mm_loadu_si128((const __m128i *)&old[k]);
+
+    _mm_storeu_si128((__m128i *)&delta[k], _mm_sub_epi64(n, o));
+  }
+#elif defined(__ARM_NEON)
+  for (; k + 2 <= nr; k += 2)
+    vst1q_u64(&delta[k], vsubq_u64(vld1q_u64(&new[k]), vld1q_u64(&old[k])));
+#endif
+  for (; k < nr; k++)
+    delta[k] = new[k] - old[k];
+}
@@ -80,6 +80,9 @@ struct sys_snapshot {
   long                  ss_deficit;
 };
 
+/* The memory a snapshot is carved from, private to acquire.c */
+struct snapshot_arena;
+
 /* The primary structure of a system snapshot. */
 struct snapshot {
   /* What types were **REQUESTED** */
@@ -92,6 +95,9 @@ struct snapshot {
   struct intr_snapshot *s_intrs;
   struct sys_snapshot   s_sys;
   size_t                s_nr_active_cpus;
+  /* How far apart the first and last CPU kstats were read, in ns */
+  hrtime_t              s_snaptime_spread;
+  struct snapshot_arena *s_arena;
 };
 
 /* print a message and exit with failure */
@@ -116,6 +122,61 @@ int kstat_copy(const kstat_t *src, kstat_t *dst);
  */
 uint64_t kstat_delta(kstat_t *old, kstat_t *new, char *name);
 
+/*
+ * A list of statistic names resolved to their positions in named kstats of
+ * one shape, i.e. module, name and number of statistics, so the kstat_schema
+ * functions can go straight to the statistics instead of looking each one up
+ * by name.  It is resolved again whenever it is used with a kstat of another
+ * shape.  A statistic the kstat doesn't have has position -1.
+ */
+struct kstat_schema {
+  char                  ksc_module[KSTAT_STRLEN];
+  char                  ksc_name[KSTAT_STRLEN];
+  uint_t                ksc_ndata;
+  size_t                ksc_nr;
+  char                **ksc_names;
+  int                  *ksc_index;
+};
+
+/*
+ * Static initialiser for a kstat_schema of the array of names, with
+ * positions kept in index, an int array of the same length.
+ */
+#define KSTAT_SCHEMA_INIT(names, index) \
+  { "", "", 0, sizeof (names) / sizeof (*(names)), (names), (index) }
+
+/* Create a schema for the nr names, which must outlive it. */
+struct kstat_schema *kstat_schema_create(char **names, size_t nr);
+
+/* free a schema */
+void kstat_schema_free(struct kstat_schema *sc);
+
+/*
+ * Resolve the schema against the named kstat, unless it already has the
+ * same shape.  Returns non-zero if the positions were resolved again.
+ */
+int kstat_schema_resolve(struct kstat_schema *sc, const kstat_t *ksp);
+
+/*
+ * As kstat_delta(), for the i'th statistic of the schema.  A statistic the
+ * kstat doesn't have gives 0.  If old has another number of statistics than
+ * new, the statistic is looked up in it by name.
+ */
+uint64_t kstat_schema_delta(struct kstat_schema *sc, kstat_t *old,
+    kstat_t *new, size_t i);
+
+/* The sum of kstat_schema_delta() over all the statistics of the schema */
+uint64_t kstat_schema_delta_sum(struct kstat_schema *sc, kstat_t *old,
+    kstat_t *new);
+
+/*
+ * delta[k] = new[k] - old[k] for nr counters, modulo 2^64, with SIMD where
+ * the compiler targets it, whatever the optimisation level.  delta may be
+ * new or old.
+ */
+void counts_delta(uint64_t *delta, const uint64_t *new, const uint64_t *old,
+    size_t nr);
+
 /* Return the number of ticks delta between two hrtime_t values. */
 uint64_t hrtime_delta(hrtime_t old, hrtime_t new);
 
@@ -140,15 +201,132 @@ uint64_t cpu_ticks_delta(kstat_t *old, kstat_t *new);
  */
 kstat_ctl_t *open_kstat(void);
 
+/*
+ * Close a kstat chain opened by open_kstat(), along with the index of it
+ * that acquire_snapshot() keeps.
+ */
+void close_kstat(kstat_ctl_t *kc);
+
+/*
+ * Have snapshots of kc read the CPU kstats with a pool of nworkers threads,
+ * each with its own kstat_ctl_t and a share of the CPUs, which narrows the
+ * spread of their snaptimes on large systems.  The threads are started here
+ * and kept until the workers are changed again.  0 or 1 goes back to reading
+ * the CPU kstats in the calling thread.  Returns 0, or an errno if the
+ * workers' kstat_ctl_t couldn't be opened or their threads started, in which
+ * case the workers kc had are kept.  The workers are released by
+ * close_kstat().
+ */
+int snapshot_set_workers(kstat_ctl_t *kc, int nworkers);
+
+/*
+ * Where snapshots get the CPU topology from.  Asking for it takes a system
+ * call per CPU ID, so it is cached with the index of each kstat_ctl_t, and
+ * only asked for again when the kstat chain ID changes, or the state
+ * statistic of a cpu_info kstat does.  A CPU moving to another pset alone
+ * changes neither, so is only seen once something else does.
+ */
+struct snapshot_topology {
+  /* The highest CPU ID there can be, as sysconf(_SC_CPUID_MAX) */
+  long                  (*st_cpuid_max)(void *arg);
+  /* As p_online(id, P_STATUS): the state of a CPU, or -1 if it is absent */
+  int                   (*st_cpu_state)(processorid_t id, void *arg);
+  /* As pset_assign(PS_QUERY, id, pset) */
+  int                   (*st_cpu_pset)(processorid_t id, psetid_t *pset,
+                            void *arg);
+  /* Passed to each of the above */
+  void                  *st_arg;
+};
+
+/*
+ * Have snapshots take the CPU topology from st, which is copied, or from the
+ * system again if st is NULL.  Every cached topology is asked for again.
+ */
+void snapshot_set_topology(const struct snapshot_topology *st);
+
 /*
  * Return a struct snapshot based on the snapshot_types parameter
  * passed in.
  */
 struct snapshot *acquire_snapshot(kstat_ctl_t *, int);
 
+/*
+ * Refill a snapshot that is no longer needed, as acquire_snapshot() would
+ * return a new one, reusing its memory.  Once a snapshot has been filled, it
+ * can be refilled in the same shape without any heap allocation.  Returns
+ * ss, or a new snapshot if ss is NULL.
+ */
+struct snapshot *recycle_snapshot(kstat_ctl_t *, struct snapshot *ss, int);
+
 /* free a snapshot */
 void free_snapshot(struct snapshot *ss);
 
+/*
+ * How the try_* functions below retry transient failures: EAGAIN, or a
+ * kstat going away (ENXIO or ENOENT) while a snapshot is taken.
+ */
+struct snapshot_retry {
+  /* The most retries one call may make, or -1 for no limit */
+  int                   sr_max_retries;
+  /* The delay before a retry in ns, doubling each time up to sr_max_delay */
+  hrtime_t              sr_delay;
+  hrtime_t              sr_max_delay;
+};
+
+/* 5 retries, backing off from 10 ms up to 1 s */
+#define SNAPSHOT_RETRY_DEFAULT { 5, 10000000LL, 1000000000LL }
+
+/*
+ * As recycle_snapshot(), but returning 0 or an errno instead of exiting,
+ * and retrying only within the budget of retry, or SNAPSHOT_RETRY_DEFAULT if
+ * it is NULL.  Only the part of the snapshot that failed (interrupts, CPUs,
+ * psets or system) is acquired again on a retry.  If *ssp is NULL, a new
+ * snapshot is stored there.  After a failure, *ssp holds a partial snapshot,
+ * which can only be refilled or freed.
+ */
+int try_acquire_snapshot(kstat_ctl_t *kc, int types,
+    const struct snapshot_retry *retry, struct snapshot **ssp);
+
+/*
+ * As open_kstat(), but returning NULL with errno set instead of exiting,
+ * once the budget of retry, or SNAPSHOT_RETRY_DEFAULT if it is NULL, is spent.
+ */
+kstat_ctl_t *try_open_kstat(const struct snapshot_retry *retry);
+
+/*
+ * A ring of preallocated snapshots of the same types, holding the last
+ * sr_size generations, so rates over several intervals need no copying.
+ */
+struct snapshot_ring {
+  kstat_ctl_t          *sr_kc;
+  int                   sr_types;
+  /* The number of slots, and how many of them have been filled */
+  size_t                sr_size;
+  size_t                sr_count;
+  /* The slot of the newest snapshot */
+  size_t                sr_head;
+  struct snapshot     **sr_slots;
+};
+
+/* Create a ring of n snapshots of the given snapshot_types. */
+struct snapshot_ring *snapshot_ring_create(kstat_ctl_t *kc, size_t n,
+    int types);
+
+/*
+ * Refill the oldest snapshot of the ring in place, reusing its memory, and
+ * return it.  It becomes the newest.
+ */
+struct snapshot *acquire_into(struct snapshot_ring *ring);
+
+/*
+ * Return the snapshot age generations before the newest one, so 0 is the
+ * newest, or NULL if the ring doesn't hold that many yet.
+ */
+struct snapshot *snapshot_ring_get(struct snapshot_ring *ring, size_t age);
+
+/* free a ring and all its snapshots */
+void snapshot_ring_free(struct snapshot_ring *ring);
+
 typedef void (*snapshot_cb)(void *old, void *new, void *data);
 
 /*
@@ -175,9 +353,40 @@ int snapshot_has_changed(struct snapshot *old, struct snapshot *new);
 void sleep_until(hrtime_t *wakeup, hrtime_t interval, int forever,
     int *caught_cont);
 
+/* Set by cont_handler(), to be passed to sleep_until() */
+extern int caught_cont;
+
 /* signal handler - so we can be aware of SIGCONT */
 void cont_handler(int sig_number);
 
+/*
+ * A drift-free interval timer.  Its ticks fall on the deadlines
+ * start + n * interval of the gethrtime() clock, which are slept until as
+ * absolute times, so neither the work done between ticks nor the latency of
+ * waking up accumulates.
+ */
+struct ticker {
+  hrtime_t              tk_interval;
+  /* The deadline of the next tick */
+  hrtime_t              tk_deadline;
+  /* Ticks so far, and deadlines skipped because they had already passed */
+  uint64_t              tk_ticks;
+  uint64_t              tk_missed;
+};
+
+/* Start a ticker, with the first deadline interval ns from now */
+void ticker_start(struct ticker *tk, hrtime_t interval);
+
+/*
+ * Sleep until the next deadline of tk, and return how many deadlines were
+ * skipped.  If the next deadline has passed, e.g. while the process was
+ * stopped until a SIGCONT, the tick is at once, and any deadlines before the
+ * last one that passed are skipped rather than made up in a burst, keeping
+ * the cadence.  Returns -1 with errno set if the sleep failed, or EINTR if a
+ * signal handler ran, after which the same deadline can be waited for again.
+ */
+int64_t ticker_wait(struct ticker *tk);
+
  
 
 #ifdef __cplusplus
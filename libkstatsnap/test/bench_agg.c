@@ -0,0 +1,139 @@
+/*
+ * Aggregating the cpu:*:sys kstats of 256, 1,024 and 4,096 CPUs into one,
+ * with a kstat_add() per kstat and with agg_add() and agg_finish(), both on
+ * their own and after copying the kstats into a snapshot: all the copies
+ * first and then kstat_add() over them, as acquire_sys() used to, against
+ * agg_add() on each copy as it is made, as acquire_cpus() does.  The
+ * Makefile builds this once for each agg_sum() path the machine has, as it
+ * does test_agg.
+ *
+ * This includes acquire.c for its static functions, so isn't linked with it.
+ */
+#include "../acquire.c"
+
+#include <stdio.h>
+
+/* About as many statistics as cpu:*:sys has, a few of them not numeric */
+#define NR_STATS 72
+
+static const size_t nr_cpus[] = { 256, 1024, 4096 };
+
+static const char *
+path(void)
+{
+#if defined(__AVX2__)
+  return ("AVX2");
+#elif defined(__SSE2__)
+  return ("SSE2");
+#elif defined(__ARM_NEON)
+  return ("NEON");
+#else
+  return ("scalar");
+#endif
+}
+
+static void
+make_kstat(kstat_t *ksp, uint64_t base)
+{
+  kstat_named_t *knp;
+  uint_t         i;
+
+  (void) memset(ksp, 0, sizeof (kstat_t));
+  ksp->ks_type = KSTAT_TYPE_NAMED;
+  ksp->ks_ndata = NR_STATS;
+  ksp->ks_data_size = NR_STATS * sizeof (kstat_named_t);
+  ksp->ks_data = knp = safe_alloc(ksp->ks_data_size);
+  (void) memset(knp, 0, ksp->ks_data_size);
+  for (i = 0; i < NR_STATS; i++) {
+    (void) snprintf(knp[i].name, KSTAT_STRLEN, "stat%u", i);
+    knp[i].data_type = i % 16 == 15 ? KSTAT_DATA_CHAR : KSTAT_DATA_UINT64;
+    knp[i].value.ui64 = base + i;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int              iterations = argc > 1 ? atoi(argv[1]) : 50;
+  struct snapshot  ss;
+  struct kstat_agg ka;
+  kstat_t         *ks, *copies, agg;
+  hrtime_t         start;
+  double           by_add, by_agg, copy_add, copy_agg;
+  size_t           c, n;
+  int              i;
+
+#if defined(__AVX2__)
+  if (!__builtin_cpu_supports("avx2")) {
+    (void) printf("no AVX2 on this machine\n");
+    return (0);
+  }
+#endif
+  (void) printf("agg_sum() path %s, %d statistics, %d iterations\n", path(),
+      NR_STATS, iterations);
+  (void) printf("%5s %14s %14s %8s %14s %14s %8s\n", "CPUs",
+      "kstat_add ns", "agg_add ns", "speedup", "copy, add ns",
+      "fused ns", "speedup");
+  (void) memset(&ss, 0, sizeof (ss));
+  for (n = 0; n < ARRAY_SIZE(nr_cpus); n++) {
+    ks = safe_alloc(nr_cpus[n] * sizeof (kstat_t));
+    copies = safe_alloc(nr_cpus[n] * sizeof (kstat_t));
+    for (c = 0; c < nr_cpus[n]; c++)
+      make_kstat(&ks[c], c);
+
+    start = gethrtime();
+    for (i = 0; i < iterations; i++) {
+      (void) memset(&agg, 0, sizeof (agg));
+      for (c = 0; c < nr_cpus[n]; c++)
+        (void) kstat_add(&ks[c], &agg);
+      free(agg.ks_data);
+    }
+    by_add = (double)(gethrtime() - start) / iterations;
+
+    start = gethrtime();
+    for (i = 0; i < iterations; i++) {
+      arena_reset(ss.s_arena);
+      (void) memset(&ka, 0, sizeof (ka));
+      (void) memset(&agg, 0, sizeof (agg));
+      for (c = 0; c < nr_cpus[n]; c++)
+        (void) agg_add(&ss, &ka, &ks[c], &agg);
+      agg_finish(&ka);
+    }
+    by_agg = (double)(gethrtime() - start) / iterations;
+
+    start = gethrtime();
+    for (i = 0; i < iterations; i++) {
+      arena_reset(ss.s_arena);
+      (void) memset(&agg, 0, sizeof (agg));
+      for (c = 0; c < nr_cpus[n]; c++)
+        (void) arena_kstat_copy(&ss, &ks[c], &copies[c]);
+      for (c = 0; c < nr_cpus[n]; c++)
+        (void) kstat_add(&copies[c], &agg);
+      free(agg.ks_data);
+    }
+    copy_add = (double)(gethrtime() - start) / iterations;
+
+    start = gethrtime();
+    for (i = 0; i < iterations; i++) {
+      arena_reset(ss.s_arena);
+      (void) memset(&ka, 0, sizeof (ka));
+      (void) memset(&agg, 0, sizeof (agg));
+      for (c = 0; c < nr_cpus[n]; c++) {
+        (void) arena_kstat_copy(&ss, &ks[c], &copies[c]);
+        (void) agg_add(&ss, &ka, &copies[c], &agg);
+      }
+      agg_finish(&ka);
+    }
+    copy_agg = (double)(gethrtime() - start) / iterations;
+
+    (void) printf("%5zu %14.0f %14.0f %7.1fx %14.0f %14.0f %7.1fx\n",
+        nr_cpus[n], by_add, by_agg, by_add / by_agg, copy_add, copy_agg,
+        copy_add / copy_agg);
+    for (c = 0; c < nr_cpus[n]; c++)
+      free(ks[c].ks_data);
+    free(ks);
+    free(copies);
+  }
+  arena_free(ss.s_arena);
+  return (0);
+}
@@ -0,0 +1,98 @@
+/*
+ * kstat_lookup(), which walks kc_chain, against kstat_index_lookup(), for
+ * the three lookups acquire_cpus() makes per CPU, as the number of CPUs and
+ * the length of the chain grow.  The extra kstats go ahead of the CPUs in
+ * the chain, which is the worst case for kstat_lookup().  The cost of
+ * building the index, which is paid once per chain ID, is given too.
+ *
+ * This includes acquire.c for its static functions, so isn't linked with it.
+ */
+#include "../acquire.c"
+#include "fake_kstat.h"
+
+#include <stdio.h>
+
+static const size_t nr_cpus[] = { 64, 256, 1024 };
+static const size_t nr_extra[] = { 0, 4096, 16384 };
+
+static void
+add_extra(size_t nr)
+{
+  char   name[KSTAT_STRLEN];
+  size_t i;
+
+  for (i = 0; i < nr; i++) {
+    (void) snprintf(name, sizeof (name), "extra%zu", i);
+    (void) fake_kstat_add("extra", (int)i, name, "misc", KSTAT_TYPE_RAW, 1,
+        8);
+  }
+}
+
+/* Look up the kstats of every CPU, returning ns per pass */
+static double
+bench(kstat_ctl_t *kc, size_t ncpu, int indexed, int iterations)
+{
+  hrtime_t start;
+  size_t   found = 0;
+  int      i, id;
+
+  start = gethrtime();
+  for (i = 0; i < iterations; i++) {
+    for (id = 0; id < (int)ncpu; id++) {
+      if (indexed) {
+        found += kstat_index_lookup(kc, "cpu_info", id, NULL) != NULL;
+        found += kstat_index_lookup(kc, "cpu", id, "vm") != NULL;
+        found += kstat_index_lookup(kc, "cpu", id, "sys") != NULL;
+      } else {
+        found += kstat_lookup(kc, "cpu_info", id, NULL) != NULL;
+        found += kstat_lookup(kc, "cpu", id, "vm") != NULL;
+        found += kstat_lookup(kc, "cpu", id, "sys") != NULL;
+      }
+    }
+  }
+  if (found != ncpu * 3 * iterations)
+    fail(0, "found %zu of %zu kstats", found, ncpu * 3 * iterations);
+  return ((double)(gethrtime() - start) / iterations);
+}
+
+int
+main(int argc, char **argv)
+{
+  int          iterations = argc > 1 ? atoi(argv[1]) : 20;
+  kstat_ctl_t *kc;
+  hrtime_t     start;
+  double       walk, index, build;
+  size_t       c, e;
+  int          id, i;
+
+  (void) printf("%5s %6s %7s %14s %14s %12s %8s\n", "CPUs", "extra",
+      "chain", "chain walk ns", "index ns", "build ns", "speedup");
+  for (c = 0; c < ARRAY_SIZE(nr_cpus); c++) {
+    for (e = 0; e < ARRAY_SIZE(nr_extra); e++) {
+      fake_reset();
+      add_extra(nr_extra[e]);
+      for (id = 0; id < (int)nr_cpus[c]; id++)
+        fake_cpu_add(id, PS_NONE);
+      kc = open_kstat();
+
+      /* As if the chain ID changed before every snapshot */
+      start = gethrtime();
+      for (i = 0; i < iterations; i++) {
+        struct kstat_index *ki = kstat_index_get(kc);
+
+        ki->ki_chain_id = -1;
+      }
+      build = (double)(gethrtime() - start) / iterations;
+      (void) kstat_index_get(kc);
+
+      walk = bench(kc, nr_cpus[c], 0, iterations);
+      index = bench(kc, nr_cpus[c], 1, iterations);
+      (void) printf("%5zu %6zu %7zu %14.0f %14.0f %12.0f %7.1fx\n",
+          nr_cpus[c], nr_extra[e], nr_cpus[c] * 3 + nr_extra[e], walk,
+          index, build, walk / index);
+      close_kstat(kc);
+    }
+  }
+  fake_reset();
+  return (0);
+}
@@ -0,0 +1,94 @@
+/*
+ * The deltas of 1,024 CPUs of 100 statistics each, by name with
+ * kstat_delta() and by position through a kstat_schema, along with what
+ * kstat_schema_resolve() costs whenever the shape changes.
+ */
+#include "kstat_common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NR_CPUS  1024
+#define NR_STATS 100
+
+static char    *names[NR_STATS];
+static kstat_t  old[NR_CPUS], new[NR_CPUS];
+
+static void
+fill(kstat_t *ksp, uint64_t base)
+{
+  kstat_named_t *knp;
+  int            i;
+
+  (void) strlcpy(ksp->ks_module, "cpu", KSTAT_STRLEN);
+  (void) strlcpy(ksp->ks_name, "sys", KSTAT_STRLEN);
+  ksp->ks_type = KSTAT_TYPE_NAMED;
+  ksp->ks_ndata = NR_STATS;
+  ksp->ks_data_size = NR_STATS * sizeof (kstat_named_t);
+  ksp->ks_data = knp = safe_alloc(ksp->ks_data_size);
+  (void) memset(knp, 0, ksp->ks_data_size);
+  for (i = 0; i < NR_STATS; i++) {
+    (void) strlcpy(knp[i].name, names[i], KSTAT_STRLEN);
+    knp[i].data_type = KSTAT_DATA_UINT64;
+    knp[i].value.ui64 = base + i;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  int                  iterations = argc > 1 ? atoi(argv[1]) : 20;
+  struct kstat_schema *sc;
+  hrtime_t             start;
+  double               by_name, by_schema, resolve;
+  uint64_t             sum_name = 0, sum_schema = 0;
+  char                 name[KSTAT_STRLEN];
+  int                  i, c, s;
+
+  for (i = 0; i < NR_STATS; i++) {
+    (void) snprintf(name, sizeof (name), "stat_%02d", i);
+    names[i] = safe_strdup(name);
+  }
+  for (c = 0; c < NR_CPUS; c++) {
+    fill(&old[c], c);
+    fill(&new[c], c * 2);
+  }
+  sc = kstat_schema_create(names, NR_STATS);
+
+  start = gethrtime();
+  for (i = 0; i < iterations; i++) {
+    for (c = 0; c < NR_CPUS; c++) {
+      for (s = 0; s < NR_STATS; s++)
+        sum_name += kstat_delta(&old[c], &new[c], names[s]);
+    }
+  }
+  by_name = (double)(gethrtime() - start) / iterations;
+
+  start = gethrtime();
+  for (i = 0; i < iterations; i++) {
+    for (c = 0; c < NR_CPUS; c++)
+      sum_schema += kstat_schema_delta_sum(sc, &old[c], &new[c]);
+  }
+  by_schema = (double)(gethrtime() - start) / iterations;
+
+  /* A shape change per iteration, so the schema is resolved every time */
+  start = gethrtime();
+  for (i = 0; i < iterations; i++) {
+    sc->ksc_ndata = 0;
+    (void) kstat_schema_resolve(sc, &new[0]);
+  }
+  resolve = (double)(gethrtime() - start) / iterations;
+
+  if (sum_name != sum_schema)
+    fail(0, "kstat_delta() summed to %llu, the schema to %llu",
+        (unsigned long long)sum_name, (unsigned long long)sum_schema);
+  (void) printf("%d CPUs x %d statistics, %d iterations\n", NR_CPUS,
+      NR_STATS, iterations);
+  (void) printf("kstat_delta() by name      %12.0f ns\n", by_name);
+  (void) printf("kstat_schema_delta_sum()   %12.0f ns\n", by_schema);
+  (void) printf("kstat_schema_resolve()     %12.0f ns\n", resolve);
+  (void) printf("speedup                    %12.1fx\n", by_name / by_schema);
+
+  kstat_schema_free(sc);
+  return (0);
+}
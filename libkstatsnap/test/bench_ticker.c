@@ -0,0 +1,63 @@
+/*
+ * How late the ticks of a ticker are after their deadlines, over 10,000
+ * intervals of 200 us, and how far behind the cadence the last tick is,
+ * against a loop that sleeps for the interval itself.
+ */
+#include "kstat_common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define INTERVAL 200000
+
+static int
+cmp_hrtime(const void *a, const void *b)
+{
+  hrtime_t x = *(const hrtime_t *)a, y = *(const hrtime_t *)b;
+
+  return (x < y ? -1 : x > y);
+}
+
+int
+main(int argc, char **argv)
+{
+  int              intervals = argc > 1 ? atoi(argv[1]) : 10000;
+  hrtime_t        *late;
+  hrtime_t         start, end;
+  struct ticker    tk;
+  struct timespec  ts;
+  int              i;
+
+  if (intervals < 1 || (late = malloc(intervals * sizeof (*late))) == NULL)
+    return (1);
+
+  ticker_start(&tk, INTERVAL);
+  start = tk.tk_deadline - INTERVAL;
+  for (i = 0; i < intervals; i++) {
+    (void) ticker_wait(&tk);
+    late[i] = gethrtime() - (tk.tk_deadline - INTERVAL);
+  }
+  end = gethrtime();
+  qsort(late, intervals, sizeof (*late), cmp_hrtime);
+  (void) printf("%d intervals of %d ns\n", intervals, INTERVAL);
+  (void) printf("ticker        median %8lld ns, p99 %8lld ns, max %8lld ns, "
+      "missed %llu\n", (long long)late[(intervals - 1) / 2],
+      (long long)late[(intervals - 1) * 99 / 100],
+      (long long)late[intervals - 1], (unsigned long long)tk.tk_missed);
+  (void) printf("ticker        behind %10lld ns\n",
+      (long long)(end - start - (hrtime_t)intervals * INTERVAL));
+
+  /* Relative sleeps, as the stat commands used to make */
+  ts.tv_sec  = 0;
+  ts.tv_nsec = INTERVAL;
+  start = gethrtime();
+  for (i = 0; i < intervals; i++)
+    (void) nanosleep(&ts, NULL);
+  end = gethrtime();
+  (void) printf("nanosleep()   behind %10lld ns\n",
+      (long long)(end - start - (hrtime_t)intervals * INTERVAL));
+
+  free(late);
+  return (0);
+}
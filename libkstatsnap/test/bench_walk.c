@@ -0,0 +1,94 @@
+/*
+ * The cost of snapshot_walk() and snapshot_has_changed() between two
+ * snapshots of a fake system of 1,024 CPUs in 4 psets with 4,096 interrupt
+ * sources, which is the work the stat commands do per interval before they
+ * print anything.
+ */
+#include "kstat_common.h"
+#include "fake_kstat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NR_CPUS  1024
+#define NR_PSETS 4
+#define NR_INTRS 4096
+
+static unsigned long pairs;
+
+static void
+count_cb(void *old, void *new, void *data)
+{
+  pairs++;
+}
+
+static void
+bench(const char *what, enum snapshot_types type, struct snapshot *old,
+    struct snapshot *new, int iterations)
+{
+  hrtime_t start, elapsed;
+  int      i;
+
+  pairs = 0;
+  start = gethrtime();
+  for (i = 0; i < iterations; i++) {
+    if (type == 0)
+      (void) snapshot_has_changed(old, new);
+    else
+      (void) snapshot_walk(type, old, new, count_cb, NULL);
+  }
+  elapsed = gethrtime() - start;
+  (void) printf("%-28s %10.0f ns/walk %8.2f ns/item\n", what,
+      (double)elapsed / iterations,
+      pairs > 0 ? (double)elapsed / pairs : 0.0);
+}
+
+int
+main(int argc, char **argv)
+{
+  int              iterations = argc > 1 ? atoi(argv[1]) : 1000;
+  int              types = SNAP_CPUS | SNAP_PSETS | SNAP_INTERRUPTS;
+  kstat_ctl_t     *kc;
+  struct snapshot *old, *new;
+  char             name[KSTAT_STRLEN];
+  int              i;
+
+  for (i = 1; i < NR_PSETS; i++)
+    fake_pset_add(i);
+  for (i = 0; i < NR_CPUS; i++)
+    fake_cpu_add(i, i * NR_PSETS / NR_CPUS == 0 ? PS_NONE :
+        i * NR_PSETS / NR_CPUS);
+  for (i = 0; i < NR_INTRS; i++) {
+    (void) snprintf(name, sizeof (name), "intr%05d", i);
+    (void) fake_intr_add("intr", i, name);
+  }
+  fake_system_add();
+
+  kc = open_kstat();
+  old = acquire_snapshot(kc, types);
+  new = acquire_snapshot(kc, types);
+  (void) printf("%zu CPUs, %zu psets, %zu interrupt sources, "
+      "%d iterations\n", new->s_nr_cpus, new->s_nr_psets, new->s_nr_intrs,
+      iterations);
+
+  bench("CPUs", SNAP_CPUS, old, new, iterations);
+  bench("psets", SNAP_PSETS, old, new, iterations);
+  bench("interrupts", SNAP_INTERRUPTS, old, new, iterations);
+  bench("snapshot_has_changed()", 0, old, new, iterations);
+
+  /* Every other source replaced, so the merge falls out of step */
+  for (i = 0; i < NR_INTRS; i += 2) {
+    (void) snprintf(name, sizeof (name), "intr%05d", i);
+    fake_kstat_remove(fake_kstat_find("intr", i, name));
+    (void) snprintf(name, sizeof (name), "intr%05dx", i);
+    (void) fake_intr_add("intr", i, name);
+  }
+  free_snapshot(new);
+  new = acquire_snapshot(kc, types);
+  bench("interrupts, half replaced", SNAP_INTERRUPTS, old, new, iterations);
+
+  free_snapshot(old);
+  free_snapshot(new);
+  close_kstat(kc);
+  return (0);
+}
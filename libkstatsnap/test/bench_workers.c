@@ -0,0 +1,53 @@
+/*
+ * Snapshots of 1,024 CPUs read serially and by 2, 4 and 8 worker threads,
+ * with every kstat_read() taking 10 us, as a kernel under load might.
+ */
+#include "kstat_common.h"
+#include "fake_kstat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NR_CPUS  1024
+#define DELAY_NS 10000
+
+int
+main(int argc, char **argv)
+{
+  int              iterations = argc > 1 ? atoi(argv[1]) : 5;
+  static const int workers[] = { 1, 2, 4, 8 };
+  kstat_ctl_t     *kc;
+  struct snapshot *ss = NULL;
+  hrtime_t         start, spread;
+  size_t           w;
+  int              i, err;
+
+  for (i = 0; i < NR_CPUS; i++)
+    fake_cpu_add(i, PS_NONE);
+  fake_system_add();
+  fake_set_read_delay(DELAY_NS);
+
+  kc = open_kstat();
+  (void) printf("%d CPUs, %d us per kstat_read(), %d iterations\n", NR_CPUS,
+      DELAY_NS / 1000, iterations);
+  (void) printf("%7s %14s %14s\n", "workers", "ms/snapshot", "spread ms");
+  for (w = 0; w < sizeof (workers) / sizeof (*workers); w++) {
+    if ((err = snapshot_set_workers(kc, workers[w])) != 0)
+      fail(0, "snapshot_set_workers: %s", strerror(err));
+    spread = 0;
+    start = gethrtime();
+    for (i = 0; i < iterations; i++) {
+      if ((err = try_acquire_snapshot(kc, SNAP_CPUS | SNAP_SYSTEM, NULL,
+          &ss)) != 0)
+        fail(0, "try_acquire_snapshot: %s", strerror(err));
+      spread += ss->s_snaptime_spread;
+    }
+    (void) printf("%7d %14.1f %14.1f\n", workers[w],
+        (double)(gethrtime() - start) / iterations / 1e6,
+        (double)spread / iterations / 1e6);
+  }
+
+  free_snapshot(ss);
+  close_kstat(kc);
+  return (0);
+}
@@ -0,0 +1,784 @@
+#include "fake_kstat.h"
+
+#include <sys/sysinfo.h>
+#include <sys/dnlc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * A kstat of the fake kernel.  Once removed, it stays on the list until
+ * fake_reset(), as the kstat_t copies of open kstat_ctl_t point to it until
+ * they next update their chain.
+ */
+struct fake_kstat {
+  kstat_t             fk_ks;
+  int                 fk_removed;
+  unsigned long       fk_reads;
+  struct fake_kstat  *fk_next;
+};
+
+struct fake_cpu {
+  int                 fc_present;
+  int                 fc_state;
+  psetid_t            fc_pset;
+};
+
+struct fake_fault {
+  char                ff_module[KSTAT_STRLEN];
+  int                 ff_skip;
+  int                 ff_nr;
+  int                 ff_err;
+};
+
+static struct fake_kstat  *kernel_head;
+static struct fake_kstat **kernel_tail = &kernel_head;
+static kid_t               kernel_chain_id = 1;
+static kid_t               next_kid = 1;
+
+static struct fake_cpu    *cpus;
+static size_t              cpus_alloc;
+static processorid_t       cpuid_max = -1;
+static uint_t              cpu_nr_stats;
+
+static psetid_t           *psets;
+static uint_t              nr_psets;
+
+static hrtime_t            read_delay;
+static struct fake_fault   faults[FAKE_PTHREAD_CREATE + 1];
+
+/* Guards all of the above, as libkstatsnap reads CPUs from worker threads */
+static pthread_mutex_t     fake_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *cpu_sys_stats[] = {
+  "cpu_ticks_idle",
+  "cpu_ticks_user",
+  "cpu_ticks_kernel",
+  "cpu_ticks_wait",
+  "cpu_nsec_idle",
+  "cpu_nsec_user",
+  "cpu_nsec_kernel",
+  "syscall",
+  "pswitch",
+  "intr",
+  "xcalls",
+  "trap"
+};
+
+static char *cpu_vm_stats[] = {
+  "pgin",
+  "pgout",
+  "scan",
+  "zfod",
+  "as_fault",
+  "maj_fault"
+};
+
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof (*a))
+
+hrtime_t
+gethrtime(void)
+{
+  struct timespec ts;
+
+  (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((hrtime_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+size_t
+strlcpy(char *dst, const char *src, size_t size)
+{
+  size_t len = strlen(src);
+
+  if (size > 0) {
+    size_t n = len < size - 1 ? len : size - 1;
+
+    (void) memcpy(dst, src, n);
+    dst[n] = '\0';
+  }
+  return (len);
+}
+
+long
+fake_sysconf(int name)
+{
+  if (name == _SC_CPUID_MAX)
+    return (cpuid_max);
+  return ((sysconf)(name));
+}
+
+static void *
+fake_alloc(size_t size)
+{
+  void *ptr;
+
+  if ((ptr = calloc(1, size > 0 ? size : 1)) == NULL) {
+    perror("fake_kstat");
+    abort();
+  }
+  return (ptr);
+}
+
+/* Whether the call should fail, with the error in *errp */
+static int
+fault_hit(enum fake_call call, const char *module, int *errp)
+{
+  struct fake_fault *ff = &faults[call];
+
+  if (ff->ff_nr == 0)
+    return (0);
+  if (ff->ff_module[0] != '\0' &&
+      (module == NULL || strcmp(ff->ff_module, module) != 0))
+    return (0);
+  if (ff->ff_skip > 0) {
+    ff->ff_skip--;
+    return (0);
+  }
+  ff->ff_nr--;
+  *errp = ff->ff_err;
+  return (1);
+}
+
+void
+fake_fail(enum fake_call call, const char *module, int skip, int nr, int err)
+{
+  struct fake_fault *ff = &faults[call];
+
+  (void) pthread_mutex_lock(&fake_lock);
+  (void) strlcpy(ff->ff_module, module != NULL ? module : "", KSTAT_STRLEN);
+  ff->ff_skip = skip;
+  ff->ff_nr   = nr;
+  ff->ff_err  = err;
+  (void) pthread_mutex_unlock(&fake_lock);
+}
+
+int
+fake_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+    void *(*start)(void *), void *arg)
+{
+  int err, hit;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  hit = fault_hit(FAKE_PTHREAD_CREATE, NULL, &err);
+  (void) pthread_mutex_unlock(&fake_lock);
+  if (hit)
+    return (err);
+  return ((pthread_create)(thread, attr, start, arg));
+}
+
+void
+fake_set_read_delay(hrtime_t delay)
+{
+  read_delay = delay;
+}
+
+void
+fake_reset(void)
+{
+  struct fake_kstat *fk, *next;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  for (fk = kernel_head; fk != NULL; fk = next) {
+    next = fk->fk_next;
+    free(fk->fk_ks.ks_data);
+    free(fk);
+  }
+  kernel_head = NULL;
+  kernel_tail = &kernel_head;
+  kernel_chain_id = next_kid++;
+
+  free(cpus);
+  cpus = NULL;
+  cpus_alloc = 0;
+  cpuid_max = -1;
+  cpu_nr_stats = 0;
+
+  free(psets);
+  psets = NULL;
+  nr_psets = 0;
+
+  read_delay = 0;
+  (void) memset(faults, 0, sizeof (faults));
+  (void) pthread_mutex_unlock(&fake_lock);
+}
+
+static struct fake_kstat *
+kstat_find_locked(const char *module, int instance, const char *name)
+{
+  struct fake_kstat *fk;
+
+  for (fk = kernel_head; fk != NULL; fk = fk->fk_next) {
+    if (!fk->fk_removed && fk->fk_ks.ks_instance == instance &&
+        strcmp(fk->fk_ks.ks_module, module) == 0 &&
+        strcmp(fk->fk_ks.ks_name, name) == 0)
+      return (fk);
+  }
+  return (NULL);
+}
+
+kstat_t *
+fake_kstat_add(const char *module, int instance, const char *name,
+    const char *class, uchar_t type, uint_t ndata, size_t size)
+{
+  struct fake_kstat *fk = fake_alloc(sizeof (struct fake_kstat));
+  kstat_t           *ksp = &fk->fk_ks;
+
+  (void) strlcpy(ksp->ks_module, module, KSTAT_STRLEN);
+  (void) strlcpy(ksp->ks_name, name, KSTAT_STRLEN);
+  (void) strlcpy(ksp->ks_class, class, KSTAT_STRLEN);
+  ksp->ks_instance  = instance;
+  ksp->ks_type      = type;
+  ksp->ks_ndata     = ndata;
+  ksp->ks_data_size = size;
+  ksp->ks_data      = fake_alloc(size);
+  ksp->ks_crtime    = gethrtime();
+  ksp->ks_private   = fk;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  ksp->ks_kid = next_kid++;
+  kernel_chain_id = ksp->ks_kid;
+  *kernel_tail = fk;
+  kernel_tail = &fk->fk_next;
+  (void) pthread_mutex_unlock(&fake_lock);
+  return (ksp);
+}
+
+kstat_t *
+fake_kstat_add_named(const char *module, int instance, const char *name,
+    const char *class, char **names, uint_t nr)
+{
+  kstat_t       *ksp;
+  kstat_named_t *knp;
+  uint_t         i;
+
+  ksp = fake_kstat_add(module, instance, name, class, KSTAT_TYPE_NAMED, nr,
+      nr * sizeof (kstat_named_t));
+  knp = KSTAT_NAMED_PTR(ksp);
+  for (i = 0; i < nr; i++) {
+    (void) strlcpy(knp[i].name, names[i], KSTAT_STRLEN);
+    knp[i].data_type = KSTAT_DATA_UINT64;
+  }
+  return (ksp);
+}
+
+kstat_t *
+fake_kstat_find(const char *module, int instance, const char *name)
+{
+  struct fake_kstat *fk;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  fk = kstat_find_locked(module, instance, name);
+  (void) pthread_mutex_unlock(&fake_lock);
+  return (fk != NULL ? &fk->fk_ks : NULL);
+}
+
+void
+fake_kstat_remove(kstat_t *ksp)
+{
+  struct fake_kstat *fk = ksp->ks_private;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  if (!fk->fk_removed) {
+    fk->fk_removed = 1;
+    kernel_chain_id = next_kid++;
+  }
+  (void) pthread_mutex_unlock(&fake_lock);
+}
+
+void
+fake_kstat_set(kstat_t *ksp, const char *stat, uint64_t value)
+{
+  kstat_named_t *knp = KSTAT_NAMED_PTR(ksp);
+  uint_t         i;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  for (i = 0; i < ksp->ks_ndata; i++) {
+    if (strcmp(knp[i].name, stat) != 0)
+      continue;
+    switch (knp[i].data_type) {
+      case KSTAT_DATA_INT32:
+        knp[i].value.i32 = (int32_t)value;
+        break;
+      case KSTAT_DATA_UINT32:
+        knp[i].value.ui32 = (uint32_t)value;
+        break;
+      default:
+        knp[i].value.ui64 = value;
+        break;
+    }
+    break;
+  }
+  (void) pthread_mutex_unlock(&fake_lock);
+}
+
+unsigned long
+fake_kstat_reads(const char *module, int instance, const char *name)
+{
+  struct fake_kstat *fk;
+  unsigned long      reads = 0;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  for (fk = kernel_head; fk != NULL; fk = fk->fk_next) {
+    if ((module == NULL || strcmp(fk->fk_ks.ks_module, module) == 0) &&
+        (instance == -1 || fk->fk_ks.ks_instance == instance) &&
+        (name == NULL || strcmp(fk->fk_ks.ks_name, name) == 0))
+      reads += fk->fk_reads;
+  }
+  (void) pthread_mutex_unlock(&fake_lock);
+  return (reads);
+}
+
+/*
+ * CPUs
+ */
+
+static const char *
+cpu_state_name(int state)
+{
+  switch (state) {
+    case P_ONLINE:
+      return ("on-line");
+    case P_NOINTR:
+      return ("no-intr");
+    case P_FAULTED:
+      return ("faulted");
+    case P_POWEROFF:
+      return ("powered-off");
+    case P_SPARE:
+      return ("spare");
+    default:
+      return ("off-line");
+  }
+}
+
+static struct fake_cpu *
+cpu_get(processorid_t id)
+{
+  if (id < 0 || (size_t)id >= cpus_alloc || !cpus[id].fc_present)
+    return (NULL);
+  return (&cpus[id]);
+}
+
+/* Add the sys or vm kstat of a CPU, with nr_stats statistics */
+static void
+cpu_kstat_add(processorid_t id, const char *name, char **stats, uint_t nr)
+{
+  uint_t   nr_all = cpu_nr_stats > nr ? cpu_nr_stats : nr;
+  char   **names = fake_alloc(nr_all * sizeof (char *));
+  char   (*extra)[KSTAT_STRLEN] = fake_alloc(nr_all * KSTAT_STRLEN);
+  uint_t   i;
+
+  for (i = 0; i < nr_all; i++) {
+    if (i < nr) {
+      names[i] = stats[i];
+    } else {
+      (void) snprintf(extra[i], KSTAT_STRLEN, "%s_stat%u", name, i);
+      names[i] = extra[i];
+    }
+  }
+  (void) fake_kstat_add_named("cpu", id, name, "misc", names, nr_all);
+  free(extra);
+  free(names);
+}
+
+void
+fake_cpu_add(processorid_t id, psetid_t pset)
+{
+  static char   *info_stats[] = { "state", "state_begin", "clock_MHz" };
+  char           name[KSTAT_STRLEN];
+  kstat_t       *ksp;
+  kstat_named_t *knp;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  if ((size_t)id >= cpus_alloc) {
+    size_t n = cpus_alloc > 0 ? cpus_alloc : 16;
+
+    while (n <= (size_t)id)
+      n *= 2;
+    if ((cpus = realloc(cpus, n * sizeof (struct fake_cpu))) == NULL) {
+      perror("fake_kstat");
+      abort();
+    }
+    (void) memset(&cpus[cpus_alloc], 0,
+        (n - cpus_alloc) * sizeof (struct fake_cpu));
+    cpus_alloc = n;
+  }
+  cpus[id].fc_present = 1;
+  cpus[id].fc_state   = P_ONLINE;
+  cpus[id].fc_pset    = pset;
+  if (id > cpuid_max)
+    cpuid_max = id;
+  (void) pthread_mutex_unlock(&fake_lock);
+
+  (void) snprintf(name, sizeof (name), "cpu_info%d", id);
+  ksp = fake_kstat_add_named("cpu_info", id, name, "misc", info_stats,
+      ARRAY_SIZE(info_stats));
+  knp = KSTAT_NAMED_PTR(ksp);
+  knp[0].data_type = KSTAT_DATA_CHAR;
+  (void) strlcpy(knp[0].value.c, cpu_state_name(P_ONLINE),
+      sizeof (knp[0].value.c));
+  cpu_kstat_add(id, "sys", cpu_sys_stats, ARRAY_SIZE(cpu_sys_stats));
+  cpu_kstat_add(id, "vm", cpu_vm_stats, ARRAY_SIZE(cpu_vm_stats));
+}
+
+void
+fake_cpu_remove(processorid_t id)
+{
+  char     name[KSTAT_STRLEN];
+  kstat_t *ksp;
+
+  (void) snprintf(name, sizeof (name), "cpu_info%d", id);
+  if ((ksp = fake_kstat_find("cpu_info", id, name)) != NULL)
+    fake_kstat_remove(ksp);
+  if ((ksp = fake_kstat_find("cpu", id, "sys")) != NULL)
+    fake_kstat_remove(ksp);
+  if ((ksp = fake_kstat_find("cpu", id, "vm")) != NULL)
+    fake_kstat_remove(ksp);
+
+  (void) pthread_mutex_lock(&fake_lock);
+  if (cpu_get(id) != NULL)
+    cpus[id].fc_present = 0;
+  (void) pthread_mutex_unlock(&fake_lock);
+}
+
+void
+fake_cpu_set_state(processorid_t id, int state)
+{
+  char     name[KSTAT_STRLEN];
+  kstat_t *ksp;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  if (cpu_get(id) != NULL)
+    cpus[id].fc_state = state;
+  (void) pthread_mutex_unlock(&fake_lock);
+
+  (void) snprintf(name, sizeof (name), "cpu_info%d", id);
+  if ((ksp = fake_kstat_find("cpu_info", id, name)) != NULL) {
+    kstat_named_t *knp = KSTAT_NAMED_PTR(ksp);
+
+    (void) pthread_mutex_lock(&fake_lock);
+    (void) strlcpy(knp[0].value.c, cpu_state_name(state),
+        sizeof (knp[0].value.c));
+    (void) pthread_mutex_unlock(&fake_lock);
+  }
+}
+
+void
+fake_cpu_set_pset(processorid_t id, psetid_t pset)
+{
+  (void) pthread_mutex_lock(&fake_lock);
+  if (cpu_get(id) != NULL)
+    cpus[id].fc_pset = pset;
+  (void) pthread_mutex_unlock(&fake_lock);
+}
+
+void
+fake_cpu_set_nr_stats(uint_t nr)
+{
+  cpu_nr_stats = nr;
+}
+
+int
+p_online(processorid_t id, int flag)
+{
+  struct fake_cpu *fc;
+  int              state;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  if ((fc = cpu_get(id)) == NULL) {
+    (void) pthread_mutex_unlock(&fake_lock);
+    errno = EINVAL;
+    return (-1);
+  }
+  state = fc->fc_state;
+  if (flag != P_STATUS)
+    fc->fc_state = flag;
+  (void) pthread_mutex_unlock(&fake_lock);
+  return (state);
+}
+
+/*
+ * Processor sets
+ */
+
+void
+fake_pset_add(psetid_t id)
+{
+  (void) pthread_mutex_lock(&fake_lock);
+  if ((psets = realloc(psets, (nr_psets + 1) * sizeof (psetid_t))) == NULL) {
+    perror("fake_kstat");
+    abort();
+  }
+  psets[nr_psets++] = id;
+  (void) pthread_mutex_unlock(&fake_lock);
+}
+
+void
+fake_pset_remove(psetid_t id)
+{
+  uint_t i, j;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  for (i = 0, j = 0; i < nr_psets; i++) {
+    if (psets[i] != id)
+      psets[j++] = psets[i];
+  }
+  nr_psets = j;
+  for (i = 0; i < cpus_alloc; i++) {
+    if (cpus[i].fc_pset == id)
+      cpus[i].fc_pset = PS_NONE;
+  }
+  (void) pthread_mutex_unlock(&fake_lock);
+}
+
+int
+pset_assign(psetid_t pset, processorid_t cpu, psetid_t *opset)
+{
+  struct fake_cpu *fc;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  if ((fc = cpu_get(cpu)) == NULL) {
+    (void) pthread_mutex_unlock(&fake_lock);
+    errno = EINVAL;
+    return (-1);
+  }
+  if (opset != NULL)
+    *opset = fc->fc_pset;
+  if (pset != PS_QUERY)
+    fc->fc_pset = pset;
+  (void) pthread_mutex_unlock(&fake_lock);
+  return (0);
+}
+
+int
+pset_list(psetid_t *psetlist, uint_t *numpsets)
+{
+  (void) pthread_mutex_lock(&fake_lock);
+  if (psetlist != NULL && nr_psets > 0) {
+    (void) memcpy(psetlist, psets,
+        (*numpsets < nr_psets ? *numpsets : nr_psets) * sizeof (psetid_t));
+  }
+  *numpsets = nr_psets;
+  (void) pthread_mutex_unlock(&fake_lock);
+  return (0);
+}
+
+/*
+ * Interrupts and the system kstats
+ */
+
+kstat_t *
+fake_intr_add(const char *module, int instance, const char *name)
+{
+  return (fake_kstat_add(module, instance, name, "controller",
+      KSTAT_TYPE_INTR, 1, sizeof (kstat_intr_t)));
+}
+
+void
+fake_system_add(void)
+{
+  static char *misc_stats[] = { "clk_intr", "deficit", "nproc" };
+
+  (void) fake_kstat_add("unix", 0, "sysinfo", "misc", KSTAT_TYPE_RAW, 1,
+      sizeof (sysinfo_t));
+  (void) fake_kstat_add("unix", 0, "vminfo", "vm", KSTAT_TYPE_RAW, 1,
+      sizeof (vminfo_t));
+  (void) fake_kstat_add("unix", 0, "dnlcstats", "misc", KSTAT_TYPE_RAW, 1,
+      sizeof (struct nc_stats));
+  (void) fake_kstat_add_named("unix", 0, "system_misc", "misc", misc_stats,
+      ARRAY_SIZE(misc_stats));
+}
+
+/*
+ * libkstat
+ */
+
+/* A kstat_ctl_t's copy of the header of a kernel kstat, without its data */
+static kstat_t *
+kstat_header(struct fake_kstat *fk)
+{
+  kstat_t *ksp = fake_alloc(sizeof (kstat_t));
+
+  *ksp = fk->fk_ks;
+  ksp->ks_next = NULL;
+  ksp->ks_data = NULL;
+  return (ksp);
+}
+
+kstat_ctl_t *
+kstat_open(void)
+{
+  kstat_ctl_t *kc;
+  int          err;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  if (fault_hit(FAKE_OPEN, NULL, &err)) {
+    (void) pthread_mutex_unlock(&fake_lock);
+    errno = err;
+    return (NULL);
+  }
+  (void) pthread_mutex_unlock(&fake_lock);
+
+  kc = fake_alloc(sizeof (kstat_ctl_t));
+  kc->kc_kd = -1;
+  kc->kc_chain_id = 0;
+  (void) kstat_chain_update(kc);
+  return (kc);
+}
+
+int
+kstat_close(kstat_ctl_t *kc)
+{
+  kstat_t *ksp, *next;
+
+  for (ksp = kc->kc_chain; ksp != NULL; ksp = next) {
+    next = ksp->ks_next;
+    free(ksp->ks_data);
+    free(ksp);
+  }
+  free(kc);
+  return (0);
+}
+
+kid_t
+kstat_chain_update(kstat_ctl_t *kc)
+{
+  struct fake_kstat  *fk;
+  kstat_t           **kspp, *ksp;
+  kid_t               last = 0;
+  int                 err;
+
+  (void) pthread_mutex_lock(&fake_lock);
+  if (kc->kc_chain_id != 0 && fault_hit(FAKE_CHAIN_UPDATE, NULL, &err)) {
+    (void) pthread_mutex_unlock(&fake_lock);
+    errno = err;
+    return (-1);
+  }
+  if (kc->kc_chain_id == kernel_chain_id) {
+    (void) pthread_mutex_unlock(&fake_lock);
+    return (0);
+  }
+
+  /* Drop the kstats that have gone */
+  for (kspp = &kc->kc_chain; (ksp = *kspp) != NULL; ) {
+    if (((struct fake_kstat *)ksp->ks_private)->fk_removed) {
+      *kspp = ksp->ks_next;
+      free(ksp->ks_data);
+      free(ksp);
+      continue;
+    }
+    if (ksp->ks_kid > last)
+      last = ksp->ks_kid;
+    kspp = &ksp->ks_next;
+  }
+
+  /* and append the new ones, which have higher KIDs */
+  for (fk = kernel_head; fk != NULL; fk = fk->fk_next) {
+    if (!fk->fk_removed && fk->fk_ks.ks_kid > last) {
+      *kspp = kstat_header(fk);
+      kspp = &(*kspp)->ks_next;
+    }
+  }
+
+  kc->kc_chain_id = kernel_chain_id;
+  (void) pthread_mutex_unlock(&fake_lock);
+  return (kc->kc_chain_id);
+}
+
+kid_t
+kstat_read(kstat_ctl_t *kc, kstat_t *ksp, void *buf)
+{
+  struct fake_kstat *fk = ksp->ks_private;
+  int                err;
+
+  if (read_delay > 0) {
+    struct timespec ts;
+
+    ts.tv_sec  = read_delay / 1000000000;
+    ts.tv_nsec = read_delay % 1000000000;
+    (void) nanosleep(&ts, NULL);
+  }
+
+  (void) pthread_mutex_lock(&fake_lock);
+  /* A kstat that has gone from the kernel can't be read any more */
+  if (fk->fk_removed) {
+    (void) pthread_mutex_unlock(&fake_lock);
+    errno = ENXIO;
+    return (-1);
+  }
+  if (fault_hit(FAKE_READ, ksp->ks_module, &err)) {
+    (void) pthread_mutex_unlock(&fake_lock);
+    errno = err;
+    return (-1);
+  }
+  if (ksp->ks_data == NULL || ksp->ks_data_size != fk->fk_ks.ks_data_size) {
+    free(ksp->ks_data);
+    ksp->ks_data = fake_alloc(fk->fk_ks.ks_data_size);
+  }
+  ksp->ks_ndata     = fk->fk_ks.ks_ndata;
+  ksp->ks_data_size = fk->fk_ks.ks_data_size;
+  (void) memcpy(ksp->ks_data, fk->fk_ks.ks_data, ksp->ks_data_size);
+  ksp->ks_snaptime  = gethrtime();
+  fk->fk_reads++;
+  (void) pthread_mutex_unlock(&fake_lock);
+
+  if (buf != NULL)
+    (void) memcpy(buf, ksp->ks_data, ksp->ks_data_size);
+  return (kc->kc_chain_id);
+}
+
+kid_t
+kstat_write(kstat_ctl_t *kc, kstat_t *ksp, void *buf)
+{
+  errno = EACCES;
+  return (-1);
+}
+
+kstat_t *
+kstat_lookup(kstat_ctl_t *kc, const char *module, int instance,
+    const char *name)
+{
+  kstat_t *ksp;
+
+  for (ksp = kc->kc_chain; ksp != NULL; ksp = ksp->ks_next) {
+    if ((module == NULL || strcmp(ksp->ks_module, module) == 0) &&
+        (instance == -1 || ksp->ks_instance == instance) &&
+        (name == NULL || strcmp(ksp->ks_name, name) == 0))
+      return (ksp);
+  }
+  errno = ENOENT;
+  return (NULL);
+}
+
+void *
+kstat_data_lookup(kstat_t *ksp, const char *name)
+{
+  uint_t i;
+
+  if (ksp->ks_data == NULL) {
+    errno = EINVAL;
+    return (NULL);
+  }
+  if (ksp->ks_type == KSTAT_TYPE_NAMED) {
+    kstat_named_t *knp = KSTAT_NAMED_PTR(ksp);
+
+    for (i = 0; i < ksp->ks_ndata; i++) {
+      if (strcmp(knp[i].name, name) == 0)
+        return (&knp[i]);
+    }
+  } else if (ksp->ks_type == KSTAT_TYPE_TIMER) {
+    kstat_timer_t *ktp = KSTAT_TIMER_PTR(ksp);
+
+    for (i = 0; i < ksp->ks_ndata; i++) {
+      if (strcmp(ktp[i].name, name) == 0)
+        return (&ktp[i]);
+    }
+  } else {
+    errno = EINVAL;
+    return (NULL);
+  }
+  errno = ENOENT;
+  return (NULL);
+}
@@ -0,0 +1,98 @@
+/*
+ * A fake libkstat, p_online(2) and pset_list(2), for testing libkstatsnap
+ * without a Solaris kernel.  A test builds the kstats of a fake kernel with
+ * the functions below.  Each kstat_ctl_t then holds its own chain of copies
+ * of their headers, which kstat_chain_update() brings up to date with the
+ * kernel as libkstat does, keeping the kstat_t of every kstat that is still
+ * there, and kstat_read() copies the data of a kstat from the kernel.
+ */
+#ifndef _FAKE_KSTAT_H
+#define _FAKE_KSTAT_H
+
+#include <kstat.h>
+#include <sys/processor.h>
+#include <sys/pset.h>
+
+/* Remove every kstat, CPU and pset from the kernel, and reset the knobs */
+void fake_reset(void);
+
+/*
+ * Add a kstat to the kernel, with size bytes of zeroed data, and return its
+ * kernel copy, whose ks_data a test may change between reads.
+ */
+kstat_t *fake_kstat_add(const char *module, int instance, const char *name,
+    const char *class, uchar_t type, uint_t ndata, size_t size);
+
+/* Add a named kstat with the nr statistics, all KSTAT_DATA_UINT64 */
+kstat_t *fake_kstat_add_named(const char *module, int instance,
+    const char *name, const char *class, char **names, uint_t nr);
+
+/* Find the kernel copy of a kstat, or NULL */
+kstat_t *fake_kstat_find(const char *module, int instance, const char *name);
+
+/* Remove a kstat, given by its kernel copy, from the kernel */
+void fake_kstat_remove(kstat_t *ksp);
+
+/* Set a numeric statistic of the kernel copy of a named kstat */
+void fake_kstat_set(kstat_t *ksp, const char *stat, uint64_t value);
+
+/*
+ * How many times kstat_read() read the kstats matching module, instance and
+ * name, of which NULL and -1 match anything.
+ */
+unsigned long fake_kstat_reads(const char *module, int instance,
+    const char *name);
+
+/*
+ * Add a CPU in pset, which may be PS_NONE, with its cpu_info, cpu:id:sys and
+ * cpu:id:vm kstats.  It is on-line, and has the nr_stats statistics set by
+ * fake_cpu_set_nr_stats() in each of sys and vm.
+ */
+void fake_cpu_add(processorid_t id, psetid_t pset);
+
+/* Remove a CPU and its kstats */
+void fake_cpu_remove(processorid_t id);
+
+/* Set the p_online(2) state of a CPU, and the state of its cpu_info kstat */
+void fake_cpu_set_state(processorid_t id, int state);
+
+/* Move a CPU to another pset */
+void fake_cpu_set_pset(processorid_t id, psetid_t pset);
+
+/*
+ * The number of statistics in the sys and vm kstats of the CPUs added after
+ * this, at least the handful every CPU has.
+ */
+void fake_cpu_set_nr_stats(uint_t nr);
+
+/* Create and destroy psets, as pset_list(2) sees them */
+void fake_pset_add(psetid_t id);
+void fake_pset_remove(psetid_t id);
+
+/* Add an interrupt kstat */
+kstat_t *fake_intr_add(const char *module, int instance, const char *name);
+
+/* Add the unix:0 sysinfo, vminfo, dnlcstats and system_misc kstats */
+void fake_system_add(void);
+
+/* How long each kstat_read() takes, in ns */
+void fake_set_read_delay(hrtime_t delay);
+
+/* The calls faults can be injected into */
+enum fake_call {
+  FAKE_OPEN,
+  FAKE_CHAIN_UPDATE,
+  FAKE_READ,
+  FAKE_PTHREAD_CREATE
+};
+
+/*
+ * Have nr calls of call fail with err, after letting skip calls through.
+ * For FAKE_READ, only reads of kstats of module count, unless it is NULL.
+ * FAKE_PTHREAD_CREATE is pthread_create(), which include/pthread.h has
+ * libkstatsnap call through the fake.
+ */
+void fake_fail(enum fake_call call, const char *module, int skip, int nr,
+    int err);
+
+#endif  /* _FAKE_KSTAT_H */
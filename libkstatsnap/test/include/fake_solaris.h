@@ -0,0 +1,35 @@
+/*
+ * The parts of the Solaris headers and libc that libkstatsnap needs and other
+ * systems lack, for building it against the fake libkstat in fake_kstat.c.
+ */
+#ifndef _FAKE_SOLARIS_H
+#define _FAKE_SOLARIS_H
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+typedef unsigned char       uchar_t;
+typedef unsigned short      ushort_t;
+typedef unsigned int        uint_t;
+typedef unsigned long       ulong_t;
+typedef long long           longlong_t;
+typedef unsigned long long  u_longlong_t;
+typedef long long           hrtime_t;
+typedef int                 kid_t;
+typedef int                 processorid_t;
+typedef int                 psetid_t;
+
+/* The highest CPU ID, which the fake answers from the CPUs it has */
+#define _SC_CPUID_MAX (-1)
+
+long fake_sysconf(int name);
+#define sysconf(name) fake_sysconf(name)
+
+hrtime_t gethrtime(void);
+
+size_t strlcpy(char *dst, const char *src, size_t size);
+
+#endif  /* _FAKE_SOLARIS_H */
@@ -0,0 +1,15 @@
+/*
+ * The system <pthread.h>, with pthread_create() going through the fake, so
+ * tests can make it fail.
+ */
+#ifndef _FAKE_PTHREAD_H
+#define _FAKE_PTHREAD_H
+
+#include_next <pthread.h>
+
+int fake_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+    void *(*start)(void *), void *arg);
+#define pthread_create(thread, attr, start, arg) \
+  fake_pthread_create(thread, attr, start, arg)
+
+#endif  /* _FAKE_PTHREAD_H */
@@ -0,0 +1 @@
+/* Nothing libkstatsnap uses from the Solaris <sys/avl.h> */
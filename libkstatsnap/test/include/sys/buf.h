@@ -0,0 +1 @@
+/* Nothing libkstatsnap uses from the Solaris <sys/buf.h> */
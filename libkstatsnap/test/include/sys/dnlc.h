@@ -0,0 +1,18 @@
+/* The unix:0:dnlcstats struct of the Solaris <sys/dnlc.h> */
+#ifndef _SYS_DNLC_H
+#define _SYS_DNLC_H
+
+#include "fake_solaris.h"
+
+struct nc_stats {
+  uint_t  hits;
+  uint_t  misses;
+  uint_t  enters;
+  uint_t  dbl_enters;
+  uint_t  long_enter;
+  uint_t  long_look;
+  uint_t  move_to_front;
+  uint_t  purges;
+};
+
+#endif  /* _SYS_DNLC_H */
@@ -0,0 +1,17 @@
+/* p_online(2), as in the Solaris <sys/processor.h> */
+#ifndef _SYS_PROCESSOR_H
+#define _SYS_PROCESSOR_H
+
+#include "fake_solaris.h"
+
+#define P_OFFLINE  0x0001
+#define P_ONLINE   0x0002
+#define P_STATUS   0x0003
+#define P_FAULTED  0x0004
+#define P_POWEROFF 0x0005
+#define P_NOINTR   0x0006
+#define P_SPARE    0x0007
+
+int p_online(processorid_t processorid, int flag);
+
+#endif  /* _SYS_PROCESSOR_H */
@@ -0,0 +1,14 @@
+/* Processor sets, as in the Solaris <sys/pset.h> */
+#ifndef _SYS_PSET_H
+#define _SYS_PSET_H
+
+#include "fake_solaris.h"
+
+#define PS_NONE   -1
+#define PS_QUERY  -2
+#define PS_MYID   -3
+
+int pset_assign(psetid_t pset, processorid_t cpu, psetid_t *opset);
+int pset_list(psetid_t *psetlist, uint_t *numpsets);
+
+#endif  /* _SYS_PSET_H */
@@ -0,0 +1,25 @@
+/* The unix:0:sysinfo and unix:0:vminfo structs of the Solaris <sys/sysinfo.h> */
+#ifndef _SYS_SYSINFO_H
+#define _SYS_SYSINFO_H
+
+#include "fake_solaris.h"
+
+typedef struct sysinfo {
+  uint_t  updates;
+  uint_t  runque;
+  uint_t  runocc;
+  uint_t  swpque;
+  uint_t  swpocc;
+  uint_t  waiting;
+} sysinfo_t;
+
+typedef struct vminfo {
+  uint64_t  freemem;
+  uint64_t  swap_resv;
+  uint64_t  swap_alloc;
+  uint64_t  swap_avail;
+  uint64_t  swap_free;
+  uint64_t  updates;
+} vminfo_t;
+
+#endif  /* _SYS_SYSINFO_H */
@@ -0,0 +1,110 @@
+#include "tap.h"
+#include "kstat_common.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <errno.h>
+
+static int tests;
+static int failed;
+
+static int
+report(int cond, const char *fmt, va_list ap)
+{
+  tests++;
+  if (!cond)
+    failed++;
+  (void) printf("%sok %d - ", cond ? "" : "not ", tests);
+  (void) vprintf(fmt, ap);
+  (void) printf("\n");
+  return (cond);
+}
+
+int
+ok(int cond, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  (void) report(cond, fmt, ap);
+  va_end(ap);
+  return (cond);
+}
+
+int
+is(uint64_t got, uint64_t expected, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  (void) report(got == expected, fmt, ap);
+  va_end(ap);
+  if (got != expected) {
+    diag("     got: %llu", (unsigned long long)got);
+    diag("expected: %llu", (unsigned long long)expected);
+  }
+  return (got == expected);
+}
+
+int
+is_str(const char *got, const char *expected, const char *fmt, ...)
+{
+  va_list ap;
+  int     cond = strcmp(got, expected) == 0;
+
+  va_start(ap, fmt);
+  (void) report(cond, fmt, ap);
+  va_end(ap);
+  if (!cond) {
+    diag("     got: %s", got);
+    diag("expected: %s", expected);
+  }
+  return (cond);
+}
+
+/* Each line of a diagnostic is a TAP comment */
+void
+diag(const char *fmt, ...)
+{
+  char    buf[8192];
+  char   *line, *next;
+  va_list ap;
+
+  va_start(ap, fmt);
+  (void) vsnprintf(buf, sizeof (buf), fmt, ap);
+  va_end(ap);
+  for (line = buf; line != NULL; line = next) {
+    if ((next = strchr(line, '\n')) != NULL)
+      *next++ = '\0';
+    if (next == NULL && *line == '\0' && line != buf)
+      break;
+    (void) printf("# %s\n", line);
+  }
+}
+
+int
+done_testing(void)
+{
+  (void) printf("1..%d\n", tests);
+  if (failed > 0)
+    diag("Looks like you failed %d test%s of %d.", failed,
+        failed > 1 ? "s" : "", tests);
+  return (failed > 0);
+}
+
+/* libkstatsnap leaves fail() to the program, as the stat commands do */
+void
+fail(int do_perror, char *message, ...)
+{
+  va_list ap;
+  int     err = errno;
+
+  (void) fflush(stdout);
+  va_start(ap, message);
+  (void) vfprintf(stderr, message, ap);
+  va_end(ap);
+  if (do_perror)
+    (void) fprintf(stderr, ": %s", strerror(err));
+  (void) fprintf(stderr, "\n");
+  exit(2);
+}
@@ -0,0 +1,25 @@
+/*
+ * Just enough of the Test Anything Protocol for the libkstatsnap tests, so
+ * prove(1) can run them as it does the Perl tests.
+ */
+#ifndef _TAP_H
+#define _TAP_H
+
+#include <stdint.h>
+
+/* Report a test, which passes if cond is non-zero, and return cond */
+int ok(int cond, const char *fmt, ...);
+
+/* As ok(), comparing two numbers, which are shown if they differ */
+int is(uint64_t got, uint64_t expected, const char *fmt, ...);
+
+/* As ok(), comparing two strings, which are shown if they differ */
+int is_str(const char *got, const char *expected, const char *fmt, ...);
+
+/* Print a diagnostic line */
+void diag(const char *fmt, ...);
+
+/* Print the plan, and return the exit status of the test program */
+int done_testing(void);
+
+#endif  /* _TAP_H */
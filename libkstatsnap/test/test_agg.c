@@ -0,0 +1,257 @@
+/*
+ * agg_sum(), agg_add() and agg_finish() against a plain scalar sum and
+ * kstat_add(), over named kstats with random mixes of data types and
+ * numbers of statistics, so every SIMD loop is run with every length of
+ * scalar tail, and counts_delta() against a scalar subtraction likewise.
+ * The Makefile builds this once for each SIMD path the machine has: the
+ * default (SSE2 on x86-64, NEON on ARM), AVX2 and scalar.
+ *
+ * This includes acquire.c for its static functions, so isn't linked with it.
+ */
+#include "../acquire.c"
+#include "tap.h"
+
+#define MAX_NDATA 37
+#define NR_KSTATS 9
+
+static const uchar_t data_types[] = {
+  KSTAT_DATA_CHAR, KSTAT_DATA_INT32, KSTAT_DATA_UINT32, KSTAT_DATA_INT64,
+  KSTAT_DATA_UINT64, KSTAT_DATA_STRING
+};
+
+static uint64_t seed = 88172645463325252ULL;
+
+/* xorshift64, so every build sees the same kstats */
+static uint64_t
+rnd(void)
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return (seed);
+}
+
+static const char *
+path(void)
+{
+#if defined(__AVX2__)
+  return ("AVX2");
+#elif defined(__SSE2__)
+  return ("SSE2");
+#elif defined(__ARM_NEON)
+  return ("NEON");
+#else
+  return ("scalar");
+#endif
+}
+
+static int
+numeric(uchar_t type)
+{
+  return (type != KSTAT_DATA_CHAR && type != KSTAT_DATA_STRING);
+}
+
+/* A named kstat of ndata statistics of the given types and random values */
+static void
+make_kstat(kstat_t *ksp, const uchar_t *types, uint_t ndata)
+{
+  kstat_named_t *knp;
+  uint_t         i;
+
+  (void) memset(ksp, 0, sizeof (kstat_t));
+  (void) strlcpy(ksp->ks_module, "cpu", KSTAT_STRLEN);
+  (void) strlcpy(ksp->ks_name, "sys", KSTAT_STRLEN);
+  ksp->ks_type = KSTAT_TYPE_NAMED;
+  ksp->ks_ndata = ndata;
+  ksp->ks_data_size = ndata * sizeof (kstat_named_t);
+  ksp->ks_data = knp = safe_alloc(ksp->ks_data_size + 1);
+  (void) memset(knp, 0, ksp->ks_data_size);
+  for (i = 0; i < ndata; i++) {
+    (void) snprintf(knp[i].name, KSTAT_STRLEN, "stat%u", i);
+    knp[i].data_type = types[i];
+    if (types[i] == KSTAT_DATA_CHAR)
+      (void) strlcpy(knp[i].value.c, "on-line", sizeof (knp[i].value.c));
+    else if (types[i] == KSTAT_DATA_STRING)
+      KSTAT_NAMED_STR_PTR(&knp[i]) = NULL;
+    else
+      knp[i].value.ui64 = rnd();
+  }
+}
+
+/* agg_sum() over nr kstats, against a sum by value.ui64 */
+static int
+check_sum(const uchar_t *types, uint_t ndata)
+{
+  kstat_t   ks[NR_KSTATS];
+  uint32_t  off[MAX_NDATA];
+  uint64_t  acc[MAX_NDATA + 1], expected[MAX_NDATA];
+  size_t    nr = 0, k;
+  uint_t    i, j;
+  int       good = 1;
+
+  for (i = 0; i < ndata; i++) {
+    if (numeric(types[i]))
+      off[nr++] = i * sizeof (kstat_named_t) +
+        offsetof(kstat_named_t, value);
+  }
+  (void) memset(acc, 0, sizeof (acc));
+  (void) memset(expected, 0, sizeof (expected));
+  /* A sentinel past the end, which agg_sum() mustn't touch */
+  acc[nr] = 0xdeadbeef;
+
+  for (j = 0; j < NR_KSTATS; j++) {
+    kstat_named_t *knp;
+
+    make_kstat(&ks[j], types, ndata);
+    agg_sum(acc, ks[j].ks_data, off, nr);
+    knp = ks[j].ks_data;
+    for (i = 0, k = 0; i < ndata; i++) {
+      if (numeric(types[i]))
+        expected[k++] += knp[i].value.ui64;
+    }
+  }
+  for (k = 0; k < nr; k++) {
+    if (acc[k] != expected[k]) {
+      diag("ks_ndata %u, sum %zu: got %llu, expected %llu", ndata, k,
+          (unsigned long long)acc[k], (unsigned long long)expected[k]);
+      good = 0;
+    }
+  }
+  if (acc[nr] != 0xdeadbeef) {
+    diag("ks_ndata %u: wrote past the last sum", ndata);
+    good = 0;
+  }
+  for (j = 0; j < NR_KSTATS; j++)
+    free(ks[j].ks_data);
+  return (good);
+}
+
+/*
+ * counts_delta() of nr random counters, about half of which have wrapped,
+ * into a separate array and in place, against a scalar subtraction
+ */
+static int
+check_delta(size_t nr)
+{
+  uint64_t  new[MAX_NDATA + 1], old[MAX_NDATA + 1], delta[MAX_NDATA + 1];
+  uint64_t  expected[MAX_NDATA];
+  size_t    k;
+  int       good = 1;
+
+  for (k = 0; k < nr; k++) {
+    new[k] = rnd();
+    old[k] = rnd() % 2 ? new[k] - rnd() % 1000000 : rnd();
+    expected[k] = new[k] - old[k];
+  }
+  /* A sentinel past the end, which counts_delta() mustn't touch */
+  delta[nr] = new[nr] = 0xdeadbeef;
+
+  counts_delta(delta, new, old, nr);
+  if (memcmp(delta, expected, nr * sizeof (uint64_t)) != 0 ||
+      delta[nr] != 0xdeadbeef) {
+    diag("%zu counters: the delta is wrong", nr);
+    good = 0;
+  }
+  counts_delta(new, new, old, nr);
+  if (memcmp(new, expected, nr * sizeof (uint64_t)) != 0 ||
+      new[nr] != 0xdeadbeef) {
+    diag("%zu counters: the delta in place is wrong", nr);
+    good = 0;
+  }
+  return (good);
+}
+
+/* agg_add() and agg_finish() over nr kstats, against kstat_add() */
+static int
+check_add(const uchar_t *types, uint_t ndata, uint_t short_ndata)
+{
+  struct snapshot  ss;
+  struct kstat_agg ka;
+  kstat_t          ks[NR_KSTATS], agg, expected;
+  kstat_named_t   *got, *want;
+  uint_t           i, j;
+  int              good = 1;
+
+  (void) memset(&ss, 0, sizeof (ss));
+  (void) memset(&ka, 0, sizeof (ka));
+  (void) memset(&agg, 0, sizeof (agg));
+  (void) memset(&expected, 0, sizeof (expected));
+
+  /* The last kstat is of another shape, cut short */
+  for (j = 0; j < NR_KSTATS; j++) {
+    make_kstat(&ks[j], types, j == NR_KSTATS - 1 ? short_ndata : ndata);
+    if (agg_add(&ss, &ka, &ks[j], &agg) != 0 ||
+        kstat_add(&ks[j], &expected) != 0)
+      fail(1, "aggregating failed");
+  }
+  agg_finish(&ka);
+
+  got = agg.ks_data;
+  want = expected.ks_data;
+  for (i = 0; i < ndata; i++) {
+    if (got[i].data_type != want[i].data_type ||
+        strcmp(got[i].name, want[i].name) != 0 ||
+        (numeric(types[i]) && got[i].value.ui64 != want[i].value.ui64) ||
+        (types[i] == KSTAT_DATA_CHAR &&
+         strcmp(got[i].value.c, want[i].value.c) != 0)) {
+      diag("ks_ndata %u, statistic %u: got %llu, expected %llu", ndata, i,
+          (unsigned long long)got[i].value.ui64,
+          (unsigned long long)want[i].value.ui64);
+      good = 0;
+    }
+  }
+  for (j = 0; j < NR_KSTATS; j++)
+    free(ks[j].ks_data);
+  free(expected.ks_data);
+  arena_free(ss.s_arena);
+  return (good);
+}
+
+int
+main(void)
+{
+  uchar_t types[MAX_NDATA];
+  uint_t  ndata, i;
+  int     round, good_sum, good_add, good_delta;
+
+#if defined(__AVX2__)
+  if (!__builtin_cpu_supports("avx2")) {
+    (void) printf("1..0 # SKIP no AVX2 on this machine\n");
+    return (0);
+  }
+#endif
+  diag("SIMD path: %s", path());
+
+  /* Every length of tail after the SIMD loops, with mixed types */
+  good_sum = good_add = 1;
+  for (round = 0; round < 20; round++) {
+    for (ndata = 1; ndata <= MAX_NDATA; ndata++) {
+      for (i = 0; i < ndata; i++)
+        types[i] = data_types[rnd() % sizeof (data_types)];
+      good_sum &= check_sum(types, ndata);
+      good_add &= check_add(types, ndata, (uint_t)(rnd() % ndata));
+    }
+  }
+  ok(good_sum, "%s agg_sum() matches the scalar sum", path());
+  ok(good_add, "%s agg_add() matches kstat_add()", path());
+
+  /* All numeric, and none numeric */
+  for (i = 0; i < MAX_NDATA; i++)
+    types[i] = KSTAT_DATA_UINT64;
+  ok(check_sum(types, MAX_NDATA) && check_add(types, MAX_NDATA, 3),
+      "%s: all numeric", path());
+  for (i = 0; i < MAX_NDATA; i++)
+    types[i] = i % 2 ? KSTAT_DATA_CHAR : KSTAT_DATA_STRING;
+  ok(check_sum(types, MAX_NDATA) && check_add(types, MAX_NDATA, 0),
+      "%s: none numeric", path());
+
+  /* counts_delta() with every length of tail, and with none at all */
+  good_delta = 1;
+  for (round = 0; round < 20; round++) {
+    for (ndata = 0; ndata <= MAX_NDATA; ndata++)
+      good_delta &= check_delta(ndata);
+  }
+  ok(good_delta, "%s counts_delta() matches the scalar subtraction", path());
+
+  return (done_testing());
+}
@@ -0,0 +1,223 @@
+/*
+ * The snapshot arena, and recycle_snapshot() refilling a snapshot from the
+ * memory it already has.
+ *
+ * This includes acquire.c for its static functions, so isn't linked with it.
+ */
+#include "../acquire.c"
+#include "fake_kstat.h"
+#include "tap.h"
+
+#define ALL_TYPES (SNAP_CPUS | SNAP_PSETS | SNAP_INTERRUPTS | SNAP_SYSTEM)
+#define NR_WORKERS 4
+
+static size_t
+nr_chunks(struct snapshot_arena *sa)
+{
+  struct arena_chunk *c;
+  size_t              nr = 0;
+
+  for (c = sa != NULL ? sa->sa_chunks : NULL; c != NULL; c = c->ac_next)
+    nr++;
+  return (nr);
+}
+
+static int
+all_zero(const char *p, size_t size)
+{
+  while (size-- > 0) {
+    if (*p++ != 0)
+      return (0);
+  }
+  return (1);
+}
+
+static uint64_t
+cpu_stat(struct snapshot *ss, processorid_t id, const char *stat)
+{
+  kstat_named_t *knp = kstat_data_lookup(&ss->s_cpus[id].cs_sys, stat);
+
+  return (knp != NULL ? knp->value.ui64 : UINT64_MAX);
+}
+
+static void
+test_alloc(void)
+{
+  struct snapshot     ss;
+  struct arena_chunk *first;
+  char               *p, *q;
+
+  (void) memset(&ss, 0, sizeof (ss));
+
+  /* Memory comes zeroed and aligned, from a first chunk of ARENA_MIN */
+  p = arena_alloc(&ss, 3);
+  ok(p != NULL && ((uintptr_t)p % ARENA_ALIGN) == 0, "alloc: aligned");
+  is(nr_chunks(ss.s_arena), 1, "alloc: one chunk");
+  first = ss.s_arena->sa_chunks;
+  is(first->ac_size, ARENA_MIN, "alloc: the first chunk is ARENA_MIN");
+  is(first->ac_used, ARENA_ALIGN, "alloc: sizes are rounded up");
+  (void) memset(p, 0xff, 3);
+  q = arena_alloc(&ss, 100);
+  ok(q == p + ARENA_ALIGN, "alloc: carved from the same chunk");
+  ok(all_zero(q, 100), "alloc: zeroed");
+
+  /* A chunk too small for the next allocation is followed by a larger one */
+  p = arena_alloc(&ss, ARENA_MIN * 3);
+  is(nr_chunks(ss.s_arena), 2, "alloc: a second chunk when full");
+  is(ss.s_arena->sa_chunks->ac_size, ARENA_MIN * 4,
+      "alloc: chunks double until big enough");
+  ok(all_zero(p, ARENA_MIN * 3), "alloc: a large allocation is zeroed");
+  (void) memset(p, 0xff, ARENA_MIN * 3);
+
+  /* Resetting coalesces the chunks into one with room to spare */
+  arena_reset(ss.s_arena);
+  is(nr_chunks(ss.s_arena), 1, "reset: coalesced into one chunk");
+  is(ss.s_arena->sa_chunks->ac_used, 0, "reset: the chunk is empty");
+  ok(ss.s_arena->sa_chunks->ac_size >= ARENA_MIN * 3 + 128,
+      "reset: the chunk holds all that was used");
+  first = ss.s_arena->sa_chunks;
+  p = arena_alloc(&ss, ARENA_MIN * 3);
+  ok(ss.s_arena->sa_chunks == first && nr_chunks(ss.s_arena) == 1,
+      "reset: the same allocations fit in the one chunk");
+  ok(all_zero(p, ARENA_MIN * 3), "reset: memory is zeroed again");
+
+  /* Resetting a single chunk keeps it */
+  arena_reset(ss.s_arena);
+  ok(ss.s_arena->sa_chunks == first && first->ac_used == 0,
+      "reset: a single chunk is kept and emptied");
+  arena_free(ss.s_arena);
+}
+
+static void
+test_recycle(void)
+{
+  kstat_ctl_t        *kc;
+  struct snapshot    *ss, *fresh;
+  struct arena_chunk *chunk;
+  processorid_t       id;
+
+  fake_reset();
+  fake_system_add();
+  fake_pset_add(1);
+  /* Enough statistics that a snapshot takes several chunks */
+  fake_cpu_set_nr_stats(100);
+  for (id = 0; id < 64; id++)
+    fake_cpu_add(id, id % 2 == 0 ? PS_NONE : 1);
+  (void) fake_intr_add("ata", 0, "ata0");
+
+  kc = open_kstat();
+  ss = recycle_snapshot(kc, NULL, ALL_TYPES);
+  ok(ss != NULL && ss->s_nr_cpus == 64, "recycle: NULL acquires a snapshot");
+  ok(nr_chunks(ss->s_arena) > 1, "recycle: the first fill takes %zu chunks",
+      nr_chunks(ss->s_arena));
+
+  /* Refilled in the same shape, the snapshot has one chunk and keeps it */
+  ok(recycle_snapshot(kc, ss, ALL_TYPES) == ss, "recycle: the same snapshot");
+  is(nr_chunks(ss->s_arena), 1, "recycle: the chunks are coalesced");
+  chunk = ss->s_arena->sa_chunks;
+  fake_kstat_set(fake_kstat_find("cpu", 5, "sys"), "cpu_ticks_user", 42);
+  (void) recycle_snapshot(kc, ss, ALL_TYPES);
+  ok(ss->s_arena->sa_chunks == chunk && chunk->ac_next == NULL,
+      "recycle: no more chunks when refilled in the same shape");
+  is(cpu_stat(ss, 5, "cpu_ticks_user"), 42, "recycle: with the new data");
+
+  /* A refilled snapshot is the same as a new one */
+  fresh = acquire_snapshot(kc, ALL_TYPES);
+  ok(!snapshot_has_changed(fresh, ss) && ss->s_nr_cpus == fresh->s_nr_cpus &&
+      ss->s_nr_psets == fresh->s_nr_psets &&
+      ss->s_nr_intrs == fresh->s_nr_intrs &&
+      ss->s_nr_active_cpus == fresh->s_nr_active_cpus,
+      "recycle: as acquire_snapshot() would fill it");
+  is(cpu_stat(ss, 5, "cpu_stat99"), cpu_stat(fresh, 5, "cpu_stat99"),
+      "recycle: the last statistic is there");
+  is(ss->s_psets[1].ps_nr_cpus, 32, "recycle: psets are rebuilt");
+  free_snapshot(fresh);
+
+  /* A larger system grows the arena, and then settles again */
+  for (id = 64; id < 128; id++)
+    fake_cpu_add(id, 1);
+  (void) recycle_snapshot(kc, ss, ALL_TYPES);
+  is(ss->s_nr_cpus, 128, "recycle: grown to 128 CPUs");
+  is(ss->s_psets[1].ps_nr_cpus, 96, "recycle: with 96 in pset 1");
+  (void) recycle_snapshot(kc, ss, ALL_TYPES);
+  chunk = ss->s_arena->sa_chunks;
+  (void) recycle_snapshot(kc, ss, ALL_TYPES);
+  ok(ss->s_arena->sa_chunks == chunk && chunk->ac_next == NULL,
+      "recycle: settled into one chunk again");
+
+  /* Another set of types is refilled in the same memory */
+  (void) recycle_snapshot(kc, ss, SNAP_INTERRUPTS);
+  ok(ss->s_types == SNAP_INTERRUPTS && ss->s_nr_cpus == 0 &&
+      ss->s_nr_intrs == 2, "recycle: with only interrupts");
+  ok(ss->s_arena->sa_chunks == chunk, "recycle: in the same chunk");
+
+  free_snapshot(ss);
+  close_kstat(kc);
+  fake_reset();
+}
+
+/*
+ * With CPU workers, each carves from its part of the arena of the snapshot.
+ * Once refilled in the same shape, neither the snapshot's chunk nor those of
+ * the parts are grown or reallocated.
+ */
+static void
+test_recycle_workers(void)
+{
+  kstat_ctl_t        *kc;
+  struct snapshot    *ss;
+  struct arena_chunk *chunks[NR_WORKERS + 1];
+  processorid_t       id;
+  size_t              i, same;
+
+  fake_reset();
+  fake_system_add();
+  fake_pset_add(1);
+  /* Enough statistics that each worker's share takes several chunks */
+  fake_cpu_set_nr_stats(100);
+  for (id = 0; id < 64; id++)
+    fake_cpu_add(id, id % 2 == 0 ? PS_NONE : 1);
+
+  kc = open_kstat();
+  ok(snapshot_set_workers(kc, NR_WORKERS) == 0, "workers: %d workers",
+      NR_WORKERS);
+  ss = recycle_snapshot(kc, NULL, ALL_TYPES);
+  ok(ss->s_arena->sa_nr_parts == NR_WORKERS, "workers: a part per worker");
+  ok(nr_chunks(&ss->s_arena->sa_parts[0]) > 1,
+      "workers: the first fill takes %zu chunks in a part",
+      nr_chunks(&ss->s_arena->sa_parts[0]));
+
+  (void) recycle_snapshot(kc, ss, ALL_TYPES);
+  chunks[0] = ss->s_arena->sa_chunks;
+  for (i = 0; i < NR_WORKERS; i++)
+    chunks[i + 1] = ss->s_arena->sa_parts[i].sa_chunks;
+
+  for (id = 0; id < 10; id++) {
+    fake_kstat_set(fake_kstat_find("cpu", id, "sys"), "cpu_ticks_user", id);
+    (void) recycle_snapshot(kc, ss, ALL_TYPES);
+  }
+  same = ss->s_arena->sa_chunks == chunks[0] &&
+      nr_chunks(ss->s_arena) == 1;
+  for (i = 0; i < NR_WORKERS; i++) {
+    same += ss->s_arena->sa_parts[i].sa_chunks == chunks[i + 1] &&
+        nr_chunks(&ss->s_arena->sa_parts[i]) == 1;
+  }
+  is(same, NR_WORKERS + 1, "workers: no chunk grown or reallocated over "
+      "10 refills");
+  ok(ss->s_arena->sa_nr_parts == NR_WORKERS, "workers: still a part per "
+      "worker");
+  is(cpu_stat(ss, 9, "cpu_ticks_user"), 9, "workers: with the new data");
+
+  free_snapshot(ss);
+  close_kstat(kc);
+  fake_reset();
+}
+
+int
+main(void)
+{
+  test_alloc();
+  test_recycle();
+  test_recycle_workers();
+  return (done_testing());
+}
@@ -0,0 +1,124 @@
+/*
+ * Acquiring interrupts in a single pass over the sources the index cached,
+ * and unix:0:system_misc being read once per snapshot, for both the clock
+ * interrupt and the system.
+ */
+#include "kstat_common.h"
+#include "fake_kstat.h"
+#include "tap.h"
+
+#include <errno.h>
+
+#define ALL_TYPES (SNAP_CPUS | SNAP_PSETS | SNAP_INTERRUPTS | SNAP_SYSTEM)
+
+static unsigned long last_sys_misc;
+
+static unsigned long
+sys_misc_reads(void)
+{
+  unsigned long reads = fake_kstat_reads("unix", 0, "system_misc");
+  unsigned long delta = reads - last_sys_misc;
+
+  last_sys_misc = reads;
+  return (delta);
+}
+
+static kstat_t *
+intr_add(const char *module, const char *name, uint_t base)
+{
+  kstat_t      *ksp = fake_intr_add(module, 0, name);
+  kstat_intr_t *ki = KSTAT_INTR_PTR(ksp);
+  int           j;
+
+  for (j = 0; j < KSTAT_NUM_INTRS; j++)
+    ki->intrs[j] = base + j;
+  return (ksp);
+}
+
+/* The interrupt sources as "name=total;" */
+static char *
+intrs(const struct snapshot *ss)
+{
+  static char buf[1024];
+  size_t      i, len = 0;
+
+  buf[0] = '\0';
+  for (i = 0; i < ss->s_nr_intrs; i++)
+    len += snprintf(buf + len, sizeof (buf) - len, "%s=%lu;",
+        ss->s_intrs[i].is_name, (unsigned long)ss->s_intrs[i].is_total);
+  return (buf);
+}
+
+int
+main(void)
+{
+  kstat_ctl_t     *kc;
+  struct snapshot *ss = NULL;
+  kstat_t         *ehci;
+
+  fake_system_add();
+  fake_cpu_add(0, PS_NONE);
+  fake_kstat_set(fake_kstat_find("unix", 0, "system_misc"), "clk_intr", 500);
+  (void) intr_add("nge", "nge0", 10);
+  ehci = intr_add("ehci", "ehci0", 100);
+  (void) intr_add("ata", "ata0", 1000);
+  (void) intr_add("zz", "zz0", 7);
+  kc = open_kstat();
+
+  /* Sorted by name, with the clock where it sorts, each summed */
+  ss = acquire_snapshot(kc, SNAP_INTERRUPTS);
+  is_str(intrs(ss), "ata0=5010;clock=500;ehci0=510;nge0=60;zz0=45;",
+      "Sources sorted by name, with the clock");
+  ok(fake_kstat_reads("nge", 0, "nge0") == 1 &&
+      fake_kstat_reads("ehci", 0, "ehci0") == 1 &&
+      fake_kstat_reads("ata", 0, "ata0") == 1 &&
+      fake_kstat_reads("zz", 0, "zz0") == 1, "Each source read once");
+
+  /* system_misc is read once, whichever of its users are asked for */
+  (void) sys_misc_reads();
+  (void) recycle_snapshot(kc, ss, ALL_TYPES);
+  is(sys_misc_reads(), 1, "All types: system_misc read once");
+  is(ss->s_sys.ss_ticks, 500, "All types: the ticks are from it");
+  (void) recycle_snapshot(kc, ss, SNAP_INTERRUPTS);
+  is(sys_misc_reads(), 1, "Interrupts: system_misc read once");
+  (void) recycle_snapshot(kc, ss, SNAP_SYSTEM);
+  is(sys_misc_reads(), 1, "System: system_misc read once");
+  (void) recycle_snapshot(kc, ss, SNAP_CPUS);
+  is(sys_misc_reads(), 0, "CPUs: system_misc not read");
+
+  /* After a failed step, the chain is updated and it is read afresh */
+  fake_fail(FAKE_READ, "unix", 1, 1, EAGAIN);
+  (void) recycle_snapshot(kc, ss, ALL_TYPES);
+  is(sys_misc_reads(), 2, "Retried: system_misc read again");
+
+  /* The counts change between snapshots, the sources don't */
+  KSTAT_INTR_PTR(ehci)->intrs[0] += 1000;
+  fake_kstat_set(fake_kstat_find("unix", 0, "system_misc"), "clk_intr", 600);
+  (void) recycle_snapshot(kc, ss, SNAP_INTERRUPTS);
+  is_str(intrs(ss), "ata0=5010;clock=600;ehci0=1510;nge0=60;zz0=45;",
+      "New counts");
+
+  /* A new source is found once the chain changes */
+  (void) intr_add("ahci", "ahci0", 0);
+  fake_kstat_remove(ehci);
+  (void) recycle_snapshot(kc, ss, SNAP_INTERRUPTS);
+  is_str(intrs(ss), "ahci0=10;ata0=5010;clock=600;nge0=60;zz0=45;",
+      "Sources added and removed");
+
+  /* With every source sorting before the clock, it goes last */
+  fake_kstat_remove(fake_kstat_find("nge", 0, "nge0"));
+  fake_kstat_remove(fake_kstat_find("zz", 0, "zz0"));
+  (void) recycle_snapshot(kc, ss, SNAP_INTERRUPTS);
+  is_str(intrs(ss), "ahci0=10;ata0=5010;clock=600;", "The clock last");
+
+  /* And with none, it is all there is */
+  fake_kstat_remove(fake_kstat_find("ahci", 0, "ahci0"));
+  fake_kstat_remove(fake_kstat_find("ata", 0, "ata0"));
+  (void) recycle_snapshot(kc, ss, SNAP_INTERRUPTS);
+  is_str(intrs(ss), "clock=600;", "Only the clock");
+
+  free_snapshot(ss);
+  close_kstat(kc);
+  fake_reset();
+  return (done_testing());
+}
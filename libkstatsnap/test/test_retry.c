@@ -0,0 +1,163 @@
+/*
+ * try_acquire_snapshot() retrying transient failures: the budget of
+ * retries, the backoff doubling up to sr_max_delay, which errors are
+ * retried, and that only the step that failed is acquired again.
+ *
+ * This includes acquire.c for retry_wait(), so isn't linked with it.
+ */
+#include "../acquire.c"
+#include "fake_kstat.h"
+#include "tap.h"
+
+#define ALL_TYPES (SNAP_CPUS | SNAP_PSETS | SNAP_INTERRUPTS | SNAP_SYSTEM)
+
+/* Reads of each kstat of interest since the last call */
+struct reads {
+  unsigned long r_intr, r_cpu_vm, r_cpu_sys, r_sysinfo, r_sys_misc;
+};
+
+static void
+reads_since(struct reads *last, struct reads *delta)
+{
+  struct reads now;
+
+  now.r_intr     = fake_kstat_reads("ata", 0, "ata0");
+  now.r_cpu_vm   = fake_kstat_reads("cpu", 0, "vm");
+  now.r_cpu_sys  = fake_kstat_reads("cpu", 0, "sys");
+  now.r_sysinfo  = fake_kstat_reads("unix", 0, "sysinfo");
+  now.r_sys_misc = fake_kstat_reads("unix", 0, "system_misc");
+  delta->r_intr     = now.r_intr - last->r_intr;
+  delta->r_cpu_vm   = now.r_cpu_vm - last->r_cpu_vm;
+  delta->r_cpu_sys  = now.r_cpu_sys - last->r_cpu_sys;
+  delta->r_sysinfo  = now.r_sysinfo - last->r_sysinfo;
+  delta->r_sys_misc = now.r_sys_misc - last->r_sys_misc;
+  *last = now;
+}
+
+static void
+test_backoff(void)
+{
+  struct snapshot_retry retry = { 6, 1000, 4000 };
+  hrtime_t              delay = retry.sr_delay;
+  hrtime_t              expected[] = { 2000, 4000, 4000, 4000, 4000, 4000 };
+  int                   i, doubling = 1;
+
+  /* EAGAIN sleeps and doubles the delay, up to sr_max_delay */
+  for (i = 0; i < 6; i++) {
+    if (!retry_wait(&retry, EAGAIN, i, 1, &delay) || delay != expected[i])
+      doubling = 0;
+  }
+  ok(doubling, "Backoff: doubles up to sr_max_delay");
+  ok(!retry_wait(&retry, EAGAIN, 6, 1, &delay), "Backoff: no retry past the "
+      "budget");
+
+  /* A kstat going away is retried at once the first time */
+  delay = retry.sr_delay;
+  ok(retry_wait(&retry, ENXIO, 0, 0, &delay) && delay == 1000,
+      "Backoff: ENXIO is retried at once the first time");
+  ok(retry_wait(&retry, ENOENT, 1, 1, &delay) && delay == 2000,
+      "Backoff: then with backoff");
+  ok(!retry_wait(&retry, EIO, 0, 0, &delay) &&
+      !retry_wait(&retry, ENOMEM, 0, 0, &delay) && delay == 2000,
+      "Backoff: other errors aren't retried");
+
+  retry.sr_max_retries = -1;
+  ok(retry_wait(&retry, EAGAIN, INT_MAX - 1, 1, &delay),
+      "Backoff: no limit with -1");
+}
+
+int
+main(void)
+{
+  struct snapshot_retry three = { 3, 1000, 8000 };
+  struct snapshot_retry none = { 0, 1000, 1000 };
+  kstat_ctl_t          *kc;
+  struct snapshot      *ss = NULL;
+  struct reads          last, d;
+  hrtime_t              start;
+
+  test_backoff();
+
+  fake_system_add();
+  fake_pset_add(1);
+  fake_cpu_add(0, PS_NONE);
+  fake_cpu_add(1, 1);
+  (void) fake_intr_add("ata", 0, "ata0");
+  kc = open_kstat();
+  (void) memset(&last, 0, sizeof (last));
+
+  ok(try_acquire_snapshot(kc, ALL_TYPES, &three, &ss) == 0, "Acquired");
+  reads_since(&last, &d);
+  ok(d.r_intr == 1 && d.r_cpu_vm == 1 && d.r_cpu_sys == 1 &&
+      d.r_sysinfo == 1, "Each kstat is read once");
+
+  /* Three failures fit in a budget of three retries, a fourth doesn't */
+  fake_fail(FAKE_READ, "cpu", 0, 3, EAGAIN);
+  ok(try_acquire_snapshot(kc, ALL_TYPES, &three, &ss) == 0,
+      "Budget: three failures are retried");
+  reads_since(&last, &d);
+  fake_fail(FAKE_READ, "cpu", 0, 4, EAGAIN);
+  start = gethrtime();
+  is(try_acquire_snapshot(kc, ALL_TYPES, &three, &ss), EAGAIN,
+      "Budget: the fourth failure is returned");
+  ok(gethrtime() - start >= 1000 + 2000 + 4000, "Budget: after backing off");
+  reads_since(&last, &d);
+  fake_fail(FAKE_READ, "cpu", 0, 0, 0);
+
+  /* The budget is for the whole snapshot, not per step */
+  fake_fail(FAKE_READ, "cpu", 0, 2, EAGAIN);
+  ok(try_acquire_snapshot(kc, ALL_TYPES, &three, &ss) == 0,
+      "Budget: two in the CPUs");
+  fake_fail(FAKE_READ, "cpu", 0, 2, EAGAIN);
+  fake_fail(FAKE_CHAIN_UPDATE, NULL, 1, 2, EAGAIN);
+  is(try_acquire_snapshot(kc, ALL_TYPES, &three, &ss), EAGAIN,
+      "Budget: and two updating the chain are too many");
+  fake_fail(FAKE_READ, "cpu", 0, 0, 0);
+  fake_fail(FAKE_CHAIN_UPDATE, NULL, 0, 0, 0);
+  reads_since(&last, &d);
+
+  /* Non-transient errors are returned at once */
+  fake_fail(FAKE_READ, "cpu", 0, 1, EIO);
+  is(try_acquire_snapshot(kc, ALL_TYPES, &three, &ss), EIO,
+      "EIO is returned at once");
+  fake_fail(FAKE_CHAIN_UPDATE, NULL, 0, 1, EIO);
+  is(try_acquire_snapshot(kc, ALL_TYPES, &three, &ss), EIO,
+      "EIO updating the chain too");
+  reads_since(&last, &d);
+
+  /* A failure in the CPUs, reading cpu:0:sys, only acquires them again */
+  fake_fail(FAKE_READ, "cpu", 1, 1, EAGAIN);
+  ok(try_acquire_snapshot(kc, ALL_TYPES, &three, &ss) == 0,
+      "CPUs failing: acquired");
+  reads_since(&last, &d);
+  is(d.r_intr, 1, "CPUs failing: interrupts read once");
+  is(d.r_cpu_vm, 2, "CPUs failing: CPU 0 read again");
+  is(d.r_sysinfo, 1, "CPUs failing: system read once");
+
+  /* A failure in the system step only acquires that again */
+  fake_fail(FAKE_READ, "unix", 1, 1, EAGAIN);
+  ok(try_acquire_snapshot(kc, ALL_TYPES, &three, &ss) == 0,
+      "System failing: acquired");
+  reads_since(&last, &d);
+  is(d.r_intr, 1, "System failing: interrupts read once");
+  is(d.r_cpu_sys, 1, "System failing: CPUs read once");
+  is(d.r_sysinfo, 1, "System failing: sysinfo read once it works");
+
+  /* A kstat going away is retried at once, with the chain updated */
+  fake_fail(FAKE_READ, "ata", 0, 1, ENXIO);
+  is(try_acquire_snapshot(kc, ALL_TYPES, &none, &ss), ENXIO,
+      "ENXIO without a budget: returned");
+  fake_fail(FAKE_READ, "ata", 0, 1, ENXIO);
+  start = gethrtime();
+  ok(try_acquire_snapshot(kc, ALL_TYPES, &(struct snapshot_retry){ 1,
+      1000000000, 1000000000 }, &ss) == 0 &&
+      gethrtime() - start < 1000000000, "ENXIO: retried without a delay");
+  ok(try_acquire_snapshot(kc, ALL_TYPES, &three, &ss) == 0 &&
+      ss->s_nr_intrs == 2 && ss->s_nr_cpus == 2 && ss->s_nr_psets == 2,
+      "Refilled in full after a failure");
+
+  free_snapshot(ss);
+  close_kstat(kc);
+  fake_reset();
+  return (done_testing());
+}
@@ -0,0 +1,106 @@
+/*
+ * A snapshot_ring, as acquire_into() fills it round and round and
+ * snapshot_ring_get() finds snapshots in it by age.
+ */
+#include "kstat_common.h"
+#include "fake_kstat.h"
+#include "tap.h"
+
+#include <stdlib.h>
+
+#define RING_SIZE 3
+
+static kstat_t *cpu0_sys;
+
+/* Acquire generation gen, which CPU 0 counts in cpu_ticks_user */
+static struct snapshot *
+acquire_gen(struct snapshot_ring *ring, uint64_t gen)
+{
+  fake_kstat_set(cpu0_sys, "cpu_ticks_user", gen);
+  return (acquire_into(ring));
+}
+
+/* The generation of the snapshot of the given age, or 0 if there is none */
+static uint64_t
+gen_of(struct snapshot_ring *ring, size_t age)
+{
+  struct snapshot *ss = snapshot_ring_get(ring, age);
+  kstat_named_t   *knp;
+
+  if (ss == NULL)
+    return (0);
+  knp = kstat_data_lookup(&ss->s_cpus[0].cs_sys, "cpu_ticks_user");
+  return (knp != NULL ? knp->value.ui64 : UINT64_MAX);
+}
+
+int
+main(void)
+{
+  kstat_ctl_t          *kc;
+  struct snapshot_ring *ring;
+  struct snapshot      *slots[RING_SIZE], *ss;
+  uint64_t              gen;
+  size_t                age;
+  int                   in_order;
+
+  fake_system_add();
+  fake_cpu_add(0, PS_NONE);
+  fake_cpu_add(1, PS_NONE);
+  cpu0_sys = fake_kstat_find("cpu", 0, "sys");
+  kc = open_kstat();
+
+  ring = snapshot_ring_create(kc, RING_SIZE, SNAP_CPUS);
+  ok(snapshot_ring_get(ring, 0) == NULL, "Empty: no snapshot of age 0");
+
+  /* Filling the ring, each snapshot is in a slot of its own */
+  for (gen = 1; gen <= RING_SIZE; gen++) {
+    slots[gen - 1] = acquire_gen(ring, gen);
+    ok(slots[gen - 1] == snapshot_ring_get(ring, 0),
+        "Filling: generation %llu is the newest", (unsigned long long)gen);
+    is(gen_of(ring, gen - 1), 1, "Filling: the oldest is of age %llu",
+        (unsigned long long)gen - 1);
+    ok(snapshot_ring_get(ring, gen) == NULL, "Filling: none older");
+  }
+  ok(slots[0] != slots[1] && slots[1] != slots[2] && slots[0] != slots[2],
+      "Filling: three slots");
+  is(slots[2]->s_nr_cpus, 2, "Filling: of the types asked for");
+
+  /* Round and round, the oldest slot is refilled and ages follow */
+  in_order = 1;
+  for (; gen <= RING_SIZE * 4 + 1; gen++) {
+    ss = acquire_gen(ring, gen);
+    if (ss != slots[(gen - 1) % RING_SIZE])
+      in_order = 0;
+    for (age = 0; age < RING_SIZE; age++) {
+      if (gen_of(ring, age) != gen - age)
+        in_order = 0;
+    }
+    if (snapshot_ring_get(ring, RING_SIZE) != NULL)
+      in_order = 0;
+  }
+  ok(in_order, "Wrapping: every slot is reused in turn, with the right ages");
+  is(gen_of(ring, 0), RING_SIZE * 4 + 1, "Wrapping: the newest");
+  is(gen_of(ring, RING_SIZE - 1), RING_SIZE * 4 - 1, "Wrapping: the oldest");
+  ok(snapshot_ring_get(ring, (size_t)-1) == NULL, "Wrapping: no huge age");
+
+  /* A refilled slot sees a CPU that came since it was last filled */
+  fake_cpu_add(2, PS_NONE);
+  ss = acquire_gen(ring, gen);
+  is(ss->s_nr_cpus, 3, "Refilled: with the new CPU");
+  is(snapshot_ring_get(ring, 1)->s_nr_cpus, 2, "Refilled: the older without");
+  ok(snapshot_has_changed(snapshot_ring_get(ring, 1), ss),
+      "Refilled: which is a change");
+  snapshot_ring_free(ring);
+
+  /* A ring of none holds one */
+  ring = snapshot_ring_create(kc, 0, SNAP_CPUS);
+  ss = acquire_gen(ring, 1);
+  ok(acquire_gen(ring, 2) == ss, "Size 0: one slot");
+  is(gen_of(ring, 0), 2, "Size 0: the newest");
+  ok(snapshot_ring_get(ring, 1) == NULL, "Size 0: none older");
+  snapshot_ring_free(ring);
+
+  close_kstat(kc);
+  fake_reset();
+  return (done_testing());
+}
@@ -0,0 +1,126 @@
+/*
+ * kstat_schema against synthetic named kstats: resolving names to
+ * positions, resolving again when the shape changes, missing statistics,
+ * and deltas between kstats with different numbers of statistics.
+ */
+#include "kstat_common.h"
+#include "tap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* A named kstat of the nr statistics, whose values are value_base + i */
+static kstat_t *
+named(const char *module, const char *name, char **stats, uint_t nr,
+    uint64_t value_base)
+{
+  kstat_t       *ksp = safe_alloc(sizeof (kstat_t));
+  kstat_named_t *knp;
+  uint_t         i;
+
+  (void) memset(ksp, 0, sizeof (kstat_t));
+  (void) strlcpy(ksp->ks_module, module, KSTAT_STRLEN);
+  (void) strlcpy(ksp->ks_name, name, KSTAT_STRLEN);
+  ksp->ks_type = KSTAT_TYPE_NAMED;
+  ksp->ks_ndata = nr;
+  ksp->ks_data_size = nr * sizeof (kstat_named_t);
+  ksp->ks_data = knp = safe_alloc(ksp->ks_data_size);
+  (void) memset(knp, 0, ksp->ks_data_size);
+  for (i = 0; i < nr; i++) {
+    (void) strlcpy(knp[i].name, stats[i], KSTAT_STRLEN);
+    knp[i].data_type = KSTAT_DATA_UINT64;
+    knp[i].value.ui64 = value_base + i;
+  }
+  return (ksp);
+}
+
+static void
+free_named(kstat_t *ksp)
+{
+  free(ksp->ks_data);
+  free(ksp);
+}
+
+int
+main(void)
+{
+  char                *wanted[] = { "c", "missing", "a" };
+  char                *abc[] = { "a", "b", "c" };
+  char                *xcab[] = { "x", "c", "a", "b" };
+  char                *ticks[] = { "cpu_ticks_idle", "cpu_ticks_user",
+                                   "cpu_ticks_kernel", "cpu_ticks_wait" };
+  struct kstat_schema *sc;
+  kstat_t             *old, *new, *other, *wider;
+
+  sc = kstat_schema_create(wanted, 3);
+  old = named("mod", "abc", abc, 3, 100);
+  new = named("mod", "abc", abc, 3, 150);
+
+  /* Resolved once, against the first kstat */
+  ok(kstat_schema_resolve(sc, new) == 1, "Resolved against a new shape");
+  is(sc->ksc_index[0], 2, "c is at position 2");
+  is(sc->ksc_index[1], (uint64_t)-1, "A missing name is at position -1");
+  is(sc->ksc_index[2], 0, "a is at position 0");
+  ok(kstat_schema_resolve(sc, new) == 0, "Not resolved again for a kstat "
+      "of the same shape");
+  ok(kstat_schema_resolve(sc, old) == 0, "nor for another of the same shape");
+
+  /* Deltas by position */
+  is(kstat_schema_delta(sc, old, new, 0), 50, "Delta of c");
+  is(kstat_schema_delta(sc, old, new, 1), 0, "Delta of a missing name is 0");
+  is(kstat_schema_delta(sc, old, new, 2), 50, "Delta of a");
+  is(kstat_schema_delta(sc, NULL, new, 0), 152, "Without old, the value");
+  is(kstat_schema_delta_sum(sc, old, new), 100, "Sum of the deltas");
+
+  /* Another name, or another number of statistics, is another shape */
+  other = named("mod", "other", abc, 3, 200);
+  ok(kstat_schema_resolve(sc, other) == 1, "Resolved again for another name");
+  wider = named("mod", "other", xcab, 4, 300);
+  ok(kstat_schema_resolve(sc, wider) == 1, "and for another ks_ndata");
+  is(sc->ksc_index[0], 1, "c has moved to position 1");
+  is(sc->ksc_index[2], 2, "a has moved to position 2");
+  is(sc->ksc_ndata, 4, "The schema has the new ks_ndata");
+
+  /* kstat_schema_delta() resolves the schema itself */
+  is(kstat_schema_delta(sc, NULL, new, 0), 152, "Delta resolves again");
+  is(sc->ksc_ndata, 3, "to the shape of new");
+
+  /*
+   * With old and new of different ks_ndata, positions in new are no use in
+   * old, so statistics are found in old by name
+   */
+  is(kstat_schema_delta(sc, old, wider, 0), 301 - 102,
+      "Wider new: delta of c");
+  is(kstat_schema_delta(sc, old, wider, 2), 302 - 100,
+      "Wider new: delta of a");
+  is(kstat_schema_delta(sc, wider, new, 0), 152 - 301,
+      "Narrower new: delta of c");
+  is(kstat_schema_delta(sc, wider, new, 2), 150 - 302,
+      "Narrower new: delta of a");
+  is(kstat_schema_delta_sum(sc, wider, new), (152 - 301) + (150 - 302),
+      "Narrower new: sum of the deltas");
+  free_named(wider);
+  wider = named("mod", "abc", xcab, 1, 400);
+  is(kstat_schema_delta(sc, wider, new, 2), 150, "A statistic old lacks "
+      "gives the value in new");
+
+  /* As kstat_delta(), by name */
+  is(kstat_schema_delta(sc, old, new, 0), kstat_delta(old, new, "c"),
+      "As kstat_delta()");
+  free_named(old);
+  free_named(new);
+
+  /* cpu_ticks_delta() sums the four tick states through its own schema */
+  old = named("cpu", "sys", ticks, 4, 1000);
+  new = named("cpu", "sys", ticks, 4, 1010);
+  is(cpu_ticks_delta(old, new), 40, "cpu_ticks_delta()");
+  is(cpu_ticks_delta(NULL, new), 1010 + 1011 + 1012 + 1013,
+      "cpu_ticks_delta() without old");
+
+  free_named(old);
+  free_named(new);
+  free_named(other);
+  free_named(wider);
+  kstat_schema_free(sc);
+  return (done_testing());
+}
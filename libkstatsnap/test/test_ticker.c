@@ -0,0 +1,116 @@
+/*
+ * ticker_start() and ticker_wait(), and sleep_until(), on the invariants of
+ * their cadence, which hold however late the ticks are on a busy machine.
+ */
+#include "kstat_common.h"
+#include "tap.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define MS 1000000LL
+
+static void
+alarm_handler(int sig)
+{
+}
+
+int
+main(void)
+{
+  struct ticker     tk;
+  struct sigaction  sa;
+  struct itimerval  it;
+  hrtime_t          before, after, deadline, wakeup;
+  int64_t           missed;
+  int               i, cont;
+
+  /* The first deadline is an interval from the start */
+  before = gethrtime();
+  ticker_start(&tk, 2 * MS);
+  after = gethrtime();
+  is(tk.tk_interval, 2 * MS, "start: the interval is kept");
+  ok(tk.tk_deadline >= before + 2 * MS && tk.tk_deadline <= after + 2 * MS,
+      "start: the first deadline is an interval away");
+  ok(tk.tk_ticks == 0 && tk.tk_missed == 0, "start: no ticks yet");
+
+  /* Each tick is no earlier than its deadline, which moves on by interval */
+  for (i = 0; i < 5; i++) {
+    deadline = tk.tk_deadline;
+    missed = ticker_wait(&tk);
+    after = gethrtime();
+    if (missed < 0 || after < deadline - 1000 ||
+        tk.tk_deadline != deadline + (missed + 1) * tk.tk_interval)
+      break;
+  }
+  is(i, 5, "wait: no tick is early, and the deadlines stay on the cadence");
+  is(tk.tk_ticks, 5, "wait: every wait is a tick");
+
+  /*
+   * Behind by five and a half intervals, those deadlines that had passed
+   * when it looked at the clock are skipped, at once, and the next is the
+   * first still to come
+   */
+  ticker_start(&tk, 100 * MS);
+  tk.tk_deadline -= 650 * MS;
+  deadline = tk.tk_deadline;
+  before = gethrtime();
+  missed = ticker_wait(&tk);
+  after = gethrtime();
+  ok(missed >= (before - deadline) / tk.tk_interval &&
+      missed <= (after - deadline) / tk.tk_interval,
+      "behind: the deadlines that passed are skipped (%lld)",
+      (long long)missed);
+  is(tk.tk_deadline, deadline + (missed + 1) * tk.tk_interval,
+      "behind: the next deadline is on the cadence");
+  ok(tk.tk_deadline > before, "behind: and still to come");
+  ok(tk.tk_ticks == 1 && tk.tk_missed == (uint64_t)missed,
+      "behind: one tick, and the skipped deadlines are totalled");
+
+  /* A signal handler ends the sleep, and the deadline is kept for a retry */
+  (void) memset(&sa, 0, sizeof (sa));
+  sa.sa_handler = alarm_handler;
+  (void) sigaction(SIGALRM, &sa, NULL);
+  (void) memset(&it, 0, sizeof (it));
+  it.it_value.tv_usec = 20000;
+  ticker_start(&tk, 200 * MS);
+  deadline = tk.tk_deadline;
+  (void) setitimer(ITIMER_REAL, &it, NULL);
+  missed = ticker_wait(&tk);
+  ok(missed == -1 && errno == EINTR, "signal: the wait fails with EINTR");
+  ok(tk.tk_deadline == deadline && tk.tk_ticks == 0,
+      "signal: the deadline is kept, with no tick");
+  missed = ticker_wait(&tk);
+  ok(missed >= 0 && gethrtime() >= deadline - 1000,
+      "signal: waiting again sleeps until the same deadline");
+
+  /* sleep_until() keeps its cadence when on time */
+  wakeup = gethrtime();
+  deadline = wakeup + 2 * MS;
+  cont = 0;
+  sleep_until(&wakeup, 2 * MS, 0, &cont);
+  is(wakeup, deadline, "sleep_until: the wakeup moves on by an interval");
+  ok(gethrtime() >= deadline - 1000, "sleep_until: and is slept until");
+
+  /* and when late counting intervals, which it makes up half at a time */
+  wakeup = gethrtime() - 10 * MS;
+  deadline = wakeup + 2 * MS;
+  sleep_until(&wakeup, 2 * MS, 0, &cont);
+  is(wakeup, deadline, "sleep_until: late, the cadence is kept");
+
+  /* but resets it when late forever, or after a SIGCONT */
+  for (i = 0; i < 2; i++) {
+    wakeup = gethrtime() - 10 * MS;
+    cont = i;
+    before = gethrtime();
+    sleep_until(&wakeup, 2 * MS, !i, &cont);
+    after = gethrtime();
+    ok(wakeup >= before + 2 * MS && wakeup <= after,
+        "sleep_until: late %s, the cadence is reset",
+        i == 0 ? "forever" : "after SIGCONT");
+  }
+
+  return (done_testing());
+}
@@ -0,0 +1,170 @@
+/*
+ * The CPU topology cache, with a fake provider plugged in through
+ * snapshot_set_topology(): when cpu_topo_get() asks the provider again, the
+ * ESTALE path that drops a stale topology and retries, and CPUs moving to
+ * another pset.
+ *
+ * This includes acquire.c for cpu_topo_get(), so isn't linked with it.
+ */
+#include "../acquire.c"
+#include "fake_kstat.h"
+#include "tap.h"
+
+#define NR_CPUS 4
+#define TYPES   (SNAP_CPUS | SNAP_PSETS)
+
+/* The topology the fake provider gives, and how often it was asked */
+static int           topo_state[NR_CPUS];
+static psetid_t      topo_pset[NR_CPUS];
+static unsigned long cpuid_max_calls, state_calls, pset_calls;
+
+static long
+fake_cpuid_max(void *arg)
+{
+  cpuid_max_calls++;
+  return (NR_CPUS - 1);
+}
+
+static int
+fake_cpu_state(processorid_t id, void *arg)
+{
+  state_calls++;
+  return (topo_state[id]);
+}
+
+static int
+fake_cpu_pset(processorid_t id, psetid_t *pset, void *arg)
+{
+  pset_calls++;
+  *pset = topo_pset[id];
+  return (0);
+}
+
+static const struct snapshot_topology fake_topology = {
+  fake_cpuid_max, fake_cpu_state, fake_cpu_pset, NULL
+};
+
+/* Whether the provider was asked about every CPU since the last call */
+static int
+queried(void)
+{
+  int all = cpuid_max_calls == 1 && state_calls == NR_CPUS &&
+    pset_calls == NR_CPUS;
+
+  if (cpuid_max_calls + state_calls + pset_calls > 0 && !all)
+    diag("cpuid_max %lu, state %lu, pset %lu calls", cpuid_max_calls,
+        state_calls, pset_calls);
+  cpuid_max_calls = state_calls = pset_calls = 0;
+  return (all);
+}
+
+static int
+not_queried(void)
+{
+  return (cpuid_max_calls + state_calls + pset_calls == 0 || queried());
+}
+
+int
+main(void)
+{
+  struct snapshot_retry  once = { 1, 1000, 1000 }, none = { 0, 1000, 1000 };
+  kstat_ctl_t           *kc;
+  struct snapshot       *ss = NULL;
+  struct kstat_index    *ki;
+  struct cpu_topo       *ct;
+  processorid_t          id;
+  size_t                 nr;
+  unsigned               gen;
+
+  /* The system puts every CPU in pset 1, the provider in 2 or none */
+  fake_system_add();
+  fake_pset_add(1);
+  fake_pset_add(2);
+  for (id = 0; id < NR_CPUS; id++) {
+    fake_cpu_add(id, 1);
+    topo_state[id] = P_ONLINE;
+    topo_pset[id] = id < 2 ? 2 : PS_NONE;
+  }
+  kc = open_kstat();
+
+  gen = topology_gen;
+  snapshot_set_topology(&fake_topology);
+  ok(topology_gen != gen, "Plugging in a provider starts a generation");
+
+  ok(try_acquire_snapshot(kc, TYPES, &none, &ss) == 0, "Acquired");
+  ok(queried(), "The provider is asked about every CPU");
+  ok(ss->s_cpus[0].cs_pset_id == 2 && ss->s_cpus[3].cs_pset_id == ID_NO_PSET,
+      "CPUs are in the psets the provider gives");
+  is(ss->s_psets[2].ps_nr_cpus, 2, "and pset 2 has two of them");
+
+  /* Cached while nothing changes */
+  ok(try_acquire_snapshot(kc, TYPES, &none, &ss) == 0 && cpuid_max_calls +
+      state_calls + pset_calls == 0, "Cached: the provider isn't asked");
+  ct = cpu_topo_get(kc, &nr);
+  ok(ct != NULL && nr == NR_CPUS && ct[1].ct_pset_id == 2 &&
+      not_queried(), "cpu_topo_get() gives the cached topology");
+
+  /* A CPU moving to another pset alone isn't seen... */
+  topo_pset[1] = PS_NONE;
+  ok(try_acquire_snapshot(kc, TYPES, &none, &ss) == 0 &&
+      ss->s_cpus[1].cs_pset_id == 2 && not_queried(),
+      "Reassigned: not seen from the cache");
+
+  /* ...until the generation changes */
+  gen = topology_gen;
+  snapshot_set_topology(&fake_topology);
+  ok(topology_gen != gen, "Reassigned: a new generation");
+  ok(try_acquire_snapshot(kc, TYPES, &none, &ss) == 0 &&
+      ss->s_cpus[1].cs_pset_id == ID_NO_PSET && queried(),
+      "Reassigned: seen in the new generation");
+  is(ss->s_psets[2].ps_nr_cpus, 1, "Reassigned: pset 2 has one CPU");
+  ki = kstat_index_get(kc);
+  is(ki->ki_topo_gen, topology_gen, "The index has the topology generation");
+
+  /* or the chain changes */
+  topo_pset[1] = 2;
+  fake_intr_add("ata", 0, "ata0");
+  ok(try_acquire_snapshot(kc, TYPES, &none, &ss) == 0 &&
+      ss->s_cpus[1].cs_pset_id == 2 && queried(),
+      "Reassigned back: seen once the chain changes");
+
+  /*
+   * A CPU going off-line changes its cpu_info state, which the cached
+   * topology doesn't match, so the CPUs fail with ESTALE.  The topology is
+   * dropped, and that is reported as ENXIO, so a snapshot with no retries
+   * left fails.
+   */
+  fake_cpu_set_state(2, P_OFFLINE);
+  topo_state[2] = P_OFFLINE;
+  is(try_acquire_snapshot(kc, TYPES, &none, &ss), ENXIO,
+      "Off-line: ENXIO with no retries left");
+  ok(not_queried(), "Off-line: from the cached topology");
+  is(ki->ki_topo_gen, 0, "Off-line: the cached topology is dropped");
+
+  /* With a retry, the topology is asked for again and the snapshot taken */
+  fake_cpu_set_state(2, P_ONLINE);
+  topo_state[2] = P_ONLINE;
+  ok(try_acquire_snapshot(kc, TYPES, &none, &ss) == 0 && queried(),
+      "On-line: asked for again");
+  fake_cpu_set_state(2, P_OFFLINE);
+  topo_state[2] = P_OFFLINE;
+  ok(try_acquire_snapshot(kc, TYPES, &once, &ss) == 0,
+      "Off-line: acquired with one retry");
+  ok(queried(), "Off-line: the provider was asked again");
+  ok(ss->s_cpus[2].cs_state == P_OFFLINE && !CPU_ACTIVE(&ss->s_cpus[2]) &&
+      ss->s_nr_active_cpus == 0, "Off-line: the CPU is off-line");
+  is(ss->s_psets[0].ps_nr_cpus, 1, "Off-line: and out of its pset");
+
+  /* Back to the system, which has every CPU in pset 1 */
+  snapshot_set_topology(NULL);
+  ok(try_acquire_snapshot(kc, TYPES, &none, &ss) == 0 &&
+      ss->s_cpus[0].cs_pset_id == 1 && ss->s_cpus[3].cs_pset_id == 1 &&
+      cpuid_max_calls + state_calls + pset_calls == 0,
+      "The system's topology again");
+  is(ss->s_psets[1].ps_nr_cpus, 3, "with three CPUs on-line in pset 1");
+
+  free_snapshot(ss);
+  close_kstat(kc);
+  fake_reset();
+  return (done_testing());
+}
@@ -0,0 +1,240 @@
+/*
+ * snapshot_walk(), snapshot_has_changed() and snapshot_report_changes() over
+ * snapshots of a fake system, as CPUs, psets and interrupt sources come, go,
+ * change state and move between psets.
+ */
+#include "kstat_common.h"
+#include "fake_kstat.h"
+#include "tap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ALL_TYPES (SNAP_CPUS | SNAP_PSETS | SNAP_INTERRUPTS | SNAP_SYSTEM)
+
+/* The pairs a walk called back with, e.g. "cpu 3 removed;cpu 9 added;" */
+static char walk_log[4096];
+
+static void
+log_pair(void *old, void *new, const char *what)
+{
+  size_t len = strlen(walk_log);
+
+  (void) snprintf(walk_log + len, sizeof (walk_log) - len, "%s %s;", what,
+      old == NULL ? "added" : new == NULL ? "removed" : "paired");
+}
+
+static void
+cpu_cb(void *old, void *new, void *data)
+{
+  struct cpu_snapshot *cs = new != NULL ? new : old;
+  char                 what[32];
+
+  (void) snprintf(what, sizeof (what), "cpu %d", cs->cs_id);
+  log_pair(old, new, what);
+}
+
+static void
+pset_cb(void *old, void *new, void *data)
+{
+  struct pset_snapshot *ps = new != NULL ? new : old;
+  char                  what[32];
+
+  (void) snprintf(what, sizeof (what), "pset %d", ps->ps_id);
+  log_pair(old, new, what);
+}
+
+static void
+intr_cb(void *old, void *new, void *data)
+{
+  struct intr_snapshot *is = new != NULL ? new : old;
+  char                  what[KSTAT_STRLEN + 8];
+
+  (void) snprintf(what, sizeof (what), "intr %s", is->is_name);
+  log_pair(old, new, what);
+}
+
+static void
+sys_cb(void *old, void *new, void *data)
+{
+  log_pair(old, new, "sys");
+}
+
+/* Walk one type, returning what it called back with in walk_log */
+static int
+walk(enum snapshot_types type, struct snapshot *old, struct snapshot *new)
+{
+  snapshot_cb cb = type == SNAP_CPUS ? cpu_cb : type == SNAP_PSETS ? pset_cb :
+    type == SNAP_INTERRUPTS ? intr_cb : sys_cb;
+
+  walk_log[0] = '\0';
+  return (snapshot_walk(type, old, new, cb, NULL));
+}
+
+/* What snapshot_report_changes() prints */
+static char *
+report(struct snapshot *old, struct snapshot *new)
+{
+  static char  buf[4096];
+  FILE        *tmp;
+  size_t       len;
+  int          saved;
+
+  if ((tmp = tmpfile()) == NULL)
+    fail(1, "tmpfile failed");
+  (void) fflush(stdout);
+  saved = dup(1);
+  (void) dup2(fileno(tmp), 1);
+  snapshot_report_changes(old, new);
+  (void) fflush(stdout);
+  (void) dup2(saved, 1);
+  (void) close(saved);
+  rewind(tmp);
+  len = fread(buf, 1, sizeof (buf) - 1, tmp);
+  buf[len] = '\0';
+  (void) fclose(tmp);
+  return (buf);
+}
+
+int
+main(void)
+{
+  kstat_ctl_t     *kc;
+  struct snapshot *a, *b, *c, *d;
+  processorid_t    id;
+
+  /* CPUs 0-1 in no pset, 2-4 in pset 1 and 5-7 in pset 2 */
+  fake_system_add();
+  fake_pset_add(2);
+  fake_pset_add(1);
+  for (id = 0; id < 8; id++)
+    fake_cpu_add(id, id < 2 ? PS_NONE : id < 5 ? 1 : 2);
+  (void) fake_intr_add("nge", 0, "nge0");
+  (void) fake_intr_add("ata", 0, "ata0");
+  (void) fake_intr_add("ehci", 0, "ehci0");
+
+  kc = open_kstat();
+  a = acquire_snapshot(kc, ALL_TYPES);
+
+  /*
+   * Everything is added to nothing, in order: CPUs by ID, psets by ID and
+   * interrupt sources by name
+   */
+  ok(walk(SNAP_CPUS, NULL, a) == 1, "NULL old: CPUs changed");
+  is_str(walk_log, "cpu 0 added;cpu 1 added;cpu 2 added;cpu 3 added;"
+      "cpu 4 added;cpu 5 added;cpu 6 added;cpu 7 added;",
+      "NULL old: every CPU is added");
+  ok(walk(SNAP_PSETS, NULL, a) == 1, "NULL old: psets changed");
+  is_str(walk_log, "pset 0 added;pset 1 added;pset 2 added;",
+      "NULL old: every pset is added, the no-pset set first");
+  ok(walk(SNAP_INTERRUPTS, NULL, a) == 1, "NULL old: interrupts changed");
+  is_str(walk_log, "intr ata0 added;intr clock added;intr ehci0 added;"
+      "intr nge0 added;", "NULL old: every source is added, with the clock");
+  ok(walk(SNAP_SYSTEM, NULL, a) == 1, "NULL old: system changed");
+  is_str(walk_log, "sys added;", "NULL old: the system is added");
+
+  /* Nothing changes between two snapshots of the same system */
+  b = acquire_snapshot(kc, ALL_TYPES);
+  ok(walk(SNAP_CPUS, a, b) == 0, "Same system: CPUs unchanged");
+  is_str(walk_log, "cpu 0 paired;cpu 1 paired;cpu 2 paired;cpu 3 paired;"
+      "cpu 4 paired;cpu 5 paired;cpu 6 paired;cpu 7 paired;",
+      "Same system: every CPU is paired");
+  ok(walk(SNAP_PSETS, a, b) == 0, "Same system: psets unchanged");
+  is_str(walk_log, "pset 0 paired;pset 1 paired;pset 2 paired;",
+      "Same system: every pset is paired");
+  ok(walk(SNAP_INTERRUPTS, a, b) == 0, "Same system: interrupts unchanged");
+  is_str(walk_log, "intr ata0 paired;intr clock paired;intr ehci0 paired;"
+      "intr nge0 paired;", "Same system: every source is paired");
+  ok(walk(SNAP_SYSTEM, a, b) == 0, "Same system: system unchanged");
+  ok(!snapshot_has_changed(a, b), "Same system: snapshot_has_changed() is 0");
+  is_str(report(a, b), "", "Same system: nothing is reported");
+
+  /* A CPU moving to another pset, and nothing else */
+  fake_cpu_set_pset(7, 1);
+  snapshot_set_topology(NULL);
+  c = acquire_snapshot(kc, ALL_TYPES);
+  ok(walk(SNAP_CPUS, b, c) == 1, "Moved CPU: CPUs changed");
+  is_str(walk_log, "cpu 0 paired;cpu 1 paired;cpu 2 paired;cpu 3 paired;"
+      "cpu 4 paired;cpu 5 paired;cpu 6 paired;cpu 7 paired;",
+      "Moved CPU: every CPU is still paired");
+  ok(walk(SNAP_PSETS, b, c) == 1, "Moved CPU: psets changed");
+  is_str(walk_log, "pset 0 paired;pset 1 paired;pset 2 paired;",
+      "Moved CPU: every pset is still paired");
+  ok(walk(SNAP_INTERRUPTS, b, c) == 0, "Moved CPU: interrupts unchanged");
+  ok(snapshot_has_changed(b, c), "Moved CPU: snapshot_has_changed()");
+  is_str(report(b, c), "<<processor 7 moved from pset: 2 to: 1>>\n",
+      "Moved CPU: the move is reported");
+  free_snapshot(c);
+  fake_cpu_set_pset(7, 2);
+  snapshot_set_topology(NULL);
+
+  /*
+   * CPU 3 goes, CPU 9 comes, CPU 6 goes off-line, CPU 5 moves to the new
+   * pset 3, and pset 1 is destroyed, leaving CPUs 2 and 4 in no pset.  One
+   * interrupt source goes and another comes.
+   */
+  fake_cpu_remove(3);
+  fake_cpu_add(9, 2);
+  fake_cpu_set_state(6, P_OFFLINE);
+  fake_pset_add(3);
+  fake_cpu_set_pset(5, 3);
+  fake_pset_remove(1);
+  fake_kstat_remove(fake_kstat_find("ehci", 0, "ehci0"));
+  (void) fake_intr_add("mpt", 0, "mpt0");
+  c = acquire_snapshot(kc, ALL_TYPES);
+
+  ok(walk(SNAP_CPUS, b, c) == 1, "Changes: CPUs changed");
+  is_str(walk_log, "cpu 0 paired;cpu 1 paired;cpu 2 paired;cpu 3 removed;"
+      "cpu 4 paired;cpu 5 paired;cpu 6 paired;cpu 7 paired;cpu 9 added;",
+      "Changes: CPUs are added, removed and paired in ID order");
+  ok(walk(SNAP_PSETS, b, c) == 1, "Changes: psets changed");
+  is_str(walk_log, "pset 0 paired;pset 1 removed;pset 2 paired;"
+      "pset 3 added;", "Changes: psets are merged by ID");
+  ok(walk(SNAP_INTERRUPTS, b, c) == 1, "Changes: interrupts changed");
+  is_str(walk_log, "intr ata0 paired;intr clock paired;intr ehci0 removed;"
+      "intr mpt0 added;intr nge0 paired;",
+      "Changes: sources are merged by name");
+  ok(snapshot_has_changed(b, c), "Changes: snapshot_has_changed()");
+  is_str(report(b, c),
+      "<<processor 2 moved from pset: 1 to: 0>>\n"
+      "<<processor 3 removed>>\n"
+      "<<processor 4 moved from pset: 1 to: 0>>\n"
+      "<<processor 5 moved from pset: 2 to: 3>>\n"
+      "<<processor 6 went offline>>\n"
+      "<<processor 9 added>>\n"
+      "<<pset 1 destroyed>>\n"
+      "<<pset 3 created>>\n"
+      "<<interrupt source ehci0 removed>>\n"
+      "<<interrupt source mpt0 added>>\n",
+      "Changes: every change is reported, in order");
+
+  /* The same changes the other way round, with more CPUs in the old one */
+  ok(walk(SNAP_CPUS, c, b) == 1, "Reversed: CPUs changed");
+  is_str(walk_log, "cpu 0 paired;cpu 1 paired;cpu 2 paired;cpu 3 added;"
+      "cpu 4 paired;cpu 5 paired;cpu 6 paired;cpu 7 paired;cpu 9 removed;",
+      "Reversed: a longer old CPU array is walked to its end");
+  ok(walk(SNAP_PSETS, c, b) == 1, "Reversed: psets changed");
+  is_str(walk_log, "pset 0 paired;pset 1 added;pset 2 paired;"
+      "pset 3 removed;", "Reversed: psets");
+  ok(walk(SNAP_INTERRUPTS, c, b) == 1, "Reversed: interrupts changed");
+  is_str(walk_log, "intr ata0 paired;intr clock paired;intr ehci0 added;"
+      "intr mpt0 removed;intr nge0 paired;", "Reversed: sources");
+
+  /* Only the types asked for are compared */
+  fake_intr_add("ahci", 0, "ahci0");
+  d = acquire_snapshot(kc, SNAP_CPUS);
+  ok(snapshot_has_changed(c, d), "Snapshots of other types differ");
+  free_snapshot(c);
+  c = acquire_snapshot(kc, SNAP_CPUS);
+  ok(!snapshot_has_changed(c, d), "A new source isn't seen without "
+      "SNAP_INTERRUPTS");
+  is_str(report(c, d), "", "and isn't reported");
+
+  free_snapshot(a);
+  free_snapshot(b);
+  free_snapshot(c);
+  free_snapshot(d);
+  close_kstat(kc);
+  fake_reset();
+  return (done_testing());
+}
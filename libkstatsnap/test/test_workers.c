@@ -0,0 +1,175 @@
+/*
+ * Reading CPU kstats with worker threads: the CPUs, their kstats and the
+ * aggregates merged from the workers are those a serial snapshot has, the
+ * CPU kstats are read over a narrower span of time, and a worker that can't
+ * be started or fails is reported as a failure of the snapshot.
+ */
+#include "kstat_common.h"
+#include "fake_kstat.h"
+#include "tap.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#define TYPES    (SNAP_CPUS | SNAP_SYSTEM)
+#define NR_CPUS  13
+#define DELAY_NS 1000000LL
+
+static const struct snapshot_retry no_retry = { 0, 0, 0 };
+
+/* Whether the numeric statistics of two named kstats are the same */
+static int
+same_kstat(const kstat_t *a, const kstat_t *b)
+{
+  kstat_named_t *ka = a->ks_data, *kb = b->ks_data;
+  uint_t         i;
+
+  if (a->ks_ndata != b->ks_ndata || (ka == NULL) != (kb == NULL))
+    return (0);
+  for (i = 0; i < a->ks_ndata; i++) {
+    if (strcmp(ka[i].name, kb[i].name) != 0 ||
+        ka[i].data_type != kb[i].data_type ||
+        (ka[i].data_type != KSTAT_DATA_CHAR &&
+         ka[i].value.ui64 != kb[i].value.ui64))
+      return (0);
+  }
+  return (1);
+}
+
+/* Whether a snapshot of CPUs and system is the same as the serial one */
+static int
+same_snapshot(const struct snapshot *a, const struct snapshot *b)
+{
+  size_t i;
+
+  if (a->s_nr_cpus != b->s_nr_cpus ||
+      a->s_nr_active_cpus != b->s_nr_active_cpus)
+    return (0);
+  for (i = 0; i < a->s_nr_cpus; i++) {
+    const struct cpu_snapshot *ca = &a->s_cpus[i], *cb = &b->s_cpus[i];
+
+    if (ca->cs_id != cb->cs_id || ca->cs_state != cb->cs_state ||
+        ca->cs_pset_id != cb->cs_pset_id)
+      return (0);
+    if (CPU_ACTIVE(ca) && (!same_kstat(&ca->cs_vm, &cb->cs_vm) ||
+        !same_kstat(&ca->cs_sys, &cb->cs_sys)))
+      return (0);
+  }
+  return (same_kstat(&a->s_sys.ss_agg_vm, &b->s_sys.ss_agg_vm) &&
+      same_kstat(&a->s_sys.ss_agg_sys, &b->s_sys.ss_agg_sys));
+}
+
+static int
+active_cpus(processorid_t lo, processorid_t hi)
+{
+  return (hi > lo ? hi - lo : 0);
+}
+
+int
+main(void)
+{
+  kstat_ctl_t     *kc;
+  struct snapshot *serial, *ss = NULL;
+  hrtime_t         spread_serial;
+  processorid_t    id;
+
+  /*
+   * 13 CPUs, so 4 workers get 4, 4, 4 and 1 of them, and CPUs 0 to 3 off-line,
+   * so the first worker has no aggregates to merge
+   */
+  fake_system_add();
+  fake_pset_add(1);
+  for (id = 0; id < NR_CPUS; id++) {
+    fake_cpu_add(id, id % 3 == 0 ? 1 : PS_NONE);
+    fake_kstat_set(fake_kstat_find("cpu", id, "sys"), "syscall", 1000 + id);
+    fake_kstat_set(fake_kstat_find("cpu", id, "vm"), "pgin", id * id);
+    if (id < 4)
+      fake_cpu_set_state(id, P_OFFLINE);
+  }
+  kc = open_kstat();
+  serial = acquire_snapshot(kc, TYPES);
+  is(serial->s_nr_active_cpus, NR_CPUS - 4, "Serial: 9 active CPUs");
+
+  /* The aggregates of the workers are merged as a serial read sums them */
+  ok(snapshot_set_workers(kc, 4) == 0, "4 workers");
+  ok(try_acquire_snapshot(kc, TYPES, &no_retry, &ss) == 0, "4 workers: "
+      "acquired");
+  ok(same_snapshot(serial, ss), "4 workers: the same as a serial snapshot");
+  ok(snapshot_set_workers(kc, 3) == 0 &&
+      try_acquire_snapshot(kc, TYPES, &no_retry, &ss) == 0 &&
+      same_snapshot(serial, ss), "3 workers: the same");
+  ok(snapshot_set_workers(kc, NR_CPUS + 7) == 0 &&
+      try_acquire_snapshot(kc, TYPES, &no_retry, &ss) == 0 &&
+      same_snapshot(serial, ss), "More workers than CPUs: the same");
+
+  /*
+   * Each read takes at least DELAY_NS, so serially the CPU kstats are read
+   * over at least the first sys and then the cpu_info, vm and sys of every
+   * other active CPU.  Four workers read the four active CPUs 4 to 7 and
+   * 8 to 11 each.  Only these lower bounds and the order are asserted, as
+   * the upper bounds depend on the load of the machine.
+   */
+  fake_set_read_delay(DELAY_NS);
+  ok(snapshot_set_workers(kc, 1) == 0 &&
+      try_acquire_snapshot(kc, TYPES, &no_retry, &ss) == 0,
+      "Delayed, serial: acquired");
+  spread_serial = ss->s_snaptime_spread;
+  ok(spread_serial >= (1 + 3 * (active_cpus(4, NR_CPUS) - 1)) * DELAY_NS,
+      "Delayed, serial: the spread covers every read");
+  ok(snapshot_set_workers(kc, 4) == 0 &&
+      try_acquire_snapshot(kc, TYPES, &no_retry, &ss) == 0,
+      "Delayed, 4 workers: acquired");
+  ok(ss->s_snaptime_spread >= (1 + 3 * (active_cpus(4, 8) - 1)) * DELAY_NS,
+      "Delayed, 4 workers: the spread covers a worker's reads");
+  ok(ss->s_snaptime_spread < spread_serial,
+      "Delayed, 4 workers: narrower than serial");
+  diag("spread: serial %.1f ms, 4 workers %.1f ms", spread_serial / 1e6,
+      ss->s_snaptime_spread / 1e6);
+  ok(same_snapshot(serial, ss), "Delayed, 4 workers: the same");
+  fake_set_read_delay(0);
+
+  /*
+   * The threads of the pool are started by snapshot_set_workers().  If the
+   * third can't be, the two that were are joined, and the four workers kc
+   * already had are kept.
+   */
+  fake_fail(FAKE_PTHREAD_CREATE, NULL, 2, 1, EAGAIN);
+  is(snapshot_set_workers(kc, 3), EAGAIN, "pthread_create() failing: EAGAIN");
+  ok(try_acquire_snapshot(kc, TYPES, &no_retry, &ss) == 0 &&
+      same_snapshot(serial, ss), "pthread_create() failing: the old workers "
+      "are kept");
+
+  /* The pool is reused, snapshot after snapshot */
+  for (id = 0; id < 50; id++) {
+    if (try_acquire_snapshot(kc, TYPES, &no_retry, &ss) != 0 ||
+        !same_snapshot(serial, ss))
+      break;
+  }
+  is(id, 50, "50 snapshots from the same pool");
+
+  /* A worker whose chain can't be updated, past the caller's own update */
+  fake_fail(FAKE_CHAIN_UPDATE, NULL, 1, 1, EAGAIN);
+  is(try_acquire_snapshot(kc, TYPES, &no_retry, &ss), EAGAIN,
+      "A worker's kstat_chain_update() failing: EAGAIN");
+  ok(try_acquire_snapshot(kc, TYPES, &no_retry, &ss) == 0 &&
+      same_snapshot(serial, ss), "A worker failing: then refilled");
+
+  /* A worker failing part way through its CPUs */
+  fake_fail(FAKE_READ, "cpu", 3, 1, EIO);
+  is(try_acquire_snapshot(kc, TYPES, NULL, &ss), EIO,
+      "A worker's kstat_read() failing: EIO, not retried");
+  fake_fail(FAKE_READ, "cpu", 3, 1, EAGAIN);
+  ok(try_acquire_snapshot(kc, TYPES, NULL, &ss) == 0 &&
+      same_snapshot(serial, ss), "A worker's kstat_read() failing: retried");
+
+  /* And back to reading serially */
+  ok(snapshot_set_workers(kc, 0) == 0 &&
+      try_acquire_snapshot(kc, TYPES, &no_retry, &ss) == 0 &&
+      same_snapshot(serial, ss), "No workers: the same");
+
+  free_snapshot(serial);
+  free_snapshot(ss);
+  close_kstat(kc);
+  fake_reset();
+  return (done_testing());
+}
@@ -0,0 +1,110 @@
+#include "kstat_common.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+/*
+ * The deadlines are gethrtime() values, so they are slept until on the
+ * clock gethrtime() reads.
+ */
+#ifdef CLOCK_HIGHRES
+#define TICKER_CLOCK CLOCK_HIGHRES
+#else
+#define TICKER_CLOCK CLOCK_MONOTONIC
+#endif
+
+/* Closer than this to a deadline is near enough */
+#define NEAR_ENOUGH 1000
+
+int caught_cont;
+
+/* Sleep until the deadline, returning 0 or an errno, e.g. EINTR */
+static int
+sleep_abs(hrtime_t deadline)
+{
+  struct timespec ts;
+
+  ts.tv_sec  = deadline / 1000000000;
+  ts.tv_nsec = deadline % 1000000000;
+  return (clock_nanosleep(TICKER_CLOCK, TIMER_ABSTIME, &ts, NULL));
+}
+
+/*
+ * As the sleep_until() of the illumos stat commands, but sleeping until an
+ * absolute deadline, so neither an interrupted sleep nor the latency of
+ * waking up pushes the cadence back.
+ */
+void
+sleep_until(hrtime_t *wakeup, hrtime_t interval, int forever,
+    int *caught_cont)
+{
+  hrtime_t now, pause, deadline;
+
+  now = gethrtime();
+  pause = *wakeup + interval - now;
+
+  if (pause <= 0 || pause < (interval / 4)) {
+    if (forever || *caught_cont) {
+      /* Reset our cadence */
+      *wakeup = now + interval;
+      deadline = *wakeup;
+    } else {
+      /*
+       * The next output is due in less than a quarter of an interval, a
+       * number of intervals was asked for and we have never been suspended,
+       * so try to keep the cadence, pausing for half an interval this time.
+       */
+      *wakeup += interval;
+      deadline = now + interval / 2;
+    }
+  } else {
+    *wakeup += interval;
+    deadline = *wakeup;
+  }
+
+  while (deadline - gethrtime() >= NEAR_ENOUGH) {
+    if (sleep_abs(deadline) != EINTR)
+      break;
+  }
+}
+
+void
+cont_handler(int sig_number)
+{
+  /* Re-set the signal handler */
+  (void) signal(sig_number, cont_handler);
+  caught_cont = 1;
+}
+
+void
+ticker_start(struct ticker *tk, hrtime_t interval)
+{
+  tk->tk_interval = interval;
+  tk->tk_deadline = gethrtime() + interval;
+  tk->tk_ticks    = 0;
+  tk->tk_missed   = 0;
+}
+
+int64_t
+ticker_wait(struct ticker *tk)
+{
+  hrtime_t now = gethrtime();
+  int64_t  missed = 0;
+  int      err;
+
+  if (tk->tk_deadline - now >= NEAR_ENOUGH) {
+    if ((err = sleep_abs(tk->tk_deadline)) != 0) {
+      errno = err;
+      return (-1);
+    }
+  } else if (now > tk->tk_deadline) {
+    /* Skip the deadlines that passed while we were busy, or stopped */
+    missed = (now - tk->tk_deadline) / tk->tk_interval;
+  }
+
+  tk->tk_deadline += (missed + 1) * tk->tk_interval;
+  tk->tk_ticks++;
+  tk->tk_missed += missed;
+  return (missed);
+}
@@ -23,8 +23,12 @@ $stat_copies[$gen] = $c;
 my @k_module_keys = keys %{$k};
 my @c_module_keys = keys %{$c};
 
-cmp_bag( \@c_module_keys, \@k_module_keys,
-         'Copy module keys should be complete' );
+cmp_bag( \@c_module_keys, [ 'cpu' ],
+         'Copy should only contain modules with kstats that have been read' );
+cmp_bag( [ keys %{$c->{cpu}} ], [ 0 ],
+         'Copy should only contain instances with kstats that have been read' );
+cmp_bag( [ keys %{$c->{cpu}->{0}} ], [ 'sys' ],
+         'Copy should only contain kstats that have been read' );
 
 #foreach my $module (@k_module_keys) {
 #  my @k_instance_keys = keys %{$k->{$module}};
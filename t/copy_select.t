@@ -0,0 +1,58 @@
+use strict;
+use warnings;
+
+use Test::Most;
+
+use_ok( 'Solaris::kstat', ':all' );
+
+my $k = Solaris::kstat->new();
+
+isa_ok($k, 'Solaris::kstat', 'hashref type is correct');
+
+my @cpus = sort { $a <=> $b } keys %{$k->{cpu}};
+
+# Read cpu:*:sys, cpu:*:vm and unix:0:var
+foreach my $cpu (@cpus) {
+  foreach my $name (qw( sys vm )) {
+    () = each %{$k->{cpu}{$cpu}{$name}} if exists $k->{cpu}{$cpu}{$name};
+  }
+}
+() = each %{$k->{unix}{0}{var}};
+
+my $c = $k->copy('cpu:*:sys');
+cmp_bag( [ keys %{$c} ], [ 'cpu' ], 'Only the selected module is copied' );
+cmp_bag( [ keys %{$c->{cpu}} ], \@cpus, 'Every CPU is copied' );
+foreach my $cpu (@cpus) {
+  cmp_bag( [ keys %{$c->{cpu}{$cpu}} ], [ 'sys' ],
+           "Only cpu:$cpu:sys is copied" );
+}
+cmp_bag( [ keys %{$c->{cpu}{$cpus[0]}{sys}} ],
+         [ keys %{$k->{cpu}{$cpus[0]}{sys}} ],
+         'Every statistic is copied without a statistic field' );
+
+$c = $k->copy([ 'cpu:*:vm', 'unix' ]);
+cmp_bag( [ keys %{$c} ], [ qw( cpu unix ) ], 'Selectors as an array ref' );
+cmp_bag( [ keys %{$c->{cpu}{$cpus[0]}} ], [ 'vm' ],
+         'Only cpu:*:vm is copied' );
+ok( exists $c->{unix}{0}{var}{snaptime}, 'unix:0:var is copied' );
+
+$c = $k->copy('cpu:0:sys:snaptime', 'cpu:0:sys:/^cpu_nsec_/');
+cmp_bag( [ keys %{$c->{cpu}{0}{sys}} ],
+         [ 'snaptime', grep { /^cpu_nsec_/ } keys %{$k->{cpu}{0}{sys}} ],
+         'Statistic fields select the statistics copied' );
+is( $c->{cpu}{0}{sys}{snaptime}, $k->{cpu}{0}{sys}{snaptime},
+    'Selected statistics have the right values' );
+
+$c = $k->copy('/^un/');
+cmp_bag( [ keys %{$c} ], [ 'unix' ], 'Regular expression module selector' );
+
+$c = $k->copy('cpu:0:sys:no_such_statistic');
+is( scalar(keys %{$c}), 0, 'No empty branches are left behind' );
+
+$c = $k->copy('cpu:*:sys_never_read');
+is( scalar(keys %{$c}), 0, 'Unread kstats are never copied' );
+
+throws_ok { $k->copy('cpu:0:sys:snaptime:extra') }
+          qr/invalid select pattern/, 'Too many fields are rejected';
+
+done_testing();
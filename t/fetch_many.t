@@ -0,0 +1,71 @@
+use strict;
+use warnings;
+
+use Test::Most;
+
+use_ok( 'Solaris::kstat', ':all' );
+
+my $k = Solaris::kstat->new();
+
+isa_ok($k, 'Solaris::kstat', 'hashref type is correct');
+
+my @cpus  = sort { $a <=> $b } keys %{$k->{cpu}};
+my @stats = qw( cpu_nsec_idle cpu_nsec_user no_such_statistic );
+
+my @rows = $k->fetch_many('cpu:*:sys', \@stats);
+is( scalar(@rows), scalar(@cpus), 'One row per CPU' );
+cmp_bag( [ map { $_->[1] } @rows ], \@cpus, 'Every CPU instance is fetched' );
+
+foreach my $row (@rows) {
+  my ($module, $instance, $name, $snaptime, @values) = @{$row};
+  is( $module, 'cpu', "cpu:$instance module is correct" );
+  is( $name, 'sys', "cpu:$instance name is correct" );
+  cmp_ok( $snaptime, '>', 0, "cpu:$instance snaptime is set" );
+  is( scalar(@values), scalar(@stats), "cpu:$instance has a value per name" );
+  like( $values[0], qr/^\d+$/, "cpu:$instance cpu_nsec_idle is a number" );
+  like( $values[1], qr/^\d+$/, "cpu:$instance cpu_nsec_user is a number" );
+  is( $values[2], undef, "cpu:$instance missing statistic is undef" );
+}
+
+# A second call goes through the cached statistic positions
+my @again = $k->fetch_many('cpu:*:sys', \@stats);
+foreach my $n (0 .. $#rows) {
+  cmp_ok( $again[$n][3], '>', $rows[$n][3],
+          "cpu:$rows[$n][1]:sys was read again" );
+  cmp_ok( $again[$n][4], '>=', $rows[$n][4],
+          "cpu:$rows[$n][1]:sys cpu_nsec_idle didn't go backwards" );
+}
+
+# The same positions also serve a reordered list of names
+my ($swapped) = $k->fetch_many("cpu:$cpus[0]:sys",
+                               [ 'cpu_nsec_user', 'cpu_nsec_idle' ]);
+cmp_ok( $swapped->[4], '>=', $again[0][5], 'Names are resolved per list' );
+
+# Raw kstats are decoded
+my ($var) = $k->fetch_many([ 'unix:0:var' ], [ 'v_proc', 'snaptime' ]);
+cmp_deeply( [ @{$var}[0 .. 2] ], [ 'unix', 0, 'var' ], 'unix:0:var row' );
+like( $var->[4], qr/^\d+$/, 'unix:0:var v_proc is a number' );
+is( $var->[5], $var->[3], 'snaptime can be fetched by name as well' );
+
+is( scalar($k->fetch_many('no_such_module', \@stats)), undef,
+    'Nothing matches a missing module' );
+is( scalar(keys %{$k->copy()}), 0, 'The hash is left untouched' );
+
+# copy() agrees with the hash, whatever fetch_many() has read since
+my $sys = $k->{cpu}{$cpus[0]}{sys};
+my $idle = $sys->{cpu_nsec_idle};
+my $snaptime = $sys->{snaptime};
+$k->fetch_many("cpu:$cpus[0]:sys", \@stats);
+my $copy = $k->copy();
+is( $copy->{cpu}{$cpus[0]}{sys}{cpu_nsec_idle}, $idle,
+    'copy() holds the value in the hash, not the last fetch_many()' );
+is( $copy->{cpu}{$cpus[0]}{sys}{snaptime}, $snaptime, 'and its snaptime' );
+is_deeply( $copy->{cpu}{$cpus[0]}{sys}, { %{$sys} },
+           'copy() holds exactly what the hash does' );
+
+throws_ok { $k->fetch_many('/(/', \@stats) }
+          qr/fetch_many: invalid select pattern/, 'Invalid selectors croak';
+throws_ok { $k->fetch_many('cpu', 'cpu_nsec_idle') } qr/array ref/,
+          'Statistic names must be an array ref';
+
+done_testing();
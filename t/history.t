@@ -0,0 +1,127 @@
+use strict;
+use warnings;
+
+use Test::Most;
+use Storable qw( dclone );
+
+use_ok( 'Solaris::kstat', ':all' );
+
+my $k = Solaris::kstat->new();
+
+isa_ok($k, 'Solaris::kstat', 'hashref type is correct');
+
+throws_ok { Solaris::kstat::History->new({}, 3, 'unix:0:system_misc') }
+          qr/not a Solaris::kstat object/, 'A history needs a Solaris::kstat';
+throws_ok { Solaris::kstat::History->new($k, 0, 'unix:0:system_misc') }
+          qr/positive/, 'A history needs a positive depth';
+throws_ok { Solaris::kstat::History->new($k, 3) }
+          qr/no statistics selected/, 'A history needs selectors';
+
+#
+# Only the statistics of kstats read so far are recorded
+#
+my $h = Solaris::kstat::History->new($k, 3, 'unix:0:system_misc:clk_intr');
+is_deeply( [ $h->series ], [ ], 'Unread kstats are not recorded' );
+
+my $misc = $k->{unix}{0}{system_misc};
+() = each %{$misc};
+() = each %{$k->{unix}{0}{var}};
+
+$h = Solaris::kstat::History->new($k, 3, 'unix:0:system_misc:clk_intr',
+                                  'unix:0:var');
+isa_ok( $h, 'Solaris::kstat::History' );
+is_deeply( [ $h->series ], [ 'unix:0:system_misc:clk_intr' ],
+           'Numeric statistics of read kstats are recorded, raw kstats not' );
+is( $h->depth, 3, 'depth is kept' );
+is( $h->count(0), 1, 'A history starts with the last read' );
+is_deeply( [ $h->last(0) ], [ [ $misc->{snaptime}, $misc->{clk_intr} ] ],
+           'which is the one in the hash' );
+
+#
+# Every update() appends, and the oldest samples make way
+#
+my @seen = ( [ $misc->{snaptime}, $misc->{clk_intr} ] );
+for (1 .. 5) {
+  $k->update();
+  push @seen, [ $misc->{snaptime}, $misc->{clk_intr} ];
+}
+
+my $label = 'unix:0:system_misc:clk_intr';
+is( $h->count($label), 3, 'Series are found by label, and hold depth samples' );
+is_deeply( [ $h->last(0) ], [ @seen[-3 .. -1] ],
+           'The last samples, oldest first' );
+is_deeply( [ $h->last(0, 2) ], [ @seen[-2 .. -1] ], 'The last 2 samples' );
+
+my @values = sort { $a <=> $b } map { $_->[1] } @seen[-3 .. -1];
+is( $h->min(0), $values[0], 'min' );
+is( $h->max(0), $values[-1], 'max' );
+is( $h->min(0, 1), $seen[-1][1], 'min of the last sample' );
+
+my $rate = ($seen[-1][1] - $seen[-3][1]) * 1e9 / ($seen[-1][0] - $seen[-3][0]);
+cmp_ok( abs($h->rate(0) - $rate), '<', 1e-6, 'rate over all the samples' );
+$rate = ($seen[-1][1] - $seen[-2][1]) * 1e9 / ($seen[-1][0] - $seen[-2][0]);
+cmp_ok( abs($h->rate(0, $seen[-1][0] - $seen[-2][0]) - $rate), '<', 1e-6,
+        'rate over a window' );
+is( $h->rate(0, 0), undef, 'No rate without two samples in the window' );
+
+throws_ok { $h->count(1) } qr/no series 1/, 'Series are checked';
+throws_ok { $h->count('unix:0:system_misc:nproc') } qr/no series/,
+          'Labels are checked';
+
+#
+# deficit is a signed statistic, so its samples come back as signed values,
+# and min and max compare them as such
+#
+my $d = Solaris::kstat::History->new($k, 4, 'unix:0:system_misc:deficit');
+my @deficits = ( $misc->{deficit} );
+for (1 .. 4) {
+  $k->update();
+  push @deficits, $misc->{deficit};
+}
+is_deeply( [ map { $_->[1] } $d->last(0) ], [ @deficits[-4 .. -1] ],
+           'Signed samples are as in the hash' );
+@values = sort { $a <=> $b } @deficits[-4 .. -1];
+is( $d->min(0), $values[0], 'min of a signed series' );
+is( $d->max(0), $values[-1], 'max of a signed series' );
+
+#
+# nproc is an unsigned 32-bit statistic, so a wrap from near 2^32 back to a
+# small value is a rise of 32, not a fall of about 2^32
+#
+my $w = Solaris::kstat::History->new($k, 2, 'unix:0:system_misc:nproc');
+my $t = $misc->{snaptime} + 1_000_000_000;
+$w->_push(0, $t, 0xFFFFFFF0);
+$w->_push(0, $t + 1_000_000_000, 0x10);
+cmp_ok( abs($w->rate(0) - 32), '<', 1e-6,
+        'A wrapped 32-bit counter gives a positive rate' );
+$w->_push(0, $t + 2_000_000_000, 0x20);
+cmp_ok( abs($w->rate(0) - 16), '<', 1e-6, 'and so does the next sample' );
+
+#
+# A copy of a history doesn't own the series it points to, so it is refused,
+# and neither it nor its destruction stops the original appending
+#
+my $copy = dclone($h);
+throws_ok { $copy->count(0) } qr/not a history/, 'A copy of a history is refused';
+throws_ok { $copy->rate(0) } qr/not a history/, 'by every method';
+$k->update();
+is_deeply( [ ($h->last(0))[-1] ], [ [ $misc->{snaptime}, $misc->{clk_intr} ] ],
+           'The original still appends after being copied' );
+undef $copy;
+$k->update();
+is_deeply( [ ($h->last(0))[-1] ], [ [ $misc->{snaptime}, $misc->{clk_intr} ] ],
+           'and after the copy is destroyed' );
+
+#
+# A history outlives its Solaris::kstat, and the tied hash of the kstat its
+# series were read from
+#
+my @last = $h->last(0);
+my $last_rate = $h->rate(0);
+undef $k;
+undef $misc;
+is( $h->count(0), 3, 'A history outlives its Solaris::kstat' );
+is_deeply( [ $h->last(0) ], \@last, 'and keeps its samples' );
+is( $h->rate(0), $last_rate, 'and still gives their rate' );
+
+done_testing();
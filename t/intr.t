@@ -0,0 +1,81 @@
+use strict;
+use warnings;
+
+use Test::Most;
+
+use_ok( 'Solaris::kstat', ':all' );
+
+my $k = Solaris::kstat->new();
+
+isa_ok($k, 'Solaris::kstat', 'hashref type is correct');
+
+my @intr_stats = qw( hard soft watchdog spurious multiple_service total );
+
+#
+# Find an interrupt source; reading the class of a kstat doesn't read it
+#
+my $source;
+MODULE: foreach my $module (sort keys %{$k}) {
+  foreach my $instance (sort { $a <=> $b } keys %{$k->{$module}}) {
+    foreach my $name (sort keys %{$k->{$module}{$instance}}) {
+      if ($k->{$module}{$instance}{$name}{class} eq 'controller' &&
+          exists $k->{$module}{$instance}{$name}{hard}) {
+        $source = [ $module, $instance, $name ];
+        last MODULE;
+      }
+    }
+  }
+}
+
+my $sample = $k->intr_sample();
+isa_ok( $sample, 'Solaris::kstat::IntrSample' );
+
+SKIP: {
+  skip 'No interrupt kstats on this host', 10 unless $source;
+
+  my $intr = $k->{$source->[0]}{$source->[1]}{$source->[2]};
+  my $label = join(':', @{$source});
+
+  cmp_bag( [ keys %{$intr} ], [ @intr_stats, qw( snaptime class crtime ) ],
+           "$label has every kstat_intr_t field" );
+  my $sum = 0;
+  $sum += $intr->{$_} foreach (@intr_stats[0 .. 4]);
+  is( $intr->{total}, $sum, "$label total is the sum of the counters" );
+
+  my @since_boot = $k->intr_delta(undef, $sample);
+  ok( scalar(@since_boot), 'A sample holds every interrupt source' );
+  my ($row) = grep { join(':', @{$_}[0 .. 2]) eq $label } @since_boot;
+  ok( $row, "$label is in the sample" );
+  # The sample was taken before the hash was read
+  ok( $row->[3] > 0 && $row->[3] <= $intr->{snaptime} - $intr->{crtime},
+      "$label counts from its creation, with the time since" );
+
+  my $next = $k->intr_sample();
+  my @delta = $k->intr_delta($sample, $next);
+  is( scalar(@delta), scalar(@since_boot), 'A row per source' );
+  is_deeply( [ map { join(':', @{$_}[0 .. 2]) } @delta ],
+             [ map { join(':', @{$_}[0 .. 2]) } @since_boot ],
+             'Rows are in the same order' );
+
+  ($row) = grep { join(':', @{$_}[0 .. 2]) eq $label } @delta;
+  cmp_ok( $row->[3], '>', 0, "$label has an elapsed time" );
+  my $total = 0;
+  $total += $row->[$_] foreach (4 .. 8);
+  is( $row->[9], $total, "$label delta total is the sum of the deltas" );
+
+  # Without a change to the chain, a delta is just the difference
+  my ($old) = grep { join(':', @{$_}[0 .. 2]) eq $label } @since_boot;
+  my ($new) = grep { join(':', @{$_}[0 .. 2]) eq $label }
+                   $k->intr_delta(undef, $next);
+  is_deeply( [ @{$row}[4 .. 9] ],
+             [ map { $new->[$_] - $old->[$_] } (4 .. 9) ],
+             "$label delta is the difference of the counts since boot" );
+}
+
+throws_ok { $k->intr_delta(undef, {}) } qr/new is not an interrupt sample/,
+          'Samples must come from intr_sample()';
+throws_ok { $k->intr_delta(bless(\my $s, 'Solaris::kstat::IntrSample'),
+                           $sample) }
+          qr/old is not an interrupt sample/, 'Samples are checked';
+
+done_testing();
@@ -0,0 +1,90 @@
+use strict;
+use warnings;
+
+use Test::Most;
+
+use_ok( 'Solaris::kstat', ':all' );
+
+my $k = Solaris::kstat->new();
+
+isa_ok($k, 'Solaris::kstat', 'hashref type is correct');
+
+my @io_stats = qw( nread nwritten reads writes wtime wlentime wlastupdate
+                   rtime rlentime rlastupdate wcnt rcnt );
+
+#
+# Find a disk; reading the class of a kstat doesn't read the kstat itself
+#
+my $disk;
+MODULE: foreach my $module (sort keys %{$k}) {
+  foreach my $instance (sort { $a <=> $b } keys %{$k->{$module}}) {
+    foreach my $name (sort keys %{$k->{$module}{$instance}}) {
+      if ($k->{$module}{$instance}{$name}{class} eq 'disk') {
+        $disk = [ $module, $instance, $name ];
+        last MODULE;
+      }
+    }
+  }
+}
+
+SKIP: {
+  skip 'No disk I/O kstats on this host', 4 unless $disk;
+
+  my $io = $k->{$disk->[0]}{$disk->[1]}{$disk->[2]};
+  my $label = join(':', @{$disk});
+
+  cmp_bag( [ keys %{$io} ], [ @io_stats, qw( snaptime class crtime ) ],
+           "$label has every kstat_io_t field" );
+  like( $io->{reads}, qr/^\d+$/, "$label reads is a number" );
+
+  my $old = { %{$io} };
+  $k->update();
+  my $new = { %{$io} };
+  cmp_ok( $new->{snaptime}, '>', $old->{snaptime}, "$label was read again" );
+
+  my $rates = $k->io_delta($old, $new);
+  cmp_ok( $rates->{'r/s'}, '>=', 0, "$label has a read rate" );
+}
+
+#
+# iostat -x columns from known deltas, over 2 seconds
+#
+my $old = { reads => 100, writes => 50, nread => 100 * 1024,
+            nwritten => 200 * 1024, wtime => 0, wlentime => 0,
+            rtime => 0, rlentime => 0, snaptime => 1_000_000_000 };
+my $new = { reads => 300, writes => 150, nread => 500 * 1024,
+            nwritten => 1000 * 1024, wtime => 250_000_000,
+            wlentime => 500_000_000, rtime => 500_000_000,
+            rlentime => 2_000_000_000, snaptime => 3_000_000_000 };
+
+my %expected = ( 'r/s'    => 100,    'w/s'    => 50,
+                 'kr/s'   => 200,    'kw/s'   => 400,
+                 'wait'   => 0.25,   'actv'   => 1,
+                 'wsvc_t' => 5 / 3,  'asvc_t' => 20 / 3,
+                 'svc_t'  => 25 / 3,
+                 '%w'     => 12.5,   '%b'     => 25 );
+
+my $rates = $k->io_delta($old, $new);
+cmp_bag( [ keys %{$rates} ], [ keys %expected ], 'Every iostat -x column' );
+foreach my $column (sort keys %expected) {
+  cmp_ok( abs($rates->{$column} - $expected{$column}), '<', 1e-9,
+          "$column is $expected{$column}" );
+}
+
+$old->{reads} = 2**32 - 6;
+$new->{reads} = 10;
+is( $k->io_delta($old, $new)->{'r/s'}, 8, 'reads wrapping at 32 bits' );
+
+$rates = $k->io_delta(undef, $new);
+cmp_ok( $rates->{'kw/s'}, '==', 1000 / 3, 'A missing old read means since boot' );
+
+$new->{writes} = $new->{reads} = $old->{writes} = $old->{reads} = 0;
+is( $k->io_delta($old, $new)->{svc_t}, 0, 'No transfers, no service time' );
+
+delete $new->{rlentime};
+throws_ok { $k->io_delta($old, $new) } qr/new has no rlentime statistic/,
+          'Missing statistics croak';
+throws_ok { $k->io_delta($old, [ ]) } qr/new must be a hash ref/,
+          'Statistics must be a hash ref';
+
+done_testing();
@@ -0,0 +1,66 @@
+use strict;
+use warnings;
+
+use Test::Most;
+
+use_ok( 'Solaris::kstat', ':all' );
+
+my $k = Solaris::kstat->new( lazy => 1 );
+my $e = Solaris::kstat->new();
+
+isa_ok($k, 'Solaris::kstat', 'hashref type is correct');
+
+#
+# Every level above the kstats themselves is tied, and nothing is created
+# until it is dereferenced
+#
+my $tree = tied %{$k};
+isa_ok($tree, 'Solaris::kstat::_Tree', 'Module level is tied');
+is( scalar(keys %{$tree}), 0, 'No modules materialised by new()' );
+
+cmp_bag( [ keys %{$k} ], [ keys %{$e} ],
+         'Module keys match those of an eager object' );
+is( scalar(keys %{$tree}), 0, 'Listing the modules materialised nothing' );
+
+ok( exists $k->{cpu}, 'cpu module exists' );
+ok( ! exists $k->{no_such_module}, 'Missing module does not exist' );
+is( $k->{no_such_module}, undef, 'Missing module fetches as undef' );
+is( scalar(keys %{$tree}), 0, 'exists() materialised nothing' );
+
+my @cpus = sort { $a <=> $b } keys %{$k->{cpu}};
+cmp_ok( scalar(@cpus), '>=', 1, "There is at least one CPU" );
+cmp_bag( [ keys %{$tree} ], [ 'cpu' ],
+         'Only the cpu module has been materialised' );
+isa_ok( tied %{$k->{cpu}}, 'Solaris::kstat::_Tree', 'Instance level is tied' );
+cmp_bag( \@cpus, [ keys %{$e->{cpu}} ],
+         'Instance keys match those of an eager object' );
+ok( ! exists $k->{cpu}{"0$cpus[0]"}, 'Instance keys must be canonical' );
+
+foreach my $cpu (@cpus) {
+  cmp_bag( [ keys %{$k->{cpu}{$cpu}} ], [ keys %{$e->{cpu}{$cpu}} ],
+           "Name keys of cpu:$cpu match those of an eager object" );
+}
+
+#
+# The kstats themselves behave as in an eager object
+#
+my $sys = $k->{cpu}{$cpus[0]}{sys};
+isa_ok( tied %{$sys}, 'Solaris::kstat::_Stat', 'Name level is tied' );
+cmp_bag( [ keys %{$sys} ], [ keys %{$e->{cpu}{$cpus[0]}{sys}} ],
+         'Statistic keys match those of an eager object' );
+
+my $snaptime = $sys->{snaptime};
+ok( defined($snaptime), 'snaptime was read' );
+$k->update();
+cmp_ok( $sys->{snaptime}, '>', $snaptime, 'update() refreshed the kstat' );
+is( $k->{cpu}{$cpus[0]}{sys}, $sys, 'Materialised entries are kept' );
+
+my $c = $k->copy();
+ok( exists $c->{cpu}{$cpus[0]}{sys}{snaptime}, 'copy() includes read kstats' );
+
+throws_ok { $k->{new_module} = {} } qr/read-only/,
+          'Modules cannot be added';
+throws_ok { delete $k->{cpu}{$cpus[0]} } qr/read-only/,
+          'Instances cannot be deleted';
+
+done_testing();
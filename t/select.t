@@ -0,0 +1,67 @@
+use strict;
+use warnings;
+
+use Test::Most;
+
+use_ok( 'Solaris::kstat', ':all' );
+
+my $all = Solaris::kstat->new();
+
+#
+# Only the selected kstats get an entry in the tree
+#
+my $k = Solaris::kstat->new( select => [ 'cpu:*:sys', 'unix:0:var' ] );
+isa_ok($k, 'Solaris::kstat', 'hashref type is correct');
+
+cmp_bag( [ keys %{$k} ], [ qw( cpu unix ) ],
+         'Only the selected modules are present' );
+cmp_bag( [ keys %{$k->{cpu}} ], [ keys %{$all->{cpu}} ],
+         'Every cpu instance is present' );
+foreach my $cpu (keys %{$k->{cpu}}) {
+  cmp_bag( [ keys %{$k->{cpu}{$cpu}} ], [ 'sys' ],
+           "Only cpu:$cpu:sys is present" );
+}
+cmp_bag( [ keys %{$k->{unix}{0}} ], [ 'var' ], 'Only unix:0:var is present' );
+ok( defined($k->{unix}{0}{var}{snaptime}), 'Selected kstats can be read' );
+
+#
+# A single pattern, with regular expressions and missing fields
+#
+$k = Solaris::kstat->new( select => '/^cp/' );
+cmp_bag( [ keys %{$k} ], [ grep { /^cp/ } keys %{$all} ],
+         'Regular expression module selector' );
+
+$k = Solaris::kstat->new( select => 'cpu::/^(sys|vm)$/' );
+foreach my $cpu (keys %{$k->{cpu}}) {
+  cmp_bag( [ keys %{$k->{cpu}{$cpu}} ],
+           [ grep { /^(sys|vm)$/ } keys %{$all->{cpu}{$cpu}} ],
+           "Regular expression name selector for cpu:$cpu" );
+}
+
+#
+# Excluded kstats are dropped, whether or not there are select patterns
+#
+$k = Solaris::kstat->new( exclude => [ 'cpu' ] );
+ok( ! exists $k->{cpu}, 'Excluded module is not present' );
+cmp_ok( scalar(keys %{$k}), '==', scalar(keys %{$all}) - 1,
+        'Every other module is present' );
+
+$k = Solaris::kstat->new( select => 'cpu', exclude => 'cpu:*:vm' );
+foreach my $cpu (keys %{$k->{cpu}}) {
+  ok( ! exists $k->{cpu}{$cpu}{vm}, "cpu:$cpu:vm is excluded" );
+}
+
+#
+# Selectors apply to lazy objects and to update() too
+#
+$k = Solaris::kstat->new( lazy => 1, select => 'cpu:*:sys' );
+cmp_bag( [ keys %{$k} ], [ 'cpu' ], 'Lazy object only has selected modules' );
+my ($added, $deleted) = $k->update();
+is( scalar(@$added) + scalar(@$deleted), 0, 'update() added nothing' );
+
+throws_ok { Solaris::kstat->new( select => 'cpu:0:sys:idle:extra' ) }
+          qr/invalid select pattern/, 'Too many fields are rejected';
+throws_ok { Solaris::kstat->new( exclude => '/unterminated' ) }
+          qr/invalid exclude pattern/, 'Bad regular expressions are rejected';
+
+done_testing();
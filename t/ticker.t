@@ -0,0 +1,70 @@
+use strict;
+use warnings;
+
+use Test::Most;
+
+use_ok( 'Solaris::kstat', ':all' );
+
+my $k = Solaris::kstat->new();
+
+throws_ok { Solaris::kstat::Ticker->new(0) } qr/positive/,
+          'A ticker needs a positive interval';
+
+#
+# The cadence over 10,000 short intervals.  However late the ticks are on a
+# busy machine, the deadlines never drift from start + n * interval, so only
+# that is asserted; how late each tick is after its deadline is reported
+#
+my $interval  = 200_000;
+my $intervals = 10_000;
+
+my $t = Solaris::kstat::Ticker->new($interval);
+isa_ok( $t, 'Solaris::kstat::Ticker' );
+is( $t->interval, $interval, 'interval is kept' );
+
+my $first = $t->deadline;
+my (@late, $missed, $steps);
+for (1 .. $intervals) {
+  my $deadline = $t->deadline;
+  my $skipped  = $t->wait();
+  push @late, $k->gethrtime() - ($t->deadline - $interval);
+  $missed += $skipped;
+  $steps++ if ($t->deadline == $deadline + ($skipped + 1) * $interval);
+}
+
+is( $t->ticks, $intervals, 'Every wait() is a tick' );
+is( $t->missed, $missed, 'Skipped deadlines are totalled' );
+is( $steps, $intervals, 'Each wait() moves the deadline past those it skipped' );
+is( $t->deadline, $first + ($intervals + $missed) * $interval,
+    'Deadlines stay on the cadence' );
+
+@late = sort { $a <=> $b } @late;
+my ($median, $p99, $max) = @late[$#late / 2, $#late * 99 / 100, $#late];
+
+diag "JITTER ns: median $median, 99th percentile $p99, max $max, missed $missed";
+
+cmp_ok( $late[0], '>=', -1000, 'No tick comes early' );
+
+#
+# A ticker that falls behind skips the deadlines it missed, rather than
+# making them up in a burst.  Exactly those that passed before wait() looked
+# at the clock are skipped, which lies between the two reads around it
+#
+$t = Solaris::kstat::Ticker->new(10_000_000);
+$t->wait();
+my $missed_before = $t->missed;
+select(undef, undef, undef, 0.055);
+my $deadline = $t->deadline;
+my $before   = $k->gethrtime();
+my $skipped  = $t->wait();
+my $after    = $k->gethrtime();
+cmp_ok( $skipped, '>=', int(($before - $deadline) / 10_000_000),
+        "Deadlines passed while busy are skipped ($skipped)" );
+cmp_ok( $skipped, '<=', int(($after - $deadline) / 10_000_000),
+        'and no more' );
+is( $t->deadline, $deadline + ($skipped + 1) * 10_000_000,
+    'The next deadline is the first still to come' );
+cmp_ok( $t->deadline, '>', $before, 'which was ahead when wait() returned' );
+is( $t->missed - $missed_before, $skipped, 'and they are totalled' );
+
+done_testing();
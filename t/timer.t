@@ -0,0 +1,106 @@
+use strict;
+use warnings;
+
+use Test::Most;
+
+use_ok( 'Solaris::kstat', ':all' );
+
+my $k = Solaris::kstat->new();
+
+isa_ok($k, 'Solaris::kstat', 'hashref type is correct');
+
+my @timer_stats = qw( name num_events elapsed_time min_time max_time
+                      start_time stop_time );
+
+#
+# Find a timer kstat; reading the class of a kstat doesn't read it
+#
+my $timer;
+MODULE: foreach my $module (sort keys %{$k}) {
+  foreach my $instance (sort { $a <=> $b } keys %{$k->{$module}}) {
+    foreach my $name (sort keys %{$k->{$module}{$instance}}) {
+      next unless defined $k->{$module}{$instance}{$name}{class};
+      if (exists $k->{$module}{$instance}{$name}{elapsed_time}) {
+        $timer = [ $module, $instance, $name ];
+        last MODULE;
+      }
+    }
+  }
+}
+
+SKIP: {
+  skip 'No timer kstats on this host', 3 unless $timer;
+
+  my $kstat = $k->{$timer->[0]}{$timer->[1]}{$timer->[2]};
+  my $label = join(':', @{$timer});
+
+  cmp_bag( [ keys %{$kstat} ], [ @timer_stats, qw( snaptime class crtime ) ],
+           "$label has every kstat_timer_t field" );
+
+  my $old = $k->copy(join(':', @{$timer}));
+  $k->update();
+  my $new = $k->copy(join(':', @{$timer}));
+  my @rows = $k->timer_summary($old, $new);
+  is( scalar(@rows), 1, "$label is summarised" );
+  cmp_ok( $rows[0][5], '>=', 0, "$label has an event rate" );
+}
+
+#
+# Synthetic timer kstats, read 2 seconds apart, among other kstats
+#
+sub timer_kstat {
+  my ($name, $events, $elapsed, $min, $max, $snaptime) = @_;
+  return { name => $name, num_events => $events, elapsed_time => $elapsed,
+           min_time => $min, max_time => $max, start_time => 0,
+           stop_time => 0, snaptime => $snaptime, class => 'misc' };
+}
+
+my $old = { drv => { 0 => { busy  => timer_kstat('busy', 100, 50_000,
+                                                 100, 2_000, 1_000_000_000),
+                            idle  => timer_kstat('idle', 7, 700,
+                                                 100, 100, 1_000_000_000),
+                            other => { snaptime => 1_000_000_000,
+                                       count => 1 } },
+                   1 => { reset => timer_kstat('reset', 1_000, 1_000_000,
+                                               10, 10_000, 1_000_000_000) } },
+            unix => { 0 => { system_misc => { snaptime => 1_000_000_000,
+                                              nproc => 100 } } } };
+
+my $new = { drv => { 0 => { busy  => timer_kstat('busy', 500, 450_000,
+                                                 50, 3_000, 3_000_000_000),
+                            idle  => timer_kstat('idle', 7, 700,
+                                                 100, 100, 3_000_000_000),
+                            other => { snaptime => 3_000_000_000,
+                                       count => 2 } },
+                   1 => { reset => timer_kstat('reset', 20, 40_000,
+                                               10, 10_000, 3_000_000_000),
+                          added => timer_kstat('added', 10, 5_000,
+                                               10, 1_000, 2_000_000_000) } },
+            unix => { 0 => { system_misc => { snaptime => 3_000_000_000,
+                                              nproc => 101 } } } };
+
+my %rows = map { join(':', @{$_}[0 .. 2]) => $_ }
+               $k->timer_summary($old, $new);
+
+cmp_bag( [ keys %rows ],
+         [ qw( drv:0:busy drv:0:idle drv:1:reset drv:1:added ) ],
+         'Only timer kstats are summarised' );
+
+is_deeply( $rows{'drv:0:busy'},
+           [ 'drv', 0, 'busy', 'busy', 2_000_000_000, 200, 1_000, 50, 3_000 ],
+           '400 events of 1000ns over 2s' );
+is_deeply( [ @{$rows{'drv:0:idle'}}[4 .. 6] ], [ 2_000_000_000, 0, 0 ],
+           'No events, no mean event time' );
+is_deeply( [ @{$rows{'drv:1:reset'}}[4 .. 6] ], [ 3_000_000_000, 20 / 3, 2_000 ],
+           'A timer with fewer events than before counts from boot' );
+is_deeply( [ @{$rows{'drv:1:added'}}[4 .. 6] ], [ 2_000_000_000, 5, 500 ],
+           'A new timer counts from boot' );
+
+%rows = map { join(':', @{$_}[0 .. 2]) => $_ } $k->timer_summary(undef, $new);
+is_deeply( [ @{$rows{'drv:0:busy'}}[4 .. 6] ], [ 3_000_000_000, 500 / 3, 900 ],
+           'A missing old copy means since boot' );
+
+throws_ok { $k->timer_summary($old, [ ]) } qr/new must be a hash ref/,
+          'Copies must be hash refs';
+
+done_testing();
@@ -0,0 +1,76 @@
+use strict;
+use warnings;
+
+use Test::Most;
+use Scalar::Util qw( refaddr );
+
+use_ok( 'Solaris::kstat', ':all' );
+
+#
+# Only the watched kstats are in the tree, so a kstat joining the chain
+# elsewhere can't allocate a tie during the loop
+#
+my $k = Solaris::kstat->new( select => [ 'cpu:*:sys', 'cpu:*:vm' ] );
+
+isa_ok($k, 'Solaris::kstat', 'hashref type is correct');
+
+my @cpus = sort { $a <=> $b } keys %{$k->{cpu}};
+cmp_ok( scalar(@cpus), '>=', 1, "There is at least one CPU" );
+
+#
+# Prime cpu:*:sys and cpu:*:vm, then hold a reference to every value SV held
+# by the tie objects underneath them.  If update() replaced a value instead of
+# refreshing it in place, the old SV would be kept alive by the reference, so
+# the new one couldn't reuse its address, and the live SV count would grow.
+#
+my %held;
+my @ties;
+foreach my $cpu (@cpus) {
+  foreach my $name (qw( sys vm )) {
+    next unless exists $k->{cpu}{$cpu}{$name};
+    () = each %{$k->{cpu}{$cpu}{$name}};
+    my $tie = tied %{$k->{cpu}{$cpu}{$name}};
+    push @ties, [ "$cpu:$name", $tie ];
+    foreach my $stat (keys %{$tie}) {
+      $held{"$cpu:$name:$stat"} = \$tie->{$stat};
+    }
+  }
+}
+
+cmp_ok( scalar(keys %held), '>', 0, 'Found statistics to watch' );
+
+my $first_snaptime = $k->{cpu}{$cpus[0]}{sys}{snaptime};
+
+# Warm up, so any first-time allocation is out of the way
+$k->update() for (1 .. 10);
+
+my $before = Solaris::kstat::_sv_count();
+for (my $i = 0; $i < 1_000; $i++) {
+  $k->update();
+}
+my $after = Solaris::kstat::_sv_count();
+
+cmp_ok( $k->{cpu}{$cpus[0]}{sys}{snaptime}, '>', $first_snaptime,
+        'update() refreshed the watched kstats' );
+
+my ($replaced, $appeared) = (0, 0);
+foreach my $pair (@ties) {
+  my ($prefix, $tie) = @$pair;
+  foreach my $stat (keys %{$tie}) {
+    my $ref = $held{"$prefix:$stat"};
+    if (! defined($ref)) {
+      $appeared++;
+    } elsif (refaddr($ref) != refaddr(\$tie->{$stat})) {
+      $replaced++;
+    }
+  }
+}
+
+diag "Watched " . scalar(keys %held) . " statistic SVs over 1,000 updates";
+diag "$appeared statistics appeared after priming";
+
+is( $replaced, 0, 'No statistic SVs were replaced by update()' );
+cmp_ok( $after - $before, '<=', $appeared,
+        'update() allocated no SVs, but for statistics that appeared' );
+
+done_testing();